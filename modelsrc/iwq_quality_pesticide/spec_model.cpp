@@ -25,7 +25,7 @@ double SoftMaximum(double x, double y, double k);
 
 //############################################################################################################
 
-IWQ_MODEL_NAME::IWQ_MODEL_NAME() : iWQModel( QUOTEME( IWQ_MODEL_NAME ) )
+IWQ_MODEL_NAME::IWQ_MODEL_NAME() : iWQDifferentiableModel<IWQ_MODEL_NAME>( QUOTEME( IWQ_MODEL_NAME ) )
 {	
 	// NOTE: specify types with VAR (variable), BFX (boundary flux), INP (input) and PAR (parameter)
 	//variables
@@ -55,19 +55,20 @@ IWQ_MODEL_NAME::IWQ_MODEL_NAME() : iWQModel( QUOTEME( IWQ_MODEL_NAME ) )
 
 //-------------------------------------------------------------------------------------------------------------
 
-void IWQ_MODEL_NAME::modelFunction(double x)
+template<typename T> void IWQ_MODEL_NAME::equations(double x, iWQEquations<T> & eq)
 {
-	// NOTE: calculate changes, then assign with *(d()) (derivative, for VARs) and *(F()) (flux, for BFXs)
-	F_decay = k_decay * M_stock * pow(theta_decay, T_air - 20.0);
-	double F_X_stock = beta * F_driver/area * 0.001 * M_stock + f_applic*area_applic*appl_loss;	// [prop/mm] * [m3]/[km2] * 0.001[mm/(m3/km2)] * kg
+	// NOTE: read the variables with eq.state(), assign with eq.d() (derivative, for VARs) and eq.F() (flux, for BFXs)
+	T M = eq.state(M_stock);
+	T F_decay_ = k_decay * M * pow(theta_decay, T_air - 20.0);
+	T F_X_stock = beta * F_driver/area * 0.001 * M + f_applic*area_applic*appl_loss;	// [prop/mm] * [m3]/[km2] * 0.001[mm/(m3/km2)] * kg
 	double F_X_bg = Q_background * C_background * 1e-9;
-	F_X = F_X_stock + F_X_bg;
-	C_X = Q_total>0.0 ? F_X/Q_total : 0.0;
+	T F_X_ = F_X_stock + F_X_bg;
+	T C_X_ = Q_total>0.0 ? F_X_/Q_total : T(0.0);
 	
-	*d(M_stock) = f_applic * area_applic - F_decay - F_X_stock;	//f_applic is in kg/km2 while we want kg
-	*F(F_decay) = F_decay;	//kg
-	*F(F_X) = F_X;			//kg
-	*F(C_X) = C_X * 1E9;	//to µg/m3 = ng/l
+	eq.d(M_stock) = f_applic * area_applic - F_decay_ - F_X_stock;	//f_applic is in kg/km2 while we want kg
+	eq.F(F_decay) = F_decay_;	//kg
+	eq.F(F_X) = F_X_;			//kg
+	eq.F(C_X) = C_X_ * 1E9;		//to µg/m3 = ng/l
 }
 
 //-------------------------------------------------------------------------------------------------------------
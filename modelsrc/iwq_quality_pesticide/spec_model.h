@@ -17,7 +17,7 @@ class iWQModel;
 
 //------------------------------------------------------------------------------------------
 
-class IWQ_MODEL_NAME : public iWQModel
+class IWQ_MODEL_NAME : public iWQDifferentiableModel<IWQ_MODEL_NAME>
 {
 private:
 	// NOTE: declare here every variable, input, flux and parameter as double
@@ -47,7 +47,7 @@ private:
 	
 public:
 	IWQ_MODEL_NAME ();
-	virtual void modelFunction(double x); 
+	template<typename T> void equations(double x, iWQEquations<T> & eq);	//modelFunction() and the Jacobian
 	virtual ~IWQ_MODEL_NAME(){ }
 	virtual bool verifyParameters();
 	virtual bool isStatic(){ return false; }	
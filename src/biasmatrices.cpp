@@ -325,6 +325,116 @@ double makeNoiseStep(double sigma_e2, double input, double kappa_e)
 
 //---------------------------------------------------------------------------------------------------
 
+#pragma mark Likelihood of bias and noise residuals
+
+//RETURNS THE LOG LIKELIHOOD OF THE RESIDUALS WITH MOVING KERNELS OF MD ELEMENTS (APPROXIMATION)
+double kernelBiasLogLikelihood(const std::vector<double> & residuals, const std::vector<double> & inputs, int md, double sigma_b2, double beta, double kappa, double pi, double sigma_e2, double kappa_e)
+{
+	int dim=residuals.size();
+	double pipart = log(1.0 / sqrt(2.0 * M_PI)); 
+	double loglikeli=0.0;
+	
+	if(md<dim){
+		//kernel solution
+		double det, det1;
+		int md1=md+1;
+		std::vector<double> inp (md);
+		std::vector<double> inp1 (md1);
+		
+		Eigen::MatrixXd kernelinv; 
+		Eigen::MatrixXd kernelinv1;
+		
+		//serially evaluate the likelihood
+		//process the residuals by moving the kernels around them
+		Eigen::VectorXd window1 (md1);		//md+1 elements
+		Eigen::VectorXd window (md);		//md elements
+		
+		double exppart, exppart1;
+		double lik, lik1;
+		
+		//process them according to conditional probability
+		for(int j=0; j<=dim-md1; j++){
+			//take md1 elements from the output
+			for(int i=0; i<md1; i++){
+				window1[i]=residuals[j+i];
+				inp1[i]=inputs[j+i];
+			}
+					
+			//create the outer kernel
+			kernelinv1=makeCovarMatrix(inp1, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e, &det1);
+			exppart1=(window1.transpose() * kernelinv1).dot(window1);
+			lik1 = md1 * pipart + 0.5 * (det1 - exppart1);
+			
+			if(j==0){
+				loglikeli = lik1;
+			}
+			else{
+				for(int i=0; i<md; i++){
+					window[i]=residuals[j+i];
+					inp[i]=inputs[j+i];
+				}
+				
+				kernelinv=makeCovarMatrix(inp, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e, &det);
+				exppart=(window.transpose() * kernelinv).dot(window);
+				lik = md * pipart + 0.5 * (det - exppart);
+				
+				//conditional likelihood of the last included element
+				loglikeli+= (lik1-lik);
+			}
+		}
+	}
+	else{
+		//full-scale solution
+		double det;
+		Eigen::MatrixXd kernelinv = makeCovarMatrix(inputs, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e, &det);
+		Eigen::VectorXd residualsv (dim);
+		for(int i=0; i<dim; i++){
+			residualsv[i]=residuals[i];
+		}
+		double exppart=(residualsv.transpose() * kernelinv).dot(residualsv);
+		loglikeli = md * pipart + 0.5 * (det - exppart);
+	}
+	
+	return loglikeli;
+}
+
+//---------------------------------------------------------------------------------------------------
+
+//RETURNS THE EXACT LOG LIKELIHOOD OF THE RESIDUALS WITH A SCALAR KALMAN FILTER
+double kalmanBiasLogLikelihood(const std::vector<double> & residuals, const std::vector<double> & inputs, double sigma_b2, double beta, double kappa, double pi, double sigma_e2, double kappa_e)
+{
+	//the bias is an AR(1) state observed with independent noise, started
+	//from N(0, sigma_b2) one step before the first residual (as in makeSigmaBMatrix)
+	int dim=residuals.size();
+	double rho = exp(-beta);
+	double log2pi = log(2.0 * M_PI);
+	
+	double mean = 0.0;		//E(b_t | residuals up to t)
+	double var = sigma_b2;	//Var(b_t | residuals up to t)
+	double loglikeli = 0.0;
+	
+	for(int t=0; t<dim; t++){
+		//predict the bias
+		mean = rho * mean;
+		var = rho * rho * var + jumpVarianceOfB(sigma_b2, beta, kappa, pi, inputs[t]);
+		
+		//innovation of the residual
+		double noisevar = varianceOfE(inputs[t], sigma_e2, kappa_e);
+		double innovvar = var + noisevar;
+		double innov = residuals[t] - mean;
+		loglikeli -= 0.5 * (log2pi + log(innovvar) + innov * innov / innovvar);
+		
+		//update with the gain
+		double gain = var / innovvar;
+		mean += gain * innov;
+		var = var * noisevar / innovvar;	//(1-gain)*var without cancellation
+	}
+	
+	return loglikeli;
+}
+
+//---------------------------------------------------------------------------------------------------
+
 #pragma mark Plain multivariate normal utilities
 
 //MAKES A PLAIN COVARIANCE MATRIX BASED ON DATA VECTORS
@@ -54,6 +54,14 @@ double makeNoiseStep(double sigma_e2, double input, double kappa_e);
 
 //---------------------------------------------------------------------------------------------------
 
+//RETURNS THE LOG LIKELIHOOD OF THE RESIDUALS WITH MOVING KERNELS OF MD ELEMENTS (APPROXIMATION, O(N*MD^3))
+double kernelBiasLogLikelihood(const std::vector<double> & residuals, const std::vector<double> & inputs, int md, double sigma_b2, double beta, double kappa, double pi, double sigma_e2, double kappa_e);
+
+//RETURNS THE EXACT LOG LIKELIHOOD OF THE RESIDUALS WITH A SCALAR KALMAN FILTER (O(N))
+double kalmanBiasLogLikelihood(const std::vector<double> & residuals, const std::vector<double> & inputs, double sigma_b2, double beta, double kappa, double pi, double sigma_e2, double kappa_e);
+
+//---------------------------------------------------------------------------------------------------
+
 //MAKES A PLAIN COVARIANCE MATRIX BASED ON DATA VECTORS
 Eigen::MatrixXd covarMatrix(const std::vector< std::vector<double> > & data, int startrow=0);
 
@@ -0,0 +1,308 @@
+/*
+ *  cmaes.cpp
+ *  Covariance matrix adaptation evolution strategy (CMA-ES) with IPOP restarts
+ *
+ *  iWaQa model framework 2010-2017
+ *
+ *  SYSTEM/OPTIMISE
+ *
+ */
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <float.h>
+#include <algorithm>
+#include <utility>
+
+#include "Eigen/Dense"
+#include "cmaes.h"
+#include "evaluator.h"
+#include "model.h"
+#include "mathutils.h"
+#include "threadpool.h"
+
+//----------------------------------------------------------------------------
+
+iWQCMAESOptimizer::iWQCMAESOptimizer()
+{
+	populationSize=0;
+	maxEvaluations=2000;
+	maxRestarts=4;
+	initialSigma=0.3;
+	tolerance=1E-6;
+	seed=0;
+}
+
+//----------------------------------------------------------------------------
+
+//offspring of one generation, context c evaluates the offspring c, c+numcontexts, c+2*numcontexts, ...
+struct iWQCMAESGeneration
+{
+	int lambda;
+	int dimensions;
+	iWQBoundsList * bounds;
+	std::vector<iWQEvaluator *> evaluators;
+	std::vector<std::vector<double> > points;	//repaired points scaled to [0,1]
+	std::vector<std::vector<double> > modelpos;	//per context
+	std::vector<double> values;
+};
+
+//----------------------------------------------------------------------------
+
+void cmaesEvaluateTask(void * context, int index)
+{
+	iWQCMAESGeneration * gen=(iWQCMAESGeneration *)context;
+	iWQBoundsList & bounds=*gen->bounds;
+	double * modelpos=&gen->modelpos[index][0];
+	for(int k=index; k<gen->lambda; k+=gen->evaluators.size()){
+		//translate to model space
+		for(int i=0; i<gen->dimensions; i++){
+			modelpos[i]=bounds[i].min+gen->points[k][i]*(bounds[i].max-bounds[i].min);
+		}
+		gen->values[k]=gen->evaluators[index]->evaluate(modelpos, gen->dimensions);
+	}
+}
+
+//----------------------------------------------------------------------------
+
+//the standard (mu/mu_w, lambda)-CMA-ES as in Hansen: The CMA Evolution Strategy: A Tutorial (2016)
+
+std::vector<double> iWQCMAESOptimizer::optimize(iWQEvaluator * evaluator, iWQBoundsList bounds, std::vector<iWQEvaluator *> clones)
+{
+	printf("Running CMA-ES optimization.\n");
+
+	if(!evaluator){
+		printf("[Error]: no evaluator specified for CMA-ES optimization.\n");
+		return std::vector<double> ();
+	}
+
+	iWQParameterManager * parmanager=evaluator->parameters();
+	if(!parmanager){
+		printf("[Error]: Evaluator does not have parameters for CMA-ES optimization.\n");
+		return std::vector<double> ();
+	}
+
+	std::vector<std::string> parnames=parmanager->namesForPlainValues();
+	std::vector<double> parvals=parmanager->plainValues();
+	int n=bounds.size();
+	if(n==0 || n>parnames.size()){
+		printf("[Error]: The count of parameter names does not match CMA-ES bounds dimension.\n");
+		return std::vector<double> ();
+	}
+
+	//evaluation contexts: the evaluator itself and its clones
+	iWQCMAESGeneration gen;
+	gen.dimensions=n;
+	gen.bounds=&bounds;
+	gen.evaluators.push_back(evaluator);
+	for(int c=0; c<clones.size(); c++){
+		if(clones[c] && clones[c]->parameters() && clones[c]->parameters()->namesForPlainValues()==parnames){
+			gen.evaluators.push_back(clones[c]);
+		}
+		else{
+			printf("[Warning]: Evaluator clone %d does not have the same parameters, it is left out of the CMA-ES optimization.\n",c+1);
+		}
+	}
+	int numcontexts=gen.evaluators.size();
+	gen.modelpos.assign(numcontexts, std::vector<double> (n));
+
+	//the offspring are sampled from one stream, so the result does not depend on the number of contexts
+	unsigned int streamseed=(seed)?seed:(unsigned int)time(0);
+	iWQRandomNormalGenerator gauss (0.0, 1.0);
+	gauss.setSeed(streamseed);
+	iWQRandomUniformGenerator uniform (0.0, 1.0);
+	uniform.setSeed(streamseed+1);
+
+	iWQThreadPool * pool=NULL;
+	if(numcontexts>1){
+		pool=new iWQThreadPool(numcontexts);
+		printf("[optimizer]: The offspring are evaluated in %d parallel contexts (seed: %u).\n",numcontexts,streamseed);
+	}
+	else{
+		printf("[optimizer]: The offspring are evaluated in one context (seed: %u).\n",streamseed);
+	}
+
+	//starting point: the actual parameter values scaled to the bounds
+	Eigen::VectorXd start (n);
+	for(int i=0; i<n; i++){
+		double width=bounds[i].max-bounds[i].min;
+		start[i]=(width>0.0)?std::min(1.0, std::max(0.0, (parvals[i]-bounds[i].min)/width)):0.0;
+	}
+	Eigen::VectorXd xbest=start;
+	double fbest=DBL_MAX;
+
+	int evaluations=0;
+	int iteration=0;	//generations of all runs
+	int lambda=(populationSize>0)?populationSize:4+(int)(3.0*log((double)n));
+	if(lambda<2){
+		lambda=2;
+	}
+
+	for(int run=0; run<=maxRestarts && evaluations<maxEvaluations; run++){
+		//strategy parameters
+		int mu=lambda/2;
+		Eigen::VectorXd weights (mu);
+		for(int i=0; i<mu; i++){
+			weights[i]=log(mu+0.5)-log(i+1.0);
+		}
+		weights/=weights.sum();
+		double mueff=1.0/weights.squaredNorm();
+		double cc=(4.0+mueff/n)/(n+4.0+2.0*mueff/n);
+		double cs=(mueff+2.0)/(n+mueff+5.0);
+		double c1=2.0/((n+1.3)*(n+1.3)+mueff);
+		double cmu=std::min(1.0-c1, 2.0*(mueff-2.0+1.0/mueff)/((n+2.0)*(n+2.0)+mueff));
+		double damps=1.0+2.0*std::max(0.0, sqrt((mueff-1.0)/(n+1.0))-1.0)+cs;
+		double chiN=sqrt((double)n)*(1.0-1.0/(4.0*n)+1.0/(21.0*n*n));
+
+		//state: the first run starts in the parameter values, the restarts at random
+		Eigen::VectorXd mean (n);
+		for(int i=0; i<n; i++){
+			mean[i]=(run==0)?start[i]:uniform.generate();
+		}
+		double sigma=initialSigma;
+		Eigen::MatrixXd C=Eigen::MatrixXd::Identity(n, n);
+		Eigen::MatrixXd B=Eigen::MatrixXd::Identity(n, n);	//C = B*D*D*B'
+		Eigen::VectorXd D=Eigen::VectorXd::Ones(n);
+		Eigen::VectorXd pc=Eigen::VectorXd::Zero(n);
+		Eigen::VectorXd ps=Eigen::VectorXd::Zero(n);
+
+		Eigen::MatrixXd arz (n, lambda);	//standard normal samples
+		Eigen::MatrixXd ary (n, lambda);	//steps before scaling with sigma
+		gen.lambda=lambda;
+		gen.points.assign(lambda, std::vector<double> (n));
+		gen.values.assign(lambda, DBL_MAX);
+		std::vector<std::pair<double, int> > ranking (lambda);
+		std::vector<double> history;	//best values of the generations
+		int historylength=10+(int)ceil(30.0*n/lambda);
+
+		printf("[optimizer]: CMA-ES run %d with %d offspring per generation.\n",run+1,lambda);
+
+		bool converged=false;
+		for(int g=0; !converged && evaluations<maxEvaluations; g++){
+			//sample the offspring and repair them into the bounds
+			for(int k=0; k<lambda; k++){
+				for(int i=0; i<n; i++){
+					arz(i,k)=gauss.generate();
+				}
+				ary.col(k)=B*D.asDiagonal()*arz.col(k);
+				for(int i=0; i<n; i++){
+					gen.points[k][i]=std::min(1.0, std::max(0.0, mean[i]+sigma*ary(i,k)));
+				}
+			}
+
+			if(pool){
+				pool->run(numcontexts, cmaesEvaluateTask, &gen);
+			}
+			else{
+				cmaesEvaluateTask(&gen, 0);
+			}
+			evaluations+=lambda;
+
+			//penalty for the repaired points, scaled by the spread of the values in this generation
+			double fmin=DBL_MAX;
+			double fmax=-DBL_MAX;
+			for(int k=0; k<lambda; k++){
+				if(gen.values[k]<DBL_MAX && !std::isnan(gen.values[k])){
+					fmin=std::min(fmin, gen.values[k]);
+					fmax=std::max(fmax, gen.values[k]);
+				}
+			}
+			double spread=(fmax>fmin)?fmax-fmin:1.0;
+			for(int k=0; k<lambda; k++){
+				double value=std::isnan(gen.values[k])?DBL_MAX:gen.values[k];
+				if(value<DBL_MAX){
+					double dist2=0.0;
+					for(int i=0; i<n; i++){
+						double d=mean[i]+sigma*ary(i,k)-gen.points[k][i];
+						dist2+=d*d;
+					}
+					value+=spread*dist2;
+				}
+				ranking[k]=std::make_pair(value, k);
+				if(gen.values[k]<fbest){
+					fbest=gen.values[k];
+					for(int i=0; i<n; i++){
+						xbest[i]=gen.points[k][i];
+					}
+				}
+			}
+			std::sort(ranking.begin(), ranking.end());
+
+			//recombination
+			Eigen::VectorXd ymean=Eigen::VectorXd::Zero(n);
+			Eigen::VectorXd zmean=Eigen::VectorXd::Zero(n);
+			for(int i=0; i<mu; i++){
+				ymean+=weights[i]*ary.col(ranking[i].second);
+				zmean+=weights[i]*arz.col(ranking[i].second);
+			}
+			mean+=sigma*ymean;
+
+			//evolution paths
+			ps=(1.0-cs)*ps+sqrt(cs*(2.0-cs)*mueff)*(B*zmean);
+			double hsig=(ps.norm()/sqrt(1.0-pow(1.0-cs, 2.0*(g+1)))/chiN < 1.4+2.0/(n+1.0))?1.0:0.0;
+			pc=(1.0-cc)*pc+hsig*sqrt(cc*(2.0-cc)*mueff)*ymean;
+
+			//covariance matrix: rank-one and rank-mu update
+			Eigen::MatrixXd rankmu=Eigen::MatrixXd::Zero(n, n);
+			for(int i=0; i<mu; i++){
+				rankmu+=weights[i]*ary.col(ranking[i].second)*ary.col(ranking[i].second).transpose();
+			}
+			C=(1.0-c1-cmu)*C+c1*(pc*pc.transpose()+(1.0-hsig)*cc*(2.0-cc)*C)+cmu*rankmu;
+			C=0.5*(C+C.transpose());
+
+			//step size
+			sigma*=exp((cs/damps)*(ps.norm()/chiN-1.0));
+
+			//decomposition for the next generation
+			Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen (C);
+			B=eigen.eigenvectors();
+			D=eigen.eigenvalues().cwiseMax(0.0).cwiseSqrt();
+
+			//convergence of the run
+			history.push_back(ranking[0].first);
+			if(history.size()>=historylength){
+				double hmin=*std::min_element(history.end()-historylength, history.end());
+				double hmax=*std::max_element(history.end()-historylength, history.end());
+				if(hmax-hmin<tolerance && ranking[lambda-1].first-ranking[0].first<tolerance){
+					converged=true;	//flat objective
+				}
+			}
+			if(sigma*sqrt(C.diagonal().maxCoeff())<tolerance && sigma*pc.cwiseAbs().maxCoeff()<tolerance){
+				converged=true;	//no more steps
+			}
+			if(!(D.minCoeff()>0.0) || D.maxCoeff()>1E7*D.minCoeff() || !(sigma>0.0) || std::isinf(sigma)){
+				converged=true;	//degenerate distribution
+			}
+
+			//write out iteration details
+			printf("CMA-ES #%d\t[%lf]\n",iteration,fbest);
+
+			//save parameters to a temporary file
+			FILE * tempfile=fopen("_calibration_progress.tmp","a");
+			if(tempfile){
+				time_t t=time(0);
+				fprintf(tempfile,"#BEGIN RECORD\n#time=%s\n#creator=cmaes\n#iteration=%d\n",ctime(&t),iteration);
+				for(int i=0; i<n; i++){
+					fprintf(tempfile,"\t%s: %g\n",parnames[i].c_str(), bounds[i].min+xbest[i]*(bounds[i].max-bounds[i].min));
+				}
+				fprintf(tempfile,"#eval=[%g]\n#END RECORD\n",fbest);
+				fclose(tempfile);
+			}
+			iteration++;
+		}
+
+		//IPOP: larger populations explore more globally
+		lambda*=2;
+	}
+
+	if(pool){
+		delete pool;
+	}
+
+	std::vector<double> result (n);
+	for(int i=0; i<n; i++){
+		result[i]=bounds[i].min+xbest[i]*(bounds[i].max-bounds[i].min);
+	}
+	return result;
+}
@@ -0,0 +1,40 @@
+/*
+ *  cmaes.h
+ *  Covariance matrix adaptation evolution strategy (CMA-ES) with IPOP restarts
+ *
+ *  iWaQa model framework 2010-2017
+ *
+ *  SYSTEM/OPTIMISE
+ *
+ */
+
+#include <vector>
+#include <string>
+#include "particleswarm.h"
+
+#ifndef cmaes_h
+#define cmaes_h
+
+class iWQEvaluator;
+
+// Minimises the evaluator function within the bounds. The search runs on the bounds scaled to [0,1],
+// points outside are evaluated on the nearest bound and penalised by their distance.
+// After convergence the search restarts from a random point with a doubled population (IPOP).
+class iWQCMAESOptimizer
+{
+public:
+	iWQCMAESOptimizer();
+
+	//settings
+	int populationSize;		//offspring of the first run, 0: 4+3*ln(dimensions)
+	int maxEvaluations;		//budget of all runs
+	int maxRestarts;		//IPOP restarts
+	double initialSigma;	//initial step size relative to the bounds
+	double tolerance;		//a run converges when the objective values and the steps are below this
+	unsigned int seed;		//0: seeded from the clock
+
+	//clones are independent evaluators of the same layout for evaluating the offspring in parallel
+	std::vector<double> optimize(iWQEvaluator * evaluator, iWQBoundsList bounds, std::vector<iWQEvaluator *> clones=std::vector<iWQEvaluator *>());
+};
+
+#endif
@@ -41,6 +41,8 @@ iWQComparisonLink::iWQComparisonLink()
 {
 	modelptr=NULL;
 	measptr=NULL;
+	modelcol=NULL;
+	meascol=NULL;
 	modelname="";
 	measname="";
 	predmode=false;
@@ -52,6 +54,9 @@ iWQComparisonLink::iWQComparisonLink(iWQDataTable * table, std::string modelfiel
 {
 	modelptr=NULL;
 	measptr=NULL;
+	modelcol=NULL;
+	meascol=NULL;
+	predmode=false;
 	
 	if(!table){
 		return;
@@ -96,3 +101,28 @@ bool iWQComparisonLink::numeric(){
 	}
 }
 
+//-------------------------------------------------------------------------------------------------
+
+bool iWQComparisonLink::attachColumns(iWQDataTable * table)
+{
+	modelcol=NULL;
+	meascol=NULL;
+	if(table && valid()){
+		//the row at the cursor has to be in the storage
+		table->commit();
+		modelcol=table->columnDataForPort(modelptr);
+		meascol=table->columnDataForPort(measptr);
+	}
+	return (modelcol && meascol);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+bool iWQComparisonLink::numeric(int row){ 
+	if(predmode || !modelcol || !meascol){
+		return false;	//pretend that link is not complete
+	}
+	else{
+		return !(isnan(modelcol[row]) || isnan(meascol[row])); 
+	}
+}
@@ -22,6 +22,8 @@ class iWQComparisonLink
 private:
 	double * modelptr;
 	double * measptr;
+	const double * modelcol;	//stored columns for row access, see attachColumns()
+	const double * meascol;
 	std::string modelname;
 	std::string measname;
 	bool predmode;
@@ -37,6 +39,12 @@ public:
 	std::string modelField(){ return modelname; }
 	std::string measuredField(){ return measname; }
 	bool numeric();					//shows if both numbers are valid
+	
+	//row access without moving the cursor of the table (valid until rows are added)
+	bool attachColumns(iWQDataTable * table);
+	double model(int row){ return modelcol[row]; }
+	double measurement(int row){ return meascol[row]; }
+	bool numeric(int row);
 	bool operator==(const iWQComparisonLink & alink) const;
 	bool operator!=(const iWQComparisonLink & alink) const;
 	void setPredictiveMode(bool p){ predmode=p; }
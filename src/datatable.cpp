@@ -16,8 +16,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <algorithm>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "threadpool.h"
+
 #pragma mark string tokenizer
 
 //C++ tokenizer from http://oopweb.com/CPP/Documents/CPPHOWTO/Volume/C++Programming-HOWTO-7.html
@@ -80,6 +90,519 @@ std::istream& safeGetline(std::istream& is, std::string& t)
 
 //##################################################################################################
 
+#pragma mark Mapped text files
+
+// Read-only view of a whole file: memory-mapped, or read into memory where mmap is missing
+class iWQMappedFile
+{
+private:
+	const char * mData;
+	size_t mSize;
+	std::vector<char> mBuffer;	//without mmap
+	
+public:
+	iWQMappedFile(){ mData=NULL; mSize=0; }
+	~iWQMappedFile(){ close(); }
+	bool open(std::string filename);
+	void close();
+	void release(const char * from, const char * to);	//pages which are not needed anymore
+	const char * begin() const { return mData; }
+	const char * end() const { return mData+mSize; }
+};
+
+//-------------------------------------------------------------------------------------------------
+
+bool iWQMappedFile::open(std::string filename)
+{
+	close();
+#ifndef _WIN32
+	int fd=::open(filename.c_str(), O_RDONLY);
+	if(fd<0){
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info)!=0){
+		::close(fd);
+		return false;
+	}
+	mSize=info.st_size;
+	if(mSize>0){
+		void * data=mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data==MAP_FAILED){
+			::close(fd);
+			mSize=0;
+			return false;
+		}
+		madvise(data, mSize, MADV_SEQUENTIAL);
+		mData=(const char *)data;
+	}
+	::close(fd);
+	return true;
+#else
+	FILE * f=fopen(filename.c_str(), "rb");
+	if(!f){
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long length=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	mBuffer.resize((length>0)?length:0);
+	mSize=(length>0)?fread(&mBuffer[0], 1, length, f):0;
+	mData=(mSize)?&mBuffer[0]:NULL;
+	fclose(f);
+	return true;
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQMappedFile::close()
+{
+#ifndef _WIN32
+	if(mData && mSize){
+		munmap((void *)mData, mSize);
+	}
+#endif
+	mBuffer.clear();
+	mData=NULL;
+	mSize=0;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQMappedFile::release(const char * from, const char * to)
+{
+#ifndef _WIN32
+	//whole pages only, they are read again from the file if touched later
+	size_t pagesize=sysconf(_SC_PAGESIZE);
+	size_t first=((from-mData)+pagesize-1)/pagesize*pagesize;
+	size_t last=(to-mData)/pagesize*pagesize;
+	if(mData && first<last && last<=mSize){
+		madvise((void *)(mData+first), last-first, MADV_DONTNEED);
+	}
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+
+// Piece of the data rows, starting at a line start. The lines are split like std::getline,
+// the items like Tokenize(" \t"). Counted in the first pass, stored in the second.
+class iWQTextChunk
+{
+public:
+	const char * begin;
+	const char * end;
+	int numLines;		//non-empty lines
+	int numRows;		//lines with the expected number of items
+	int firstLine;		//numbering of the lines and the rows from the earlier chunks
+	int firstRow;
+	std::vector<std::pair<int, int> > skipped;	//line number and item count of the skipped lines
+};
+
+class iWQTextParseJob
+{
+public:
+	std::vector<iWQTextChunk> chunks;
+	int numItems;								//expected items per line
+	const std::vector<int> * destinations;		//column of each item, -1 to drop it
+	std::vector<std::vector<double> > * storage;
+	int baseRow;
+	bool store;									//second pass
+};
+
+//-------------------------------------------------------------------------------------------------
+
+static int countItems(const char * p, const char * end)
+{
+	int count=0;
+	while(p<end){
+		while(p<end && (*p==' ' || *p=='\t')){
+			p++;
+		}
+		if(p==end){
+			break;
+		}
+		count++;
+		while(p<end && *p!=' ' && *p!='\t'){
+			p++;
+		}
+	}
+	return count;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static double parseItem(const char * p, const char * end)
+{
+	//strtod needs a terminated string: copy to the stack, the mapping has no terminator
+	char buffer[64];
+	size_t length=end-p;
+	if(length<sizeof(buffer)){
+		memcpy(buffer, p, length);
+		buffer[length]=0;
+		char * sptr;
+		double value=strtod(buffer, &sptr);
+		//if not valid number, don't complain, just load NaN
+		return (sptr!=buffer)?value:iWQNaN;
+	}
+	std::string item (p, length);
+	char * sptr;
+	double value=strtod(item.c_str(), &sptr);
+	return (sptr!=item.c_str())?value:iWQNaN;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static void parseTextChunk(void * context, int index)
+{
+	iWQTextParseJob * job=(iWQTextParseJob *)context;
+	iWQTextChunk & chunk=job->chunks[index];
+	int linenumber=chunk.firstLine;
+	int row=job->baseRow+chunk.firstRow;
+	const char * p=chunk.begin;
+	while(p<chunk.end){
+		const char * eol=(const char *)memchr(p, '\n', chunk.end-p);
+		if(!eol){
+			eol=chunk.end;
+		}
+		if(eol>p){
+			linenumber++;
+			int items=countItems(p, eol);
+			if(!job->store){
+				chunk.numLines++;
+				if(items==job->numItems){
+					chunk.numRows++;
+				}
+			}
+			else if(items==job->numItems){
+				//valid number of items in row
+				const std::vector<int> & dest=*(job->destinations);
+				const char * q=p;
+				for(int i=0; i<items; i++){
+					while(*q==' ' || *q=='\t'){
+						q++;
+					}
+					const char * itemend=q;
+					while(itemend<eol && *itemend!=' ' && *itemend!='\t'){
+						itemend++;
+					}
+					if(i<dest.size() && dest[i]>=0){
+						(*job->storage)[dest[i]][row]=parseItem(q, itemend);
+					}
+					q=itemend;
+				}
+				row++;
+			}
+			else{
+				chunk.skipped.push_back(std::make_pair(linenumber, items));
+			}
+		}
+		p=eol+1;
+	}
+}
+
+//##################################################################################################
+
+#pragma mark Binary columnar files
+
+// Layout, in the byte order of the writer (checked with the marker):
+//   magic (8 bytes), uint32 byte order marker, uint32 column count, uint64 row count,
+//   for each column: uint32 name length and the name,
+//   padding to 8 bytes, uint64 offset of each column from the file start,
+//   the columns as doubles, each starting at an 8 byte boundary
+#define IWQ_BINARY_TABLE_BYTEORDER 0x01020304
+
+static bool isBinaryTable(const iWQMappedFile & f)
+{
+	return (f.end()-f.begin()>=8 && memcmp(f.begin(), IWQ_BINARY_TABLE_MAGIC, 8)==0);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static size_t binaryTableHeaderSize(const std::vector<std::string> & names)
+{
+	size_t size=24;
+	for(int i=0; i<names.size(); i++){
+		size+=4+names[i].size();
+	}
+	size=(size+7)/8*8;
+	return size+8*names.size();
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static bool parseBinaryTable(const iWQMappedFile & f, std::vector<std::string> & names, std::vector<const double *> & columns, int & numrows)
+{
+	const char * p=f.begin()+8;
+	size_t size=f.end()-f.begin();
+	if(size<24){
+		return false;
+	}
+	uint32_t byteorder, numcols;
+	uint64_t rows;
+	memcpy(&byteorder, p, 4);
+	memcpy(&numcols, p+4, 4);
+	memcpy(&rows, p+8, 8);
+	p+=16;
+	if(byteorder!=IWQ_BINARY_TABLE_BYTEORDER){
+		printf("[Error]: Binary data file was written with a different byte order.\n");
+		return false;
+	}
+	if(rows>(uint64_t)std::numeric_limits<int>::max()){
+		return false;
+	}
+	for(uint32_t i=0; i<numcols; i++){
+		uint32_t length;
+		if(f.end()-p<4){
+			return false;
+		}
+		memcpy(&length, p, 4);
+		p+=4;
+		if(f.end()-p<length){
+			return false;
+		}
+		names.push_back(std::string(p, length));
+		p+=length;
+	}
+	size_t offsetpos=((p-f.begin())+7)/8*8;
+	if(offsetpos+8*(size_t)numcols>size){
+		return false;
+	}
+	for(uint32_t i=0; i<numcols; i++){
+		uint64_t offset;
+		memcpy(&offset, f.begin()+offsetpos+8*i, 8);
+		if(offset%8!=0 || offset>size || (size-offset)/8<rows){
+			return false;
+		}
+		columns.push_back((const double *)(f.begin()+offset));
+	}
+	numrows=(int)rows;
+	return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+// Source of the rows of a streamed table: text read line by line, or a mapped binary file
+class iWQTableStream
+{
+public:
+	int windowRows;
+	std::vector<int> destinations;		//table column of each file column, -1 to drop it
+	bool isBinary;
+	//text
+	std::ifstream text;
+	std::string buffer;					//lines of one window
+	int numLines;						//non-empty lines read after the header
+	//binary
+	iWQMappedFile binary;
+	std::vector<const double *> columns;
+	int numRows;
+	int nextRow;
+};
+
+//##################################################################################################
+
+#pragma mark Fast text output
+
+// Numbers are written like printf("%0.9lg"): the 9 digits come from one scaling by a power of ten,
+// which is exact unless the value is close to a rounding tie, those (and inf) go through sprintf.
+// A formatted value takes at most IWQ_FORMATTED_VALUE_SIZE characters.
+#define IWQ_FORMATTED_VALUE_SIZE 16
+#define IWQ_FORMAT_BLOCK_ROWS 4096
+
+static const double powersOfTen[23]={1E0,1E1,1E2,1E3,1E4,1E5,1E6,1E7,1E8,1E9,1E10,1E11,
+	1E12,1E13,1E14,1E15,1E16,1E17,1E18,1E19,1E20,1E21,1E22};
+
+static char * formatValue(double value, char * p)
+{
+	//NaN as in the input files
+	if(isnan(value)){
+		memcpy(p, "NA", 2);
+		return p+2;
+	}
+	if(value==0.0){
+		if(signbit(value)){
+			*p++='-';
+		}
+		*p++='0';
+		return p;
+	}
+	double a=fabs(value);
+	int e=(isinf(a))?0:(int)floor(log10(a));
+	uint32_t digits=0;
+	bool exact=false;
+	for(int attempt=0; attempt<3 && !isinf(a); attempt++){
+		int k=8-e;
+		if(k<-22 || k>22){
+			break;
+		}
+		//one correctly rounded operation: off by less than 6E-8
+		double y=(k>=0)?a*powersOfTen[k]:a/powersOfTen[-k];
+		if(y<1E8){
+			e--;
+			continue;
+		}
+		if(y>=1E9){
+			e++;
+			continue;
+		}
+		double whole=floor(y);
+		double fraction=y-whole;
+		if(fabs(fraction-0.5)<2E-7){
+			break;
+		}
+		digits=(uint32_t)whole+((fraction>0.5)?1:0);
+		if(digits==1000000000){
+			digits=100000000;
+			e++;
+		}
+		exact=true;
+		break;
+	}
+	if(!exact){
+		return p+sprintf(p, "%0.9lg", value);
+	}
+	char d[9];
+	for(int i=8; i>=0; i--){
+		d[i]='0'+digits%10;
+		digits/=10;
+	}
+	int n=9;
+	while(n>1 && d[n-1]=='0'){
+		n--;
+	}
+	if(value<0.0){
+		*p++='-';
+	}
+	if(e<-4 || e>=9){
+		*p++=d[0];
+		if(n>1){
+			*p++='.';
+			memcpy(p, d+1, n-1);
+			p+=n-1;
+		}
+		*p++='e';
+		*p++=(e<0)?'-':'+';
+		int x=(e<0)?-e:e;
+		if(x>=100){
+			*p++='0'+x/100;
+		}
+		*p++='0'+(x/10)%10;
+		*p++='0'+x%10;
+	}
+	else if(e>=0){
+		memcpy(p, d, e+1);
+		p+=e+1;
+		if(n>e+1){
+			*p++='.';
+			memcpy(p, d+e+1, n-e-1);
+			p+=n-e-1;
+		}
+	}
+	else{
+		*p++='0';
+		*p++='.';
+		for(int i=0; i<-e-1; i++){
+			*p++='0';
+		}
+		memcpy(p, d, n);
+		p+=n;
+	}
+	return p;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static char * formatInteger(int value, char * p)
+{
+	char digits[12];
+	unsigned int x=(value<0)?-(unsigned int)value:value;
+	int n=0;
+	do{
+		digits[n++]='0'+x%10;
+		x/=10;
+	}while(x);
+	if(value<0){
+		*p++='-';
+	}
+	while(n){
+		*p++=digits[--n];
+	}
+	return p;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+// Rows of the tab-separated output, formatted in blocks on the threads and written in order
+class iWQTextFormatJob
+{
+public:
+	std::vector<const double *> columns;	//NULL for the columns which are not printed
+	int firstRow;
+	int endRow;
+	int firstBlock;							//of the current batch
+	std::vector<std::string> blocks;
+};
+
+static void formatTextBlock(void * context, int index)
+{
+	iWQTextFormatJob * job=(iWQTextFormatJob *)context;
+	int from=job->firstRow+(job->firstBlock+index)*IWQ_FORMAT_BLOCK_ROWS;
+	int to=std::min(from+IWQ_FORMAT_BLOCK_ROWS, job->endRow);
+	std::string & block=job->blocks[index];
+	block.resize((size_t)(to-from)*(job->columns.size()*(IWQ_FORMATTED_VALUE_SIZE+1)+1));
+	char * p=&block[0];
+	for(int j=from; j<to; j++){
+		for(int i=0; i<job->columns.size(); i++){
+			if(job->columns[i]){
+				if(i>0){
+					*p++='\t';
+				}
+				p=formatValue(job->columns[i][j], p);
+			}
+		}
+		*p++='\n';
+	}
+	block.resize(p-&block[0]);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+// UNCSIM lines of the columns, one column per task
+class iWQUNCSIMFormatJob
+{
+public:
+	std::vector<const double *> columns;
+	std::vector<std::string> names;
+	int numRows;
+	std::vector<std::string> blocks;
+};
+
+static void formatUNCSIMColumn(void * context, int index)
+{
+	iWQUNCSIMFormatJob * job=(iWQUNCSIMFormatJob *)context;
+	const std::string & name=job->names[index];
+	const double * values=job->columns[index];
+	std::string & block=job->blocks[index];
+	block.resize((size_t)job->numRows*(name.size()+IWQ_FORMATTED_VALUE_SIZE+14));
+	char * p=&block[0];
+	for(int j=0; j<job->numRows; j++){
+		//silently omit NaNs from the dataset
+		if(!isnan(values[j])){
+			memcpy(p, name.data(), name.size());
+			p+=name.size();
+			*p++='_';
+			p=formatInteger(j, p);
+			*p++='\t';
+			p=formatValue(values[j], p);
+			*p++='\n';
+		}
+	}
+	block.resize(p-&block[0]);
+}
+
+//##################################################################################################
+
 #pragma mark DataTable
 
 iWQDataTable::iWQDataTable()
@@ -95,6 +618,11 @@ void iWQDataTable::emptyInit()
 	mNumCols=0;
 	mActRow=-1;
 	mTIndex=-1;
+	mBoundCursor=true;
+	mRevision=0;
+	mMappedFile=NULL;
+	mStream=NULL;
+	mWindowStart=0;
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -125,12 +653,14 @@ iWQDataTable::iWQDataTable(std::string filename)
 void iWQDataTable::initFromTable(iWQDataTable * atable)
 {
 	clear();
+	atable->materializeAll();
 	//import headers and data
 	mColIndexes=atable->mColIndexes;
 	mDataStorage=atable->mDataStorage;
 	for(int i=0; i<atable->mDataPort.size(); i++){
 		double * aval=new double;
 		mDataPort.push_back(aval);
+		mPortBound.push_back(0);
 	}
 	//other attributes
 	mNumRows=atable->mNumRows;
@@ -141,6 +671,31 @@ void iWQDataTable::initFromTable(iWQDataTable * atable)
 
 //-------------------------------------------------------------------------------------------------
 
+void iWQDataTable::copyValuesFrom(iWQDataTable * atable)
+{
+	//same values and row count, the columns missing here are added
+	atable->commit();
+	atable->materializeAll();
+	materializeAll();
+	mNumRows=atable->mNumRows;
+	for(std::map<std::string, int>::iterator it=atable->mColIndexes.begin(); it!=atable->mColIndexes.end(); it++){
+		addColumn(it->first, false);
+		int index=getColIndex(it->first);
+		mDataStorage[index]=atable->mDataStorage[it->second];
+		touchColumn(index);
+	}
+	for(int i=0; i<mNumCols; i++){
+		if(mDataStorage[i].size()!=mNumRows){
+			mDataStorage[i].resize(mNumRows, 0.0);
+			touchColumn(i);
+		}
+	}
+	mActRow=-1;
+	mRevision++;
+}
+
+//-------------------------------------------------------------------------------------------------
+
 bool iWQDataTable::isPortValid(double * port)
 {
 	for(int i=0; i<mNumCols; i++){
@@ -163,10 +718,15 @@ void iWQDataTable::clear()
 	for(int i=0; i<mDataStorage.size(); i++){
 		mDataStorage[i].clear();
 	}
+	mPortBound.assign(mDataPort.size(),0);
+	mBoundColumns.clear();
+	releaseMapping();
+	closeStream();
 	mNumRows=0;
 	mNumCols=0;
 	mActRow=-1;
 	mTIndex=-1;
+	mRevision++;
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -175,7 +735,11 @@ void iWQDataTable::clearColumn(std::string colname)
 {
 	int colindex=getColIndex(colname);
 	if(colindex!=-1){
+		if(colindex<mLazyColumns.size()){
+			mLazyColumns[colindex]=NULL;
+		}
 		mDataStorage[colindex].assign(mNumRows,0.0);
+		mRevision++;
 	}
 }
 
@@ -187,20 +751,29 @@ void iWQDataTable::deleteColumn(std::string colname)
 	if(colindex!=-1 && colindex!=mTIndex){
 		//remove data
 		mDataStorage.erase(mDataStorage.begin()+colindex);
+		if(colindex<mLazyColumns.size()){
+			mLazyColumns.erase(mLazyColumns.begin()+colindex);
+		}
 		//remove port
 		if(colindex<mDataPort.size()){
 			if(mDataPort[colindex]){
 				delete mDataPort[colindex];
 			}
 			mDataPort.erase(mDataPort.begin()+colindex);
+			mPortBound.erase(mPortBound.begin()+colindex);
+			rebuildBoundColumns();
 		}
 		else{
 			printf("[Error]: Index for column \"%s\" (%d) is out of bounds (%zd).\n",colname.c_str(),colindex,mDataPort.size());
 		}
+		if(colindex<mColumnRevisions.size()){
+			mColumnRevisions.erase(mColumnRevisions.begin()+colindex);
+		}
 		//remove name
 		mColIndexes.erase(colname);
 		//reduce col count
 		mNumCols--;
+		mRevision++;
 	}
 	if(colindex!=-1 && colindex==mTIndex){
 		printf("[Error]: Cannot delete time column \"%s\".\n",colname.c_str());
@@ -211,24 +784,31 @@ void iWQDataTable::deleteColumn(std::string colname)
 
 void iWQDataTable::initFromFile(std::string filename)
 {	
-	std::ifstream f;
-	f.open(filename.c_str(), std::ios::in);
-	if(!f.is_open()){
+	iWQMappedFile * binary=new iWQMappedFile;
+	if(!binary->open(filename)){
 		printf("[Error]: failed to open data file \"%s\".\n",filename.c_str());
+		delete binary;
 		return;
 	}
 	
 	//get rid of previous content
 	clear();
 	
-	if(f.eof()){
-		//empty file
+	//binary files keep their mapping for the lazy columns
+	if(isBinaryTable(*binary)){
+		if(!initFromBinary(binary)){
+			printf("[Error]: Binary data file \"%s\" is damaged.\n",filename.c_str());
+		}
 		return;
 	}
+	iWQMappedFile & f=*binary;
+	
 	//read header
-	std::string headerline;
-	std::getline(f,headerline);
-	//safeGetline(f, headerline);
+	const char * headerend=(f.begin()<f.end())?(const char *)memchr(f.begin(), '\n', f.end()-f.begin()):NULL;
+	if(!headerend){
+		headerend=f.end();
+	}
+	std::string headerline (f.begin(), headerend-f.begin());
 	//explode columns headers
 	std::stringstream strstr (headerline);
 	std::istream_iterator<std::string> it (strstr);
@@ -241,42 +821,148 @@ void iWQDataTable::initFromFile(std::string filename)
 	}
 	
 	//now read in the content
-	std::string dataline;
-	std::vector<double> values;
-	std::vector<std::string> svalues;
-	int linenumber=0;
-	while(!f.eof()){
-		//read the next data row
-		std::getline(f,dataline);
-		if(dataline.size()){
-			values.clear();
-			linenumber++;
-			Tokenize(dataline, svalues, " \t");
-			if(svalues.size()==mDataStorage.size()){
-				//valid number of items in row	
-				for(int i=0; i<svalues.size(); i++){
-					char * sptr;
-					double value=strtod(svalues[i].c_str(), &sptr);
-					if(sptr!=svalues[i].c_str()){
-						values.push_back(value);
-					}
-					else{
-						//if not valid number, don't complain, just load NaN
-						values.push_back(iWQNaN);
-					}
-				}
-				//load them
-				mNumRows++;
-				for(int i=0; i<mNumCols; i++){
-					mDataStorage[i].push_back(values[i]);
-				}
-			}
-			else{
-				printf("[Warning]: Row %d contains %zd columns instead of %zd - skipped.\n",linenumber,svalues.size(),mDataStorage.size());
-			}
+	std::vector<int> destinations;
+	for(int i=0; i<mNumCols; i++){
+		destinations.push_back(i);
+	}
+	if(headerend<f.end()){
+		loadRows(headerend+1, f.end(), destinations, mDataStorage.size());
+	}
+	delete binary;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+bool iWQDataTable::initFromBinary(iWQMappedFile * file)
+{
+	std::vector<std::string> names;
+	std::vector<const double *> columns;
+	int numrows=0;
+	if(!parseBinaryTable(*file, names, columns, numrows)){
+		delete file;
+		return false;
+	}
+	//columns with ports but without data, nothing is read until a column is used
+	for(int i=0; i<names.size(); i++){
+		addColumn(names[i]);
+	}
+	mNumRows=numrows;
+	mMappedFile=file;
+	mLazyColumns.assign(mNumCols, (const double *)NULL);
+	for(int i=0; i<names.size(); i++){
+		int index=getColIndex(names[i]);
+		if(index>=0 && index<mNumCols){
+			mLazyColumns[index]=columns[i];
+		}
+	}
+	if(!mBoundCursor){
+		//every column is copied on each row step
+		materializeAll();
+	}
+	return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::loadLazyColumn(int index)
+{
+	const double * values=mLazyColumns[index];
+	mDataStorage[index].assign(values, values+mNumRows);
+	mLazyColumns[index]=NULL;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::materializeAll()
+{
+	for(int i=0; i<mLazyColumns.size(); i++){
+		materialize(i);
+	}
+	releaseMapping();
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::releaseMapping()
+{
+	if(mMappedFile){
+		delete mMappedFile;
+		mMappedFile=NULL;
+	}
+	mLazyColumns.clear();
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::loadRows(const char * begin, const char * end, const std::vector<int> & destinations, int numitems, int firstline)
+{
+	//chunks start after a line break, large files are parsed on all the cores
+	int numchunks=(end-begin>=IWQ_PARALLEL_PARSE_SIZE)?iWQThreadPool::hardwareThreads():1;
+	iWQTextParseJob job;
+	job.numItems=numitems;
+	job.destinations=&destinations;
+	job.storage=&mDataStorage;
+	job.baseRow=mNumRows;
+	job.store=false;
+	const char * chunkbegin=begin;
+	for(int i=0; i<numchunks; i++){
+		const char * chunkend=(i+1<numchunks)?begin+(end-begin)/numchunks*(i+1):end;
+		if(chunkend<chunkbegin){
+			chunkend=chunkbegin;
+		}
+		if(chunkend<end){
+			const char * eol=(const char *)memchr(chunkend, '\n', end-chunkend);
+			chunkend=(eol)?eol+1:end;
+		}
+		iWQTextChunk chunk;
+		chunk.begin=chunkbegin;
+		chunk.end=chunkend;
+		chunk.numLines=0;
+		chunk.numRows=0;
+		chunk.firstLine=0;
+		chunk.firstRow=0;
+		job.chunks.push_back(chunk);
+		chunkbegin=chunkend;
+	}
+	iWQThreadPool * pool=(numchunks>1)?new iWQThreadPool(numchunks):NULL;
+	
+	//count the rows, then the storage is sized once
+	if(pool){
+		pool->run(numchunks, parseTextChunk, &job);
+	}
+	else{
+		parseTextChunk(&job, 0);
+	}
+	int numrows=0;
+	int numlines=firstline;
+	for(int i=0; i<numchunks; i++){
+		job.chunks[i].firstLine=numlines;
+		job.chunks[i].firstRow=numrows;
+		numlines+=job.chunks[i].numLines;
+		numrows+=job.chunks[i].numRows;
+	}
+	for(int i=0; i<destinations.size(); i++){
+		if(destinations[i]>=0){
+			mDataStorage[destinations[i]].resize(mNumRows+numrows);
 		}
-	}	
-	f.close();
+	}
+	
+	//parse the values in place
+	job.store=true;
+	if(pool){
+		pool->run(numchunks, parseTextChunk, &job);
+		delete pool;
+	}
+	else{
+		parseTextChunk(&job, 0);
+	}
+	mNumRows+=numrows;
+	
+	for(int i=0; i<numchunks; i++){
+		for(int j=0; j<job.chunks[i].skipped.size(); j++){
+			printf("[Warning]: Row %d contains %d columns instead of %d - skipped.\n",job.chunks[i].skipped[j].first,job.chunks[i].skipped[j].second,numitems);
+		}
+	}
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -284,9 +970,8 @@ void iWQDataTable::initFromFile(std::string filename)
 void iWQDataTable::reloadFromFile(std::string filename)
 {
 	//same as initFromFile but with keeping the structure
-	std::ifstream f;
-	f.open(filename.c_str(), std::ios::in);
-	if(!f.is_open()){
+	iWQMappedFile f;
+	if(!f.open(filename)){
 		printf("[Error]: failed to open data file \"%s\".\n",filename.c_str());
 		return;
 	}
@@ -295,16 +980,22 @@ void iWQDataTable::reloadFromFile(std::string filename)
 	for(int i=0; i<mDataStorage.size(); i++){
 		mDataStorage[i].clear();
 	}
+	releaseMapping();
 	mNumRows=0;
 	mActRow=-1;
+	mRevision++;
 	
-	if(f.eof()){
-		//empty file
+	if(isBinaryTable(f)){
+		reloadFromBinary(&f);
 		return;
 	}
+	
 	//read header
-	std::string headerline;
-	std::getline(f,headerline);
+	const char * headerend=(f.begin()<f.end())?(const char *)memchr(f.begin(), '\n', f.end()-f.begin()):NULL;
+	if(!headerend){
+		headerend=f.end();
+	}
+	std::string headerline (f.begin(), headerend-f.begin());
 	//explode columns headers
 	std::stringstream strstr (headerline);
 	std::istream_iterator<std::string> it (strstr);
@@ -315,48 +1006,184 @@ void iWQDataTable::reloadFromFile(std::string filename)
 	
 	
 	//for each column make storage, register them in the index and open a port
-	for(int i=0; i<tokens.size(); i++){
+	for(int i=0; i<tokens.size() && i<mNumCols; i++){
 		fieldIndexInOriginal.push_back(getColIndex(tokens[i]));
 	}
 	
 	//now read in the content
-	std::string dataline;
-	std::vector<double> values;
-	std::vector<std::string> svalues;
-	int linenumber=0;
-	while(!f.eof()){
-		//read the next data row
-		std::getline(f,dataline);
-		if(dataline.size()){
-			values.clear();
-			linenumber++;
-			Tokenize(dataline, svalues, " \t");
-			//int skipped=0;
-			if(svalues.size()==mDataStorage.size()){
-				//valid number of items in row	
-				for(int i=0; i<svalues.size(); i++){
-					char * sptr;
-					double value=strtod(svalues[i].c_str(), &sptr);
-					if(sptr!=svalues[i].c_str()){
-						values.push_back(value);
-					}
-					else{
-						//if not valid number, don't complain, just load NaN
-						values.push_back(iWQNaN);
-					}
-				}
-				//load them
-				mNumRows++;
-				for(int i=0; i<mNumCols; i++){
-					mDataStorage[fieldIndexInOriginal[i]].push_back(values[i]);
-				}
+	if(headerend<f.end()){
+		loadRows(headerend+1, f.end(), fieldIndexInOriginal, mDataStorage.size());
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::reloadFromBinary(iWQMappedFile * file)
+{
+	//the structure stays, the matching columns are copied right away
+	std::vector<std::string> names;
+	std::vector<const double *> columns;
+	int numrows=0;
+	if(!parseBinaryTable(*file, names, columns, numrows)){
+		printf("[Error]: Binary data file is damaged.\n");
+		return;
+	}
+	for(int i=0; i<names.size(); i++){
+		int index=getColIndex(names[i]);
+		if(index>=0 && index<mNumCols){
+			mDataStorage[index].assign(columns[i], columns[i]+numrows);
+		}
+	}
+	mNumRows=numrows;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+bool iWQDataTable::openStream(std::string filename, int windowrows)
+{
+	//get rid of previous content
+	clear();
+	
+	iWQTableStream * stream=new iWQTableStream;
+	stream->windowRows=(windowrows>0)?windowrows:1;
+	stream->numLines=0;
+	stream->numRows=0;
+	stream->nextRow=0;
+	std::vector<std::string> names;
+	stream->isBinary=(stream->binary.open(filename) && isBinaryTable(stream->binary));
+	if(stream->isBinary){
+		if(!parseBinaryTable(stream->binary, names, stream->columns, stream->numRows)){
+			printf("[Error]: Binary data file \"%s\" is damaged.\n",filename.c_str());
+			delete stream;
+			return false;
+		}
+	}
+	else{
+		//text is read line by line, the whole file is never in memory
+		stream->binary.close();
+		stream->text.open(filename.c_str(), std::ios::in | std::ios::binary);
+		if(!stream->text.is_open()){
+			printf("[Error]: failed to open data file \"%s\".\n",filename.c_str());
+			delete stream;
+			return false;
+		}
+		std::string headerline;
+		safeGetline(stream->text, headerline);
+		Tokenize(headerline, names, " \t");
+	}
+	
+	//for each column make storage, register them in the index and open a port
+	for(int i=0; i<names.size(); i++){
+		addColumn(names[i]);
+	}
+	for(int i=0; i<names.size(); i++){
+		stream->destinations.push_back(getColIndex(names[i]));
+	}
+	mStream=stream;
+	mWindowStart=0;
+	loadNextWindow(0);
+	return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+int iWQDataTable::loadNextWindow(int keeprows)
+{
+	if(!mStream){
+		return 0;
+	}
+	setRow(-1);
+	
+	//the kept rows move to the front, the capacity of the columns is reused
+	int keep=(keeprows<0)?0:((keeprows>mNumRows)?mNumRows:keeprows);
+	int shift=mNumRows-keep;
+	for(int i=0; i<mDataStorage.size(); i++){
+		if(mDataStorage[i].size()>=mNumRows){
+			std::copy(mDataStorage[i].begin()+shift, mDataStorage[i].begin()+mNumRows, mDataStorage[i].begin());
+		}
+		mDataStorage[i].resize(keep);
+	}
+	mNumRows=keep;
+	mWindowStart+=shift;
+	mRevision++;
+	
+	//new rows of the file columns
+	const std::vector<int> & destinations=mStream->destinations;
+	if(mStream->isBinary){
+		int count=std::min(mStream->windowRows, mStream->numRows-mStream->nextRow);
+		for(int i=0; i<destinations.size(); i++){
+			const double * values=mStream->columns[i]+mStream->nextRow;
+			if(destinations[i]>=0 && count>0){
+				mDataStorage[destinations[i]].insert(mDataStorage[destinations[i]].end(), values, values+count);
 			}
-			else{
-				printf("[Warning]: Row %d contains %zd columns instead of %zd - skipped.\n",linenumber,svalues.size(),mDataStorage.size());
+			mStream->binary.release((const char *)mStream->columns[i], (const char *)(values+count));
+		}
+		mStream->nextRow+=count;
+		mNumRows+=count;
+	}
+	else{
+		std::string & buffer=mStream->buffer;
+		std::string line;
+		int lines=0;
+		buffer.clear();
+		while(lines<mStream->windowRows && mStream->text.peek()!=EOF){
+			safeGetline(mStream->text, line);
+			if(line.size()){
+				buffer.append(line);
+				buffer.push_back('\n');
+				lines++;
 			}
 		}
-	}	
-	f.close();
+		if(lines){
+			loadRows(buffer.data(), buffer.data()+buffer.size(), destinations, destinations.size(), mStream->numLines);
+		}
+		mStream->numLines+=lines;
+	}
+	
+	//the other columns start empty
+	for(int i=0; i<mDataStorage.size(); i++){
+		mDataStorage[i].resize(mNumRows, 0.0);
+	}
+	return mNumRows-keep;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+bool iWQDataTable::rewindStream()
+{
+	if(!mStream){
+		return false;
+	}
+	setRow(-1);
+	if(mStream->isBinary){
+		mStream->nextRow=0;
+	}
+	else{
+		//back to the first row after the header
+		std::string headerline;
+		mStream->text.clear();
+		mStream->text.seekg(0);
+		safeGetline(mStream->text, headerline);
+		mStream->numLines=0;
+	}
+	for(int i=0; i<mDataStorage.size(); i++){
+		mDataStorage[i].clear();
+	}
+	mNumRows=0;
+	mWindowStart=0;
+	loadNextWindow(0);
+	return mNumRows>0;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::closeStream()
+{
+	if(mStream){
+		delete mStream;
+		mStream=NULL;
+	}
+	mWindowStart=0;
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -376,6 +1203,10 @@ void iWQDataTable::addColumn(std::string colname, bool warn)
 	data.assign(mNumRows,0.0);
 	mDataStorage.push_back(data);
 	mDataPort.push_back(port);
+	mPortBound.push_back(0);
+	if(mMappedFile){
+		mLazyColumns.push_back(NULL);
+	}
 	mColIndexes[colname]=index;
 	mNumCols++;
 }
@@ -409,8 +1240,13 @@ void iWQDataTable::copyColumn(std::string origin, std::string destination, bool
 		destcol=getColIndex(destination);
 	}
 	if(destcol!=-1){
+		materialize(srccol);
+		if(destcol<mLazyColumns.size()){
+			mLazyColumns[destcol]=NULL;
+		}
 		//copy data
 		mDataStorage[destcol].assign(mDataStorage[srccol].begin(),mDataStorage[srccol].end());
+		mRevision++;
 	}
 	else{
 		printf("[Warning]: Failed to create column %s.\n", destination.c_str());
@@ -424,6 +1260,7 @@ void iWQDataTable::addRows(int count)
 	if(count<=0){
 		return;
 	}
+	materializeAll();
 	std::vector<double> empty (count,0.0);
 	for(int i=0; i<mNumCols; i++){
 		mDataStorage[i].insert(mDataStorage[i].end(), empty.begin(), empty.end());
@@ -450,8 +1287,16 @@ void iWQDataTable::setRow(int index)
 	
 	if(index>=0 && index<mNumRows){
 		//read values from the new location    
-		for(int i=0; i<mNumCols; i++){
-			*(mDataPort[i])=mDataStorage[i][index];
+		if(mBoundCursor){
+			for(int k=0; k<mBoundColumns.size(); k++){
+				int i=mBoundColumns[k];
+				*(mDataPort[i])=mDataStorage[i][index];
+			}
+		}
+		else{
+			for(int i=0; i<mNumCols; i++){
+				*(mDataPort[i])=mDataStorage[i][index];
+			}
 		}
 			
 		//set the index
@@ -459,8 +1304,15 @@ void iWQDataTable::setRow(int index)
 	}
 	else{
 		//override with zeros
-		for(int i=0; i<mNumCols; i++){
-			*mDataPort[i]=0.0;
+		if(mBoundCursor){
+			for(int k=0; k<mBoundColumns.size(); k++){
+				*mDataPort[mBoundColumns[k]]=0.0;
+			}
+		}
+		else{
+			for(int i=0; i<mNumCols; i++){
+				*mDataPort[i]=0.0;
+			}
 		}
 		mActRow=-1;
 	}
@@ -472,8 +1324,90 @@ void iWQDataTable::commit()
 {
 	//copy (modified) contents back to the storage
 	if(mActRow!=-1){
+		if(mBoundCursor){
+			//ports which were never handed out cannot be modified
+			for(int k=0; k<mBoundColumns.size(); k++){
+				int i=mBoundColumns[k];
+				double & stored=mDataStorage[i][mActRow];
+				if(stored!=*(mDataPort[i]) && !(isnan(stored) && isnan(*(mDataPort[i])))){
+					touchColumn(i);
+				}
+				stored=*(mDataPort[i]);
+			}
+		}
+		else{
+			for(int i=0; i<mNumCols; i++){
+				double & stored=mDataStorage[i][mActRow];
+				if(stored!=*(mDataPort[i]) && !(isnan(stored) && isnan(*(mDataPort[i])))){
+					touchColumn(i);
+				}
+				stored=*(mDataPort[i]);
+			}
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::touchColumn(int index)
+{
+	if(index>=mColumnRevisions.size()){
+		mColumnRevisions.resize(mNumCols, 0);
+	}
+	mColumnRevisions[index]++;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+long iWQDataTable::columnRevision(std::string colname)
+{
+	int index=getColIndex(colname);
+	if(index<0 || index>=mColumnRevisions.size()){
+		return mRevision;
+	}
+	//both only grow, so the sum changes with each of them
+	return mRevision+mColumnRevisions[index];
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::setBoundCursor(bool bound)
+{
+	commit();
+	if(!bound && mBoundCursor){
+		materializeAll();
+		//unbound ports are out of date
 		for(int i=0; i<mNumCols; i++){
-			mDataStorage[i][mActRow]=*(mDataPort[i]);
+			*mDataPort[i]=(mActRow!=-1)?mDataStorage[i][mActRow]:0.0;
+		}
+	}
+	mBoundCursor=bound;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::bindPort(int index)
+{
+	if(mPortBound[index]){
+		return;
+	}
+	//the port joins the cursor with the value of the current row
+	materialize(index);
+	mPortBound[index]=1;
+	if(mBoundCursor){
+		*mDataPort[index]=(mActRow!=-1)?mDataStorage[index][mActRow]:0.0;
+	}
+	rebuildBoundColumns();
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::rebuildBoundColumns()
+{
+	mBoundColumns.clear();
+	for(int i=0; i<mNumCols && i<mPortBound.size(); i++){
+		if(mPortBound[i]){
+			mBoundColumns.push_back(i);
 		}
 	}
 }
@@ -528,7 +1462,11 @@ int iWQDataTable::numCols()
 double * iWQDataTable::portForColumn(std::string colname)
 {
 	int index=getColIndex(colname);
-	return (index>=0 && index<mNumCols)?mDataPort[index]:NULL;
+	if(index>=0 && index<mNumCols){
+		bindPort(index);
+		return mDataPort[index];
+	}
+	return NULL;
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -545,6 +1483,45 @@ std::string iWQDataTable::columnForPort(double * port)
 
 //-------------------------------------------------------------------------------------------------
 
+double * iWQDataTable::columnDataForPort(double * port)
+{
+	for(int i=0; i<mDataPort.size(); i++){
+		if(mDataPort[i]==port){
+			materialize(i);
+			return (mNumRows>0)?&(mDataStorage[i][0]):NULL;
+		}
+	}
+	return NULL;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+void iWQDataTable::touchColumnForPort(double * port)
+{
+	for(int i=0; i<mDataPort.size(); i++){
+		if(mDataPort[i]==port){
+			touchColumn(i);
+			return;
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+
+const double * iWQDataTable::columnView(std::string colname)
+{
+	int index=getColIndex(colname);
+	if(index<0 || index>=mNumCols || mNumRows==0){
+		return NULL;
+	}
+	//the row at the cursor may hold modified values
+	commit();
+	materialize(index);
+	return &(mDataStorage[index][0]);
+}
+
+//-------------------------------------------------------------------------------------------------
+
 double iWQDataTable::valueForColumn(std::string colname)
 {
 	double * port=portForColumn(colname);
@@ -558,6 +1535,10 @@ double iWQDataTable::valueForColumn(std::string colname, int rowindex)
 	//get the column index
 	int index=getColIndex(colname); 
 	if(index>=0 && index<mNumCols && rowindex>=0 && rowindex<mNumRows){
+		if(index<mLazyColumns.size() && mLazyColumns[index]){
+			//single values are read from the mapping
+			return mLazyColumns[index][rowindex];
+		}
 		return mDataStorage[index][rowindex];
 	}
 	else{
@@ -578,7 +1559,9 @@ void iWQDataTable::setValueForColumn(double value, std::string colname, int rowi
 {
 	int index=getColIndex(colname);
 	if(index>=0 && index<mNumCols && rowindex>=0 && rowindex<mNumRows){
+		materialize(index);
 		mDataStorage[index][rowindex]=value;
+		mRevision++;
 		if(rowindex==mActRow){
 			//refresh THAT value in DataPort
 			*mDataPort[index]=value;
@@ -592,7 +1575,9 @@ void iWQDataTable::addToValueForColumn(double value, std::string colname, int ro
 {
     int index=getColIndex(colname);
     if(index>=0 && index<mNumCols && rowindex>=0 && rowindex<mNumRows){
+        materialize(index);
         mDataStorage[index][rowindex]+=value;
+        mRevision++;
         if(rowindex==mActRow){
             //refresh THAT value in DataPort
             *mDataPort[index]=mDataStorage[index][rowindex];
@@ -617,53 +1602,143 @@ std::string iWQDataTable::colNameForIndex(int index)
 
 void iWQDataTable::writeToFile(std::string filename, std::vector<int> colindicestoprint)
 {
-	FILE * f=fopen(filename.c_str(),"w");
-	if(!f){
+	//the lazy columns may be mapped from the target itself, so it is replaced only by the complete output
+	std::string tempname=filename+".tmp";
+	std::string extension=IWQ_BINARY_TABLE_EXTENSION;
+	bool ok=false;
+	if(filename.size()>extension.size() && filename.compare(filename.size()-extension.size(), extension.size(), extension)==0){
+		ok=writeBinaryToFile(tempname, colindicestoprint);
+	}
+	else{
+		FILE * f=fopen(tempname.c_str(),"w");
+		if(f){
+			writeToFile(f,colindicestoprint);
+			ok=(ferror(f)==0);
+			if(fclose(f)!=0){
+				ok=false;
+			}
+		}
+	}
+#ifdef _WIN32
+	if(ok){
+		remove(filename.c_str());	//rename() does not replace, the table is not mapped here
+	}
+#endif
+	if(!ok || rename(tempname.c_str(), filename.c_str())!=0){
 		printf("[Error]: Failed to write data table to \"%s\".\n",filename.c_str());
-        return;
+		remove(tempname.c_str());
 	}
-    writeToFile(f,colindicestoprint);
-    fclose(f);
 }
 
 //-------------------------------------------------------------------------------------------------
 
-void iWQDataTable::writeToFile(FILE * f, std::vector<int> colindicestoprint)
+void iWQDataTable::writeToFile(FILE * f, std::vector<int> colindicestoprint, int firstrow, int endrow, bool header)
 {
     if(!f){
         return;
     }
+    if(endrow<0 || endrow>mNumRows){
+        endrow=mNumRows;
+    }
     //actualise data
     commit();
-    //print header
     for(int i=0; i<colindicestoprint.size(); i++){
-        std::string act_name=colNameForIndex(colindicestoprint[i]);
-        if(i>0){
-            fprintf(f,"\t");
-        }
-        fprintf(f,"%s",act_name.c_str());
+        materialize(colindicestoprint[i]);
     }
-    fprintf(f,"\n");
-    
-    //print data
-    for(int j=0; j<mNumRows; j++){
+    //print header
+    if(header){
         for(int i=0; i<colindicestoprint.size(); i++){
-            int act_index=colindicestoprint[i];
-            if(act_index>=0 && act_index<mNumCols){
-                if(i>0){
-                    fprintf(f,"\t");
-                }
-                double val=mDataStorage[act_index][j];
-                if(isnan(val)){
-                    fprintf(f,"NA");
-                }
-                else{
-                    fprintf(f,"%0.9lg",val);
-                }
+            std::string act_name=colNameForIndex(colindicestoprint[i]);
+            if(i>0){
+                fprintf(f,"\t");
             }
+            fprintf(f,"%s",act_name.c_str());
         }
         fprintf(f,"\n");
     }
+    
+    //print data: blocks of rows are formatted in parallel, and written in order
+    iWQTextFormatJob job;
+    for(int i=0; i<colindicestoprint.size(); i++){
+        int act_index=colindicestoprint[i];
+        job.columns.push_back((act_index>=0 && act_index<mNumCols && mNumRows>0)?&(mDataStorage[act_index][0]):NULL);
+    }
+    job.firstRow=(firstrow>0)?firstrow:0;
+    job.endRow=endrow;
+    int numrows=endrow-job.firstRow;
+    int numblocks=(numrows>0)?(numrows+IWQ_FORMAT_BLOCK_ROWS-1)/IWQ_FORMAT_BLOCK_ROWS:0;
+    int numthreads=((long)numrows*colindicestoprint.size()>=IWQ_PARALLEL_FORMAT_SIZE)?iWQThreadPool::hardwareThreads():1;
+    iWQThreadPool * pool=(numthreads>1 && numblocks>1)?new iWQThreadPool(numthreads):NULL;
+    int batch=(pool)?4*numthreads:1;
+    for(job.firstBlock=0; job.firstBlock<numblocks; job.firstBlock+=batch){
+        int count=std::min(batch, numblocks-job.firstBlock);
+        job.blocks.resize(count);
+        if(pool){
+            pool->run(count, formatTextBlock, &job);
+        }
+        else{
+            formatTextBlock(&job, 0);
+        }
+        for(int b=0; b<count; b++){
+            fwrite(job.blocks[b].data(), 1, job.blocks[b].size(), f);
+        }
+    }
+    if(pool){
+        delete pool;
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+
+bool iWQDataTable::writeBinaryToFile(std::string filename, std::vector<int> colindicestoprint)
+{
+	std::vector<int> indices;
+	std::vector<std::string> names;
+	for(int i=0; i<colindicestoprint.size(); i++){
+		if(colindicestoprint[i]>=0 && colindicestoprint[i]<mNumCols){
+			indices.push_back(colindicestoprint[i]);
+			names.push_back(colNameForIndex(colindicestoprint[i]));
+		}
+	}
+	FILE * f=fopen(filename.c_str(),"wb");
+	if(!f){
+		return false;
+	}
+	//actualise data
+	commit();
+	
+	//header
+	std::vector<char> header (binaryTableHeaderSize(names), 0);
+	char * p=&header[0];
+	uint32_t byteorder=IWQ_BINARY_TABLE_BYTEORDER;
+	uint32_t numcols=names.size();
+	uint64_t numrows=mNumRows;
+	memcpy(p, IWQ_BINARY_TABLE_MAGIC, 8);
+	memcpy(p+8, &byteorder, 4);
+	memcpy(p+12, &numcols, 4);
+	memcpy(p+16, &numrows, 8);
+	p+=24;
+	for(int i=0; i<names.size(); i++){
+		uint32_t length=names[i].size();
+		memcpy(p, &length, 4);
+		memcpy(p+4, names[i].data(), length);
+		p+=4+length;
+	}
+	//offsets at the end of the header
+	p=&header[0]+header.size()-8*names.size();
+	for(int i=0; i<names.size(); i++){
+		uint64_t offset=header.size()+(uint64_t)i*mNumRows*sizeof(double);
+		memcpy(p+8*i, &offset, 8);
+	}
+	bool ok=(fwrite(&header[0], 1, header.size(), f)==header.size());
+	
+	//columns, lazy ones straight from the mapping
+	for(int i=0; i<indices.size() && ok && mNumRows>0; i++){
+		int index=indices[i];
+		const double * values=(index<mLazyColumns.size() && mLazyColumns[index])?mLazyColumns[index]:&(mDataStorage[index][0]);
+		ok=(fwrite(values, sizeof(double), mNumRows, f)==mNumRows);
+	}
+	return (fclose(f)==0 && ok);
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -681,18 +1756,30 @@ void iWQDataTable::saveUNCSIMFormatToFile(std::string filename, std::vector<int>
 	}
 	//actualise data
 	commit();
-	//print data
+	//the columns are formatted in parallel, and written in order
+	iWQUNCSIMFormatJob job;
+	job.numRows=mNumRows;
 	for(int i=0; i<colindicestoprint.size(); i++){
 		int index=colindicestoprint[i];
-		if(index!=mTIndex){
-			std::string act_name=colNameForIndex(index);
-			
-			std::vector<std::string> data=UNCSIMdata(act_name);			
-			for(int j=0; j<data.size(); j++){
-				fprintf(f, "%s\n", data[j].c_str());
-			}
+		if(index>=0 && index<mNumCols && index!=mTIndex && mNumRows>0){
+			materialize(index);
+			job.columns.push_back(&(mDataStorage[index][0]));
+			job.names.push_back(colNameForIndex(index));
 		}
-		//next var comes
+	}
+	job.blocks.resize(job.columns.size());
+	int numthreads=((long)mNumRows*job.columns.size()>=IWQ_PARALLEL_FORMAT_SIZE)?iWQThreadPool::hardwareThreads():1;
+	if(numthreads>1 && job.columns.size()>1){
+		iWQThreadPool pool (std::min(numthreads, (int)job.columns.size()));
+		pool.run(job.columns.size(), formatUNCSIMColumn, &job);
+	}
+	else{
+		for(int i=0; i<job.columns.size(); i++){
+			formatUNCSIMColumn(&job, i);
+		}
+	}
+	for(int i=0; i<job.blocks.size(); i++){
+		fwrite(job.blocks[i].data(), 1, job.blocks[i].size(), f);
 	}
 	fclose(f);
 }
@@ -704,19 +1791,23 @@ std::vector<std::string> iWQDataTable::UNCSIMdata(std::string colname, std::stri
 	// Unified UNCSIM coding routine (index coding, no problems with timestamp precision)
 	std::vector<std::string> result;
 	int index=getColIndex(colname);
-	const char * varname=(alias.size()?alias.c_str():colname.c_str());
-	char buf [strlen(varname)+20];
+	std::string varname=(alias.size()?alias:colname);
+	std::vector<char> buf (varname.size()+IWQ_FORMATTED_VALUE_SIZE+14);
+	materialize(index);
 	if(index!=-1 && index!=mTIndex){
 		for(int j=0; j<mNumRows; j++){
 			double val=mDataStorage[index][j];
-			if(isnan(val)){
+			if(!isnan(val)){
 				//silently omit NaNs from the dataset
-				//sprintf(buf, "%s_%d\t%0.9lg",varname,j,val);
-			}
-			else{
-				sprintf(buf, "%s_%d\t%0.9lg",varname,j,val);
+				char * p=&buf[0];
+				memcpy(p, varname.data(), varname.size());
+				p+=varname.size();
+				*p++='_';
+				p=formatInteger(j, p);
+				*p++='\t';
+				p=formatValue(val, p);
+				result.push_back(std::string(&buf[0], p-&buf[0]));
 			}
-			result.push_back(buf);
 		}
 	}
 	return result;
@@ -731,6 +1822,13 @@ void iWQDataTable::writeToFile(std::string filename)
 
 //-------------------------------------------------------------------------------------------------
 
+void iWQDataTable::writeRowsToFile(FILE * f, int firstrow, int endrow, bool header)
+{
+	writeToFile(f, getAllIndexes(), firstrow, endrow, header);
+}
+
+//-------------------------------------------------------------------------------------------------
+
 void iWQDataTable::saveUNCSIMFormatToFile(std::string filename)
 {
 	saveUNCSIMFormatToFile(filename, getAllIndexes());
@@ -772,7 +1870,11 @@ void iWQDataTable::setTField(int colindex)
 
 double * iWQDataTable::timePort()
 {
-	return (mTIndex!=-1)?mDataPort[mTIndex]:NULL;
+	if(mTIndex==-1){
+		return NULL;
+	}
+	bindPort(mTIndex);
+	return mDataPort[mTIndex];
 }
 
 //-------------------------------------------------------------------------------------------------
@@ -816,6 +1918,7 @@ const std::vector<double> * iWQDataTable::vectorForColumn(std::string colname)
 {
 	int index=getColIndex(colname);
 	if(index!=-1){
+		materialize(index);
 		return &(mDataStorage[index]);
 	}
 	return NULL;
@@ -840,6 +1943,7 @@ bool iWQDataTable::isRowComplete()
 	if(mActRow<0){
 		return false;
 	}
+	materializeAll();
 	bool complete=true;
 	for(int i=0; i<mDataStorage.size(); i++){
 		if(isnan(mDataStorage[i][mActRow])){
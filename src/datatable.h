@@ -21,8 +21,24 @@
 
 //Utilities to have NaN in data tables
 #define iWQNaN std::numeric_limits<double>::quiet_NaN()	
+
+//Data files from this size are parsed on multiple threads
+#define IWQ_PARALLEL_PARSE_SIZE 4194304
+
+//Tables from this many values are formatted on multiple threads when written
+#define IWQ_PARALLEL_FORMAT_SIZE 262144
+
+//Binary columnar data files: recognised by the magic, written for file names with the extension
+#define IWQ_BINARY_TABLE_MAGIC "IWQDATA1"
+#define IWQ_BINARY_TABLE_EXTENSION ".iwqb"
+
+//Rows in the window of a streamed data table, if not specified
+#define IWQ_STREAM_WINDOW_ROWS 65536
  
 //--------------------------------------------------------------------------------
+
+class iWQMappedFile;
+class iWQTableStream;
  
 class iWQDataTable
 {
@@ -35,12 +51,41 @@ private:
 	int mActRow;
 	int mTIndex;
 	
+	//row cursor: only the columns with handed out ports are copied by setRow() and commit()
+	bool mBoundCursor;
+	std::vector<char> mPortBound;
+	std::vector<int> mBoundColumns;
+	void bindPort(int index);
+	void rebuildBoundColumns();
+	
+	long mRevision;		//counts the changes of stored values outside of the row cursor
+	std::vector<long> mColumnRevisions;	//changes of the single columns: committed rows and direct writes
+	void touchColumn(int index);
+	
+	//binary files: the columns stay in the mapping until they are used
+	iWQMappedFile * mMappedFile;
+	std::vector<const double *> mLazyColumns;	//values in the mapping, NULL if materialized
+	void materialize(int index){ if(index>=0 && index<mLazyColumns.size() && mLazyColumns[index]) loadLazyColumn(index); }
+	void loadLazyColumn(int index);
+	void materializeAll();
+	void releaseMapping();
+	bool initFromBinary(iWQMappedFile * file);
+	void reloadFromBinary(iWQMappedFile * file);
+	
+	//streamed files: the table holds a window of the rows
+	iWQTableStream * mStream;
+	long mWindowStart;
+	void closeStream();
+	
 	int getColIndex(std::string colname);
 	std::string colNameForIndex(int index);
 	void writeToFile(std::string filename, std::vector<int> colindicestoprint);
-    void writeToFile(FILE * f, std::vector<int> colindicestoprint);
+    void writeToFile(FILE * f, std::vector<int> colindicestoprint, int firstrow=0, int endrow=-1, bool header=true);
+	bool writeBinaryToFile(std::string filename, std::vector<int> colindicestoprint);	//false if the file could not be written
 	void saveUNCSIMFormatToFile(std::string filename, std::vector<int> colindicestoprint);
 		
+	void loadRows(const char * begin, const char * end, const std::vector<int> & destinations, int numitems, int firstline=0);	//text rows to the columns in destinations
+	
 	std::vector<int> getAllIndexes();
 	std::vector<int> getIndexesForColNames(std::vector<std::string> colnames);
 	void emptyInit();
@@ -54,9 +99,18 @@ public:
 	~iWQDataTable();
 	iWQDataTable(iWQDataTable * atable);
 	void initFromTable(iWQDataTable * atable);
+	void copyValuesFrom(iWQDataTable * atable);	//the ports of this table stay valid
 	void initFromFile(std::string filename);
 	void reloadFromFile(std::string filename);
 	
+	//streaming: rows are read from the file in windows
+	bool openStream(std::string filename, int windowrows);
+	int loadNextWindow(int keeprows);		//keeps the last rows in front, returns the count of the new rows (0 at the end)
+	bool rewindStream();					//back to the first window
+	bool isStreamed() const { return mStream!=NULL; }
+	long windowStart() const { return mWindowStart; }	//row in the file of the first row in the table
+	void writeRowsToFile(FILE * f, int firstrow, int endrow, bool header);	//all columns as text
+	
 	void addColumn(std::string colname, bool warn=true);
     void addColumns(std::vector<std::string> colnames, bool warn=true);
 	void addRows(int count);
@@ -71,6 +125,10 @@ public:
 	void rewind(){ setRow(0); }
 	
 	void commit();
+	void setBoundCursor(bool bound);		//false: sync every column on each row step
+	bool hasBoundCursor() const { return mBoundCursor; }
+	long revision() const { return mRevision; }	//for caches of column contents
+	long columnRevision(std::string colname);	//revision() plus the changes of this column
 	
 	void clear();
 	void clearColumn(std::string colname);
@@ -78,6 +136,9 @@ public:
 		
 	double * portForColumn(std::string colname);
 	std::string columnForPort(double * port);
+	double * columnDataForPort(double * port);	//storage of the whole column (invalidated by adding rows)
+	void touchColumnForPort(double * port);		//after writing into the storage of columnDataForPort()
+	const double * columnView(std::string colname);	//read-only storage of a column, committed, without a port
 	double * operator[](std::string colname){ return portForColumn(colname); }
 	bool isPortValid(double * port);
 	
@@ -105,7 +166,7 @@ public:
 	//checking for NaN in data
 	bool isRowComplete();					//shows if the current row has NaN(s)
 	
-	bool hasColumnWithName(std::string colname){ return (portForColumn(colname)!=NULL); }
+	bool hasColumnWithName(std::string colname){ int index=getColIndex(colname); return (index>=0 && index<mNumCols); }
     
     //seeking for unique key values in a column
     void createIndexForColumn(std::string colname);
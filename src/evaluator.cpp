@@ -48,11 +48,27 @@ iWQEvaluator::iWQEvaluator()
 	mModelState.clear();
 	mRainColPtr=NULL;
 	
+	//early rejection is off by default
+	RejectionChunk=0;
+	resetRejectionStatistics();
+	
 	//temporary PSO params
 	PSOActive=false;
 	PSOMaxNumRounds=100;
 	PSOMaxIdleRounds=10;
 	PSOSwarmSize=20;
+	PSOSeed=0;
+	PSOThreads=1;
+	
+	//CMA-ES is off by default
+	CMAESActive=false;
+	CMAESThreads=1;
+	
+	//so is L-BFGS-B
+	LBFGSBActive=false;
+	mRecordSensitivities=false;
+	
+	OptimizerClones.clear();
 	
 	//temporary NMS params
 	NMSActive=true;
@@ -219,6 +235,66 @@ double iWQEvaluator::evaluate(std::vector<double> values)
 //-----------------------------------------------------------------------------------
 
 double iWQEvaluator::evaluate()
+{
+	return evaluateWithBound(DBL_MAX);
+}
+
+//-----------------------------------------------------------------------------------
+
+void iWQEvaluator::copyStateFrom(iWQEvaluator * other)
+{
+	if(!other || other==this){
+		return;
+	}
+	mEvaluateStartRow=other->mEvaluateStartRow;
+	mEvaluateEndRow=other->mEvaluateEndRow;
+	mModelState=other->mModelState;
+	RejectionChunk=other->RejectionChunk;
+	returnUnstableSolutions=other->returnUnstableSolutions;
+}
+
+//-----------------------------------------------------------------------------------
+
+void iWQEvaluator::resetRejectionStatistics()
+{
+	mBoundedRuns=0;
+	mEarlyRejections=0;
+	mBoundedRows=0;
+	mSkippedRows=0;
+}
+
+//-----------------------------------------------------------------------------------
+
+void iWQEvaluator::mergeRejectionStatistics(iWQEvaluator * other)
+{
+	if(other && other!=this){
+		mBoundedRuns+=other->mBoundedRuns;
+		mEarlyRejections+=other->mEarlyRejections;
+		mBoundedRows+=other->mBoundedRows;
+		mSkippedRows+=other->mSkippedRows;
+	}
+}
+
+//-----------------------------------------------------------------------------------
+
+double iWQEvaluator::partialLowerBound(int startrow, int endrow, int lastrow, double prior)
+{
+	//the same sum as the full evaluation, with the lower bounds of the methods
+	double result=prior;
+	for(int i=0; i<mEvaluatorMethods.size(); i++){
+		mEvaluatorMethods[i]->updateDynamicParams();
+		double bound=mEvaluatorMethods[i]->lowerBound(startrow, endrow, lastrow);
+		if(bound==-DBL_MAX || mEvaluatorWeights[i]<0.0){
+			return -DBL_MAX;
+		}
+		result+=mEvaluatorWeights[i]*bound;
+	}
+	return result;
+}
+
+//-----------------------------------------------------------------------------------
+
+double iWQEvaluator::evaluateWithBound(double bound)
 {
 	if(!mDataTable || !mSolver || !mInitVals || !mCommonParameters || mComparisonLinks.size()==0 || mDataTable->timePort()==NULL || mEvaluatorMethods.size()==0 || mComparisonLinks.size()!=mEvaluatorMethods.size() || mEvaluatorWeights.size()!=mEvaluatorMethods.size()){
 		printf("[Error]: Evaluator was misconfigured.\n");
@@ -276,24 +352,67 @@ double iWQEvaluator::evaluate()
 		}
 	}
 	
+	//early rejection needs the run row by row, and nothing may change the outputs after it
+	bool bounded=(bound<DBL_MAX && RejectionChunk>0 && !mSolver->trajectoryMode() && mFilters.size()==0 && mPostScripts.size()==0);
+	double prior=0.0;
+	if(bounded && mEvaluatorMethods[0]->priorsApply()){
+		prior=-mCommonParameters->logLikelihood(false);
+		if(!(prior<DBL_MAX)){
+			bounded=false;	//invalid anyway, the full run reports it
+		}
+	}
+	if(bounded){
+		mBoundedRuns++;
+		mBoundedRows+=endrow-startrow;
+		for(int i=0; i<mEvaluatorMethods.size(); i++){
+			mEvaluatorMethods[i]->resetPartialRun();
+		}
+	}
+	
 	//run the model from startrow (step right after invocation, so real output comes from startrow+1)	
 	int firsterrorrow = -1; 		//the first row where instability occurs
 	double firsterrort = -DBL_MAX;
 	std::vector<iWQModel *> wrongs;
 	wrongs.clear();
-	for(int row=startrow; row<endrow; row++){
-		if(!mDataTable->stepRow()){
-			printf("[Error]: Partial run stepped beyond the end of data table.\n");
-			break;
-		}
-		if(!mSolver->solve1Step(prev_t, *t, yfeed)){
+	if(mSolver->trajectoryMode()){
+		std::vector<int> failedrows;
+		if(!mSolver->solveTrajectory(mDataTable, endrow, yfeed, &failedrows)){
 			stable=false;
-			firsterrorrow = mDataTable->pos();
-			firsterrort = prev_t;
+			if(failedrows.size()){
+				firsterrorrow = failedrows.back();
+				firsterrort = mDataTable->valueForColumn(mDataTable->timeColumn(), firsterrorrow-1);
+			}
 			wrongs = mSolver->modelsThatDidNotSolve();
 		}
-		prev_t = *t;
-		yfeed=NULL;
+	}
+	else{
+		for(int row=startrow; row<endrow; row++){
+			if(!mDataTable->stepRow()){
+				printf("[Error]: Partial run stepped beyond the end of data table.\n");
+				break;
+			}
+			if(!mSolver->solve1Step(prev_t, *t, yfeed)){
+				stable=false;
+				firsterrorrow = mDataTable->pos();
+				firsterrort = prev_t;
+				wrongs = mSolver->modelsThatDidNotSolve();
+			}
+			prev_t = *t;
+			yfeed=NULL;
+			if(mRecordSensitivities){
+				recordSensitivities();
+			}
+			
+			//reject as soon as the rows so far are enough
+			if(bounded && stable && (row-startrow+1)%RejectionChunk==0 && row+1<endrow){
+				double partial=partialLowerBound(startrow+1, endrow, mDataTable->pos()+1, prior);
+				if(partial>bound && partial<DBL_MAX){
+					mEarlyRejections++;
+					mSkippedRows+=endrow-row-1;
+					return partial;
+				}
+			}
+		}
 	}
 	
 	//run is over
@@ -357,6 +476,13 @@ double iWQEvaluator::evaluate()
 		}	
 	}
 
+	return likelihoodOfRun(startrow, endrow);
+}
+
+//-----------------------------------------------------------------------------------
+
+double iWQEvaluator::likelihoodOfRun(int startrow, int endrow)
+{
 	//calculate normal evaluation result
 	//now collect all results from the evaluator methods
 	double result=0.0;
@@ -605,6 +731,111 @@ void iWQEvaluator::sequentialCalibrateInputs(std::string eventflagfield, std::st
 
 //-----------------------------------------------------------------------------------
 
+void iWQEvaluator::recordSensitivities()
+{
+	int row=mDataTable->pos();
+	int numrows=mDataTable->numRows();
+	int numsens=mSolver->numSensitivityParameters();
+	for(int c=0; c<mSensitivityPorts.size(); c++){
+		const double * sens=mSolver->sensitivitiesForPort(mSensitivityPorts[c]);
+		for(int p=0; p<numsens && sens; p++){
+			mSensitivityRecords[(c*numsens+p)*numrows+row]=sens[p];
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------------
+
+double iWQEvaluator::evaluateWithGradient(std::vector<double> values, std::vector<double> & gradient)
+{
+	gradient.clear();
+	if(!mDataTable || !mSolver || !mCommonParameters || values.size()!=mCommonParameters->numberOfParams()){
+		printf("[Error]: Evaluator was misconfigured.\n");
+		return DBL_MAX;
+	}
+	int numpars=values.size();
+	int numrows=mDataTable->numRows();
+	
+	//one run with the sensitivities of all parameters
+	std::vector<int> slots;
+	for(int p=0; p<numpars; p++){
+		slots.push_back(p);
+	}
+	if(!mSolver->setSensitivityParameters(slots)){
+		return DBL_MAX;
+	}
+	mSensitivityPorts.clear();
+	for(int i=0; i<mComparisonLinks.size(); i++){
+		double * port=mComparisonLinks[i].modelPtr();
+		if(port && std::find(mSensitivityPorts.begin(), mSensitivityPorts.end(), port)==mSensitivityPorts.end()){
+			mSensitivityPorts.push_back(port);
+		}
+	}
+	mSensitivityRecords.assign(mSensitivityPorts.size()*numpars*numrows, 0.0);
+	mRecordSensitivities=true;
+	double result=evaluate(values);
+	mRecordSensitivities=false;
+	mSolver->setSensitivityParameters(std::vector<int> ());
+	if(!(result<DBL_MAX)){
+		return result;
+	}
+	
+	//the gradient of the linearised model: the outputs are moved along the sensitivities 
+	//without running the models again, the priors and the evaluator parameters are moved directly
+	int startrow = (mEvaluateStartRow!=-1)?mEvaluateStartRow:0;
+	int endrow = (mEvaluateEndRow!=-1)?mEvaluateEndRow:mDataTable->numRows();
+	int cursor=mDataTable->pos();
+	mDataTable->commit();
+	std::vector<double *> columns;
+	std::vector<std::vector<double> > backups;
+	for(int c=0; c<mSensitivityPorts.size(); c++){
+		double * column=mDataTable->columnDataForPort(mSensitivityPorts[c]);
+		columns.push_back(column);
+		backups.push_back((column)?std::vector<double> (column, column+numrows):std::vector<double> ());
+	}
+	bool warnings=printWarnings;
+	printWarnings=false;
+	std::vector<double> perturbed=values;
+	gradient.assign(numpars, 0.0);
+	for(int p=0; p<numpars; p++){
+		double h=sqrt(DBL_EPSILON)*std::max(1.0, fabs(values[p]));
+		perturbed[p]=values[p]+h;
+		mCommonParameters->setPlainValues(perturbed);
+		for(int c=0; c<columns.size(); c++){
+			if(!columns[c]){
+				continue;
+			}
+			const double * sens=&mSensitivityRecords[(c*numpars+p)*numrows];
+			for(int r=startrow+1; r<endrow; r++){
+				columns[c][r]=backups[c][r]+h*sens[r];
+			}
+			mDataTable->touchColumnForPort(mSensitivityPorts[c]);
+			if(cursor>=0 && cursor<numrows){
+				*mSensitivityPorts[c]=columns[c][cursor];	//the cursor row is committed again
+			}
+		}
+		double moved=likelihoodOfRun(startrow, endrow);
+		gradient[p]=(moved<DBL_MAX && !isnan(moved))?(moved-result)/h:0.0;
+		perturbed[p]=values[p];
+	}
+	
+	//restore the run
+	for(int c=0; c<columns.size(); c++){
+		if(columns[c]){
+			std::copy(backups[c].begin(), backups[c].end(), columns[c]);
+			mDataTable->touchColumnForPort(mSensitivityPorts[c]);
+			if(cursor>=0 && cursor<numrows){
+				*mSensitivityPorts[c]=columns[c][cursor];
+			}
+		}
+	}
+	mCommonParameters->setPlainValues(values);
+	printWarnings=warnings;
+	return result;
+}
+
+//-----------------------------------------------------------------------------------
+
 void iWQEvaluator::calibrate()
 {
 	//Heavy reuse of asa047 code in this function
@@ -641,12 +872,11 @@ void iWQEvaluator::calibrate()
 	
 	printWarnings=false;
 	
-	//preparatory phase with PSO
-	if(PSOActive){
-		printf("Particle Swarm Optimization...\n");
+	//search bounds of the global optimizers
+	iWQBoundsList bounds;
+	if(PSOActive || CMAESActive || LBFGSBActive){
 		parvals=mCommonParameters->plainValues();
 		
-		iWQBoundsList bounds;
 		for(i=0; i<parvals.size(); i++){
 			if(mCommonParameters->hasLimitsForParam(parnames[i])){
 				//we have bounds
@@ -658,11 +888,45 @@ void iWQEvaluator::calibrate()
 				bounds.add(0,(parvals[i]!=0.0?10*parvals[i]:0.0));		//search from 0 to 10*parvals[i]
 			}
 		}
-		parvals=iWQParticleSwarmOptimize(this,bounds,PSOSwarmSize,PSOMaxNumRounds,PSOMaxIdleRounds);
+	}
+	
+	//preparatory phase with PSO
+	if(PSOActive){
+		printf("Particle Swarm Optimization...\n");
+		std::vector<iWQEvaluator *> clones(OptimizerClones.begin(), OptimizerClones.begin()+std::min((int)OptimizerClones.size(), PSOThreads-1));
+		parvals=iWQParticleSwarmOptimize(this,bounds,PSOSwarmSize,PSOMaxNumRounds,PSOMaxIdleRounds,clones,PSOSeed);
 		mCommonParameters->setPlainValues(parvals);
 		printf("Ready\n");
 	}
 	
+	//CMA-ES from the actual values
+	if(CMAESActive){
+		printf("CMA-ES Optimization...\n");
+		std::vector<iWQEvaluator *> clones(OptimizerClones.begin(), OptimizerClones.begin()+std::min((int)OptimizerClones.size(), CMAESThreads-1));
+		parvals=CMAES.optimize(this,bounds,clones);
+		if(parvals.size()>0){
+			mCommonParameters->setPlainValues(parvals);
+		}
+		printf("Ready\n");
+	}
+	
+	//local gradient-based search from the actual values
+	if(LBFGSBActive){
+		printf("L-BFGS-B Optimization...\n");
+		bool trajectory=mSolver->trajectoryMode();
+		if(trajectory){
+			mSolver->setTrajectoryMode(false, mDataTable);	//the sensitivities are integrated row by row
+		}
+		parvals=LBFGSB.optimize(this,bounds);
+		if(parvals.size()>0){
+			mCommonParameters->setPlainValues(parvals);
+		}
+		if(trajectory){
+			mSolver->setTrajectoryMode(true, mDataTable);
+		}
+		printf("Ready\n");
+	}
+	
 	if(NMSActive){
 		printf("Nelder-Mead Simplex Optimization...\n");
 		for(j=0; j<kcount; j++){
@@ -15,6 +15,9 @@
 #ifndef evaluator_h
 #define evaluator_h
 
+#include "cmaes.h"
+#include "lbfgsb.h"
+
 class iWQSolver;
 class iWQParameterManager; 
 class iWQInitialValues;
@@ -54,6 +57,22 @@ private:
 	std::map<std::string, iWQKeyValues> mModelState;
 	double * mRainColPtr;	//ptr to the column to adjust
 	
+	//early rejection statistics
+	long mBoundedRuns;
+	long mEarlyRejections;
+	long mBoundedRows;
+	long mSkippedRows;
+	double partialLowerBound(int startrow, int endrow, int lastrow, double prior);
+	
+	//evaluation of the finished run: priors and the evaluator methods
+	double likelihoodOfRun(int startrow, int endrow);
+	
+	//forward sensitivities of the compared model columns, recorded in the gradient runs
+	bool mRecordSensitivities;
+	std::vector<double *> mSensitivityPorts;	//distinct model ports of the comparison links
+	std::vector<double> mSensitivityRecords;	//port c, parameter p, row r at (c*P+p)*numrows+r
+	void recordSensitivities();
+	
 public:
 	iWQEvaluator();
 	~iWQEvaluator();
@@ -68,6 +87,7 @@ public:
 	void setFilters(std::vector<iWQFilter *> filters);
 	void setPreScripts(std::vector<iWQScript> pres);
 	void setPostScripts(std::vector<iWQScript> posts);
+	void copyStateFrom(iWQEvaluator * other);	//evaluation interval, partial-run state and run settings, e.g. for the copies of the layout
 	
 	//accessors
 	iWQParameterManager * parameters(){ return mCommonParameters; };
@@ -79,6 +99,18 @@ public:
 	double evaluate(double * values, int numpars);
 	double evaluate();
 	
+	//early rejection: the run stops when the evaluation will surely exceed the bound, the returned value is then only a lower bound above it
+	double evaluateWithBound(double bound);
+	int RejectionChunk;		//rows simulated between the checks of the bound, 0: never stop early
+	void resetRejectionStatistics();
+	void mergeRejectionStatistics(iWQEvaluator * other);
+	long boundedRuns(){ return mBoundedRuns; }
+	long earlyRejections(){ return mEarlyRejections; }
+	double skippedRowRatio(){ return (mBoundedRows>0)?mSkippedRows/(double)mBoundedRows:0.0; }
+	
+	//value and gradient from one run with the forward sensitivities of the models (not in trajectory mode)
+	double evaluateWithGradient(std::vector<double> values, std::vector<double> & gradient);
+	
 	bool printWarnings;
 	bool returnUnstableSolutions;
 	
@@ -94,6 +126,20 @@ public:
 	int PSOMaxNumRounds;
 	int PSOMaxIdleRounds;
 	int PSOSwarmSize;
+	unsigned int PSOSeed;					//0: seeded from the clock
+	int PSOThreads;							//evaluation contexts of the swarm
+	
+	//CMA-ES with its settings
+	bool CMAESActive;
+	iWQCMAESOptimizer CMAES;
+	int CMAESThreads;						//evaluation contexts of the offspring
+	
+	//L-BFGS-B with its settings
+	bool LBFGSBActive;
+	iWQLBFGSBOptimizer LBFGSB;
+	
+	//parallel evaluations in the global optimizers (PSO, CMA-ES), each uses as many as its threads
+	std::vector<iWQEvaluator *> OptimizerClones;	//evaluators of independent copies of the layout
 	
 	//temporary storage for nelder-mead simplex parameters
 	bool NMSActive;
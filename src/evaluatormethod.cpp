@@ -29,6 +29,18 @@ iWQEvaluatorMethod::iWQEvaluatorMethod()
 { 
 	mDataTable=0;
 	mCommonParameters=0;
+	mMeasColumn=0;
+	mMeasRevision=-1;
+	mMeasStart=0;
+	mMeasEnd=0;
+	mMeasLambda1=1.0;
+	mMeasLambda2=0.0;
+	mLastRow=-1;
+	mPartialRun=false;
+	mPartialMeas=0;
+	mPartialRows=0;
+	mPartialLogLikeli=0.0;
+	mPartialState=0.0;
 	initDefaultParams(); 
 }
 
@@ -203,6 +215,144 @@ double iWQEvaluatorMethod::evaluate()
 	return evaluate(start, end);
 }
 
+//-----------------------------------------------------------------------------------------------
+
+double iWQEvaluatorMethod::lowerBound(int startindex, int endindex, int lastrow)
+{
+	if(!mDataTable || !boundsPartialRuns()){
+		return -DBL_MAX;
+	}
+	
+	//the simulated rows give their exact terms, those summed at the previous check are not summed again
+	mLastRow=lastrow;
+	double result=evaluate(startindex, endindex);
+	mLastRow=-1;
+	if(result==DBL_MAX || std::isnan(result)){
+		return -DBL_MAX;
+	}
+	
+	//the pending rows can add at most the largest likelihood of each row, or nothing when their model value turns out NaN
+	double pending=maxLogLikeliOfRows(mPendingRows);
+	if(pending==DBL_MAX){
+		return -DBL_MAX;
+	}
+	return result-pending;
+}
+
+//-----------------------------------------------------------------------------------------------
+
+int iWQEvaluatorMethod::gatherColumns(int startindex, int endindex, double lambda_1, double lambda_2)
+{
+	//same rows as numeric(j) of the comparison link
+	const double * meascol=NULL;
+	const double * modelcol=NULL;
+	if(mDataTable && mComparisonLink.attachColumns(mDataTable) && !mComparisonLink.predictiveMode()){
+		meascol=mDataTable->columnView(measuredFieldName());
+		modelcol=mDataTable->columnView(modelFieldName());
+	}
+	if(!meascol || !modelcol){
+		mRows.clear();
+		mMeasured.clear();
+		mMeasuredTr.clear();
+		mModelled.clear();
+		mModelledTr.clear();
+		mPartialRun=false;
+		return 0;
+	}
+	startindex=std::max(startindex, 0);
+	endindex=std::min(endindex, mDataTable->numRows());
+	
+	//the measurements are only transformed again when something changed
+	long revision=mDataTable->columnRevision(measuredFieldName());
+	if(meascol!=mMeasColumn || revision!=mMeasRevision || startindex!=mMeasStart || endindex!=mMeasEnd || lambda_1!=mMeasLambda1 || lambda_2!=mMeasLambda2){
+		mMeasRows.clear();
+		mMeasValues.clear();
+		for(int j=startindex; j<endindex; j++){
+			if(!isnan(meascol[j])){
+				mMeasRows.push_back(j);
+				mMeasValues.push_back(meascol[j]);
+			}
+		}
+		mMeasValuesTr.resize(mMeasValues.size());
+		if(mMeasValues.size()){
+			boxcox_transform_array(lambda_1, lambda_2, &mMeasValues[0], &mMeasValuesTr[0], mMeasValues.size(), NULL);
+		}
+		mMeasColumn=meascol;
+		mMeasRevision=revision;
+		mMeasStart=startindex;
+		mMeasEnd=endindex;
+		mMeasLambda1=lambda_1;
+		mMeasLambda2=lambda_2;
+		mPartialRun=false;
+	}
+	
+	//a partial run continuing the previous check only appends the rows simulated since then
+	int first=0;
+	if(mLastRow>=0 && mPartialRun){
+		first=mPartialMeas;
+	}
+	else{
+		mRows.clear();
+		mMeasured.clear();
+		mMeasuredTr.clear();
+		mModelled.clear();
+		mPartialRun=false;
+	}
+	int oldn=mRows.size();
+	
+	//keep the rows where the model is a number too, on partial runs only those already simulated
+	mPendingRows.clear();
+	int numrows=mMeasRows.size();
+	if(mLastRow>=0){
+		numrows=std::lower_bound(mMeasRows.begin(), mMeasRows.end(), mLastRow)-mMeasRows.begin();
+		mPendingRows.assign(mMeasRows.begin()+numrows, mMeasRows.end());
+		mPartialMeas=numrows;
+	}
+	for(int k=first; k<numrows; k++){
+		double model=modelcol[mMeasRows[k]];
+		if(!isnan(model)){
+			mRows.push_back(mMeasRows[k]);
+			mMeasured.push_back(mMeasValues[k]);
+			mMeasuredTr.push_back(mMeasValuesTr[k]);
+			mModelled.push_back(model);
+		}
+	}
+	
+	int n=mRows.size();
+	mModelledTr.resize(n);
+	mTerms.resize(n);
+	if(n>oldn){
+		boxcox_transform_array(lambda_1, lambda_2, &mModelled[oldn], &mModelledTr[oldn], n-oldn, NULL);
+	}
+	return n;
+}
+
+//-----------------------------------------------------------------------------------------------
+
+int iWQEvaluatorMethod::resumePartialRun(double * loglikeli, double * state)
+{
+	//the rows summed at the previous check keep their terms
+	if(mLastRow<0 || !mPartialRun){
+		return 0;
+	}
+	*loglikeli=mPartialLogLikeli;
+	*state=mPartialState;
+	return mPartialRows;
+}
+
+//-----------------------------------------------------------------------------------------------
+
+void iWQEvaluatorMethod::keepPartialRun(int n, double loglikeli, double state)
+{
+	if(mLastRow<0){
+		return;
+	}
+	mPartialRun=true;
+	mPartialRows=n;
+	mPartialLogLikeli=loglikeli;
+	mPartialState=state;
+}
+
 //===============================================================================================
 
 #pragma mark Class factory function
@@ -256,32 +406,27 @@ iWQEvaluatorMethod * createEvalMethod(std::string methodName)
 
 double iWQNSBoxCoxEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays, the transformed measurements are cached
+	int n=gatherColumns(startindex, endindex, lambda_1, lambda_2);
+	
 	//Nash-Sutcliffe statistics on the Box-Cox transformed values
 	//returns NaN or INF if the transformation fails for any value
 	double sum=0.0;
 	double sumsqdeviation=0.0;
 	double sumsqmodeldeviation=0.0;
-	int count=0;
 	
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			sum+=mComparisonLink.measurement();	//<----
-			count++;
-		}
+	for(int k=0; k<n; k++){
+		sum+=mMeasured[k];	//<----
 	}
 	
-	double average=sum/(double)count;
+	double average=sum/(double)n;
 		
 	//deviations from the averages (Nash-Sutcliffe statistics)
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas=boxcox_transform(lambda_1, lambda_2, mComparisonLink.measurement(), NULL);		//<----
-			double model=boxcox_transform(lambda_1, lambda_2, mComparisonLink.model(), NULL);			//<----
-			sumsqdeviation+=(meas-average)*(meas-average);
-			sumsqmodeldeviation+=(meas-model)*(meas-model);
-		}
+	const double * meas=mMeasuredTr.data();
+	const double * model=mModelledTr.data();
+	for(int k=0; k<n; k++){
+		sumsqdeviation+=(meas[k]-average)*(meas[k]-average);
+		sumsqmodeldeviation+=(meas[k]-model[k])*(meas[k]-model[k]);
 	}
 	
 	double NS=(sumsqdeviation!=0.0)?sumsqmodeldeviation/sumsqdeviation:0.0;
@@ -332,74 +477,97 @@ void iWQNormalLikelihoodEvaluation::setParams(iWQSettingList list)
 
 double iWQNormalLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays, the transformed measurements are cached
+	int n=gatherColumns(startindex, endindex, lambda_1, lambda_2);
+	
 	//log likelihood with normal error model
 	double loglikeli=0.0;
-	double result=0.0;
 	
 	dist.setStdev(sigma);	//update before each evaluation
 	
 	//get the sum of log values of observations if not done so before
 	if(sumlogy==-DBL_MAX){
 		sumlogy = 0.0;
-		for(int j=startindex; j<endindex; j++){
-			mDataTable->setRow(j);
-			if(mComparisonLink.numeric()){
-				double meas_raw = mComparisonLink.measurement();
-				if(meas_raw<=LOQ){
-					meas_raw = 0.5 * LOQ;
-				}
-				if(meas_raw + lambda_2 > 0.0){
-					sumlogy += log(meas_raw + lambda_2);
-				}
-				else{
-					printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, j);
-					sumlogy=0.0;
-					break;
-				}
+		for(int k=0; k<n; k++){
+			double meas_raw = mMeasured[k];
+			if(meas_raw<=LOQ){
+				meas_raw = 0.5 * LOQ;
+			}
+			if(meas_raw + lambda_2 > 0.0){
+				sumlogy += log(meas_raw + lambda_2);
+			}
+			else{
+				printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, mRows[k]);
+				sumlogy=0.0;
+				break;
 			}
 		}
 	}	
 		
 	loglikeli += (lambda_1 - 1.0) * sumlogy;
+	double unused=0.0;
+	int first=resumePartialRun(&loglikeli, &unused);
 		
-	//log likelihood of deviations
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas_raw = mComparisonLink.measurement();
-			double model_raw = mComparisonLink.model();
-			if(meas_raw>LOQ){ //non-LOQ measurements
-				double meas=boxcox_transform(lambda_1, lambda_2, meas_raw, NULL);
-				double model=boxcox_transform(lambda_1, lambda_2, model_raw, NULL);
-				double newres=dist.logLikeli(model-meas);
-				loglikeli+=newres;
-				if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
-					printf("[Warning]: Log likelihood of point %d in %s (measured=%lf, modelled=%lf) is %lf\n",j, modelFieldName().c_str(), meas_raw, model_raw, newres);
-					printf("           BC(measured)=%lf, BC(modelled)=%lf\n", meas, model);
-					printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
-				}
+	//log likelihood of the deviations in one pass over the arrays, the rows below LOQ are redone below
+	double * terms=mTerms.data();
+	for(int k=first; k<n; k++){
+		terms[k]=mModelledTr[k]-mMeasuredTr[k];
+	}
+	dist.logLikeliArray(terms+first, terms+first, n-first);
+	
+	//summed in row order as before
+	double LOQtr=boxcox_transform(lambda_1, lambda_2, LOQ, NULL);
+	for(int k=first; k<n; k++){
+		double meas_raw = mMeasured[k];
+		double model_raw = mModelled[k];
+		if(meas_raw>LOQ){ //non-LOQ measurements
+			double newres=terms[k];
+			loglikeli+=newres;
+			if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
+				printf("[Warning]: Log likelihood of point %d in %s (measured=%lf, modelled=%lf) is %lf\n",mRows[k], modelFieldName().c_str(), meas_raw, model_raw, newres);
+				printf("           BC(measured)=%lf, BC(modelled)=%lf\n", mMeasuredTr[k], mModelledTr[k]);
+				printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
 			}
-			else{
-				//get the cumulative likelihood that meas_raw is below LOQ
-				double meas=boxcox_transform(lambda_1, lambda_2, LOQ, NULL);
-				double model=boxcox_transform(lambda_1, lambda_2, model_raw, NULL);
-				double xi = (meas-model) / sigma; //standardized variable
-				double pxi = lpnorm(xi);
-				double pxinull = 0.0;
-				double newres = pxi; //log(pxi - pxinull);
-				if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
-					printf("[Warning]: Log likelihood of point %d in %s (measured=%lf (<=LOQ), modelled=%lf) is %lf\n",j, modelFieldName().c_str(), meas_raw, model_raw, newres);
-					printf("           BC(measured)=%lf, BC(modelled)=%lf\n", meas, model);
-					printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
-					printf("           sigma=%lf, xi=%lf, p(xi)=%lf, p(xi0)=%lf\n", sigma, xi, pxi, pxinull);
-				}
-				loglikeli+=newres;
+		}
+		else{
+			//get the cumulative likelihood that meas_raw is below LOQ
+			double meas=LOQtr;
+			double model=mModelledTr[k];
+			double xi = (meas-model) / sigma; //standardized variable
+			double pxi = lpnorm(xi);
+			double pxinull = 0.0;
+			double newres = pxi; //log(pxi - pxinull);
+			if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
+				printf("[Warning]: Log likelihood of point %d in %s (measured=%lf (<=LOQ), modelled=%lf) is %lf\n",mRows[k], modelFieldName().c_str(), meas_raw, model_raw, newres);
+				printf("           BC(measured)=%lf, BC(modelled)=%lf\n", meas, model);
+				printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
+				printf("           sigma=%lf, xi=%lf, p(xi)=%lf, p(xi0)=%lf\n", sigma, xi, pxi, pxinull);
 			}
+			loglikeli+=newres;
 		}
 	}
+	keepPartialRun(n, loglikeli, 0.0);
 	return -loglikeli;	//to make it reversed for minimization
 }
 
+double iWQNormalLikelihoodEvaluation::maxLogLikeliOfRows(const std::vector<int> & rows)
+{
+	//no deviation at all, the rows below LOQ have at most 0
+	const double * meascol=mDataTable->columnView(measuredFieldName());
+	if(!meascol){
+		return DBL_MAX;
+	}
+	dist.setStdev(sigma);
+	double maxterm=pendingTerm(dist.logLikeli(0.0));
+	double result=0.0;
+	for(int k=0; k<rows.size(); k++){
+		if(meascol[rows[k]]>LOQ){
+			result+=maxterm;
+		}
+	}
+	return result;
+}
+
 std::vector<std::string> iWQNormalLikelihoodEvaluation::sampleSeriesNames()
 {
 	std::vector<std::string> result;
@@ -478,73 +646,88 @@ void iWQHeteroscedasticNormalLikelihoodEvaluation::setParams(iWQSettingList list
 
 double iWQHeteroscedasticNormalLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays, the transformed measurements are cached
+	int n=gatherColumns(startindex, endindex, lambda_1, lambda_2);
+	
 	//log likelihood with normal error model
 	double loglikeli=0.0;
-	double result=0.0;
 	
 	dist.setStdev(sigma);	//update before each evaluation
-	inputptr=mDataTable->portForColumn(inputfieldname);
-		
+	const double * inputcol=mDataTable->columnView(inputfieldname);
+	
 	//get the sum of log values of observations if not done so before
 	if(sumlogy==-DBL_MAX){
 		sumlogy = 0.0;
-		for(int j=startindex; j<endindex; j++){
-			mDataTable->setRow(j);
-			if(mComparisonLink.numeric()){
-				double meas_raw = mComparisonLink.measurement();
-				if(meas_raw<=LOQ){
-					meas_raw = 0.5 * LOQ;
-				}
-				if(meas_raw + lambda_2 > 0.0){
-					sumlogy += log(meas_raw + lambda_2);
-				}
-				else{
-					printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, j);
-					sumlogy=0.0;
-					break;
-				}
+		for(int k=0; k<n; k++){
+			double meas_raw = mMeasured[k];
+			if(meas_raw<=LOQ){
+				meas_raw = 0.5 * LOQ;
+			}
+			if(meas_raw + lambda_2 > 0.0){
+				sumlogy += log(meas_raw + lambda_2);
+			}
+			else{
+				printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, mRows[k]);
+				sumlogy=0.0;
+				break;
 			}
 		}
 	}	
 		
 	loglikeli += (lambda_1 - 1.0) * sumlogy;
-		
-	//log likelihood of deviations
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas_raw = mComparisonLink.measurement();
-			double model_raw = mComparisonLink.model();
-			double act_scaling = (inputptr && *inputptr!=DBL_MAX && *inputptr>0.0 && k_input>0.0) ? *inputptr/k_input : 1.0;
-			if(meas_raw>LOQ){ //non-LOQ measurements
-				double meas=boxcox_transform(lambda_1, lambda_2, meas_raw, NULL);
-				double model=boxcox_transform(lambda_1, lambda_2, model_raw, NULL);
-				double newres=dist.logLikeli((model-meas)/act_scaling);
-				loglikeli+=newres;
-				if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
-					printf("[Warning]: Log likelihood of point %d in %s (measured=%lf, modelled=%lf) is %lf\n",j, modelFieldName().c_str(), meas_raw, model_raw, newres);
-					printf("           BC(measured)=%lf, BC(modelled)=%lf\n", meas, model);
-					printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
-				}
+	double unused=0.0;
+	int first=resumePartialRun(&loglikeli, &unused);
+	
+	//scaling of the error by the input, 1.0 where there is no valid input, from the first row to sum on
+	std::vector<double> scaling(n-first, 1.0);
+	if(inputcol && k_input>0.0){
+		for(int k=first; k<n; k++){
+			double input=inputcol[mRows[k]];
+			if(input!=DBL_MAX && input>0.0){
+				scaling[k-first]=input/k_input;
 			}
-			else{
-				//get the cumulative likelihood that meas_raw is below LOQ
-				double meas=boxcox_transform(lambda_1, lambda_2, LOQ, NULL);
-				double model=boxcox_transform(lambda_1, lambda_2, model_raw, NULL);
-				double xi = (meas-model) / (sigma * act_scaling); //standardized variable
-				double pxi = lpnorm(xi);
-				double pxinull = 0.0;
-				double newres = pxi; //log(pxi - pxinull);
-				if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
-					printf("[Warning]: Log likelihood of point %d in %s (measured=%lf (<=LOQ), modelled=%lf) is %lf\n",j, modelFieldName().c_str(), meas_raw, model_raw, newres);
-					printf("           BC(measured)=%lf, BC(modelled)=%lf\n", meas, model);
-					printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
-					printf("           sigma=%lf, xi=%lf, p(xi)=%lf, p(xi0)=%lf\n", sigma, xi, pxi, pxinull);
-				}
-				loglikeli+=newres;
+		}
+	}
+	
+	//log likelihood of the deviations in one pass over the arrays, the rows below LOQ are redone below
+	double * terms=mTerms.data();
+	for(int k=first; k<n; k++){
+		terms[k]=(mModelledTr[k]-mMeasuredTr[k])/scaling[k-first];
+	}
+	dist.logLikeliArray(terms+first, terms+first, n-first);
+	
+	//summed in row order as before
+	double LOQtr=boxcox_transform(lambda_1, lambda_2, LOQ, NULL);
+	for(int k=first; k<n; k++){
+		double meas_raw = mMeasured[k];
+		double model_raw = mModelled[k];
+		if(meas_raw>LOQ){ //non-LOQ measurements
+			double newres=terms[k];
+			loglikeli+=newres;
+			if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
+				printf("[Warning]: Log likelihood of point %d in %s (measured=%lf, modelled=%lf) is %lf\n",mRows[k], modelFieldName().c_str(), meas_raw, model_raw, newres);
+				printf("           BC(measured)=%lf, BC(modelled)=%lf\n", mMeasuredTr[k], mModelledTr[k]);
+				printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
+			}
+		}
+		else{
+			//get the cumulative likelihood that meas_raw is below LOQ
+			double meas=LOQtr;
+			double model=mModelledTr[k];
+			double xi = (meas-model) / (sigma * scaling[k-first]); //standardized variable
+			double pxi = lpnorm(xi);
+			double pxinull = 0.0;
+			double newres = pxi; //log(pxi - pxinull);
+			if(std::isnan(newres) || std::isinf(newres) || newres== DBL_MAX || newres== -DBL_MAX){
+				printf("[Warning]: Log likelihood of point %d in %s (measured=%lf (<=LOQ), modelled=%lf) is %lf\n",mRows[k], modelFieldName().c_str(), meas_raw, model_raw, newres);
+				printf("           BC(measured)=%lf, BC(modelled)=%lf\n", meas, model);
+				printf("           lambda_1=%lf, lambda_2=%lf\n", lambda_1, lambda_2);
+				printf("           sigma=%lf, xi=%lf, p(xi)=%lf, p(xi0)=%lf\n", sigma, xi, pxi, pxinull);
 			}
+			loglikeli+=newres;
 		}
 	}
+	keepPartialRun(n, loglikeli, 0.0);
 	return -loglikeli;	//to make it reversed for minimization
 }
 
@@ -639,22 +822,15 @@ void iWQQuantileNormalLikelihoodEvaluation::setParams(iWQSettingList list)
 
 double iWQQuantileNormalLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays, the transformed measurements are cached
+	gatherColumns(startindex, endindex, lambda_1, lambda_2);
+	
 	//log likelihood with normal error model
 	double loglikeli=0.0;
 	
 	//prepare the lists of measurements and models
-	std::vector<double> measured;
-	std::vector<double> modelled;
-	
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas=boxcox_transform(lambda_1, lambda_2, mComparisonLink.measurement(), NULL);
-			double model=boxcox_transform(lambda_1, lambda_2, mComparisonLink.model(), NULL);
-			measured.push_back(meas);
-			modelled.push_back(model);
-		}
-	}
+	std::vector<double> measured(mMeasuredTr);
+	std::vector<double> modelled(mModelledTr);
 	
 	std::sort(measured.begin(), measured.end());
 	std::sort(modelled.begin(), modelled.end());
@@ -853,22 +1029,15 @@ void iWQQuantileLikelihoodEvaluation::setParams(iWQSettingList list)
 
 double iWQQuantileLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays
+	gatherColumns(startindex, endindex);
+	
 	//log likelihood with normal error model
 	double loglikeli=0.0;
 	
 	//prepare the lists of measurements and models
-	std::vector<double> measured;
-	std::vector<double> modelled;
-	
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas=mComparisonLink.measurement();
-			double model=mComparisonLink.model();
-			measured.push_back(meas);
-			modelled.push_back(model);
-		}
-	}
+	std::vector<double> measured(mMeasured);
+	std::vector<double> modelled(mModelled);
 	
 	std::sort(measured.begin(), measured.end());
 	std::sort(modelled.begin(), modelled.end());
@@ -1009,30 +1178,30 @@ void iWQIDARLikelihoodEvaluation::setParams(iWQSettingList list)
 
 double iWQIDARLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays, the transformed measurements are cached
+	int n=gatherColumns(startindex, endindex, lambda_1, lambda_2);
+	
 	//log likelihood with IDAR error model
 	double loglikeli=0.0;
 		
-	inputptr=mDataTable->portForColumn(inputfieldname);
+	const double * inputcol=mDataTable->columnView(inputfieldname);
 	
-	if(!inputptr){
+	if(!inputcol){
 		return loglikeli;
 	}
 	
 	//get the sum of log values of observations if not done so before
 	if(sumlogy==-DBL_MAX){
 		sumlogy = 0.0;
-		for(int j=startindex; j<endindex; j++){
-			mDataTable->setRow(j);
-			if(mComparisonLink.numeric()){
-				double meas_raw = mComparisonLink.measurement();
-				if(meas_raw + lambda_2 > 0.0){
-					sumlogy += log(meas_raw + lambda_2);
-				}
-				else{
-					printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, j);
-					sumlogy=0.0;
-					break;
-				}
+		for(int k=0; k<n; k++){
+			double meas_raw = mMeasured[k];
+			if(meas_raw + lambda_2 > 0.0){
+				sumlogy += log(meas_raw + lambda_2);
+			}
+			else{
+				printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, mRows[k]);
+				sumlogy=0.0;
+				break;
 			}
 		}
 	}	
@@ -1043,30 +1212,46 @@ double iWQIDARLikelihoodEvaluation::evaluate(int startindex, int endindex)
 	double rho = exp(-beta);
 	
 	double prev_bias=0.0;
+	int first=resumePartialRun(&loglikeli, &prev_bias);
 	
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas=mComparisonLink.measurement();
-			double model=mComparisonLink.model();
-			double meastr=boxcox_transform(lambda_1, lambda_2, meas, NULL);
-			double modeltr=boxcox_transform(lambda_1, lambda_2, model, NULL);
-			double act_bias=modeltr-meastr;	//was model-meas
-			double input=*inputptr;
-			
-			//reformulated
-			double condstdev = sqrt(jumpVarianceOfB(sigma_b2, beta, kappa, 0.0, input));
-			double condmean = rho * prev_bias;
-			dist.setMean(condmean);
-			dist.setStdev(condstdev);
-			loglikeli+=dist.logLikeli(act_bias);
-			
-			prev_bias=act_bias;
-		}
+	for(int k=first; k<n; k++){
+		double act_bias=mModelledTr[k]-mMeasuredTr[k];	//was model-meas
+		double input=inputcol[mRows[k]];
+		
+		//reformulated
+		double condstdev = sqrt(jumpVarianceOfB(sigma_b2, beta, kappa, 0.0, input));
+		double condmean = rho * prev_bias;
+		dist.setMean(condmean);
+		dist.setStdev(condstdev);
+		loglikeli+=dist.logLikeli(act_bias);
+		
+		prev_bias=act_bias;
 	}
+	keepPartialRun(n, loglikeli, prev_bias);
 	return -loglikeli;	//to make it reversed for minimization
 }
 
+double iWQIDARLikelihoodEvaluation::maxLogLikeliOfRows(const std::vector<int> & rows)
+{
+	//the bias jump equals its conditional mean, the variance depends only on the input (a data column)
+	const double * inputcol=mDataTable->columnView(inputfieldname);
+	if(!inputcol){
+		return DBL_MAX;
+	}
+	double result=0.0;
+	dist.setMean(0.0);
+	for(int k=0; k<rows.size(); k++){
+		double condstdev = sqrt(jumpVarianceOfB(sigma_b2, beta, kappa, 0.0, inputcol[rows[k]]));
+		dist.setStdev(condstdev);
+		double maxterm=dist.logLikeli(0.0);
+		if(std::isnan(maxterm)){
+			return DBL_MAX;
+		}
+		result+=pendingTerm(maxterm);
+	}
+	return result;
+}
+
 std::vector<std::string> iWQIDARLikelihoodEvaluation::sampleSeriesNames()
 {
 	std::vector<std::string> result;
@@ -1171,6 +1356,7 @@ void iWQBiasIDARLikelihoodEvaluation::initDefaultParams()
 	sumlogy = -DBL_MAX;
 	
 	maxkernelsize = 10;		//must be even
+	kalman = false;
 }
 
 void iWQBiasIDARLikelihoodEvaluation::setParams(iWQSettingList list)
@@ -1189,10 +1375,30 @@ void iWQBiasIDARLikelihoodEvaluation::setParams(iWQSettingList list)
 	setParamValueFromMap(&lambda_2,"lambda_2",&list,varname);
 	
 	setParamValueFromMap(&maxkernelsize,"max_kernel_size",&list,varname);
+	
+	//likelihood solver: moving kernels (default) or Kalman filter
+	std::string solver;
+	if(setParamValueFromMap(&solver,"solver",&list,varname)){
+		std::transform(solver.begin(), solver.end(), solver.begin(), ::tolower);
+		if(solver.compare("kalman")==0){
+			kalman=true;
+			printf("Evaluation of %s uses the exact Kalman filter likelihood.\n", varname.c_str());
+		}
+		else if(solver.compare("kernel")==0){
+			kalman=false;
+		}
+		else{
+			printf("[Warning]: Unknown bias likelihood solver \"%s\" for %s, using kernels.\n", solver.c_str(), varname.c_str());
+			kalman=false;
+		}
+	}
 }
 
 double iWQBiasIDARLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//read the stored columns directly, no row cursor
+	mComparisonLink.attachColumns(mDataTable);
+	
 	//pre-filter parameters
 	double minbeta=1E-3;
 	double maxbeta=10.0;
@@ -1220,36 +1426,31 @@ double iWQBiasIDARLikelihoodEvaluation::evaluate(int startindex, int endindex)
 	}
 	
 	//make residual series
-	inputptr=mDataTable->portForColumn(inputfieldname);
+	const double * inputcol=mDataTable->columnView(inputfieldname);
 	std::vector<double> yL_yLM;
 	std::vector<double> inputs;
 	
 	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas=boxcox_transform(lambda_1, lambda_2, mComparisonLink.measurement(), NULL);
-			double model=boxcox_transform(lambda_1, lambda_2, mComparisonLink.model(), NULL);
+		if(mComparisonLink.numeric(j)){
+			double meas=boxcox_transform(lambda_1, lambda_2, mComparisonLink.measurement(j), NULL);
+			double model=boxcox_transform(lambda_1, lambda_2, mComparisonLink.model(j), NULL);
 			yL_yLM.push_back(meas-model);
-			inputs.push_back(*inputptr);
+			inputs.push_back(inputcol[j]);
 		}
 		else{
 			break;
 		}
 	}
-	int dim=yL_yLM.size();
 	
 	//calculate likelihood
-	double result=0.0;
 	double loglikeli=0.0;
-	double pipart = log(1.0 / sqrt(2.0 * M_PI)); 
 	
 	//get the sum of log values of observations if not done so before
 	if(sumlogy==-DBL_MAX){
 		sumlogy = 0.0;
 		for(int j=startindex; j<endindex; j++){
-			mDataTable->setRow(j);
-			if(mComparisonLink.numeric()){
-				double meas_raw = mComparisonLink.measurement();
+			if(mComparisonLink.numeric(j)){
+				double meas_raw = mComparisonLink.measurement(j);
 				if(meas_raw + lambda_2 > 0.0){
 					sumlogy += log(meas_raw + lambda_2);
 				}
@@ -1264,6 +1465,12 @@ double iWQBiasIDARLikelihoodEvaluation::evaluate(int startindex, int endindex)
 		
 	loglikeli += (lambda_1 - 1.0) * sumlogy;
 	
+	if(kalman){
+		//exact likelihood in one pass
+		loglikeli += kalmanBiasLogLikelihood(yL_yLM, inputs, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e);
+		return -loglikeli; //for minimisation
+	}
+	
 	int md=(int)maxkernelsize;	//fixed kernel size, was 10
 	if(md%1){
 		md++;
@@ -1271,66 +1478,7 @@ double iWQBiasIDARLikelihoodEvaluation::evaluate(int startindex, int endindex)
 	if(md<4){
 		md=4;
 	}
-	if(md<dim){
-		//kernel solution
-		double det, det1;
-		int md1=md+1;
-		std::vector<double> inp (md);
-		std::vector<double> inp1 (md1);
-		
-		Eigen::MatrixXd kernelinv; 
-		Eigen::MatrixXd kernelinv1;
-		
-		//serially evaluate the likelihood
-		//process the residuals by moving the kernels around them
-		Eigen::VectorXd window1 (md1);		//md+1 elements
-		Eigen::VectorXd window (md);		//md elements
-		
-		double exppart, exppart1;
-		double lik, lik1;
-		
-		//process them according to conditional probability
-		for(int j=0; j<=dim-md1; j++){
-			//take md1 elements from the output
-			for(int i=0; i<md1; i++){
-				window1[i]=yL_yLM[j+i];
-				inp1[i]=inputs[j+i];
-			}
-					
-			//create the outer kernel
-			kernelinv1=makeCovarMatrix(inp1, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e, &det1);
-			exppart1=(window1.transpose() * kernelinv1).dot(window1);
-			lik1 = md1 * pipart + 0.5 * (det1 - exppart1);
-			
-			if(j==0){
-				loglikeli = lik1;
-			}
-			else{
-				for(int i=0; i<md; i++){
-					window[i]=yL_yLM[j+i];
-					inp[i]=inputs[j+i];
-				}
-				
-				kernelinv=makeCovarMatrix(inp, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e, &det);
-				exppart=(window.transpose() * kernelinv).dot(window);
-				lik = md * pipart + 0.5 * (det - exppart);
-				
-				//conditional likelihood of the last included element
-				loglikeli+= (lik1-lik);
-			}
-		}
-	}
-	else{
-		//full-scale solution
-		double det;
-		Eigen::MatrixXd kernelinv = makeCovarMatrix(inputs, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e, &det);
-		Eigen::VectorXd yL_yLMv (dim);
-		for(int i=0; i<dim; i++){
-			yL_yLMv[i]=yL_yLM[i];
-		}
-		double exppart=(yL_yLMv.transpose() * kernelinv).dot(yL_yLMv);
-		loglikeli = md * pipart + 0.5 * (det - exppart);
-	}
+	loglikeli = kernelBiasLogLikelihood(yL_yLM, inputs, md, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e);	//without the Jacobian term, as it always was
 
 	return -loglikeli; //for minimisation
 }
@@ -1515,6 +1663,9 @@ void iWQARSEPLikelihoodEvaluation::setParams(iWQSettingList list)
 
 double iWQARSEPLikelihoodEvaluation::evaluate(int startindex, int endindex)
 {
+	//numeric rows as arrays, the transformed measurements are cached
+	int n=gatherColumns(startindex, endindex, lambda_1, lambda_2);
+	
 	//log likelihood with ARSEP error model
 	double loglikeli=0.0;
 		
@@ -1526,50 +1677,58 @@ double iWQARSEPLikelihoodEvaluation::evaluate(int startindex, int endindex)
 	//get the sum of log values of observations if not done so before
 	if(sumlogy==-DBL_MAX){
 		sumlogy = 0.0;
-		for(int j=startindex; j<endindex; j++){
-			mDataTable->setRow(j);
-			if(mComparisonLink.numeric()){
-				double meas_raw = mComparisonLink.measurement();
-				if(meas_raw + lambda_2 > 0.0){
-					sumlogy += log(meas_raw + lambda_2);
-				}
-				else{
-					printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, j);
-					sumlogy=0.0;
-					break;
-				}
+		for(int k=0; k<n; k++){
+			double meas_raw = mMeasured[k];
+			if(meas_raw + lambda_2 > 0.0){
+				sumlogy += log(meas_raw + lambda_2);
+			}
+			else{
+				printf("[Warning]: Measurement (%s=%lf at index %d) is not strictly positive after adding lambda_2, so cannot account for lambda_1 in likelihood.\n", measuredFieldName().c_str(), meas_raw, mRows[k]);
+				sumlogy=0.0;
+				break;
 			}
 		}
 	}	
 		
 	loglikeli += (lambda_1 - 1.0) * sumlogy;
+	int first=resumePartialRun(&loglikeli, &prev_bias);
 	
-	for(int j=startindex; j<endindex; j++){
-		mDataTable->setRow(j);
-		if(mComparisonLink.numeric()){
-			double meas=mComparisonLink.measurement();
-			double model=mComparisonLink.model();
-			double meastr=boxcox_transform(lambda_1, lambda_2, meas, NULL);
-			double modeltr=boxcox_transform(lambda_1, lambda_2, model, NULL);
-			double act_bias=meastr-modeltr;	
-			double innovation = act_bias - fi * prev_bias;
-			
-			double sigma_t = sigma0 + sigma1 * pow(modeltr > 0.0 ? modeltr : 0.0, mu);
-			if(sigma_t <= 0.0){
-				sigma_t = 1.0;
-			}
-			double std_innovation = innovation/sigma_t;
-			loglikeli+=dist.logLikeli(std_innovation) - log(sigma_t);
-			
-			prev_bias=act_bias;
+	for(int k=first; k<n; k++){
+		double modeltr=mModelledTr[k];
+		double act_bias=mMeasuredTr[k]-modeltr;	
+		double innovation = act_bias - fi * prev_bias;
+		
+		double sigma_t = sigma0 + sigma1 * pow(modeltr > 0.0 ? modeltr : 0.0, mu);
+		if(sigma_t <= 0.0){
+			sigma_t = 1.0;
 		}
+		double std_innovation = innovation/sigma_t;
+		loglikeli+=dist.logLikeli(std_innovation) - log(sigma_t);
+		
+		prev_bias=act_bias;
 	}
+	keepPartialRun(n, loglikeli, prev_bias);
 	if(std::isinf(loglikeli) || std::isnan(loglikeli)){
 		return DBL_MAX;
 	}
 	return -loglikeli;	//to make it reversed for minimization
 }
 
+double iWQARSEPLikelihoodEvaluation::maxLogLikeliOfRows(const std::vector<int> & rows)
+{
+	//innovation at the mode of the SEP, the smallest scale is sigma0 when it cannot decrease with the model
+	if(sigma0<=0.0 || sigma1<0.0){
+		return DBL_MAX;
+	}
+	dist.setBeta(beta);
+	dist.setXi(xi);
+	double maxterm=dist.maxLogLikeli() - log(sigma0);
+	if(std::isnan(maxterm) || std::isinf(maxterm)){
+		return DBL_MAX;
+	}
+	return rows.size()*pendingTerm(maxterm);
+}
+
 std::vector<std::string> iWQARSEPLikelihoodEvaluation::sampleSeriesNames()
 {
 	std::vector<std::string> result;
@@ -11,6 +11,7 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <float.h>
 
 #ifndef evaluatormethod_h
 #define evaluatormethod_h
@@ -40,6 +41,43 @@ protected:
 	bool hasDynamicParamValue(std::string key, double * dest=NULL, std::string flag="");		//responds with true if there is a properly named parameter
 	bool setParamValueDynamically(double * dest, std::string key, std::string flag="");	
 	
+	//numeric rows of the evaluation interval as plain arrays, filled by gatherColumns()
+	std::vector<int> mRows;				//table rows where both model and measurement are numbers
+	std::vector<double> mMeasured;		//raw values in the order of mRows
+	std::vector<double> mModelled;
+	std::vector<double> mMeasuredTr;	//Box-Cox transformed values
+	std::vector<double> mModelledTr;
+	std::vector<double> mTerms;			//per-row terms of the likelihoods
+	int gatherColumns(int startindex, int endindex, double lambda_1=1.0, double lambda_2=0.0);	//returns the number of rows
+	
+	//partial runs: the model columns are valid only before mLastRow, the measured rows from there on are pending
+	int mLastRow;						//-1: full run
+	std::vector<int> mPendingRows;
+	virtual bool boundsPartialRuns(){ return false; }	//the evaluation is a sum of row terms in row order
+	virtual double maxLogLikeliOfRows(const std::vector<int> & rows){ return DBL_MAX; }	//upper bound of the summed terms of these rows
+	
+	//running sum of a partial run, each check of the bound adds only the rows simulated since the last one
+	bool mPartialRun;					//the arrays and the sum continue the previous check
+	int mPartialMeas;					//measured rows gathered so far
+	int mPartialRows;					//numeric rows summed so far
+	double mPartialLogLikeli;
+	double mPartialState;				//carried from row to row, e.g. the previous bias
+	int resumePartialRun(double * loglikeli, double * state);	//returns the first row to sum
+	void keepPartialRun(int n, double loglikeli, double state);
+	double pendingTerm(double maxterm){ return (maxterm>0.0)?maxterm:0.0; }	//a pending row adds nothing when its model value turns out NaN
+	
+private:
+	//the measurements stay the same between evaluations, so they are transformed only when the interval or the lambdas change
+	std::vector<int> mMeasRows;
+	std::vector<double> mMeasValues;
+	std::vector<double> mMeasValuesTr;
+	const double * mMeasColumn;
+	long mMeasRevision;
+	int mMeasStart;
+	int mMeasEnd;
+	double mMeasLambda1;
+	double mMeasLambda2;
+	
 public:
 	iWQEvaluatorMethod();
 	virtual ~iWQEvaluatorMethod(){ }
@@ -53,6 +91,8 @@ public:
 	std::string modelFieldName(){ return mComparisonLink.modelField(); }
 	std::string measuredFieldName(){ return mComparisonLink.measuredField(); }
 	void setLinkPredictiveMode(bool pred){ mComparisonLink.setPredictiveMode(pred); }
+	double lowerBound(int startindex, int endindex, int lastrow);	//of evaluate() when the model has run only until lastrow, -DBL_MAX if unknown
+	void resetPartialRun(){ mPartialRun=false; }	//before a new run is bounded
 		
 	//optional implementation
 	virtual void setParams(iWQSettingList list){ } 
@@ -120,6 +160,9 @@ public:
 	virtual std::vector<std::string> sampleSeriesNames();
 	virtual void createSampleSeries(std::map<std::string, std::vector<double> > * storage);
 	virtual bool priorsApply(){ return true; }
+protected:
+	virtual bool boundsPartialRuns(){ return (sumlogy!=-DBL_MAX); }	//the Box-Cox term is known after the first full run
+	virtual double maxLogLikeliOfRows(const std::vector<int> & rows);
 };
 
 //-----------------------------------------------------------------------------------------------
@@ -154,6 +197,8 @@ public:
 	virtual double evaluate(int startindex, int endindex);
 	virtual std::vector<std::string> sampleSeriesNames();
 	virtual void createSampleSeries(std::map<std::string, std::vector<double> > * storage);
+protected:
+	virtual bool boundsPartialRuns(){ return false; }	//quantiles need the whole series
 };
 
 //-----------------------------------------------------------------------------------------------
@@ -172,6 +217,8 @@ public:
 	virtual double evaluate(int startindex, int endindex);
 	virtual std::vector<std::string> sampleSeriesNames();
 	virtual void createSampleSeries(std::map<std::string, std::vector<double> > * storage);
+protected:
+	virtual bool boundsPartialRuns(){ return false; }	//quantiles need the whole series
 };
 
 //-----------------------------------------------------------------------------------------------
@@ -202,6 +249,9 @@ public:
 	virtual std::vector<std::string> sampleSeriesNames();
 	virtual void createSampleSeries(std::map<std::string, std::vector<double> > * storage);
 	virtual bool priorsApply(){ return true; }
+protected:
+	virtual bool boundsPartialRuns(){ return (sumlogy!=-DBL_MAX); }	//the Box-Cox term is known after the first full run
+	virtual double maxLogLikeliOfRows(const std::vector<int> & rows);
 };
 
 //-----------------------------------------------------------------------------------------------
@@ -211,6 +261,7 @@ class iWQBiasIDARLikelihoodEvaluation : public iWQEvaluatorMethod
 //Input-dependent model bias and indepenedent measurement error
 private:
 	double maxkernelsize;
+	bool kalman;					//exact Kalman filter likelihood instead of the kernels
 protected:
 	iWQRandomNormalGenerator dist;	//N(0,1)
 	double sigma_b2;				//bias base variance
@@ -263,6 +314,9 @@ public:
 	virtual std::vector<std::string> sampleSeriesNames();
 	virtual void createSampleSeries(std::map<std::string, std::vector<double> > * storage);
 	virtual bool priorsApply(){ return true; }
+protected:
+	virtual bool boundsPartialRuns(){ return (sumlogy!=-DBL_MAX); }	//the Box-Cox term is known after the first full run
+	virtual double maxLogLikeliOfRows(const std::vector<int> & rows);
 };
 
 //-----------------------------------------------------------------------------------------------
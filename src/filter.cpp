@@ -11,7 +11,12 @@
 #include <math.h>
 #include <stdlib.h>
 #include <map>
+#include <set>
+#include <deque>
+#include <algorithm>
+#include <limits>
 #include <stdio.h>
+#include <float.h>
 
 #include "filter.h"
 #include "datatable.h"
@@ -26,6 +31,7 @@ iWQFilter::iWQFilter()
 	mDestFieldName = "";
 	mFuncName = "copy";
 	mAggrFunc = NULL;
+	mKernel = IWQ_FILTER_GENERIC;
 	mWindowLength = 1;
 	mWindowCenter = 0;
 	mSrcCol = NULL;
@@ -95,29 +101,41 @@ bool iWQFilter::setFunction(std::string funcname)
 {
 	mFuncName = "copy";
 	mAggrFunc = NULL;
+	mKernel = IWQ_FILTER_GENERIC;
 	if(funcname.compare("average")==0){
 		mFuncName = funcname;
 		mAggrFunc = average;
+		mKernel = IWQ_FILTER_AVERAGE;
 	}
 	if(funcname.compare("variance")==0){
 		mFuncName = funcname;
 		mAggrFunc = variance;
+		mKernel = IWQ_FILTER_VARIANCE;
 	}
 	if(funcname.compare("min")==0){
 		mFuncName = funcname;
 		mAggrFunc = min;
+		mKernel = IWQ_FILTER_MIN;
 	}
 	if(funcname.compare("max")==0){
 		mFuncName = funcname;
 		mAggrFunc = max;
+		mKernel = IWQ_FILTER_MAX;
 	}
 	if(funcname.compare("sumsquares")==0){
 		mFuncName = funcname;
 		mAggrFunc = sumsquares;
+		mKernel = IWQ_FILTER_SUMSQUARES;
 	}
 	if(funcname.compare("sum")==0){
 		mFuncName = funcname;
 		mAggrFunc = sum;
+		mKernel = IWQ_FILTER_SUM;
+	}
+	if(funcname.compare("median")==0){
+		mFuncName = funcname;
+		mAggrFunc = median;
+		mKernel = IWQ_FILTER_MEDIAN;
 	}
 	if(!mAggrFunc){
 		printf("[Error]: Cannot set filter type to \"%s\": unknown function. Reverting to default (%s).\n",funcname.c_str(),mFuncName.c_str());
@@ -168,23 +186,369 @@ bool iWQFilter::valid()
 
 void iWQFilter::filter()
 {
-	//does the actual filtering
-	//for each row of destField assemble the vector of sources
-	mDataTable->rewind();
+	//does the actual filtering, straight into the destination column
+	mDataTable->commit();
 	int nrows = mDataTable->numRows();
+	double * dest = mDataTable->columnDataForPort(mDestPtr);
+	if(!dest || !mSrcCol || mSrcCol->size()<nrows || nrows==0){
+		return;
+	}
+	const double * src = &(mSrcCol->at(0));
+	if(src==dest){
+		//in place: each window sees the rows already filtered before it
+		filterGeneric(src, dest, nrows);
+	}
+	else{
+		switch(mKernel){
+			case IWQ_FILTER_SUM:
+			case IWQ_FILTER_SUMSQUARES:
+			case IWQ_FILTER_AVERAGE:
+				filterSums(src, dest, nrows);
+				break;
+			case IWQ_FILTER_VARIANCE:
+				filterVariance(src, dest, nrows);
+				break;
+			case IWQ_FILTER_MIN:
+			case IWQ_FILTER_MAX:
+				filterExtremes(src, dest, nrows);
+				break;
+			case IWQ_FILTER_MEDIAN:
+				filterMedian(src, dest, nrows);
+				break;
+			default:
+				filterGeneric(src, dest, nrows);
+		}
+	}
+	mDataTable->touchColumnForPort(mDestPtr);
+	//the port shows the new value of the current row
+	int row = mDataTable->pos();
+	if(row>=0){
+		*mDestPtr = dest[row];
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQFilter::windowBounds(int row, int nrows, int * start, int * end)
+{
+	*start = row - mWindowCenter;
+	*end = row + (mWindowLength - mWindowCenter);	//index AFTER the last element
+	if(*start<0){ *start=0; }
+	if(*end>nrows){ *end=nrows; }
+}
+
+//--------------------------------------------------------------------------------------------------
+
+double iWQFilter::aggregateRow(const double * src, int row, int nrows, iWQVector * subdata)
+{
+	int vecstart, vecend;
+	windowBounds(row, nrows, &vecstart, &vecend);
+	subdata->assign(src + vecstart, src + vecend);
+	return mAggrFunc(subdata);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQFilter::filterGeneric(const double * src, double * dest, int nrows)
+{
+	//the whole window is aggregated for each row
+	iWQVector subdata;
+	subdata.reserve(mWindowLength);
 	for(int r=0; r<nrows; r++){
-		mDataTable->setRow(r);	//r is at the center of the window
-		int vecstart = r - mWindowCenter;
-		int vecend = r + (mWindowLength - mWindowCenter);	//index AFTER the last element
-		if(vecstart<0){ vecstart=0; }
-		if(vecend>nrows){ vecend=nrows; }
-		iWQVector subdata;
-		//subdata.assign(mSrcCol->begin() + vecstart, mSrcCol->begin() + vecend);
-		for(int s=vecstart; s<vecend; s++){
-			subdata.push_back(mSrcCol->at(s));
-		}
-		double result = mAggrFunc(&subdata);
-		*mDestPtr = result;
+		dest[r] = aggregateRow(src, r, nrows, &subdata);
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+// The sliding forms are trusted while the terms since the last reset are within this factor of the result,
+// beyond it the state is summed again from the window
+#define IWQ_FILTER_CONDITION 1e12
+
+// Compensated (Neumaier) sum of the finite terms entering and leaving a window, infinite ones are counted
+class iWQRunningSum
+{
+public:
+	double sum;
+	double compensation;
+	double magnitude;		//absolute values of the finite terms since the reset
+	int count;				//finite terms
+	int positiveInf;
+	int negativeInf;
+	
+	iWQRunningSum(){ clear(); }
+	void clear(){ sum=0.0; compensation=0.0; magnitude=0.0; count=0; positiveInf=0; negativeInf=0; }
+	void add(double term, int sign){
+		if(isnan(term)){
+			return;
+		}
+		if(isinf(term)){
+			if(term>0.0){ positiveInf+=sign; }
+			else{ negativeInf+=sign; }
+			return;
+		}
+		count+=sign;
+		magnitude+=fabs(term);
+		term*=sign;
+		double t=sum+term;
+		if(fabs(sum)>=fabs(term)){
+			compensation+=(sum-t)+term;
+		}
+		else{
+			compensation+=(term-t)+sum;
+		}
+		sum=t;
+	}
+	double value(){
+		if(positiveInf && negativeInf){
+			return std::numeric_limits<double>::quiet_NaN();
+		}
+		if(positiveInf || negativeInf){
+			return (positiveInf)?HUGE_VAL:-HUGE_VAL;
+		}
+		return sum+compensation;
+	}
+	bool overflowed(){ return isinf(sum) || isnan(sum) || isinf(compensation) || isnan(compensation); }
+	bool precise(){ return positiveInf || negativeInf || magnitude<=fabs(sum+compensation)*IWQ_FILTER_CONDITION; }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+// Welford's updates of the mean and the squared deviations of the finite values, in both directions
+class iWQRunningVariance
+{
+public:
+	double mean;
+	double m2;
+	double spread;			//largest deviation of the updates since the reset, a constant series has none
+	int count;				//finite values
+	int infinite;
+	
+	iWQRunningVariance(){ clear(); }
+	void clear(){ mean=0.0; m2=0.0; spread=0.0; count=0; infinite=0; }
+	void add(double x){
+		if(isinf(x)){
+			infinite++;
+		}
+		else if(!isnan(x)){
+			count++;
+			double d=x-mean;
+			mean+=d/count;
+			m2+=d*(x-mean);
+			if(count>1){
+				spread=std::max(spread, fabs(d));
+			}
+		}
+	}
+	void remove(double x){
+		if(isinf(x)){
+			infinite--;
+		}
+		else if(!isnan(x)){
+			count--;
+			if(count==0){
+				mean=0.0;
+				m2=0.0;
+			}
+			else{
+				double d=x-mean;
+				mean-=d/count;
+				m2-=d*(x-mean);
+				spread=std::max(spread, fabs(d));
+			}
+		}
+	}
+	bool overflowed(){ return isinf(mean*mean) || isnan(mean) || isinf(m2) || isnan(m2); }	//the squares of variance() would not fit either
+	bool precise(){ return infinite || count<2 || spread*spread<=m2/count*IWQ_FILTER_CONDITION; }
+};
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQFilter::filterSums(const double * src, double * dest, int nrows)
+{
+	iWQRunningSum sums;
+	iWQVector subdata;
+	bool squares = (mKernel==IWQ_FILTER_SUMSQUARES);
+	bool overflow = false;
+	int lo=0, hi=0;
+	for(int r=0; r<nrows; r++){
+		int start, end;
+		windowBounds(r, nrows, &start, &end);
+		if(r%mWindowLength==0){
+			//summed again once per window length: the updates cannot drift, and it is still O(n)
+			sums.clear();
+			overflow=false;
+			lo=hi=start;
+		}
+		if(!overflow){
+			for(; hi<end; hi++){
+				sums.add((squares)?src[hi]*src[hi]:src[hi], 1);
+			}
+			for(; lo<start; lo++){
+				sums.add((squares)?src[lo]*src[lo]:src[lo], -1);
+			}
+			if(!sums.overflowed() && !sums.precise()){
+				//far below the terms which passed (e.g. a dry spell after rain): the state starts again from the window
+				sums.clear();
+				for(lo=hi=start; hi<end; hi++){
+					sums.add((squares)?src[hi]*src[hi]:src[hi], 1);
+				}
+			}
+			overflow=sums.overflowed();	//the updates are lost until the next reset
+		}
+		if(overflow){
+			//beyond the range of doubles: the window is summed by the function
+			dest[r] = aggregateRow(src, r, nrows, &subdata);
+			continue;
+		}
+		double total = sums.value();
+		if(mKernel==IWQ_FILTER_AVERAGE && !isinf(total) && !isnan(total)){
+			total/=(double)sums.count;	//NaN without numbers, as average()
+		}
+		dest[r] = total;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQFilter::filterVariance(const double * src, double * dest, int nrows)
+{
+	iWQRunningVariance window;
+	iWQVector subdata;
+	bool overflow = false;
+	int lo=0, hi=0;
+	for(int r=0; r<nrows; r++){
+		int start, end;
+		windowBounds(r, nrows, &start, &end);
+		if(r%mWindowLength==0){
+			window.clear();
+			overflow=false;
+			lo=hi=start;
+		}
+		if(!overflow){
+			for(; hi<end; hi++){
+				window.add(src[hi]);
+			}
+			for(; lo<start; lo++){
+				window.remove(src[lo]);
+			}
+			if(!window.overflowed() && !window.precise()){
+				//far below the deviations which passed: the state starts again from the window
+				window.clear();
+				for(lo=hi=start; hi<end; hi++){
+					window.add(src[hi]);
+				}
+			}
+			overflow=window.overflowed();	//the updates are lost until the next reset
+		}
+		if(overflow){
+			//beyond the range of doubles: variance() of the window
+			dest[r] = aggregateRow(src, r, nrows, &subdata);
+			continue;
+		}
+		//same scaling as variance(): NaNs count in the degrees of freedom
+		int n = end-start;
+		if(window.infinite){
+			dest[r] = std::numeric_limits<double>::quiet_NaN();
+		}
+		else if(window.count==0){
+			dest[r] = 0.0;
+		}
+		else{
+			//a single value has no deviation, whatever the updates left over
+			double squares=(window.count>1 && window.m2>0.0)?window.m2:0.0;
+			dest[r] = squares/(n-1.0)*n/(double)window.count;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQFilter::filterExtremes(const double * src, double * dest, int nrows)
+{
+	//monotonic queue of the finite values which can still become the extreme
+	bool minimum = (mKernel==IWQ_FILTER_MIN);
+	std::deque<int> candidates;
+	int hi=0;
+	for(int r=0; r<nrows; r++){
+		int start, end;
+		windowBounds(r, nrows, &start, &end);
+		for(; hi<end; hi++){
+			double x=src[hi];
+			if(!isnan(x) && !isinf(x)){
+				while(candidates.size() && ((minimum)?src[candidates.back()]>=x:src[candidates.back()]<=x)){
+					candidates.pop_back();
+				}
+				candidates.push_back(hi);
+			}
+		}
+		while(candidates.size() && candidates.front()<start){
+			candidates.pop_front();
+		}
+		if(candidates.size()){
+			dest[r] = src[candidates.front()];
+		}
+		else{
+			dest[r] = (minimum)?DBL_MAX:-DBL_MAX;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQFilter::filterMedian(const double * src, double * dest, int nrows)
+{
+	//lower half with the middle value, and upper half of the values which are not NaN
+	std::multiset<double> lower, upper;
+	auto balance=[&](){
+		if(lower.size()>upper.size()+1){
+			upper.insert(*lower.rbegin());
+			lower.erase(--lower.end());
+		}
+		if(upper.size()>lower.size()){
+			lower.insert(*upper.begin());
+			upper.erase(upper.begin());
+		}
+	};
+	int lo=0, hi=0;
+	for(int r=0; r<nrows; r++){
+		int start, end;
+		windowBounds(r, nrows, &start, &end);
+		for(; hi<end; hi++){
+			double x=src[hi];
+			if(!isnan(x)){
+				if(lower.empty() || x<=*lower.rbegin()){
+					lower.insert(x);
+				}
+				else{
+					upper.insert(x);
+				}
+				balance();
+			}
+		}
+		for(; lo<start; lo++){
+			double x=src[lo];
+			if(!isnan(x)){
+				//balanced: the lower half is not empty
+				if(x<=*lower.rbegin()){
+					lower.erase(lower.find(x));
+				}
+				else{
+					upper.erase(upper.find(x));
+				}
+				balance();
+			}
+		}
+		if(lower.empty()){
+			dest[r] = 0.0;
+		}
+		else if(lower.size()==upper.size()){
+			//interpolated as quantile()
+			double a=*lower.rbegin();
+			dest[r] = a+(*upper.begin()-a)*0.5;
+		}
+		else{
+			dest[r] = *lower.rbegin();
+		}
 	}
-	mDataTable->commit();
 }
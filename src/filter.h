@@ -21,6 +21,9 @@ class iWQParameterManager;
 
 typedef std::multimap<std::string,std::string> iWQSettingList;	//nested parameter structure
 
+//window updates of the functions: values enter and leave once, instead of aggregating each window
+typedef enum { IWQ_FILTER_GENERIC=0, IWQ_FILTER_SUM, IWQ_FILTER_SUMSQUARES, IWQ_FILTER_AVERAGE, IWQ_FILTER_VARIANCE, IWQ_FILTER_MIN, IWQ_FILTER_MAX, IWQ_FILTER_MEDIAN } iWQFilterKernel;
+
 //data filter class
 class iWQFilter
 {
@@ -30,10 +33,20 @@ protected:
 	std::string mDestFieldName;
 	std::string mFuncName;
 	double (*mAggrFunc)(const iWQVector *);	//pointer to an aggregating function
+	iWQFilterKernel mKernel;				//sliding window form of the function
 	int mWindowLength;						//total length of the aggregation window
 	int mWindowCenter;						//relative position of the output cell
 	const iWQVector * mSrcCol;
 	double * mDestPtr;
+	
+	//window of row r: [r-center, r-center+length) within the table
+	void windowBounds(int row, int nrows, int * start, int * end);
+	double aggregateRow(const double * src, int row, int nrows, iWQVector * subdata);
+	void filterGeneric(const double * src, double * dest, int nrows);
+	void filterSums(const double * src, double * dest, int nrows);
+	void filterVariance(const double * src, double * dest, int nrows);
+	void filterExtremes(const double * src, double * dest, int nrows);
+	void filterMedian(const double * src, double * dest, int nrows);
 public:
 	iWQFilter();
 	std::string destFieldName(){ return mDestFieldName; }
@@ -0,0 +1,262 @@
+/*
+ *  lbfgsb.cpp
+ *  Limited memory quasi-Newton optimizer with bounds (L-BFGS-B)
+ *
+ *  iWaQa model framework 2010-2017
+ *
+ *  SYSTEM/OPTIMISE
+ *
+ */
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <float.h>
+#include <algorithm>
+#include <deque>
+
+#include "lbfgsb.h"
+#include "evaluator.h"
+#include "model.h"
+
+//----------------------------------------------------------------------------
+
+iWQLBFGSBOptimizer::iWQLBFGSBOptimizer()
+{
+	maxIterations=100;
+	memory=5;
+	tolerance=1E-7;
+	gradientTolerance=1E-5;
+}
+
+//----------------------------------------------------------------------------
+
+//value and gradient in the scaled space
+static double lbfgsbEvaluate(iWQEvaluator * evaluator, iWQBoundsList & bounds, const std::vector<double> & x, std::vector<double> & g)
+{
+	int n=x.size();
+	std::vector<double> modelpos (n);
+	for(int i=0; i<n; i++){
+		modelpos[i]=bounds[i].min+x[i]*(bounds[i].max-bounds[i].min);
+	}
+	double f=evaluator->evaluateWithGradient(modelpos, g);
+	if(!(f<DBL_MAX) || g.size()!=n){
+		g.assign(n, 0.0);
+		return DBL_MAX;
+	}
+	for(int i=0; i<n; i++){
+		g[i]*=bounds[i].max-bounds[i].min;
+		if(isnan(g[i]) || isinf(g[i])){
+			return DBL_MAX;
+		}
+	}
+	return f;
+}
+
+//----------------------------------------------------------------------------
+
+//projected quasi-Newton steps as in Byrd, Lu, Nocedal, Zhu: A limited memory algorithm for bound
+//constrained optimization (1995), with the active set taken from the projected gradient instead of
+//the generalized Cauchy point
+
+std::vector<double> iWQLBFGSBOptimizer::optimize(iWQEvaluator * evaluator, iWQBoundsList bounds)
+{
+	printf("Running L-BFGS-B optimization.\n");
+
+	if(!evaluator){
+		printf("[Error]: no evaluator specified for L-BFGS-B optimization.\n");
+		return std::vector<double> ();
+	}
+
+	iWQParameterManager * parmanager=evaluator->parameters();
+	if(!parmanager){
+		printf("[Error]: Evaluator does not have parameters for L-BFGS-B optimization.\n");
+		return std::vector<double> ();
+	}
+
+	std::vector<std::string> parnames=parmanager->namesForPlainValues();
+	std::vector<double> parvals=parmanager->plainValues();
+	int n=bounds.size();
+	if(n==0 || n!=parnames.size()){
+		printf("[Error]: The count of parameter names does not match L-BFGS-B bounds dimension.\n");
+		return std::vector<double> ();
+	}
+
+	//starting point: the actual parameter values scaled to the bounds
+	std::vector<double> x (n);
+	for(int i=0; i<n; i++){
+		double width=bounds[i].max-bounds[i].min;
+		x[i]=(width>0.0)?std::min(1.0, std::max(0.0, (parvals[i]-bounds[i].min)/width)):0.0;
+	}
+	std::vector<double> g;
+	double f=lbfgsbEvaluate(evaluator, bounds, x, g);
+	if(!(f<DBL_MAX)){
+		printf("[Error]: L-BFGS-B could not evaluate the starting point.\n");
+		return std::vector<double> ();
+	}
+
+	std::deque<std::vector<double> > S;	//steps
+	std::deque<std::vector<double> > Y;	//gradient changes
+	std::deque<double> rho;
+	std::vector<double> d (n), q (n), xnew (n), gnew, alpha;
+	std::vector<bool> fixed (n);
+	int evaluations=1;
+
+	for(int iteration=0; iteration<maxIterations; iteration++){
+		//variables held by their bounds
+		double pgnorm=0.0;
+		for(int i=0; i<n; i++){
+			fixed[i]=(bounds[i].max<=bounds[i].min || (x[i]<=0.0 && g[i]>0.0) || (x[i]>=1.0 && g[i]<0.0));
+			if(!fixed[i]){
+				pgnorm=std::max(pgnorm, fabs(g[i]));
+			}
+		}
+		if(pgnorm<gradientTolerance){
+			printf("[optimizer]: L-BFGS-B converged, the projected gradient vanished.\n");
+			break;
+		}
+
+		//two-loop recursion on the free variables
+		for(int i=0; i<n; i++){
+			q[i]=(fixed[i])?0.0:g[i];
+		}
+		int m=S.size();
+		alpha.assign(m, 0.0);
+		for(int k=m-1; k>=0; k--){
+			double sq=0.0;
+			for(int i=0; i<n; i++){
+				sq+=(fixed[i])?0.0:S[k][i]*q[i];
+			}
+			alpha[k]=rho[k]*sq;
+			for(int i=0; i<n; i++){
+				q[i]-=(fixed[i])?0.0:alpha[k]*Y[k][i];
+			}
+		}
+		double gamma=1.0;
+		if(m>0){
+			double sy=0.0, yy=0.0;
+			for(int i=0; i<n; i++){
+				sy+=S[m-1][i]*Y[m-1][i];
+				yy+=Y[m-1][i]*Y[m-1][i];
+			}
+			gamma=(yy>0.0)?sy/yy:1.0;
+		}
+		for(int i=0; i<n; i++){
+			q[i]*=gamma;
+		}
+		for(int k=0; k<m; k++){
+			double yq=0.0;
+			for(int i=0; i<n; i++){
+				yq+=(fixed[i])?0.0:Y[k][i]*q[i];
+			}
+			double beta=rho[k]*yq;
+			for(int i=0; i<n; i++){
+				q[i]+=(fixed[i])?0.0:S[k][i]*(alpha[k]-beta);
+			}
+		}
+		double slope=0.0;
+		double dmax=0.0;
+		for(int i=0; i<n; i++){
+			d[i]=(fixed[i])?0.0:-q[i];
+			slope+=g[i]*d[i];
+			dmax=std::max(dmax, fabs(d[i]));
+		}
+		if(!(slope<0.0)){
+			//not a descent direction: restart from the steepest descent
+			S.clear();
+			Y.clear();
+			rho.clear();
+			slope=0.0;
+			dmax=0.0;
+			for(int i=0; i<n; i++){
+				d[i]=(fixed[i])?0.0:-g[i];
+				slope+=g[i]*d[i];
+				dmax=std::max(dmax, fabs(d[i]));
+			}
+		}
+
+		//backtracking on the projected path with the Armijo condition
+		double t=(S.size()>0 || dmax<=0.1)?1.0:0.1/dmax;
+		double fnew=DBL_MAX;
+		bool accepted=false;
+		for(int ls=0; ls<20 && !accepted; ls++){
+			double decrease=0.0;
+			for(int i=0; i<n; i++){
+				xnew[i]=std::min(1.0, std::max(0.0, x[i]+t*d[i]));
+				decrease+=g[i]*(xnew[i]-x[i]);
+			}
+			fnew=lbfgsbEvaluate(evaluator, bounds, xnew, gnew);
+			evaluations++;
+			if(fnew<DBL_MAX && fnew<=f+1E-4*decrease){
+				accepted=true;
+			}
+			else{
+				t*=0.5;
+			}
+		}
+		if(!accepted){
+			if(S.size()>0){
+				//forget the curvature pairs and try the steepest descent
+				S.clear();
+				Y.clear();
+				rho.clear();
+				continue;
+			}
+			printf("[optimizer]: L-BFGS-B stopped, the line search failed.\n");
+			break;
+		}
+
+		//curvature pair
+		std::vector<double> s (n), y (n);
+		double sy=0.0;
+		double yy=0.0;
+		for(int i=0; i<n; i++){
+			s[i]=xnew[i]-x[i];
+			y[i]=gnew[i]-g[i];
+			sy+=s[i]*y[i];
+			yy+=y[i]*y[i];
+		}
+		if(sy>DBL_EPSILON*yy){
+			S.push_back(s);
+			Y.push_back(y);
+			rho.push_back(1.0/sy);
+			if(S.size()>memory){
+				S.pop_front();
+				Y.pop_front();
+				rho.pop_front();
+			}
+		}
+
+		double change=f-fnew;
+		x=xnew;
+		g=gnew;
+		f=fnew;
+
+		//write out iteration details
+		printf("L-BFGS-B #%d\t[%lf]\n",iteration,f);
+
+		//save parameters to a temporary file
+		FILE * tempfile=fopen("_calibration_progress.tmp","a");
+		if(tempfile){
+			time_t now=time(0);
+			fprintf(tempfile,"#BEGIN RECORD\n#time=%s\n#creator=lbfgsb\n#iteration=%d\n",ctime(&now),iteration);
+			for(int i=0; i<n; i++){
+				fprintf(tempfile,"\t%s: %g\n",parnames[i].c_str(), bounds[i].min+x[i]*(bounds[i].max-bounds[i].min));
+			}
+			fprintf(tempfile,"#eval=[%g]\n#END RECORD\n",f);
+			fclose(tempfile);
+		}
+
+		if(change<=tolerance*std::max(1.0, fabs(f))){
+			printf("[optimizer]: L-BFGS-B converged, the objective does not decrease anymore.\n");
+			break;
+		}
+	}
+	printf("[optimizer]: L-BFGS-B used %d evaluations with gradients.\n",evaluations);
+
+	std::vector<double> result (n);
+	for(int i=0; i<n; i++){
+		result[i]=bounds[i].min+x[i]*(bounds[i].max-bounds[i].min);
+	}
+	return result;
+}
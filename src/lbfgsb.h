@@ -0,0 +1,37 @@
+/*
+ *  lbfgsb.h
+ *  Limited memory quasi-Newton optimizer with bounds (L-BFGS-B)
+ *
+ *  iWaQa model framework 2010-2017
+ *
+ *  SYSTEM/OPTIMISE
+ *
+ */
+
+#include <vector>
+#include <string>
+#include "particleswarm.h"
+
+#ifndef lbfgsb_h
+#define lbfgsb_h
+
+class iWQEvaluator;
+
+// Minimises the evaluator function within the bounds, using its gradient from the forward sensitivities.
+// The search runs on the bounds scaled to [0,1]. Variables on a bound with the gradient pointing outwards
+// are fixed for the step, the others follow the L-BFGS direction, projected back into the bounds.
+class iWQLBFGSBOptimizer
+{
+public:
+	iWQLBFGSBOptimizer();
+
+	//settings
+	int maxIterations;
+	int memory;					//correction pairs kept for the inverse Hessian
+	double tolerance;			//converged when the objective decreases less than this (relative)
+	double gradientTolerance;	//converged when the projected gradient is below this (scaled to the bounds)
+
+	std::vector<double> optimize(iWQEvaluator * evaluator, iWQBoundsList bounds);
+};
+
+#endif
@@ -48,6 +48,8 @@ tam@wri.com
 #include "lsodaintegrator.h"
 #include "model.h"
 #include <stdlib.h>
+#include <algorithm>
+#include <iterator>
 
 //============================================================================================
 
@@ -57,21 +59,21 @@ void iWQLSODAIntegrator::f( int neq, double t, double *y, double *ydot )
 		return;
 	}
 	
-	//y is indexed from 1, need a 0-indexed replacement container
-	double * y2=new double [neq];
-	for(int x=0; x<neq; x++){
-		y2[x]=y[x+1];
-	}
-	model->readVariables(y2,neq);			//send the var data from y2 to the derived class
+	//y and ydot are indexed from 1, shifting the pointers gives the 0-indexed view
+	int numvars=model->mVarLocations.size();
+	model->readVariables(y+1,numvars);			//send the var data from y to the derived class
 	model->modelFunction(t);						//FUNCTION CALLED
-	model->copyDerivatives(ydot+1,neq);	//get back the derivatives to ydot, but with 1-indexed
+	model->copyDerivatives(ydot+1,numvars);	//get back the derivatives to ydot, but with 1-indexed
 	
-	delete [] y2;
+	//augmented system: the forward sensitivities follow the states
+	if(neq>numvars){
+		model->sensitivityFunction(t, y+1, ydot+1);
+	}
 }
 
 //--------------------------------------------------------------------------------------------
 
-bool iWQLSODAIntegrator::solve1Step(iWQModel * m, double tstart, double tend, double eps)
+iWQLSODAIntegrator::iWQLSODAIntegrator(bool persistent)
 {
 	//what is this?
 	mord[0] = 0;
@@ -92,13 +94,204 @@ bool iWQLSODAIntegrator::solve1Step(iWQModel * m, double tstart, double tend, do
 	sm1[10] = 0.075;
 	sm1[11] = 0.05 ;
 	sm1[12] = 0.025;
-
+	
 	illin=0;
 	init=0;
 	ntrep=0;
 	ixpr=0;
 	mesflg=0;		//suppress all messages
+	nfe=0;
+	hnatural=0.0;
+	
+	model=NULL;
+	yh=NULL;
+	wm=NULL;
+	ewt=NULL;
+	savf=NULL;
+	acor=NULL;
+	ipvt=NULL;
+	m_lenyh=0;
+	m_nyh=0;
+	
+	mPersistent=persistent;
+	mNeq=-1;
+	mLastT=0.0;
+	mLastEps=0.0;
+	mY=NULL;
+	mAtol=NULL;
+	mRtol=NULL;
+	mReference=NULL;
+	mReferenceSampling=0;
+	mRestartCost=mColdCost=0.0;
+	mRestartSamples=mColdSamples=0;
+	mJumps=0;
 	
+	mSparseJacobian=false;
+	mPatternSize=0;
+	mPatternAge=0;
+	mLowerBand=0;
+	mUpperBand=0;
+	mBanded=false;
+	mBandFactored=false;
+}
+
+//--------------------------------------------------------------------------------------------
+
+iWQLSODAIntegrator::~iWQLSODAIntegrator()
+{
+	releaseVectors();
+	delete [] mY;
+	delete [] mAtol;
+	delete [] mRtol;
+	if(mReference){
+		delete mReference;
+	}
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::setPersistent(bool persistent)
+{
+	mPersistent=persistent;
+	init=0;
+	setReferenceSampling(mReferenceSampling);
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::setReferenceSampling(int interval)
+{
+	mReferenceSampling=(interval>0)?interval:0;
+	if(mPersistent && mReferenceSampling && !mReference){
+		mReference=new iWQLSODAIntegrator(false);
+		mReference->setSparseJacobian(mSparseJacobian);
+	}
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::setSparseJacobian(bool sparse)
+{
+	mSparseJacobian=sparse;
+	mPatternSize=0;
+	if(mReference){
+		mReference->setSparseJacobian(sparse);
+	}
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::invalidate()
+{
+	init=0;
+}
+
+//--------------------------------------------------------------------------------------------
+
+bool iWQLSODAIntegrator::canContinue(double tstart, double eps)
+{
+	//the history is only usable if the previous step ended exactly here 
+	if(!mPersistent || !init || !yh || mNeq!=model->mVarLocations.size() || mLastT!=tstart || mLastEps!=eps){
+		return false;
+	}
+	//and nobody has touched the state since then
+	for(int k=0; k<mNeq; k++){
+		if(!model->mShouldTakeDelta[k] && *(model->mVarLocations[k])!=mY[k+1]){
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------
+
+bool iWQLSODAIntegrator::inputsChanged()
+{
+	bool changed=(mInputs.size()!=model->mInputLocations.size());
+	mInputs.resize(model->mInputLocations.size());
+	for(int k=0; k<mInputs.size(); k++){
+		if(mInputs[k]!=*(model->mInputLocations[k])){
+			mInputs[k]=*(model->mInputLocations[k]);
+			changed=true;
+		}
+	}
+	return changed;
+}
+
+//--------------------------------------------------------------------------------------------
+
+bool iWQLSODAIntegrator::restartPays()
+{
+	//the inputs jumped: continue at order 1 or start cold, whichever was cheaper so far
+	mJumps++;
+	if(!mRestartSamples || !mColdSamples){
+		return !mRestartSamples;
+	}
+	bool cheaper=(mRestartCost<=mColdCost);
+	if(mJumps%IWQ_RESTART_PROBE==0){
+		return !cheaper;
+	}
+	return cheaper;
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::noteCost(double * average, long * samples, long evaluations)
+{
+	//moving average, the cost follows the dynamics of the season
+	if(*samples){
+		*average+=((double)evaluations-*average)/8.0;
+	}
+	else{
+		*average=(double)evaluations;
+	}
+	(*samples)++;
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::restartHistory()
+{
+	//the inputs jumped at the row boundary: the derivatives in the Nordsieck 
+	//history are not valid anymore, restart at order 1 with the new slope, but 
+	//keep the step size, the method and the workspace
+	if ( hnatural > h ){
+		h = hnatural;	//undo the last cut at tcrit
+	}
+	hold = h;
+	f( n, tn, yh[1], savf );
+	nfe++;
+	nq = 1;
+	l = 2;
+	ialth = l;
+	resetcoeff();
+	for (int i = 1 ; i <= n ; i++ ){
+		yh[2][i] = h * savf[i];
+	}
+}
+
+//--------------------------------------------------------------------------------------------
+
+void iWQLSODAIntegrator::measureOneShotStep(double tstart, double tend, double eps, bool count)
+{
+	//repeat the step the old way for the statistics, then put the state back 
+	for(int k=0; k<mNeq; k++){
+		mStateBackup[k]=*(model->mVarLocations[k]);
+	}
+	mReference->solve1Step(model, tstart, tend, eps);
+	if(count){
+		mStatistics.referenceSteps++;
+		mStatistics.referenceEvaluations+=mReference->nfe;
+	}
+	for(int k=0; k<mNeq; k++){
+		*(model->mVarLocations[k])=mStateBackup[k];
+	}
+}
+
+//--------------------------------------------------------------------------------------------
+
+bool iWQLSODAIntegrator::solve1Step(iWQModel * m, double tstart, double tend, double eps)
+{
 	model=m;
 	
 	//printf("LSODA: from %lf to %lf, tol=%e\n",tstart, tend, eps);
@@ -107,24 +300,59 @@ bool iWQLSODAIntegrator::solve1Step(iWQModel * m, double tstart, double tend, do
 		return true;
 	}
 
-	int neq = model->mVarLocations.size();
+	int numvars = model->mVarLocations.size();
+	int neq = numvars*(1+model->mSensitivitySlots.size());	//states and their sensitivities
 	double rwork1, rwork5, rwork6, rwork7;
 	double t, tout;
 	int iwork1, iwork2, iwork5, iwork6, iwork7, iwork8, iwork9;
 	int itol, itask, istate, iopt, jt, iout, j, k, jdum;
-
+	
+	bool warm=canContinue(tstart, eps);
+	bool changed=false;
+	if(mPersistent){
+		changed=inputsChanged();
+		if(warm && changed && !restartPays()){
+			warm=false;
+		}
+	}
+	
 	//alloc dimension dependent storage
-	double * atol=new double [neq+1];
-	double * rtol=new double [neq+1];
-	double * y=new double [neq+1];
+	if(neq!=mNeq){
+		delete [] mAtol;
+		delete [] mRtol;
+		delete [] mY;
+		mAtol=new double [neq+1];
+		mRtol=new double [neq+1];
+		mY=new double [neq+1];
+		mStateBackup.resize(neq);
+		mNeq=neq;
+	}
+	
+	if(mPersistent && mReferenceSampling){
+		if(warm && (mStatistics.warmSteps%mReferenceSampling)==0){
+			measureOneShotStep(tstart, tend, eps, true);
+		}
+		else if(!warm && mReference->mNeq!=neq){
+			//allocate the workspace of the reference integrator in the first row
+			measureOneShotStep(tstart, tend, eps, false);
+		}
+	}
+	double * atol=mAtol;
+	double * rtol=mRtol;
+	double * y=mY;
 	
 	//initial state: set in the model before calling the solver on itself
 	//m->setInitialValues(yvon);
 	
 	//get values from the model into the plain storage
-	for(k=0; k<neq; k++){
+	for(k=0; k<numvars; k++){
 		y[k+1]=(!model->mShouldTakeDelta[k])?*(model->mVarLocations[k]):0.0;
 	}
+	int numsens=model->mSensitivitySlots.size();
+	for(k=numvars; k<neq; k++){
+		//boundary fluxes are integrated from zero, like their values
+		y[k+1]=(!model->mShouldTakeDelta[(k-numvars)/numsens])?model->mStateSensitivities[k-numvars]:0.0;
+	}
 	
 	double t0=tstart;
 	double tf=tend;
@@ -146,29 +374,80 @@ bool iWQLSODAIntegrator::solve1Step(iWQModel * m, double tstart, double tend, do
 			atol[k] = eps;
 		}
 	}
-		
+	
+	if(!warm){
+		illin=0;
+		init=0;
+		ntrep=0;
+		ixpr=0;
+	}
+	
+	int nfe_before=(warm)?nfe:0;
+	
+	if(mPersistent){
+		if(warm && changed){
+			restartHistory();
+		}
+		hnatural=0.0;
+	}
+	
 	itask = 1;
-	istate = 1;
+	istate = (warm)?2:1;
 	iopt = 0;
-	jt = 2;
+	jt = (model->hasJacobian() && neq==numvars)?1:2;	//analytic Jacobian if the model has one
+	
+	if(mPersistent){
+		//never step beyond the row boundary: the inputs change there
+		itask = 4;
+		rwork1 = tend;
+	}
 
 	// make that step
 	lsoda(neq,y,&t,tout,itol,rtol,atol,itask,&istate,iopt,jt, iwork1, iwork2, iwork5, iwork6, iwork7, iwork8, iwork9, rwork1,rwork5,rwork6,rwork7);
 	
 	//extract results from the y array into the model
-	for(k=0; k<neq; k++){
+	for(k=0; k<numvars; k++){
 		*(model->mVarLocations[k])=(model->mShouldTakeDelta[k])?y[k+1]/(tend-tstart):y[k+1];
 	}
+	for(k=numvars; k<neq; k++){
+		model->mStateSensitivities[k-numvars]=(model->mShouldTakeDelta[(k-numvars)/numsens])?y[k+1]/(tend-tstart):y[k+1];
+	}
 	
 	/*printf("LSODA: t=%lf, dt=%lf", t, dt);
 	for(k=0; k<neq; k++){
 		printf("\t%lf", y[k+1]);
 	}
 	printf("\n");*/
-
-	delete [] atol;
-	delete [] rtol;
-	delete [] y;
+	
+	if(mPersistent){
+		if(warm){
+			mStatistics.warmSteps++;
+			mStatistics.warmEvaluations+=nfe-nfe_before;
+			if(changed){
+				mStatistics.restartSteps++;
+				noteCost(&mRestartCost, &mRestartSamples, nfe-nfe_before);
+			}
+		}
+		else{
+			mStatistics.coldSteps++;
+			mStatistics.coldEvaluations+=nfe;
+			noteCost(&mColdCost, &mColdSamples, nfe);
+		}
+		if(istate>0){
+			//boundary fluxes are integrated from zero in each row
+			for(k=0; k<numvars; k++){
+				if(model->mShouldTakeDelta[k]){
+					yh[1][k+1]-=y[k+1];
+					y[k+1]=0.0;
+				}
+			}
+			mLastT=tend;
+			mLastEps=eps;
+		}
+		else{
+			init=0;
+		}
+	}
 	
 	if (istate <= 0){
 		//printf("[Error]: LSODA return state = %d\n",istate);
@@ -178,6 +457,30 @@ bool iWQLSODAIntegrator::solve1Step(iWQModel * m, double tstart, double tend, do
 	return true;
 }
 
+//--------------------------------------------------------------------------------------------
+
+void iWQIntegratorStatistics::add(const iWQIntegratorStatistics & other)
+{
+	coldSteps+=other.coldSteps;
+	coldEvaluations+=other.coldEvaluations;
+	warmSteps+=other.warmSteps;
+	warmEvaluations+=other.warmEvaluations;
+	restartSteps+=other.restartSteps;
+	referenceSteps+=other.referenceSteps;
+	referenceEvaluations+=other.referenceEvaluations;
+}
+
+//--------------------------------------------------------------------------------------------
+
+long iWQIntegratorStatistics::savedEvaluations() const
+{
+	if(referenceSteps==0){
+		return 0;
+	}
+	double oneshotaverage=(double)referenceEvaluations/(double)referenceSteps;
+	return (long)(oneshotaverage*warmSteps)-warmEvaluations;
+}
+
 //============================================================================================
 
 void iWQLSODAIntegrator::daxpy( int n, double da, double *dx, int incx, double *dy, int incy )
@@ -771,8 +1074,9 @@ void iWQLSODAIntegrator::successreturn( double *y, double *t, int itask, int ihi
 
 
 /*
-	In this version all memory allocated using malloc is freed upon exit.
-	Therefore *istate = 2 and *istate = 3 will not work.
+	In this version the memory allocated using malloc is kept by the 
+	integrator object between the calls, so *istate = 2 and *istate = 3 work
+	as long as the same object is used.
 */
 
 void iWQLSODAIntegrator::lsoda( int neq, double *y, double *t, double tout, int itol,
@@ -993,7 +1297,13 @@ double rwork5, double rwork6, double rwork7 )
 		meth = 1;
 		nyh = n;
 		lenyh = 1 + max( mxordn, mxords );
-
+	}
+	if ( *istate == 1 && ( yh == NULL || m_lenyh != lenyh || m_nyh != nyh ) ) {
+		/*
+	The workspace of a previous call is reused if the dimensions agree.
+*/
+		releaseVectors();
+		
 		m_lenyh=lenyh;
 		m_nyh=nyh;
 
@@ -1008,7 +1318,7 @@ double rwork5, double rwork6, double rwork7 )
 
 		wm = ( double ** ) malloc( ( 1 + nyh ) * sizeof( *wm ) );
 		if ( wm == NULL ) {
-			free( yh );
+			releaseVectors();
 			printf( "lsoda -- insufficient memory for your problem (wm, nyh=%d)\n", nyh );
 			terminate( istate );
 			return;
@@ -1018,8 +1328,7 @@ double rwork5, double rwork6, double rwork7 )
 
 		ewt = ( double * ) malloc( ( 1 + nyh ) * sizeof( double ) );
 		if ( ewt == NULL ) {
-			free( yh );
-			free( wm );
+			releaseVectors();
 			printf( "lsoda -- insufficient memory for your problem (ewt, nyh=%d)\n", nyh );
 			terminate( istate );
 			return;
@@ -1027,9 +1336,7 @@ double rwork5, double rwork6, double rwork7 )
 
 		savf = ( double * ) malloc( ( 1 + nyh ) * sizeof( double ) );
 		if ( savf == NULL ) {
-			free( yh );
-			free( wm );
-			free( ewt );
+			releaseVectors();
 			printf( "lsoda -- insufficient memory for your problem (savf, nyh=%d)\n", nyh );
 			terminate( istate );
 			return;
@@ -1037,10 +1344,7 @@ double rwork5, double rwork6, double rwork7 )
 
 		acor = ( double * ) malloc( ( 1 + nyh ) * sizeof( double ) );
 		if ( acor == NULL ) {
-			free( yh );
-			free( wm );
-			free( ewt );
-			free( savf );
+			releaseVectors();
 			printf( "lsoda -- insufficient memory for your problem (acor, nyh=%d)\n", nyh );
 			terminate( istate );
 			return;
@@ -1048,11 +1352,7 @@ double rwork5, double rwork6, double rwork7 )
 
 		ipvt = ( int * ) malloc( ( 1 + nyh ) * sizeof( int ) );
 		if ( ipvt == NULL ) {
-			free( yh );
-			free( wm );
-			free( ewt );
-			free( savf );
-			free( acor );
+			releaseVectors();
 			printf( "lsoda -- insufficient memory for your problem (ipvt, nyh=%d)\n", nyh );
 			terminate( istate );
 			return;
@@ -1303,6 +1603,7 @@ double rwork5, double rwork6, double rwork7 )
 			tnext = tn + h * ( 1. + 4. * ETA );
 			if ( ( tnext - tcrit ) * h <= 0. )
 			break;
+			hnatural = h;
 			h = ( tcrit - tn ) * ( 1. - 4. * ETA );
 			if ( *istate == 2 )
 			jstart = -2;
@@ -1472,7 +1773,8 @@ double rwork5, double rwork6, double rwork7 )
 					tnext = tn + h * ( 1. + 4. * ETA );
 					if ( ( tnext - tcrit ) * h <= 0. )
 					continue;
-					h = ( tcrit - tn ) * ( 1. - 4. * ETA );
+					hnatural = h;
+			h = ( tcrit - tn ) * ( 1. - 4. * ETA );
 					jstart = -2;
 					continue;
 				}
@@ -2140,42 +2442,63 @@ void iWQLSODAIntegrator::prja( int neq, double *y )
 	/*
 	prja is called by stoda to compute and process the matrix
 	P = I - h * el[1] * J, where J is an approximation to the Jacobian.
-	Here J is computed by finite differencing.
+	Here J is computed by finite differencing, or by the model if miter = 1.
 	J, scaled by -h * el[1], is stored in wm.  Then the norm of J ( the
 	matrix norm consistent with the weighted max-norm on vectors given
 	by vmnorm ) is computed, and J is overwritten by P.  P is then
 	subjected to LU decomposition in preparation for later solution
 	of linear systems with p as coefficient matrix.  This is done
-	by dgefa if miter = 2, and by dgbfa if miter = 5.
+	by dgefa if miter = 1 or 2, and by dgbfa if miter = 5.
 */
 	nje++;
 	ierpj = 0;
 	jcur = 1;
 	hl0 = h * el0;
+	mBandFactored = false;
 	/*
+	If miter = 1, get J from the model at y.
 	If miter = 2, make n calls to f to approximate J.
 */
-	if ( miter != 2 ) {
-		printf( "prja -- miter != 2\n" );
+	if ( miter != 1 && miter != 2 ) {
+		printf( "prja -- miter != 1 and miter != 2\n" );
 		return;
 	}
 
-	if ( miter == 2 ) {
-		fac = vmnorm( n, savf, ewt );
-		r0 = 1000. * fabs( h ) * ETA * ( ( double ) n ) * fac;
-		if ( r0 == 0. )
-		r0 = 1.;
-		for ( j = 1 ; j <= n ; j++ ) {
-			yj = y[j];
-			r = max( sqrteta * fabs( yj ), r0 / ewt[j] );
-			y[j] += r;
-			fac = -hl0 / r;
-			f( neq, tn, y, acor );
+	if ( miter == 1 || miter == 2 ) {
+		if ( miter == 1 ) {
+			mJacobian.resize( n * n );
+			model->readVariables( y + 1, n );
+			model->jacobianFunction( tn, &mJacobian[0] );
 			for ( i = 1 ; i <= n ; i++ )
-			wm[i][j] = ( acor[i] - savf[i] ) * fac;
-			y[j] = yj;
+			for ( j = 1 ; j <= n ; j++ )
+			wm[i][j] = -hl0 * mJacobian[( i - 1 ) * n + j - 1];
+		}
+		else if ( mSparseJacobian ) {
+			sparseJacobian( neq, y, hl0 );
+			if ( mBanded ) {
+				mBandFactored = true;
+				if ( !bandFactor() )
+				ierpj = 1;
+				return;
+			}
+		}
+		else {
+			fac = vmnorm( n, savf, ewt );
+			r0 = 1000. * fabs( h ) * ETA * ( ( double ) n ) * fac;
+			if ( r0 == 0. )
+			r0 = 1.;
+			for ( j = 1 ; j <= n ; j++ ) {
+				yj = y[j];
+				r = max( sqrteta * fabs( yj ), r0 / ewt[j] );
+				y[j] += r;
+				fac = -hl0 / r;
+				f( neq, tn, y, acor );
+				for ( i = 1 ; i <= n ; i++ )
+				wm[i][j] = ( acor[i] - savf[i] ) * fac;
+				y[j] = yj;
+			}
+			nfe += n;
 		}
-		nfe += n;
 		/*
 	Compute norm of Jacobian.
 */
@@ -2428,7 +2751,7 @@ void iWQLSODAIntegrator::solsy( double *y )
 /*
 	This routine manages the solution of the linear system arising from
 	a chord iteration.  It is called if miter != 0.
-	If miter is 2, it calls dgesl to accomplish this.
+	If miter is 1 or 2, it calls dgesl to accomplish this.
 	If miter is 5, it calls dgbsl.
 
 	y = the right-hand side vector on input, and the solution vector
@@ -2436,18 +2759,247 @@ void iWQLSODAIntegrator::solsy( double *y )
 */
 {
 	iersl = 0;
-	if ( miter != 2 ) {
-		printf( "solsy -- miter != 2\n" );
+	if ( miter != 1 && miter != 2 ) {
+		printf( "solsy -- miter != 1 and miter != 2\n" );
 		return;
 	}
 
-	if ( miter == 2 )
+	if ( mBandFactored )
+	bandSolve( y );
+	else if ( miter == 1 || miter == 2 )
 	dgesl( wm, n, ipvt, y, 0 );
 	return;
 
 }          /*   end solsy   */
 
 
+void iWQLSODAIntegrator::probeSparsity( int neq, double *y )
+/*
+	Finds the structure of J by perturbing one variable at a time, merged with
+	the structure found before (a term can vanish at a single point). The diagonal
+	is always kept. The columns are then coloured greedily: columns of the same
+	colour have no common row, so one call to f gives all of them.
+*/
+{
+	int i, j, c, k;
+	double fac, r, r0, yj;
+	
+	if ( mPatternSize != n ) {
+		mPatternRows.assign( n + 1, std::vector<int>() );
+	}
+	fac = vmnorm( n, savf, ewt );
+	r0 = 1000. * fabs( h ) * ETA * ( ( double ) n ) * fac;
+	if ( r0 == 0. )
+	r0 = 1.;
+	std::vector<int> rows;
+	std::vector<int> merged;
+	for ( j = 1 ; j <= n ; j++ ) {
+		yj = y[j];
+		r = max( sqrteta * fabs( yj ), r0 / ewt[j] );
+		y[j] += r;
+		f( neq, tn, y, acor );
+		y[j] = yj;
+		rows.clear();
+		for ( i = 1 ; i <= n ; i++ )
+		if ( i == j || acor[i] != savf[i] )
+		rows.push_back( i );
+		merged.clear();
+		std::set_union( rows.begin(), rows.end(), mPatternRows[j].begin(), mPatternRows[j].end(), std::back_inserter( merged ) );
+		mPatternRows[j].swap( merged );
+	}
+	nfe += n;
+	mPatternSize = n;
+	mPatternAge = 0;
+	
+	//greedy colouring, taken[c][i] marks the rows used by colour c
+	mColourColumns.clear();
+	std::vector<std::vector<char> > taken;
+	mLowerBand = 0;
+	mUpperBand = 0;
+	for ( j = 1 ; j <= n ; j++ ) {
+		const std::vector<int> & col = mPatternRows[j];
+		for ( k = 0 ; k < col.size() ; k++ ) {
+			mLowerBand = max( mLowerBand, col[k] - j );
+			mUpperBand = max( mUpperBand, j - col[k] );
+		}
+		for ( c = 0 ; c < mColourColumns.size() ; c++ ) {
+			for ( k = 0 ; k < col.size() && !taken[c][col[k]] ; k++ );
+			if ( k == col.size() )
+			break;
+		}
+		if ( c == mColourColumns.size() ) {
+			mColourColumns.push_back( std::vector<int>() );
+			taken.push_back( std::vector<char> ( n + 1, 0 ) );
+		}
+		mColourColumns[c].push_back( j );
+		for ( k = 0 ; k < col.size() ; k++ )
+		taken[c][col[k]] = 1;
+	}
+	
+	//the band pays off when its width is well below n
+	mBanded = ( 4 * ( 2 * mLowerBand + mUpperBand + 1 ) <= n );
+
+}          /*   end probeSparsity   */
+
+
+void iWQLSODAIntegrator::sparseJacobian( int neq, double *y, double hl0 )
+/*
+	Computes J with one call to f per colour, scaled by -hl0 like the dense
+	version. The result goes to wm, or to the band storage if mBanded. For
+	the band storage the norm of J is computed and the identity added here.
+*/
+{
+	int i, j, c, k, width;
+	double fac, r0, an, sum;
+	
+	if ( mPatternSize != n || mPatternAge >= IWQ_SPARSITY_REFRESH )
+	probeSparsity( neq, y );
+	mPatternAge++;
+	
+	width = 2 * mLowerBand + mUpperBand + 1;
+	if ( mBanded )
+	mBand.assign( n * width, 0. );
+	else {
+		//clear the structure (and the fill-in of the last LU)
+		for ( i = 1 ; i <= n ; i++ )
+		for ( j = 1 ; j <= n ; j++ )
+		wm[i][j] = 0.;
+	}
+	
+	fac = vmnorm( n, savf, ewt );
+	r0 = 1000. * fabs( h ) * ETA * ( ( double ) n ) * fac;
+	if ( r0 == 0. )
+	r0 = 1.;
+	std::vector<double> steps ( n + 1 );
+	std::vector<double> saved ( n + 1 );
+	for ( c = 0 ; c < mColourColumns.size() ; c++ ) {
+		const std::vector<int> & cols = mColourColumns[c];
+		for ( k = 0 ; k < cols.size() ; k++ ) {
+			j = cols[k];
+			saved[j] = y[j];
+			steps[j] = max( sqrteta * fabs( y[j] ), r0 / ewt[j] );
+			y[j] += steps[j];
+		}
+		f( neq, tn, y, acor );
+		for ( k = 0 ; k < cols.size() ; k++ ) {
+			j = cols[k];
+			y[j] = saved[j];
+			fac = -hl0 / steps[j];
+			const std::vector<int> & rows = mPatternRows[j];
+			for ( int ii = 0 ; ii < rows.size() ; ii++ ) {
+				i = rows[ii];
+				if ( mBanded )
+				mBand[( i - 1 ) * width + j - i + mLowerBand] = ( acor[i] - savf[i] ) * fac;
+				else
+				wm[i][j] = ( acor[i] - savf[i] ) * fac;
+			}
+		}
+	}
+	nfe += mColourColumns.size();
+	
+	if ( mBanded ) {
+		//norm of J as in fnorm, then P = I - hl0 * J
+		an = 0.;
+		for ( i = 1 ; i <= n ; i++ ) {
+			sum = 0.;
+			for ( j = max( 1, i - mLowerBand ) ; j <= min( n, i + mUpperBand ) ; j++ )
+			sum += fabs( mBand[( i - 1 ) * width + j - i + mLowerBand] ) / ewt[j];
+			an = max( an, sum * ewt[i] );
+		}
+		pdnorm = an / fabs( hl0 );
+		for ( i = 1 ; i <= n ; i++ )
+		mBand[( i - 1 ) * width + mLowerBand] += 1.;
+	}
+
+}          /*   end sparseJacobian   */
+
+
+bool iWQLSODAIntegrator::bandFactor()
+/*
+	LU decomposition with partial pivoting in the band storage. Row
+	interchanges widen the upper band to mUpperBand + mLowerBand. The
+	multipliers stay in place, the interchanges in mBandPivots.
+	Returns false for a singular matrix.
+*/
+{
+	int i, j, k, p, last, width, rk, rp, ri;
+	double t, piv;
+	bool regular = true;
+	
+	width = 2 * mLowerBand + mUpperBand + 1;
+	mBandPivots.resize( n + 1 );
+	for ( k = 1 ; k <= n ; k++ ) {
+		//entry ( i, j ) is at ri + j with ri = ( i - 1 ) * width + mLowerBand - i
+		rk = ( k - 1 ) * width + mLowerBand - k;
+		p = k;
+		piv = fabs( mBand[rk + k] );
+		for ( i = k + 1 ; i <= min( n, k + mLowerBand ) ; i++ ) {
+			t = fabs( mBand[( i - 1 ) * width + mLowerBand - i + k] );
+			if ( t > piv ) {
+				piv = t;
+				p = i;
+			}
+		}
+		mBandPivots[k] = p;
+		if ( piv == 0. ) {
+			regular = false;
+			continue;
+		}
+		last = min( n, k + mUpperBand + mLowerBand );
+		if ( p != k ) {
+			rp = ( p - 1 ) * width + mLowerBand - p;
+			for ( j = k ; j <= last ; j++ ) {
+				t = mBand[rk + j];
+				mBand[rk + j] = mBand[rp + j];
+				mBand[rp + j] = t;
+			}
+		}
+		for ( i = k + 1 ; i <= min( n, k + mLowerBand ) ; i++ ) {
+			ri = ( i - 1 ) * width + mLowerBand - i;
+			t = mBand[ri + k] / mBand[rk + k];
+			mBand[ri + k] = t;
+			if ( t != 0. )
+			for ( j = k + 1 ; j <= last ; j++ )
+			mBand[ri + j] -= t * mBand[rk + j];
+		}
+	}
+	return regular;
+
+}          /*   end bandFactor   */
+
+
+void iWQLSODAIntegrator::bandSolve( double *b )
+/*
+	Solves P x = b with the factors of bandFactor(), b is 1-indexed and
+	overwritten by x.
+*/
+{
+	int i, j, k, p, last, width, rk;
+	double t;
+	
+	width = 2 * mLowerBand + mUpperBand + 1;
+	for ( k = 1 ; k <= n ; k++ ) {
+		p = mBandPivots[k];
+		if ( p != k ) {
+			t = b[k];
+			b[k] = b[p];
+			b[p] = t;
+		}
+		for ( i = k + 1 ; i <= min( n, k + mLowerBand ) ; i++ )
+		b[i] -= mBand[( i - 1 ) * width + mLowerBand - i + k] * b[k];
+	}
+	for ( k = n ; k >= 1 ; k-- ) {
+		rk = ( k - 1 ) * width + mLowerBand - k;
+		last = min( n, k + mUpperBand + mLowerBand );
+		t = b[k];
+		for ( j = k + 1 ; j <= last ; j++ )
+		t -= mBand[rk + j] * b[j];
+		b[k] = t / mBand[rk + k];
+	}
+
+}          /*   end bandSolve   */
+
+
 void iWQLSODAIntegrator::methodswitch( double dsm, double pnorm, double *pdh, double *rh )
 {
 	int lm1, lm1p1, lm2, lm2p1, nqm1, nqm2;
@@ -2716,6 +3268,12 @@ void iWQLSODAIntegrator::resetcoeff()
 }     /*   end resetcoeff   */
 
 void iWQLSODAIntegrator::freevectors()
+{
+	//the workspace is kept for the next call of the same integrator, it is 
+	//released by the destructor or when the problem size changes
+}     /*   end freevectors   */
+
+void iWQLSODAIntegrator::releaseVectors()
 {
 	int i;
 	if(yh){
@@ -2739,5 +3297,12 @@ void iWQLSODAIntegrator::freevectors()
 	if(savf) free( savf );
 	if(acor) free( acor );
 	if(ipvt) free( ipvt );
-}     /*   end freevectors   */
+	
+	yh=NULL;
+	wm=NULL;
+	ewt=NULL;
+	savf=NULL;
+	acor=NULL;
+	ipvt=NULL;
+}     /*   end releaseVectors   */
 
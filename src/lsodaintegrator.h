@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 
 #include <stdio.h>
 #include <math.h>
+#include <vector>
 
 /*
 
@@ -34,22 +35,124 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 	for its separate existence as a class is that its numerous static variables 
 	can be separated from real iWQModel contents. 
 	
-	A possible development would be to implement it as a singleton class serving
-	multiple models for multiple timesteps. Now each integrator is "one-shot" so
-	it is created to make a single timestep and deleted afterwards.
+	Each model keeps its integrator and the LSODA workspace between the 
+	timesteps, so the steady state is free of heap allocations. By default 
+	every timestep is a cold start (istate=1). In persistent mode the Nordsieck
+	history, the step size, the method and the order survive the row 
+	boundaries too, and the next row is continued with istate=2. Boundary flux
+	(delta) components are shifted back to zero after each row, which keeps
+	the history valid. Any external change of the state restarts cold.
+	
+	When the inputs jump at the row boundary, the higher derivatives in the 
+	history are lost and the row is re-entered at order 1 with the old step 
+	size. With daily inputs that jump in every row this costs more than a cold 
+	start, which estimates a fresh step size. The integrator keeps the average 
+	cost of both paths after a jump, follows the cheaper one and tries the 
+	other one now and then to keep its average up to date.
 	
 */
 class iWQModel;
 
+// Every n-th input jump takes the more expensive path to measure it again
+#define IWQ_RESTART_PROBE 32
+
+// The structure of a sparse Jacobian is probed again after this many Jacobians
+#define IWQ_SPARSITY_REFRESH 100
+
+// Work counters of a persistent integrator
+class iWQIntegratorStatistics
+{
+public:
+	long coldSteps;				//rows started with istate=1
+	long coldEvaluations;		//RHS evaluations spent on these rows
+	long warmSteps;				//rows continued with istate=2
+	long warmEvaluations;		//RHS evaluations spent on these rows
+	long restartSteps;			//warm rows re-entered at order 1 after an input jump
+	long referenceSteps;		//sampled warm rows repeated with a one-shot integrator
+	long referenceEvaluations;	//RHS evaluations of the one-shot integrator on these rows
+	
+	iWQIntegratorStatistics(){ reset(); }
+	void reset(){ coldSteps=coldEvaluations=warmSteps=warmEvaluations=restartSteps=referenceSteps=referenceEvaluations=0; }
+	void add(const iWQIntegratorStatistics & other);
+	long savedEvaluations() const;	//extrapolated from the sampled rows, negative if warm restart costs more
+};
+
 class iWQLSODAIntegrator
 {
 	public:
+		iWQLSODAIntegrator(bool persistent=false);
+		~iWQLSODAIntegrator();
+		
 		//an interface to LSODA for iWQModels
 		bool solve1Step(iWQModel * m, double tstart, double tend, double eps);
+		
+		//persistent mode
+		void setPersistent(bool persistent);
+		bool isPersistent() const { return mPersistent; }
+		void invalidate();	//force a cold start in the next step
+		iWQIntegratorStatistics statistics() const { return mStatistics; }
+		void resetStatistics(){ mStatistics.reset(); }
+		
+		//diagnostics: every n-th warm row is repeated with a one-shot integrator to
+		//measure the savings, 0 (default) switches the reference integrator off
+		void setReferenceSampling(int interval);
+		int referenceSampling() const { return mReferenceSampling; }
+		
+		//sparse finite-difference Jacobian: structure probed in the first Jacobian, columns
+		//without common rows perturbed together, banded LU when the structure allows it
+		void setSparseJacobian(bool sparse);
+		bool hasSparseJacobian() const { return mSparseJacobian; }
+		
 	private:
 		// Associated iWQModel instance
 		iWQModel * model;
 		
+		// Persistent state
+		bool mPersistent;
+		int mNeq;
+		double mLastT;
+		double mLastEps;
+		double * mY;
+		double * mAtol;
+		double * mRtol;
+		std::vector<double> mInputs;	//input values of the previous step
+		iWQIntegratorStatistics mStatistics;
+		iWQLSODAIntegrator * mReference;	//one-shot integrator for the statistics
+		int mReferenceSampling;
+		double mRestartCost;	//average RHS evaluations of a warm row after an input jump
+		double mColdCost;		//average RHS evaluations of a cold row
+		long mRestartSamples;
+		long mColdSamples;
+		long mJumps;
+		std::vector<double> mStateBackup;
+		std::vector<double> mJacobian;		//analytic Jacobian of the model (miter = 1), row major
+		
+		// Sparse Jacobian
+		bool mSparseJacobian;
+		int mPatternSize;								//n of the probed structure, 0 if none
+		int mPatternAge;								//Jacobians since the last probe
+		std::vector<std::vector<int> > mPatternRows;	//nonzero rows of each column (1-indexed, sorted)
+		std::vector<std::vector<int> > mColourColumns;	//groups of columns without common rows
+		int mLowerBand;
+		int mUpperBand;
+		bool mBanded;				//LU in the band storage
+		bool mBandFactored;			//the last prja factored the band storage, used by solsy
+		std::vector<double> mBand;	//row i, column j at (i-1)*width+j-i+mLowerBand, width=2*mLowerBand+mUpperBand+1
+		std::vector<int> mBandPivots;
+		
+		void probeSparsity( int neq, double *y );
+		void sparseJacobian( int neq, double *y, double hl0 );
+		bool bandFactor();
+		void bandSolve( double *b );
+		
+		bool canContinue(double tstart, double eps);
+		bool inputsChanged();
+		bool restartPays();
+		void noteCost(double * average, long * samples, long evaluations);
+		void restartHistory();
+		void measureOneShotStep(double tstart, double tend, double eps, bool count);
+		void releaseVectors();
+		
 		// LSODA integrator
 		void f( int neq, double t, double *y, double *ydot );
 		void daxpy( int n, double da, double *dx, int incx, double *dy, int incy );
@@ -89,6 +192,7 @@ class iWQLSODAIntegrator
 		double ccmax, el0, h, hmin, hmxi, hu, rc, tn;
 		int illin, init, mxstep, mxhnil, nhnil, ntrep, nslast, nyh, ierpj, iersl, jcur, jstart, kflag, l, meth, miter, maxord, maxcor, msbp, mxncf, n, nq, nst, nfe, nje, nqu;
 		double tsw, pdnorm;
+		double hnatural;	//step size before the last cut at tcrit
 		int ixpr, jtyp, mused, mxordn, mxords;
 
 		/* no static variable for prja(), solsy() */
@@ -21,6 +21,10 @@
 #include "setup.h"
 #include "server.h"
 #include "sampleutils.h"
+#include "biasmatrices.h"
+#include "mathutils.h"
+#include <math.h>
+#include <chrono>
 
 //############################################################################################################
 
@@ -48,6 +52,7 @@ void printHelp(std::string topics)
 	act_cmd="RUN";
 	if(topics.size()==0 || act_cmd.find(topics)!=std::string::npos){
 		printf("RUN - Run the model.\n");	
+		printf("      With <data stream=\"true\"> the results are written window by window.\n");
 		printf("            Parameters:\n");
 		printf("           (1) [parfile] initial parameter file\n");
 		printf("               (optional, default=layout parameters)\n");
@@ -97,6 +102,7 @@ void printHelp(std::string topics)
 		printf("            Parameters:\n");
 		printf("            1  [target] name of the target variable\n");
 		printf("           (2) [factor] perturbation factor (optional, default=0.1)\n");
+		printf("                        or FORWARD for the forward sensitivity equations in one run\n");
 		printf("            3  [output_filename] output filename for results\n");
 		printf("\n");
 		found=true;
@@ -162,6 +168,39 @@ void printHelp(std::string topics)
 		found=true;
 	}
 	
+	//DREAM
+	act_cmd="DREAM";
+	if(topics.size()==0 || act_cmd.find(topics)!=std::string::npos){
+		printf("DREAM - Run multi-chain Markov chain Monte Carlo sampling (DREAM(ZS)).\n");	
+		printf("            Stops when the chains converged (Gelman-Rubin R-hat < 1.2).\n");
+		printf("            Parameters:\n");
+		printf("            1  [output_filename] output file for sample\n");
+		printf("            2  [totallength] maximal number of rounds\n");
+		printf("            3  [burninlength] number of rounds for burn-in\n");
+		printf("           (4) [numchains] number of chains, at least 3 (optional)\n");
+		printf("           (5) [numthreads] chains evaluated in parallel (optional)\n");
+		printf("           (6) [seed] random seed, 0 is the clock (optional)\n");
+		printf("\n");
+		found=true;
+	}
+	
+	//MCMC_TEMPERING
+	act_cmd="MCMC_TEMPERING";
+	if(topics.size()==0 || act_cmd.find(topics)!=std::string::npos){
+		printf("MCMC_TEMPERING - Run parallel tempering Markov chain Monte Carlo sampling.\n");	
+		printf("            Only the chain at temperature 1 is written to the sample.\n");
+		printf("            Parameters:\n");
+		printf("            1  [output_filename] output file for sample\n");
+		printf("            2  [totallength] total number of rounds\n");
+		printf("            3  [burninlength] number of rounds for burn-in\n");
+		printf("           (4) [numtemperatures] number of chains (optional)\n");
+		printf("           (5) [maxtemperature] temperature of the hottest chain (optional)\n");
+		printf("           (6) [numthreads] chains evaluated in parallel, at most one per temperature (optional)\n");
+		printf("           (7) [seed] random seed, 0 is the clock (optional)\n");
+		printf("\n");
+		found=true;
+	}
+	
 	//SAMPLE_HIST
 	act_cmd="SAMPLE_HIST";
 	if(topics.size()==0 || act_cmd.find(topics)!=std::string::npos){
@@ -252,6 +291,30 @@ void printHelp(std::string topics)
 		found=true;
 	}
 	
+	//BENCH_BIAS
+	act_cmd="BENCH_BIAS";
+	if(topics.size()==0 || act_cmd.find(topics)!=std::string::npos){
+		printf("BENCH_BIAS - Compare the kernel and Kalman filter likelihoods of the bias model\n");
+		printf("             on a synthetic residual series (no layout needed).\n");
+		printf("            Parameters:\n");
+		printf("           (1) [length] number of residuals (optional, default=2000)\n");
+		printf("\n");
+		found=true;
+	}
+	
+	//CONVERT_DATA
+	act_cmd="CONVERT_DATA";
+	if(topics.size()==0 || act_cmd.find(topics)!=std::string::npos){
+		printf("CONVERT_DATA - Convert a data table between text and the binary columnar format\n");
+		printf("               (no layout needed). The input format is detected, output file names\n");
+		printf("               ending with %s are written in binary, others as text.\n",IWQ_BINARY_TABLE_EXTENSION);
+		printf("            Parameters:\n");
+		printf("           (1) [input] data file\n");
+		printf("           (2) [output] data file\n");
+		printf("\n");
+		found=true;
+	}
+	
 	if(!found && topics.size()){
 		printf("No command found with \"%s\".\n",topics.c_str());
 	}
@@ -260,6 +323,96 @@ void printHelp(std::string topics)
 
 //-----------------------------------------------------------------------------------------------------
 
+void benchmarkBiasLikelihood(int length)
+{
+	//synthetic residuals of the bias model driven by an intermittent input
+	double sigma_b2=1.0;
+	double beta=0.05;
+	double kappa=0.5;
+	double pi=0.0;
+	double sigma_e2=0.1;
+	double kappa_e=0.2;
+	
+	srand(1);
+	std::vector<double> inputs (length);
+	std::vector<double> residuals (length);
+	double bias=invnormdist(0.0, sqrt(sigma_b2));
+	for(int t=0; t<length; t++){
+		inputs[t]=(urand()<0.1)?10.0*urand():0.0;
+		bias=makeOUStep(bias, jumpVarianceOfB(sigma_b2, beta, kappa, pi, inputs[t]), beta);
+		residuals[t]=bias+makeNoiseStep(sigma_e2, inputs[t], kappa_e);
+	}
+	
+	printf("Bias likelihood benchmark: n=%d, sigma_b2=%g, beta=%g, kappa=%g, sigma_e2=%g, kappa_e=%g\n", length, sigma_b2, beta, kappa, sigma_e2, kappa_e);
+	printf("%-20s %20s %14s %14s\n", "solver", "log likelihood", "abs. error", "time [ms]");
+	
+	//exact reference
+	int rounds=0;
+	double exact=0.0;
+	std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+	double elapsed=0.0;
+	while(elapsed<200.0){
+		exact=kalmanBiasLogLikelihood(residuals, inputs, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e);
+		rounds++;
+		elapsed=std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+	}
+	printf("%-20s %20.8f %14s %14.4f\n", "Kalman (exact)", exact, "-", elapsed/rounds);
+	
+	//dense full-scale solution as a check of the filter (the determinant leaves the double range for long series)
+	if(length<=200){
+		start=std::chrono::steady_clock::now();
+		double dense=kernelBiasLogLikelihood(residuals, inputs, length, sigma_b2, beta, kappa, pi, sigma_e2, kappa_e);
+		elapsed=std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+		printf("%-20s %20.8f %14.3e %14.4f\n", "dense (exact)", dense, fabs(dense-exact), elapsed);
+	}
+	
+	//kernel approximations
+	int kernelsizes[]={4, 10, 20};
+	for(int k=0; k<3; k++){
+		start=std::chrono::steady_clock::now();
+		double approx=kernelBiasLogLikelihood(residuals, inputs, kernelsizes[k], sigma_b2, beta, kappa, pi, sigma_e2, kappa_e);
+		elapsed=std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+		char name[64];
+		sprintf(name, "kernel (md=%d)", kernelsizes[k]);
+		printf("%-20s %20.8f %14.3e %14.4f\n", name, approx, fabs(approx-exact), elapsed);
+	}
+}
+
+//-----------------------------------------------------------------------------------------------------
+
+//rounds and burn-in of the multi-chain samplers, then their optional thread count and seed from the
+//given token on: returns the answer for the first invalid value, or an empty string
+std::string parseChainArguments(std::vector<std::string> & tokens, int * numrounds, int * burnin, int threadtoken, int * numthreads, unsigned int * seed)
+{
+	char * endptr;
+	*numrounds=strtol(tokens[2].c_str(), &endptr, 10);
+	if(*endptr || *numrounds<=0){
+		return "@Iteration count is not a valid number.\n";
+	}
+	
+	*burnin=strtol(tokens[3].c_str(), &endptr, 10);
+	if(*endptr || *burnin<0){
+		return "@Burn-in length is not a valid number.\n";
+	}
+	
+	if(tokens.size()>threadtoken){
+		*numthreads=strtol(tokens[threadtoken].c_str(), &endptr, 10);
+		if(*endptr || *numthreads<1){
+			return "@Thread count is not a valid number.\n";
+		}
+	}
+	
+	if(tokens.size()>threadtoken+1){
+		*seed=(unsigned int)strtoul(tokens[threadtoken+1].c_str(), &endptr, 10);
+		if(*endptr){
+			return "@Seed is not a valid number.\n";
+		}
+	}
+	return "";
+}
+
+//-----------------------------------------------------------------------------------------------------
+
 std::string processcmd(std::string command)
 {
 	std::string answer="@I don't understand your command (\""+command+"\")\n";
@@ -298,8 +451,13 @@ std::string processcmd(std::string command)
 				outfilename=tokens[2];
 				setup->loadParameters(parfilename);
 			}
-			setup->run();
-			setup->saveResults(outfilename);
+			if(setup->dataTable()->isStreamed()){
+				setup->runStreaming(outfilename);
+			}
+			else{
+				setup->run();
+				setup->saveResults(outfilename);
+			}
 			return "@RUN completed.\n";
 		}
 	}
@@ -307,6 +465,9 @@ std::string processcmd(std::string command)
 		if(setup->validity()<IWQ_VALID_FOR_RUN){
 			answer="@Model layout is not valid for RUN.\n";
 		}
+		else if(setup->dataTable()->isStreamed()){
+			answer="@RUN_UNCSIM cannot be used with a streamed data table, it can only be used with RUN.\n";
+		}
 		else{
 			std::string parfilename;
 			std::string outfilename;
@@ -362,22 +523,33 @@ std::string processcmd(std::string command)
 		if(setup->validity()<IWQ_VALID_FOR_RUN){
 			answer="@Model layout is not valid for SENS_LOC.\n";
 		}
+		else if(setup->dataTable()->isStreamed()){
+			answer="@SENS_LOC cannot be used with a streamed data table, it can only be used with RUN.\n";
+		}
 		else{
 			std::string target=tokens[1];
 			double factor=0.1;
+			bool forward=false;
 			std::string filename;
 			if(tokens.size()==4){
-				char * endptr;
-				factor=strtod(tokens[2].c_str(), &endptr);
-				if(*endptr || factor<=0.0){
-					return "@Perturbation factor is not a valid number.\n";
+				std::string mode=tokens[2];
+				std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+				if(mode.compare("FORWARD")==0){
+					forward=true;
+				}
+				else{
+					char * endptr;
+					factor=strtod(tokens[2].c_str(), &endptr);
+					if(*endptr || factor<=0.0){
+						return "@Perturbation factor is not a valid number.\n";
+					}
 				}
 				filename=tokens[3];
 			}
 			else{
 				filename=tokens[2];
 			}
-			setup->localSensitivityAnalysis(factor,target,filename);
+			setup->localSensitivityAnalysis(factor,target,filename,forward);
 			
 			return "@SENS_LOC completed.\n";
 		}
@@ -386,6 +558,9 @@ std::string processcmd(std::string command)
 		if(setup->validity()<IWQ_VALID_FOR_RUN){
 			answer="@Model layout is not valid for SENS_REG.\n";
 		}
+		else if(setup->dataTable()->isStreamed()){
+			answer="@SENS_REG cannot be used with a streamed data table, it can only be used with RUN.\n";
+		}
 		else{
 			std::string target=tokens[1];
 			double factor=0.1;
@@ -490,6 +665,74 @@ std::string processcmd(std::string command)
 			return "@MCMC completed.\n";
 		}
 	}
+	if(pricommand.compare("DREAM")==0 && tokens.size()>=4 && tokens.size()<=7){
+		if(setup->validity()<IWQ_VALID_FOR_CALIBRATE){
+			answer="@Model layout is not valid for DREAM.\n";
+		}
+		else{
+			std::string filename=tokens[1];
+			int numrounds=5500;
+			int burnin=500;
+			int numchains=3;
+			int numthreads=1;
+			unsigned int seed=0;
+			
+			std::string error=parseChainArguments(tokens, &numrounds, &burnin, 5, &numthreads, &seed);
+			if(error.size()){
+				return error;
+			}
+			
+			if(tokens.size()>=5){
+				char * endptr;
+				numchains=strtol(tokens[4].c_str(), &endptr, 10);
+				if(*endptr || numchains<3){
+					return "@Chain count is not a valid number (at least 3).\n";
+				}
+			}
+			
+			setup->DREAM(numrounds, burnin, filename, numchains, numthreads, seed);
+			
+			return "@DREAM completed.\n";
+		}
+	}
+	if(pricommand.compare("MCMC_TEMPERING")==0 && tokens.size()>=4 && tokens.size()<=8){
+		if(setup->validity()<IWQ_VALID_FOR_CALIBRATE){
+			answer="@Model layout is not valid for MCMC_TEMPERING.\n";
+		}
+		else{
+			std::string filename=tokens[1];
+			int numrounds=5500;
+			int burnin=500;
+			int numtemperatures=4;
+			double maxtemperature=10.0;
+			int numthreads=0;	//one thread per temperature
+			unsigned int seed=0;
+			
+			std::string error=parseChainArguments(tokens, &numrounds, &burnin, 6, &numthreads, &seed);
+			if(error.size()){
+				return error;
+			}
+			
+			char * endptr;
+			if(tokens.size()>=5){
+				numtemperatures=strtol(tokens[4].c_str(), &endptr, 10);
+				if(*endptr || numtemperatures<2){
+					return "@Temperature count is not a valid number (at least 2).\n";
+				}
+			}
+			
+			if(tokens.size()>=6){
+				maxtemperature=strtod(tokens[5].c_str(), &endptr);
+				if(*endptr || maxtemperature<=1.0){
+					return "@Maximal temperature is not a valid number (above 1).\n";
+				}
+			}
+			
+			setup->parallelTempering(numrounds, burnin, filename, numtemperatures, maxtemperature, numthreads, seed);
+			
+			return "@MCMC_TEMPERING completed.\n";
+		}
+	}
 	if(pricommand.compare("SAMPLE_HIST")==0 && tokens.size()==4){
 		std::string filename=tokens[1];
 		std::string ofilename=tokens[2];
@@ -608,6 +851,25 @@ int main (int argc, char * const argv[])
 		printHelp(searchstr);
 		return 0;
 	}
+	if(argv1.compare("BENCH_BIAS")==0){
+		int length=(argc>2)?atoi(argv[2]):2000;
+		benchmarkBiasLikelihood((length>0)?length:2000);
+		return 0;
+	}
+	if(argv1.compare("CONVERT_DATA")==0){
+		if(argc<4){
+			printf("[Error]: CONVERT_DATA needs an input and an output file.\n");
+			return 1;
+		}
+		iWQDataTable table (argv[2]);
+		if(table.numCols()==0){
+			printf("[Error]: No data loaded from \"%s\".\n",argv[2]);
+			return 1;
+		}
+		table.writeToFile(argv[3]);
+		printf("Converted %d rows and %d columns to \"%s\".\n",table.numRows(),table.numCols(),argv[3]);
+		return 0;
+	}
 	
 	setup=new iWQModelLayout(argv1);
 	
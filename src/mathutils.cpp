@@ -579,6 +579,21 @@ double quantile(iWQVector x, double q,  unsigned short int qtype, bool sorted)
 
 //========================================================================================================
 
+//Median
+double median(const iWQVector * x)
+{
+	iWQVector valid;
+	valid.reserve(x->size());
+	for(int i=0; i<x->size(); i++){
+		if(!isnan(x->at(i))){
+			valid.push_back(x->at(i));
+		}
+	}
+	return quantile(valid, 0.5);
+}
+
+//========================================================================================================
+
 void sampleConfidenceLimits(iWQVector * data, double p, double * low, double * high)
 {
 	if(!low || !high){
@@ -890,6 +905,19 @@ double iWQRandomNormalGenerator::logLikeli(double x)
 
 //--------------------------------------------------------------------------------------------------------
 
+void iWQRandomNormalGenerator::logLikeliArray(const double * x, double * dest, int n)
+{
+	//plain arithmetic without branches, so the compiler can vectorise it
+	double first=mLogFirstPart;
+	double avg=mAvg;
+	double inv=mInverse2SigmaSquare;
+	for(int i=0; i<n; i++){
+		dest[i]=first-(x[i]-avg)*(x[i]-avg)*inv;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------
+
 void iWQRandomNormalGenerator::initialize(iWQDistributionSettings settings)
 {
 	double mean=settings["mean"];
@@ -954,6 +982,15 @@ double iWQRandomLogNormalGenerator::logLikeli(double x)
 	return iWQRandomNormalGenerator::logLikeli(log(x));
 }
 
+//--------------------------------------------------------------------------------------------------------
+
+void iWQRandomLogNormalGenerator::logLikeliArray(const double * x, double * dest, int n)
+{
+	for(int i=0; i<n; i++){
+		dest[i]=logLikeli(x[i]);
+	}
+}
+
 //--------------------------------------------------------------------------------------------------------
 	
 void iWQRandomLogNormalGenerator::initialize(iWQDistributionSettings settings)
@@ -1457,6 +1494,14 @@ double iWQRandomSEPGenerator::logLikeli(double x)
 
 //--------------------------------------------------------------------------------------------------------
 
+double iWQRandomSEPGenerator::maxLogLikeli()
+{
+	//the exponential part is 1 where the skewed variable is 0
+	return log(2.0 / mSigma * mSigmaXi / (mXi + 1.0/mXi) * mOmegaBeta);
+}
+
+//--------------------------------------------------------------------------------------------------------
+
 void iWQRandomSEPGenerator::initialize(iWQDistributionSettings settings)
 {
 	double beta=settings["beta"];
@@ -1710,6 +1755,39 @@ double boxcox_transform(double lambda_1, double lambda_2, double value, bool * e
 
 //--------------------------------------------------------------------------------------------------------
 
+void boxcox_transform_array(double lambda_1, double lambda_2, const double * values, double * dest, int n, bool * error)
+{
+	//the special cases are decided once, the loops have no branches to vectorise
+	if(lambda_1==1.0){
+		for(int i=0; i<n; i++){
+			dest[i]=values[i]+lambda_2;
+		}
+		return;
+	}
+	for(int i=0; i<n; i++){
+		double biased=values[i]+lambda_2;
+		if(biased<=0.0){
+			if(error){
+				*error=true;
+			}
+			biased=DBL_MIN;
+		}
+		dest[i]=biased;
+	}
+	if(lambda_1!=0.0){
+		for(int i=0; i<n; i++){
+			dest[i]=(pow(dest[i],lambda_1)-1)/lambda_1;
+		}
+	}
+	else{
+		for(int i=0; i<n; i++){
+			dest[i]=log(dest[i]);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------
+
 double boxcox_retransform(double lambda_1, double lambda_2, double value, bool * error)
 {
 	//backward BoxCox
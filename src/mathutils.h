@@ -63,6 +63,9 @@ double covariance(const iWQVector * x, const iWQVector * y, int startrow);	//all
 // Quantile
 double quantile(iWQVector x, double q,  unsigned short int qtype=7, bool sorted=false);
 
+// Median of the values which are not NaN
+double median(const iWQVector * x);
+
 //Sum of squares
 double sumsquares(const iWQVector * x);
 
@@ -127,6 +130,7 @@ public:
 		virtual double generate()=0;									//forward operation: get a random number
 		virtual double logLikeli(double x)=0;							//backward operation: get probability/likelihood
 		virtual void initialize(iWQDistributionSettings settings)=0;	//uniform parameter initializer method
+		void setSeed(unsigned int seed){ mSeed=seed; }					//for reproducible streams
 protected:
 		unsigned int mSeed;
 		double uniform_random();
@@ -197,6 +201,7 @@ public:
 	virtual void setMean(double val);
 	virtual void setStdev(double val);
 	virtual double logLikeli(double x);
+	virtual void logLikeliArray(const double * x, double * dest, int n);	//element-wise logLikeli()
 	virtual void initialize(iWQDistributionSettings settings);
 };
 
@@ -218,6 +223,7 @@ public:
 	virtual double mean(){ return mMu; }
 	virtual double stdev(){ return mSigma; }
 	virtual double logLikeli(double x);
+	virtual void logLikeliArray(const double * x, double * dest, int n);
 	virtual void initialize(iWQDistributionSettings settings);
 };
 
@@ -322,6 +328,7 @@ public:
 	virtual void setSigma(double val);
 	virtual double sigma(){ return mSigma; }
 	virtual double logLikeli(double x);
+	double maxLogLikeli();		//log density at the mode
 	virtual void initialize(iWQDistributionSettings settings);
 };
 
@@ -348,4 +355,7 @@ double NS(std::vector<double> * measured, std::vector<double> * modelled, int st
 double boxcox_transform(double lambda_1, double lambda_2, double value, bool * error);
 double boxcox_retransform(double lambda_1, double lambda_2, double value, bool * error);
 
+// Box-Cox transformation of n values (same results as boxcox_transform one by one)
+void boxcox_transform_array(double lambda_1, double lambda_2, const double * values, double * dest, int n, bool * error);
+
 #endif
@@ -15,6 +15,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sstream>
 #include <algorithm>
 #include <float.h>
@@ -71,7 +72,9 @@ void searchAndReplace(std::string& value, std::string const& search,std::string
 
 iWQParameterManager::iWQParameterManager()
 {
-	//
+	mAccessLog=NULL;
+	mRevision=0;
+	mPropagating=false;
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -101,6 +104,7 @@ void iWQParameterManager::defineParam(std::string key)
 	*d=0.0;
 	//load into the name storage
 	mParams[key]=d;
+	mRevision++;
 	//init the distribution strorage
 	mOrderedDistributions.push_back(NULL);	//no distribution by default
 }
@@ -109,7 +113,14 @@ void iWQParameterManager::defineParam(std::string key)
 
 void iWQParameterManager::setValueForParam(double value, std::string key)
 {
-	double * par=mParams[key];
+	std::map<std::string, double *>::iterator it=mParams.find(key);
+	if(it==mParams.end()){
+		//unknown keys are remembered without storage
+		mParams[key]=NULL;
+		mRevision++;
+		return;
+	}
+	double * par=it->second;
 	if(par){
 		*par=value;
 		for(int i=0; i<mBoundClients.size(); i++){
@@ -130,8 +141,18 @@ void iWQParameterManager::initParam(std::string key, double value)
 
 double iWQParameterManager::valueForParam(std::string key)
 {
-	double * par=mParams[key];
+	std::map<std::string, double *>::iterator it=mParams.find(key);
+	if(it==mParams.end()){
+		//unknown keys are remembered without storage
+		mParams[key]=NULL;
+		mRevision++;
+		return 0.0;
+	}
+	double * par=it->second;
 	if(par){
+		if(mAccessLog){
+			mAccessLog->push_back(par);
+		}
 		return *par;
 	}
 	return 0.0;
@@ -187,24 +208,42 @@ std::vector<std::string> iWQParameterManager::namesForPlainValues()
 
 void iWQParameterManager::setPlainValues(std::vector<double> new_values)
 {
-	for(int i=0; i<mLocalParams.size() && i<new_values.size(); i++){
-		*(mLocalParams[i])=new_values[i];
-	}
-	for(int i=0; i<mBoundClients.size(); i++){
-		mBoundClients[i]->updateParameters();
-	}
+	markChangedValues((new_values.size())?&new_values[0]:NULL, new_values.size());
+	propagateChangedValues();
 }	
 
 //-------------------------------------------------------------------------------------------------------------
 
 void iWQParameterManager::setPlainValues(double * new_values, int numvals)
 {
+	markChangedValues(new_values, numvals);
+	propagateChangedValues();
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQParameterManager::markChangedValues(const double * new_values, int numvals)
+{
+	//bitwise comparison: a value is changed even if only its sign or NaN payload differs
+	mDirty.assign(mLocalParams.size(),0);
 	for(int i=0; i<mLocalParams.size() && i<numvals; i++){
-		*(mLocalParams[i])=new_values[i];
+		if(memcmp(mLocalParams[i],&new_values[i],sizeof(double))!=0){
+			*(mLocalParams[i])=new_values[i];
+			mDirty[i]=1;
+		}
 	}
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQParameterManager::propagateChangedValues()
+{
+	//the clients copy only the slots marked in markChangedValues()
+	mPropagating=true;
 	for(int i=0; i<mBoundClients.size(); i++){
 		mBoundClients[i]->updateParameters();
 	}
+	mPropagating=false;
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -329,6 +368,7 @@ void iWQParameterManager::initFromTabDelimitedFile(std::string filename)
 	//clean previous values
 	mLocalParams.clear();
 	mParams.clear();
+	mRevision++;
 	
 	//get new values from the file
 	while(fgets(Buffer,512,in)>0){
@@ -700,6 +740,9 @@ std::map<int, double> iWQParameterManager::valuesForParam(std::string key, std::
 					//cast it to int
 					int i = lexical_cast<int, std::string>(flagflag);
 					result[i] = *(it->second);
+					if(mAccessLog){
+						mAccessLog->push_back(it->second);
+					}
 				}
 			}
 			
@@ -722,6 +765,7 @@ void iWQParameterManager::clearAllParams()
 	mLinkedDistributions.clear();
 	mLimits.clear();
 	mOrderedDistributions.clear();
+	mRevision++;
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -737,6 +781,7 @@ void iWQParameterManager::clearParam(std::string key)
 		mLimits.erase(key);
 		mOrderedDistributions.erase(mOrderedDistributions.begin()+index);
 		delete d;
+		mRevision++;
 	}
 }
 
@@ -748,22 +793,68 @@ void iWQParameterManager::clearParam(std::string key, std::string flag)
 	clearParam(flagged);
 }
 
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQParameterManager::startAccessLog(std::vector<const double *> * log)
+{
+	mAccessLog=log;
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQParameterManager::stopAccessLog()
+{
+	mAccessLog=NULL;
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+const double * iWQParameterManager::slotForParam(std::string key, int * index)
+{
+	static const double emptyslot=0.0;	//defined without storage, reads as 0.0
+	
+	*index=-1;
+	std::map<std::string, double *>::iterator it=mParams.find(key);
+	if(it==mParams.end()){
+		return NULL;
+	}
+	if(!it->second){
+		return &emptyslot;
+	}
+	*index=indexOfParam(key);
+	return it->second;
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+const double * iWQParameterManager::slotForParam(std::string key, std::string flag, int * index)
+{
+	std::string flagged=makeFlaggedStr(key, flag);
+	return slotForParam(flagged, index);
+}
+
 //#############################################################################################################
 
 #pragma mark Diagnostic and working functions for iWQModel variables
 
 double * iWQDelta(iWQModel * aModel, double * variable)
 {
-	return aModel->mDerivLocations.operator[](variable);
+	//fallback of the slot table in iWQModel::d()
+	int index=aModel->indexOfVariable(variable);
+	if(index>=0){
+		return &(aModel->mDerivatives[index]);
+	}
+	return aModel->mFooVarDeltaContainer;
 }
 
 //-------------------------------------------------------------------------------------------------------------
 
 double * iWQDiagnosticDelta(iWQModel * aModel, double * variable)
 {
-	if(aModel->mDerivLocations.find(variable)!=aModel->mDerivLocations.end()){
+	int index=aModel->indexOfVariable(variable);
+	if(index>=0){
 		//normal operation
-		return aModel->mDerivLocations.operator[](variable);
+		return &(aModel->mDerivatives[index]);
 	}
 	else{
 		//error happened
@@ -804,17 +895,27 @@ iWQModel::iWQModel(std::string type) : mTypeId (type) , mModelId ("<unnamed>")
 	
 	//default execution type (not diagnostic)
 	dFunction = iWQDelta;
+	mDiagnosticDelta = false;
 	mFooVarDeltaContainer = new double;
+	mDerivSlotBase = NULL;
+	
+	//created on the first LSODA step, cold starts by default
+	mIntegrator = NULL;
+	mPersistentIntegrator = false;
+	mIntegratorSampling = 0;
+	mSparseJacobian = false;
+	mSensitivityIntegrator = NULL;
+	
+	//parameter bindings are resolved on the first update
+	mBindingRevision = -1;
+	mBindingParamCount = 0;
+	mBindingManager = NULL;
 }
 
 //-------------------------------------------------------------------------------------------------------------
 
 iWQModel::~iWQModel()
 {
-	std::map<double*,double*>::iterator it;
-	for(it=mDerivLocations.begin(); it!=mDerivLocations.end(); ++it){
-		delete it->second;
-	}
 	delete mFooVarDeltaContainer;
 	
 	//delete the RKF solver arrays
@@ -826,6 +927,13 @@ iWQModel::~iWQModel()
 		delete [] mB[i];
 	}
 	delete [] mB;
+	
+	if(mIntegrator){
+		delete mIntegrator;
+	}
+	if(mSensitivityIntegrator){
+		delete mSensitivityIntegrator;
+	}
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -854,6 +962,8 @@ void iWQModel::setValueForParam(double value, std::string key)
 	if(par){
 		*par=value;
 	}
+	//local values are overwritten by the next update as a whole
+	invalidateParameterBindings();
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -889,6 +999,7 @@ void iWQModel::bind(iWQParameterManager * par)
 {
 	if(par){
 		mParentParameterManager=par;
+		invalidateParameterBindings();
 		par->bindRequest(this);
 		updateParameters();		//initiated locally to get the latest values
 	}
@@ -926,29 +1037,59 @@ void iWQModel::updateParameters()
 	if(!mParentParameterManager){
 		return;
 	}
+	bool resolved=false;
+	if(mBindingManager!=mParentParameterManager || mBindingRevision!=mParentParameterManager->revision() || mBindingParamCount!=mParams.size()){
+		resolveParameterBindings();
+		resolved=true;
+	}
+	//within setPlainValues() only the changed slots are copied
+	for(int i=0; i<mBindingDests.size(); i++){
+		if(resolved || mParentParameterManager->needsUpdate(mBindingSlots[i])){
+			*(mBindingDests[i])=*(mBindingSources[i]);
+			mParentParameterManager->logAccess(mBindingSources[i]);
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQModel::resolveParameterBindings()
+{
+	//string lookup once per definition change instead of once per update
+	mBindingDests.clear();
+	mBindingSources.clear();
+	mBindingSlots.clear();
+	
 	std::map<std::string, double *>::iterator it;
 	for(it=mParams.begin(); it!=mParams.end(); ++it){
 		std::string act_key=it->first;
 		double * act_dest=it->second;
+		if(!act_dest){
+			continue;
+		}
 		//try out flags
-		bool foundflagged=false;
-		for(int i=0; i<mModelFlags.size(); i++){
+		const double * source=NULL;
+		int slot=-1;
+		for(int i=0; i<mModelFlags.size() && !source; i++){
 			std::string act_flag=mModelFlags[i];
 			if(mParentParameterManager->hasValueForParam(act_key, act_flag)){
-				double new_val=mParentParameterManager->valueForParam(act_key, act_flag);
-				*act_dest=new_val;
-				foundflagged=true;
-				break;
+				source=mParentParameterManager->slotForParam(act_key, act_flag, &slot);
 			}	
 		}
-		if(!foundflagged){
+		if(!source){
 			//ask for the general one
-			if(mParentParameterManager->hasValueForParam(act_key)){
-				double new_val=mParentParameterManager->valueForParam(act_key);
-				*act_dest=new_val;
-			}
+			source=mParentParameterManager->slotForParam(act_key, &slot);
+		}
+		if(source){
+			mBindingDests.push_back(act_dest);
+			mBindingSources.push_back(source);
+			mBindingSlots.push_back(slot);
 		}
 	}
+	
+	mBindingManager=mParentParameterManager;
+	mBindingRevision=mParentParameterManager->revision();
+	mBindingParamCount=mParams.size();
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -958,34 +1099,54 @@ void iWQModel::defineVariable(double * var, const char * varname, bool delta)
 	mVarLocations.push_back(var);
 	mVarNames.push_back(varname);
 	*var=0.0;
-	double * deriv=new double;
-	*deriv=0.0;
-	mDerivLocations[var]=deriv;
+	mDerivatives.push_back(0.0);
 	mShouldTakeDelta.push_back(delta);
+	rebuildDerivSlots();
+	mScratch.assign(IWQ_NUM_SCRATCH_BUFFERS*mVarLocations.size(),0.0);
 }
 
 //-------------------------------------------------------------------------------------------------------------
 
-//for direct descendants (they use references to variables)
-double * iWQModel::d(double & var)
-{
-	return dFunction(this,&var);
-}
-
-//-------------------------------------------------------------------------------------------------------------
-
-//for indirect descendants (they can only use pointers to variables)
-double * iWQModel::D(double * var)
+void iWQModel::rebuildDerivSlots()
 {
-	return dFunction(this,var);
+	//variables are normally members of the same object, so a small table covers them all
+	mDerivSlots.clear();
+	mDerivSlotBase=NULL;
+	if(mVarLocations.size()==0){
+		return;
+	}
+	char * lowest=(char *)mVarLocations[0];
+	char * highest=(char *)mVarLocations[0];
+	for(int i=1; i<mVarLocations.size(); i++){
+		char * act=(char *)mVarLocations[i];
+		lowest=(act<lowest)?act:lowest;
+		highest=(act>highest)?act:highest;
+	}
+	size_t numslots=(highest-lowest)/sizeof(double)+1;
+	if(numslots>IWQ_MAX_DERIVATIVE_SLOTS){
+		//scattered variables: d() falls back to searching
+		return;
+	}
+	mDerivSlotBase=lowest;
+	mDerivSlots.assign(numslots,-1);
+	for(int i=0; i<mVarLocations.size(); i++){
+		size_t slot=((char *)mVarLocations[i]-lowest)/sizeof(double);
+		if(mDerivSlots[slot]==-1){
+			mDerivSlots[slot]=i;
+		}
+	}
 }
 
 //-------------------------------------------------------------------------------------------------------------
 
-//alias for d to use with boundary fluxes
-double * iWQModel::F(double & var)
+int iWQModel::indexOfVariable(double * var)
 {
-	return d(var);
+	for(int i=0; i<mVarLocations.size(); i++){
+		if(mVarLocations[i]==var){
+			return i;
+		}
+	}
+	return -1;
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -1013,10 +1174,8 @@ void iWQModel::copyDerivatives(double * dest, int length)
 	if(!dest){
 		return;
 	}
-	for(int i=0; i<length && i<mVarLocations.size(); i++){
-		double * var=mVarLocations[i];
-		double * deriv=mDerivLocations[var];
-		dest[i]=*deriv;
+	for(int i=0; i<length && i<mDerivatives.size(); i++){
+		dest[i]=mDerivatives[i];
 	}
 }
 
@@ -1110,6 +1269,38 @@ int iWQModel::numVariables() const
 
 //-------------------------------------------------------------------------------------------------------------
 
+void iWQModel::parameterValues(std::vector<double> & values) const
+{
+	values.clear();
+	std::map<std::string, double *>::const_iterator it;
+	for(it=mParams.begin(); it!=mParams.end(); ++it){
+		if(it->second){
+			values.push_back(*(it->second));
+		}
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQModel::stateValues(std::vector<double> & values) const
+{
+	values.resize(mVarLocations.size());
+	for(int i=0; i<mVarLocations.size(); i++){
+		values[i]=*(mVarLocations[i]);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
+void iWQModel::setStateValues(const std::vector<double> & values)
+{
+	for(int i=0; i<mVarLocations.size() && i<values.size(); i++){
+		*(mVarLocations[i])=values[i];
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------------
+
 double * iWQModel::rwoutlet(std::string name) const
 {
 	//look up input
@@ -1157,6 +1348,7 @@ iWQStrings iWQModel::modelFlags() const
 void iWQModel::setModelFlags(iWQStrings flags)
 {
 	mModelFlags=flags;
+	invalidateParameterBindings();
 	//refresh parameter values if needed
 	updateParameters(); 
 }		
@@ -1166,6 +1358,7 @@ void iWQModel::setModelFlags(iWQStrings flags)
 void iWQModel::setModelFlag(std::string flag)
 {
 	mModelFlags.push_back(flag);
+	invalidateParameterBindings();
 }
 
 //---------------------------------------------------------------------------------------------------------------
@@ -1200,26 +1393,20 @@ bool iWQModel::verify()
 	
 	//diagnose variables
 	dFunction=iWQDiagnosticDelta;
-	std::map<double *, double *>::iterator it;
-	for(it=mDerivLocations.begin(); it!=mDerivLocations.end(); ++it){
-		*(it->second)=0.0;
+	mDiagnosticDelta=true;
+	for(int j=0; j<mDerivatives.size(); j++){
+		mDerivatives[j]=0.0;
 	}
 	modelFunction(0.0);
 	//check if we got something invalid in the delta container
 	bool problematic=false;
-	for(it=mDerivLocations.begin(); it!=mDerivLocations.end(); ++it){
-		double value=*(it->second);
+	for(int j=0; j<mDerivatives.size(); j++){
+		double value=mDerivatives[j];
 		if(isnan(value) || isinf(value)){
 			//something strange happened
 			problematic=true;
-			std::string varname="<unknown variable>";
+			std::string varname=mVarNames[j];
 			std::string errtype=(isnan(value)?"NaN":"infinity");
-			double * var_address=it->first;
-			for(int j=0; j<mVarLocations.size(); j++){
-				if(mVarLocations[j]==var_address){
-					varname=mVarNames[j];
-				}
-			}
 			printf("[Warning]: %s produced invalid derivative or flux value (%s) for %s.\n",mTypeId.c_str(),errtype.c_str(),varname.c_str());
 		}
 	}
@@ -1351,6 +1538,7 @@ bool iWQModel::verify()
 	// END OF TESTS
 	// restore normal operation
 	dFunction=iWQDelta;
+	mDiagnosticDelta=false;
 	
 	return result;
 }
@@ -1372,15 +1560,27 @@ bool iWQModel::solve1Step(double xvon, double xbis, iWQInitialValues * yvon, dou
 	else{
 		//Simple solution for static models (no integration, no initial values)
 		unsigned int numVariables=mVarLocations.size();
-		double * ys;
-		ys=new double [numVariables];
+		double * ys=scratchBuffer(0);
 		modelFunction(xbis);						//FUNCTION CALLED
 		copyDerivatives(ys,numVariables);	//get back the derivatives
+		if(mSensitivitySlots.size()){
+			//the outputs depend on the inputs and the parameters only
+			resolveSensitivityParameters();
+			std::vector<double> & y=mSensitivityY;
+			std::vector<double> & ydot=mSensitivityYdot;
+			std::fill(y.begin(), y.end(), 0.0);
+			std::fill(ydot.begin(), ydot.end(), 0.0);
+			for(int k=0; k<numVariables; k++){
+				y[k]=*(mVarLocations[k]);
+				ydot[k]=ys[k];
+			}
+			sensitivityFunction(xbis, &y[0], &ydot[0]);
+			std::copy(ydot.begin()+numVariables, ydot.end(), mStateSensitivities.begin());
+		}
 		//reload new values into variables
 		for(int k=0; k<numVariables; k++){
 			*(mVarLocations[k])=ys[k];
 		}
-		delete [] ys;
 		return true;
 	}
 }
@@ -1406,12 +1606,12 @@ bool iWQModel::solve1StepRungeKuttaFehlberg(double xvon, double xbis, iWQInitial
 	}
 	
 	//Storages for variables
-	y=new double [numVariables];
-	ys=new double [numVariables];
-	yhut=new double [numVariables];
+	y=scratchBuffer(0);
+	ys=scratchBuffer(1);
+	yhut=scratchBuffer(2);
 	
 	for(i=0; i<=5; i++){
-		mF[i]=new double [numVariables];
+		mF[i]=scratchBuffer(3+i);
 	}  
 	
 	//Storage for inputs
@@ -1498,15 +1698,6 @@ bool iWQModel::solve1StepRungeKuttaFehlberg(double xvon, double xbis, iWQInitial
 		}
 	}while(xs<xbis);
 	
-	//cleanup
-	delete [] y;
-	delete [] ys;
-	delete [] yhut;
-	
-	for(i=0; i<=5; i++){
-		delete [] mF[i];
-	}
-	
 	return validityflag;
 }
 
@@ -1526,15 +1717,254 @@ bool iWQModel::solve1StepLSODA(double xvon, double xbis, iWQInitialValues * yvon
 	//initial variable values: will not modify anything if yvon is NULL
 	setInitialValues(yvon);
 	
-	// now should create and call the LSODA integrator
-	iWQLSODAIntegrator * integrator=new iWQLSODAIntegrator();
-	validityflag=integrator->solve1Step(this, xvon, xbis, eps);
+	if(mSensitivitySlots.size()){
+		//the augmented system is integrated from a cold start in each step
+		if(yvon){
+			resetSensitivities();	//initial values do not depend on the parameters
+		}
+		resolveSensitivityParameters();
+		if(!mSensitivityIntegrator){
+			mSensitivityIntegrator=new iWQLSODAIntegrator(false);
+			mSensitivityIntegrator->setSparseJacobian(mSparseJacobian);
+		}
+		return mSensitivityIntegrator->solve1Step(this, xvon, xbis, eps);
+	}
 	
-	delete integrator;
+	// the integrator and its workspace are kept by the model
+	if(!mIntegrator){
+		mIntegrator=new iWQLSODAIntegrator(mPersistentIntegrator);
+		mIntegrator->setSparseJacobian(mSparseJacobian);
+		mIntegrator->setReferenceSampling(mIntegratorSampling);
+	}
+	if(yvon){
+		//a new run must not reuse the old history
+		mIntegrator->invalidate();
+	}
+	validityflag=mIntegrator->solve1Step(this, xvon, xbis, eps);
 		
 	return validityflag;
 }
 
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::setPersistentIntegrator(bool persistent)
+{
+	mPersistentIntegrator=persistent;
+	if(mIntegrator){
+		mIntegrator->setPersistent(persistent);
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::setIntegratorSampling(int interval)
+{
+	mIntegratorSampling=interval;
+	if(mIntegrator){
+		mIntegrator->setReferenceSampling(interval);
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::setSparseJacobian(bool sparse)
+{
+	mSparseJacobian=sparse;
+	if(mIntegrator){
+		mIntegrator->setSparseJacobian(sparse);
+	}
+	if(mSensitivityIntegrator){
+		mSensitivityIntegrator->setSparseJacobian(sparse);
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::resetIntegrator()
+{
+	if(mIntegrator){
+		mIntegrator->invalidate();
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+iWQIntegratorStatistics iWQModel::integratorStatistics() const
+{
+	if(mIntegrator){
+		return mIntegrator->statistics();
+	}
+	return iWQIntegratorStatistics();
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::resetIntegratorStatistics()
+{
+	if(mIntegrator){
+		mIntegrator->resetStatistics();
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::setSensitivityParameters(const std::vector<int> & slots)
+{
+	mSensitivitySlots=slots;
+	mSensitivityDests.assign(slots.size(), std::vector<double *> ());
+	mSensitivitySources.assign(slots.size(), std::vector<const double *> ());
+	mStateSensitivities.assign(mVarLocations.size()*slots.size(), 0.0);
+	mInputSensitivities.assign(mInputLocations.size()*slots.size(), 0.0);
+	mSensitivityScratch.assign(mInputLocations.size(), 0.0);
+	mSensitivityY.assign(mVarLocations.size()*(1+slots.size()), 0.0);
+	mSensitivityYdot.assign(mSensitivityY.size(), 0.0);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::resetSensitivities()
+{
+	std::fill(mStateSensitivities.begin(), mStateSensitivities.end(), 0.0);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::resolveSensitivityParameters()
+{
+	//the local copies of the parameters are perturbed
+	for(int p=0; p<mSensitivitySlots.size(); p++){
+		mSensitivityDests[p].clear();
+		mSensitivitySources[p].clear();
+	}
+	if(!mParentParameterManager){
+		return;
+	}
+	if(mBindingManager!=mParentParameterManager || mBindingRevision!=mParentParameterManager->revision() || mBindingParamCount!=mParams.size()){
+		resolveParameterBindings();
+	}
+	for(int i=0; i<mBindingSlots.size(); i++){
+		for(int p=0; p<mSensitivitySlots.size(); p++){
+			if(mBindingSlots[i]==mSensitivitySlots[p]){
+				mSensitivityDests[p].push_back(mBindingDests[i]);
+				mSensitivitySources[p].push_back(mBindingSources[i]);
+			}
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::sensitivityFunction(double x, double * y, double * ydot)
+{
+	//y and ydot hold the states, then the sensitivities (variable k to parameter p at numvars+k*P+p),
+	//the derivatives of the states are already in ydot. The derivative of a sensitivity, 
+	//J*s + df/du*du/dp + df/dp, is the directional derivative of the model function.
+	int numvars=mVarLocations.size();
+	int numinputs=mInputLocations.size();
+	int numsens=mSensitivitySlots.size();
+	double * sens=y+numvars;
+	double * sensdot=ydot+numvars;
+	
+	for(int p=0; p<numsens; p++){
+		std::vector<double *> & dests=mSensitivityDests[p];
+		double scale=1.0;
+		double norm=(dests.size())?1.0:0.0;
+		for(int k=0; k<numvars; k++){
+			scale=std::max(scale, fabs(y[k]));
+			norm=std::max(norm, fabs(sens[k*numsens+p]));
+		}
+		for(int i=0; i<numinputs; i++){
+			scale=std::max(scale, fabs(*mInputLocations[i]));
+			norm=std::max(norm, fabs(mInputSensitivities[i*numsens+p]));
+		}
+		for(int j=0; j<dests.size(); j++){
+			scale=std::max(scale, fabs(*dests[j]));
+		}
+		if(norm==0.0){
+			//the parameter does not reach this model (yet)
+			for(int k=0; k<numvars; k++){
+				sensdot[k*numsens+p]=0.0;
+			}
+			continue;
+		}
+		
+		//forward difference along the direction
+		double h=sqrt(DBL_EPSILON)*scale/norm;
+		for(int k=0; k<numvars; k++){
+			*mVarLocations[k]=y[k]+h*sens[k*numsens+p];
+		}
+		for(int i=0; i<numinputs; i++){
+			mSensitivityScratch[i]=*mInputLocations[i];
+			*mInputLocations[i]+=h*mInputSensitivities[i*numsens+p];
+		}
+		for(int j=0; j<dests.size(); j++){
+			*dests[j]+=h;
+		}
+		modelFunction(x);
+		for(int k=0; k<numvars; k++){
+			sensdot[k*numsens+p]=(mDerivatives[k]-ydot[k])/h;
+		}
+		for(int i=0; i<numinputs; i++){
+			*mInputLocations[i]=mSensitivityScratch[i];
+		}
+		for(int j=0; j<dests.size(); j++){
+			*dests[j]=*mSensitivitySources[p][j];
+		}
+	}
+	for(int k=0; k<numvars; k++){
+		*mVarLocations[k]=y[k];
+	}
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+double * iWQModel::inputSensitivities(const double * input)
+{
+	if(mSensitivitySlots.size()==0){
+		return NULL;
+	}
+	for(int i=0; i<mInputLocations.size(); i++){
+		if(mInputLocations[i]==input){
+			return &mInputSensitivities[i*mSensitivitySlots.size()];
+		}
+	}
+	return NULL;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+void iWQModel::addOutletSensitivities(const double * outlet, double factor, double * dest) const
+{
+	//outlets are variables, inputs or local parameters, see routlet()
+	int numsens=mSensitivitySlots.size();
+	if(!dest || numsens==0){
+		return;
+	}
+	for(int k=0; k<mVarLocations.size(); k++){
+		if(mVarLocations[k]==outlet){
+			for(int p=0; p<numsens; p++){
+				dest[p]+=factor*mStateSensitivities[k*numsens+p];
+			}
+			return;
+		}
+	}
+	for(int i=0; i<mInputLocations.size(); i++){
+		if(mInputLocations[i]==outlet){
+			for(int p=0; p<numsens; p++){
+				dest[p]+=factor*mInputSensitivities[i*numsens+p];
+			}
+			return;
+		}
+	}
+	for(int p=0; p<numsens; p++){
+		for(int j=0; j<mSensitivityDests[p].size(); j++){
+			if(mSensitivityDests[p][j]==outlet){
+				dest[p]+=factor;
+			}
+		}
+	}
+}
+
 //--------------------------------------------------------------------------------------------------
 
 //BEGIN DANGEROUS LOW-LEVEL FUNCTIONS
@@ -1546,6 +1976,8 @@ void iWQModel::resetState()
 	for(int i=0; i<mInputLocations.size(); i++){
 		*mInputLocations[i]=0.0;
 	}
+	resetIntegrator();
+	resetSensitivities();
 }
 
 void iWQModel::setStateVariable(std::string name, double value)
@@ -1553,6 +1985,7 @@ void iWQModel::setStateVariable(std::string name, double value)
 	for(int i=0; i<mVarNames.size(); i++){
 		if(mVarNames[i]==name){
 			*mVarLocations[i]=value;
+			resetIntegrator();
 			break;
 		}
 	}
@@ -1810,4 +2243,14 @@ iWQParameterManager * iWQInitialValues::parameterManager()
 {
 	return mSharedParameterManager;
 }
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQInitialValues::copyValuesFrom(iWQInitialValues * inits)
+{
+	if(inits && inits!=this){
+		mDefaultValues=inits->mDefaultValues;
+		mValues=inits->mValues;
+	}
+}
 	
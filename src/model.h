@@ -11,6 +11,7 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <math.h>
 
 #ifndef model_h
 #define model_h
@@ -22,6 +23,12 @@
 #define BFX(x) defineVariable( &x , #x , true )
 #define CVAR(x) defineConcentrationVariable( &x , #x )		//Concentration variable for transport models
 
+//largest address range (in doubles) of the variables resolved by the d() slot table
+#define IWQ_MAX_DERIVATIVE_SLOTS 65536
+
+//variable-sized scratch vectors per model (y, ys, yhut and the 6 RKF stages)
+#define IWQ_NUM_SCRATCH_BUFFERS 9
+
 class iWQModel;
 class iWQInitialValues;
 class iWQRandomGenerator;
@@ -100,6 +107,16 @@ private:
 	
 	int indexOfParam(std::string key);
 	
+	//dependency tracking
+	std::vector<const double *> * mAccessLog;	//slots read by the clients while logging
+	long mRevision;								//changes when parameters are defined or cleared
+	
+	//slots changed by the running setPlainValues() call
+	std::vector<char> mDirty;
+	bool mPropagating;
+	void markChangedValues(const double * new_values, int numvals);
+	void propagateChangedValues();
+	
 public:
 	iWQParameterManager();
 	~iWQParameterManager();
@@ -139,6 +156,18 @@ public:
 	
 	//wildcard access for flagged parameters by grid-type models
 	std::map<int, double> valuesForParam(std::string key, std::string flag);
+	
+	//which slots a client reads (e.g. during updateParameters()), valid until revision() changes
+	void startAccessLog(std::vector<const double *> * log);
+	void stopAccessLog();
+	long revision() const { return mRevision; }
+	void logAccess(const double * slot){ if(mAccessLog) mAccessLog->push_back(slot); }
+	
+	//pre-resolved access for the clients: the slot of a (flagged) key and its index in plainValues()
+	const double * slotForParam(std::string key, int * index);
+	const double * slotForParam(std::string key, std::string flag, int * index);
+	//false if the slot of the index is unchanged by the running setPlainValues() call
+	bool needsUpdate(int index) const { return (!mPropagating || index<0 || mDirty[index]); }
 		
 	//(un)archiving
 	void initFromFile(std::string filename);
@@ -173,15 +202,45 @@ class iWQModel : public iWQParameterHandler
 	{
 	private:
 		std::map<std::string, double *> mParams;
-		std::map<double*, double*> mDerivLocations;
 		std::vector<double *> mVarLocations;
 		std::vector<double *> mInputLocations;
 		std::vector<bool> mShouldTakeDelta;
 		iWQStrings mVarNames;
+		
+		//derivatives in the order of mVarLocations, and the table resolving a variable 
+		//address to its index: slot = (address - mDerivSlotBase) / sizeof(double)
+		std::vector<double> mDerivatives;
+		std::vector<int> mDerivSlots;
+		char * mDerivSlotBase;
+		void rebuildDerivSlots();
+		int indexOfVariable(double * var);	//slow search for variables outside the table
+		double * fastDelta(double * var);
 		iWQStrings mInputNames;
 		
 		iWQParameterManager * mParentParameterManager;
 		
+		//parameter bindings resolved from the keys and flags: local destination <- manager slot
+		std::vector<double *> mBindingDests;
+		std::vector<const double *> mBindingSources;
+		std::vector<int> mBindingSlots;			//index in the plainValues() of the manager, -1 if none
+		long mBindingRevision;					//manager revision at resolution, -1 if invalid
+		int mBindingParamCount;					//size of mParams at resolution
+		iWQParameterManager * mBindingManager;
+		void resolveParameterBindings();
+		
+		//forward sensitivities to parameters of the manager, p-th in mSensitivitySlots (index in plainValues())
+		std::vector<int> mSensitivitySlots;
+		std::vector<std::vector<double *> > mSensitivityDests;			//local destinations bound to each slot
+		std::vector<std::vector<const double *> > mSensitivitySources;	//their manager slots, to restore them
+		std::vector<double> mStateSensitivities;	//variable k to parameter p at k*P+p (fluxes of the last step)
+		std::vector<double> mInputSensitivities;	//input i to parameter p at i*P+p, set by the solver
+		std::vector<double> mSensitivityScratch;
+		std::vector<double> mSensitivityY;		//augmented state and its derivatives of static models
+		std::vector<double> mSensitivityYdot;
+		iWQLSODAIntegrator * mSensitivityIntegrator;	//one-shot integrator of the augmented system
+		void resolveSensitivityParameters();
+		void sensitivityFunction(double x, double * y, double * ydot);
+		
 		//solver things
 		double * mA;
 		double ** mB;
@@ -189,6 +248,16 @@ class iWQModel : public iWQParameterHandler
 		double * mD;
 		double ** mF;
 		
+		//LSODA integrator kept between the timesteps
+		iWQLSODAIntegrator * mIntegrator;
+		bool mPersistentIntegrator;		//warm restart mode
+		int mIntegratorSampling;		//reference integration of every n-th warm step, 0: off
+		bool mSparseJacobian;			//coloured finite-difference Jacobian in LSODA
+		
+		//scratch storage of the static and RKF solvers, sized in defineVariable
+		std::vector<double> mScratch;
+		double * scratchBuffer(int index){ return (mScratch.size())?&mScratch[index*mVarLocations.size()]:NULL; }
+		
 		//internal solver interface
 		void readVariables(double * from, int length);
 		void copyDerivatives(double * dest, int length);
@@ -204,6 +273,7 @@ class iWQModel : public iWQParameterHandler
 		std::map<std::string, bool> mInputConnectedState;
 		double * mFooVarDeltaContainer;		//to redirect erroneous delta requests
 		bool mVarDeltaErrorIndicator;
+		bool mDiagnosticDelta;				//route d() through dFunction instead of the slot table
 		iWQVariableDeltaAccessor dFunction;
 		
 		friend double * iWQDelta(iWQModel * aModel, double * variable);
@@ -217,11 +287,11 @@ class iWQModel : public iWQParameterHandler
 		void defineParam(double * par, const char * parname);
 		
 		//connection between a variable and its derivative
-		double * d(double & var);
-		double * D(double * var);	//method for the abstract channel transport module
+		double * d(double & var){ return (mDiagnosticDelta)?dFunction(this,&var):fastDelta(&var); }
+		double * D(double * var){ return (mDiagnosticDelta)?dFunction(this,var):fastDelta(var); }	//method for the abstract channel transport module
 		
 		//boundary flux connector
-		double * F(double & var);
+		double * F(double & var){ return d(var); }
 		
 		//type identifier
 		std::string mTypeId;
@@ -245,6 +315,7 @@ class iWQModel : public iWQParameterHandler
 		bool isBound() const;
 		iWQParameterManager * sharedManager();
 		virtual void updateParameters();	//virtual because of GRID models
+		void invalidateParameterBindings(){ mBindingRevision=-1; }
 		
 		//initial value resolver: public from version 4.1.1
         void setInitialValues(iWQInitialValues * initvals);
@@ -254,6 +325,9 @@ class iWQModel : public iWQParameterHandler
 		iWQStrings inputDataHeaders() const;
 		iWQStrings parameters() const;
 		int numVariables() const;
+		void parameterValues(std::vector<double> & values) const;	//in the order of parameters()
+		void stateValues(std::vector<double> & values) const;		//in the order of variableNames()
+		void setStateValues(const std::vector<double> & values);
 		
 		//outlets
 		virtual double * rwoutlet(std::string name) const;
@@ -263,9 +337,36 @@ class iWQModel : public iWQParameterHandler
         virtual bool solve1Step(double xvon, double xbis, iWQInitialValues * yvon, double hmin, double eps);
 		virtual bool isStatic(){ return false; }	//return true if the model does not need to be integrated (non-differential type models)
 		
+		//warm restart of the integrator between timesteps
+		void setPersistentIntegrator(bool persistent);
+		bool hasPersistentIntegrator() const { return mPersistentIntegrator; }
+		void resetIntegrator();		//next step starts cold
+		iWQIntegratorStatistics integratorStatistics() const;
+		void setSparseJacobian(bool sparse);
+		bool hasSparseJacobian() const { return mSparseJacobian; }
+		void resetIntegratorStatistics();
+		void setIntegratorSampling(int interval);	//diagnostics of the warm restart, 0: off
+		//forward sensitivities: the states are differentiated to the parameters of the shared manager
+		//given by their indices in plainValues(), and integrated with the states in the LSODA path
+		void setSensitivityParameters(const std::vector<int> & slots);	//empty: off
+		int numSensitivityParameters() const { return mSensitivitySlots.size(); }
+		void resetSensitivities();
+		double * inputSensitivities(const double * input);	//P values of an input (set before the step), NULL if not an input
+		void addOutletSensitivities(const double * outlet, double factor, double * dest) const;	//dest[p]+=factor*d(outlet)/d(parameter p)
+		
 		//computation methods
 		virtual void modelFunction(double x)=0; 
 		
+		//analytic Jacobian for LSODA (jt=1), the other models use finite differences
+		virtual bool hasJacobian(){ return false; }
+		virtual void jacobianFunction(double x, double * jac){ }	//jac[i*n+j]=d(derivative i)/d(variable j) at the actual state
+		
+		//variable access of the differentiable models (iWQEquations)
+		int variableIndex(double * var);	//position in variableNames(), -1 if not a variable
+		int variableCount() const { return mVarLocations.size(); }
+		double * variableLocation(int index) const { return mVarLocations[index]; }
+		double * derivativeOf(double * var){ return D(var); }
+		
 		//model identifier
 		void setModelId(std::string newid);
 		std::string modelId() const;
@@ -290,6 +391,167 @@ class iWQModel : public iWQParameterHandler
 
 //-----------------------------------------------------------------------------------------------
 
+inline double * iWQModel::fastDelta(double * var)
+{
+	size_t slot=(size_t)((char *)var-mDerivSlotBase)/sizeof(double);
+	if(slot<mDerivSlots.size()){
+		int index=mDerivSlots[slot];
+		if(index>=0 && mVarLocations[index]==var){
+			return &mDerivatives[index];
+		}
+	}
+	return iWQDelta(this,var);
+}
+
+inline int iWQModel::variableIndex(double * var)
+{
+	size_t slot=(size_t)((char *)var-mDerivSlotBase)/sizeof(double);
+	if(slot<mDerivSlots.size()){
+		int index=mDerivSlots[slot];
+		if(index>=0 && mVarLocations[index]==var){
+			return index;
+		}
+	}
+	return indexOfVariable(var);
+}
+
+//-----------------------------------------------------------------------------------------------
+
+#pragma mark Differentiable models
+
+// Forward-mode dual number: a value and its derivative along one seeded direction.
+class iWQDual
+{
+public:
+	double v;
+	double d;
+	
+	iWQDual() : v(0.0), d(0.0) { }
+	iWQDual(double value) : v(value), d(0.0) { }
+	iWQDual(double value, double derivative) : v(value), d(derivative) { }
+	
+	iWQDual & operator+=(const iWQDual & b){ v+=b.v; d+=b.d; return *this; }
+	iWQDual & operator-=(const iWQDual & b){ v-=b.v; d-=b.d; return *this; }
+	iWQDual & operator*=(const iWQDual & b){ d=d*b.v+v*b.d; v*=b.v; return *this; }
+	iWQDual & operator/=(const iWQDual & b){ d=(d*b.v-v*b.d)/(b.v*b.v); v/=b.v; return *this; }
+};
+
+inline iWQDual operator+(const iWQDual & a, const iWQDual & b){ return iWQDual(a.v+b.v, a.d+b.d); }
+inline iWQDual operator-(const iWQDual & a, const iWQDual & b){ return iWQDual(a.v-b.v, a.d-b.d); }
+inline iWQDual operator*(const iWQDual & a, const iWQDual & b){ return iWQDual(a.v*b.v, a.d*b.v+a.v*b.d); }
+inline iWQDual operator/(const iWQDual & a, const iWQDual & b){ return iWQDual(a.v/b.v, (a.d*b.v-a.v*b.d)/(b.v*b.v)); }
+inline iWQDual operator-(const iWQDual & a){ return iWQDual(-a.v, -a.d); }
+inline iWQDual operator+(const iWQDual & a){ return a; }
+
+inline bool operator<(const iWQDual & a, const iWQDual & b){ return a.v<b.v; }
+inline bool operator>(const iWQDual & a, const iWQDual & b){ return a.v>b.v; }
+inline bool operator<=(const iWQDual & a, const iWQDual & b){ return a.v<=b.v; }
+inline bool operator>=(const iWQDual & a, const iWQDual & b){ return a.v>=b.v; }
+inline bool operator==(const iWQDual & a, const iWQDual & b){ return a.v==b.v; }
+inline bool operator!=(const iWQDual & a, const iWQDual & b){ return a.v!=b.v; }
+
+inline iWQDual exp(const iWQDual & a){ double e=exp(a.v); return iWQDual(e, e*a.d); }
+inline iWQDual log(const iWQDual & a){ return iWQDual(log(a.v), a.d/a.v); }
+inline iWQDual log10(const iWQDual & a){ return iWQDual(log10(a.v), a.d/(a.v*log(10.0))); }
+inline iWQDual sqrt(const iWQDual & a){ double r=sqrt(a.v); return iWQDual(r, (r>0.0)?0.5*a.d/r:0.0); }
+inline iWQDual fabs(const iWQDual & a){ return (a.v<0.0)?-a:a; }
+inline iWQDual sin(const iWQDual & a){ return iWQDual(sin(a.v), cos(a.v)*a.d); }
+inline iWQDual cos(const iWQDual & a){ return iWQDual(cos(a.v), -sin(a.v)*a.d); }
+inline iWQDual tanh(const iWQDual & a){ double t=tanh(a.v); return iWQDual(t, (1.0-t*t)*a.d); }
+inline iWQDual atan(const iWQDual & a){ return iWQDual(atan(a.v), a.d/(1.0+a.v*a.v)); }
+inline iWQDual pow(const iWQDual & a, const iWQDual & b)
+{
+	double p=pow(a.v, b.v);
+	double d=(a.d!=0.0)?b.v*pow(a.v, b.v-1.0)*a.d:0.0;
+	if(b.d!=0.0){
+		d+=p*log(a.v)*b.d;
+	}
+	return iWQDual(p, d);
+}
+
+//helpers of mathutils.h for the dual numbers
+inline iWQDual constrain_min(const iWQDual & x, double min){ return (x.v<min)?iWQDual(min):x; }
+inline iWQDual constrain_max(const iWQDual & x, double max){ return (x.v>max)?iWQDual(max):x; }
+inline iWQDual constrain_minmax(const iWQDual & x, double min, double max){ return constrain_max(constrain_min(x, min), max); }
+
+inline double iWQValue(double a){ return a; }
+inline double iWQValue(const iWQDual & a){ return a.v; }
+inline void iWQSetScalar(double & s, double value, bool seeded){ s=value; }
+inline void iWQSetScalar(iWQDual & s, double value, bool seeded){ s.v=value; s.d=(seeded)?1.0:0.0; }
+
+//-----------------------------------------------------------------------------------------------
+
+// View of the model state in the scalar type T of the model equations: the variables are
+// read with state() and the changes assigned with d() (variables) and F() (boundary fluxes).
+// Inputs and parameters are used as plain doubles.
+template<typename T> class iWQEquations
+{
+private:
+	iWQModel * mModel;
+	T * mDerivatives;			//in the order of the variables, unused for double
+	const double * mSeed;		//variable with the unit derivative, NULL if none
+	T mFoo;						//to redirect erroneous requests
+	
+public:
+	iWQEquations(iWQModel * model, T * derivatives, const double * seed) : mModel(model), mDerivatives(derivatives), mSeed(seed) { }
+	
+	T state(double & var) const { T result; iWQSetScalar(result, var, &var==mSeed); return result; }
+	T & d(double & var);
+	T & F(double & var){ return d(var); }
+};
+
+template<typename T> inline T & iWQEquations<T>::d(double & var)
+{
+	int index=mModel->variableIndex(&var);
+	return (index>=0)?mDerivatives[index]:mFoo;
+}
+
+template<> inline double & iWQEquations<double>::d(double & var)
+{
+	return *(mModel->derivativeOf(&var));	//same path as iWQModel::d(), diagnostics included
+}
+
+//-----------------------------------------------------------------------------------------------
+
+// Base of the models written once as a template over the scalar type. The derived class M
+// implements
+//		template<typename T> void equations(double x, iWQEquations<T> & eq);
+// which is instantiated for double as modelFunction() and for iWQDual to fill the analytic
+// Jacobian, one seeded variable per pass. The variables must be read through eq.state(),
+// otherwise their column of the Jacobian is lost.
+template<class M> class iWQDifferentiableModel : public iWQModel
+{
+private:
+	std::vector<iWQDual> mDualDerivatives;
+	
+public:
+	iWQDifferentiableModel(std::string type) : iWQModel(type) { }
+	virtual ~iWQDifferentiableModel(){ }
+	
+	virtual void modelFunction(double x)
+	{
+		iWQEquations<double> eq (this, NULL, NULL);
+		static_cast<M *>(this)->equations(x, eq);
+	}
+	
+	virtual bool hasJacobian(){ return !isStatic(); }
+	
+	virtual void jacobianFunction(double x, double * jac)
+	{
+		int n=variableCount();
+		for(int j=0; j<n; j++){
+			mDualDerivatives.assign(n, iWQDual());
+			iWQEquations<iWQDual> eq (this, &mDualDerivatives[0], variableLocation(j));
+			static_cast<M *>(this)->equations(x, eq);
+			for(int i=0; i<n; i++){
+				jac[i*n+j]=mDualDerivatives[i].d;
+			}
+		}
+	}
+};
+
+//-----------------------------------------------------------------------------------------------
+
 // Model class for any channel transport schema (CSTR concept)
 
 class iWQGenericChannelTransport : public iWQModel
@@ -346,6 +608,7 @@ public:
 	
 	void setParameterManager(iWQParameterManager * par);
 	iWQParameterManager * parameterManager();
+	void copyValuesFrom(iWQInitialValues * inits);	//keeps the parameter manager
 	
 	//to get a dump from all the available values
 	iWQKeyValues allValues();
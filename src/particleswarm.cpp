@@ -18,6 +18,8 @@
 #include "particleswarm.h"
 #include "evaluator.h"
 #include "model.h"
+#include "mathutils.h"
+#include "threadpool.h"
 
 //----------------------------------------------------------------------------
 
@@ -78,16 +80,146 @@ T * make1Darray(int dim1)
 
 //----------------------------------------------------------------------------
 
-double Rnd()
+double Rnd(iWQRandomUniformGenerator * stream)
 {
-	return rand()/((double)RAND_MAX + 1.0);
+	return stream->generate();
+}
+
+//----------------------------------------------------------------------------
+
+//state of the swarm shared by the evaluation contexts
+//context c works on the particles c, c+numcontexts, c+2*numcontexts, ... with its own evaluator and random stream
+struct iWQSwarm
+{
+	int iPOPSIZE;
+	int iDIMENSIONS;
+	int iLOCAL;
+	int iHOODSIZE;
+	int iUSEBETTER;
+	double fMAXVEL;
+	int iGbest;
+	iWQBoundsList * fBounds;
+	double ** fPos;
+	double ** fVel;
+	double ** fBestPos;
+	double * fErrVal;
+	double * fPbestVal;
+	int * iBetter;
+	
+	int numcontexts;
+	iWQEvaluator ** evaluators;
+	iWQRandomUniformGenerator ** streams;
+	double ** modelpos;		//per context
+	double ** fDumVel;		//per context
+	int ** iNeighbor;		//per context
+};
+
+//----------------------------------------------------------------------------
+
+//evaluates the particles of one context
+void swarmEvaluateTask(void * context, int index)
+{
+	iWQSwarm * swarm=(iWQSwarm *)context;
+	iWQBoundsList & fBounds=*swarm->fBounds;
+	double * modelpos=swarm->modelpos[index];
+	for(int iPopindex=index; iPopindex<swarm->iPOPSIZE; iPopindex+=swarm->numcontexts){
+		//translate to model space 
+		for(int iDimindex=0; iDimindex<swarm->iDIMENSIONS; iDimindex++){
+			modelpos[iDimindex]=fBounds[iDimindex].min+swarm->fPos[iPopindex][iDimindex]*(fBounds[iDimindex].max-fBounds[iDimindex].min);
+		}
+		swarm->fErrVal[iPopindex]=swarm->evaluators[index]->evaluate(modelpos, swarm->iDIMENSIONS);    			// evaluates f function: fErrVal(iPopindex)
+	}
+}
+
+//----------------------------------------------------------------------------
+
+//updates velocity & position of the particles of one context (the personal bests are final by now)
+void swarmMoveTask(void * context, int index)
+{
+	iWQSwarm * swarm=(iWQSwarm *)context;
+	int iPOPSIZE=swarm->iPOPSIZE;
+	int iDIMENSIONS=swarm->iDIMENSIONS;
+	int iHOODSIZE=swarm->iHOODSIZE;
+	int iLOCAL=swarm->iLOCAL;
+	double fMAXVEL=swarm->fMAXVEL;
+	double ** fPos=swarm->fPos;
+	double ** fVel=swarm->fVel;
+	double ** fBestPos=swarm->fBestPos;
+	double * fPbestVal=swarm->fPbestVal;
+	double * fDumVel=swarm->fDumVel[index];
+	int * iNeighbor=swarm->iNeighbor[index];
+	iWQRandomUniformGenerator * stream=swarm->streams[index];
+	int iHOODINDEX;
+	int iDimindex;
+	int iLbest=swarm->iGbest;
+	
+	for(int iPopindex=index; iPopindex<iPOPSIZE; iPopindex+=swarm->numcontexts){
+		// Setup dummy velocity vector for current population member
+		for(iDimindex = 0; iDimindex<iDIMENSIONS; iDimindex++){
+			fDumVel[iDimindex] = fVel[iPopindex][iDimindex];
+		}
+		
+		// Does neighborhood calculation of iLbest
+		if(iLOCAL > 0){
+			//TODO: check this
+			for(iHOODINDEX = 0; iHOODINDEX<=iHOODSIZE; iHOODINDEX++){
+				iNeighbor[iHOODINDEX] = iPopindex - (iHOODSIZE / 2) + iHOODINDEX;
+				// for iPopindex = 1,goes from 0 to 2 for iHOODSIZE of 2
+				//                       from -1 to 3 for iHOODSIZE of 4
+				
+				// Now wrap the ends of the array
+				if(iNeighbor[iHOODINDEX] < 0){
+					iNeighbor[iHOODINDEX] += iPOPSIZE;
+				}
+				if(iNeighbor[iHOODINDEX] >= iPOPSIZE){
+					iNeighbor[iHOODINDEX] -= iPOPSIZE;
+				}
+				// Start with iNeighbor[0] as iLbest and try to beat it
+				if(iHOODINDEX == 0){
+					iLbest = iNeighbor[0];
+				}
+				if(fPbestVal[iNeighbor[iHOODINDEX]] < fPbestVal[iLbest]){
+					iLbest = iNeighbor[iHOODINDEX];
+				}
+			}
+		}
+		
+		if(iLOCAL == 0){
+			iLbest = swarm->iGbest;
+		}
+					
+		// Update velocity vector for one particle Russ Reduced version
+		for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){        	//fInerWt below
+			fVel[iPopindex][iDimindex] = (0.5 + (Rnd(stream) / 2.0)) * fVel[iPopindex][iDimindex] + 2.0 * Rnd(stream) * 
+										 (fBestPos[iPopindex][iDimindex] - fPos[iPopindex][iDimindex]) + 
+										 2.0 * Rnd(stream) * (fBestPos[iLbest][iDimindex] - fPos[iPopindex][iDimindex]);
+			 
+			if(fVel[iPopindex][iDimindex] > fMAXVEL){
+				fVel[iPopindex][iDimindex] = fMAXVEL;
+			}
+			else if(fVel[iPopindex][iDimindex] < -fMAXVEL){
+				fVel[iPopindex][iDimindex] = -fMAXVEL;
+			}
+		}
+		
+		//If it's going the right way, keep going
+		if(swarm->iBetter[iPopindex]== 1){
+			for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){
+				fVel[iPopindex][iDimindex] = fDumVel[iDimindex];
+			}
+		}
+
+		for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){  		// Define new positions for all dimensions
+			fPos[iPopindex][iDimindex] = fPos[iPopindex][iDimindex] + fVel[iPopindex][iDimindex];
+		}
+	}
 }
 
 //----------------------------------------------------------------------------
 
 //optimizer implementation (translated from VISUAL BASIC implementation at http://read.pudn.com/downloads137/sourcecode/math/587436/FRMSWARM.FRM__.htm)
 
-std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBoundsList bounds, int populationsize, int maxiterations, int idlerunlength)
+std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBoundsList bounds, int populationsize, int maxiterations, int idlerunlength, std::vector<iWQEvaluator *> clones, unsigned int seed)
 {
 	//declarations
 	int iPOPSIZE; 		// Population size
@@ -96,9 +228,7 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
 	double fMAXVEL; 	// Maximum velocity allowed
 	int nMAXITER;		// Maximum number of iterations
 	double ** fPos;		// Position for each particle
-	double ** fTempPos; // Temporary updated position for each particle
 	double ** fVel;		// Velocity for each particle
-	double * fDumVel;	// Dummy velocity vector 1-dim array
 	double ** fBestPos;	// Best previous position for each particle
 	iWQBoundsList fBounds;	//bounds for each dimension
 	double fInerWt; 	// Inertia weight
@@ -109,7 +239,6 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
 	int * iBetter; 		// This gets set in program
 	int iLOCAL;			// Neighborhood size specified in run file
 	int iHOODSIZE;		// Neighborhood size used in program
-	int * iNeighbor;	// Popindexes of neighbors resulting from iLOCAL
 	
 	printf("Running particle swarm optimization test.\n");
 	
@@ -139,6 +268,18 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
 		return std::vector<double> ();
 	}
 	
+	//evaluation contexts: the evaluator itself and its clones
+	std::vector<iWQEvaluator *> evaluators (1, evaluator);
+	for(int c=0; c<clones.size(); c++){
+		if(clones[c] && clones[c]->parameters() && clones[c]->parameters()->namesForPlainValues()==parnames){
+			evaluators.push_back(clones[c]);
+		}
+		else{
+			printf("[Warning]: Evaluator clone %d does not have the same parameters, it is left out of the PSO optimization.\n",c+1);
+		}
+	}
+	int numcontexts=evaluators.size();
+	
 	//other parameters
 	iPOPSIZE = populationsize; 	
 	fERRCUTOFF = idlerunlength;			//1E-6
@@ -153,27 +294,60 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
 	if(iHOODSIZE>iPOPSIZE){
 		iHOODSIZE=iPOPSIZE;
 	}
+	if(numcontexts>iPOPSIZE){
+		numcontexts=iPOPSIZE;	//no context without particles
+	}
 	
 	//furnish storages
 	fPos = make2Darray<double>(iPOPSIZE, iDIMENSIONS);
-	fTempPos = make2Darray<double>(iPOPSIZE, iDIMENSIONS);
 	fVel = make2Darray<double>(iPOPSIZE, iDIMENSIONS);
 	fBestPos = make2Darray<double>(iPOPSIZE, iDIMENSIONS);
-	fDumVel = make1Darray<double>(iDIMENSIONS);
 	fErrVal = make1Darray<double>(iPOPSIZE);
 	fPbestVal = make1Darray<double>(iPOPSIZE);
 	iBetter = make1Darray<int>(iPOPSIZE);
-	iNeighbor = make1Darray<int>(iHOODSIZE+1); //! -iPOPSIZE to iPOPSIZE
   
-	//init randomization
-	srand(time(0));
+	//init randomization: one stream per context, so a seed and a thread count always give the same swarm
+	if(seed==0){
+		seed=time(0);
+	}
+	iWQRandomUniformGenerator ** streams=new iWQRandomUniformGenerator * [numcontexts];
+	for(int c=0; c<numcontexts; c++){
+		streams[c]=new iWQRandomUniformGenerator(0.0, 1.0, c);
+		streams[c]->setSeed(seed+c);
+	}
+	
+	iWQSwarm swarm;
+	swarm.iPOPSIZE=iPOPSIZE;
+	swarm.iDIMENSIONS=iDIMENSIONS;
+	swarm.iLOCAL=iLOCAL;
+	swarm.iHOODSIZE=iHOODSIZE;
+	swarm.iUSEBETTER=iUSEBETTER;
+	swarm.fMAXVEL=fMAXVEL;
+	swarm.iGbest=0;
+	swarm.fBounds=&fBounds;
+	swarm.fPos=fPos;
+	swarm.fVel=fVel;
+	swarm.fBestPos=fBestPos;
+	swarm.fErrVal=fErrVal;
+	swarm.fPbestVal=fPbestVal;
+	swarm.iBetter=iBetter;
+	swarm.numcontexts=numcontexts;
+	swarm.evaluators=&evaluators[0];
+	swarm.streams=streams;
+	swarm.modelpos=make2Darray<double>(numcontexts, iDIMENSIONS);
+	swarm.fDumVel=make2Darray<double>(numcontexts, iDIMENSIONS);
+	swarm.iNeighbor=make2Darray<int>(numcontexts, iHOODSIZE+1); //! -iPOPSIZE to iPOPSIZE
+	
+	iWQThreadPool * pool=NULL;
+	if(numcontexts>1){
+		pool=new iWQThreadPool(numcontexts);
+		printf("[optimizer]: The swarm is evaluated in %d parallel contexts (seed: %u).\n",numcontexts,seed);
+	}
 	
 	int iPopindex; 		// Index for population
 	int iDimindex;		// Index for dimensions
 	int nIter;			// Number of iterations
-	int iHOODINDEX;		// Neighborhood index (offset from particle)
 	int iGbest; 		// Index for global best particle
-	int iLbest; 		// Index for local (neighborhood) best particle
 	double previousbest=0.0;
 	int samebestcount=0;
 	double modelpos [iDIMENSIONS];
@@ -182,16 +356,17 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
 		
 	// Randomize the positions and velocities for entire population
 	for(iPopindex=0; iPopindex<iPOPSIZE; iPopindex++){
+		iWQRandomUniformGenerator * stream=streams[iPopindex % numcontexts];
 		for(iDimindex = 0;  iDimindex<iDIMENSIONS; iDimindex++){
 			if(iPopindex==0){
 				fPos[iPopindex][iDimindex] = (parvals[iDimindex] - fBounds[iDimindex].min) / (fBounds[iDimindex].max-fBounds[iDimindex].min);	//the 1st particle is positioned in the original parameter value
 			}
 			else{
-				fPos[iPopindex][iDimindex] = Rnd(); // * fMaxPos;
+				fPos[iPopindex][iDimindex] = Rnd(stream); // * fMaxPos;
             }
 			fBestPos[iPopindex][iDimindex] = fPos[iPopindex][iDimindex];
-            fVel[iPopindex][iDimindex] = Rnd() * fMAXVEL;
-            if(Rnd()>0.5){
+            fVel[iPopindex][iDimindex] = Rnd(stream) * fMAXVEL;
+            if(Rnd(stream)>0.5){
 				fVel[iPopindex][iDimindex] *= -1.0; 
 			}
 		}
@@ -203,21 +378,17 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
         // Update inertia weight; linear from fINITWT to 0.4
         fInerWt = ((fINITWT - 0.4) * (nMAXITER - nIter) / (double)nMAXITER) + 0.4;
         
+		// evaluates f function for the whole generation
+		if(pool){
+			pool->run(numcontexts, swarmEvaluateTask, &swarm);
+		}
+		else{
+			swarmEvaluateTask(&swarm, 0);
+		}
+        
 		for(iPopindex = 0;  iPopindex<iPOPSIZE; iPopindex++){     			// MAIN main loop starts here
-            // Setup dummy velocity vector for current population member
-            for(iDimindex = 0; iDimindex<iDIMENSIONS; iDimindex++){
-				fDumVel[iDimindex] = fVel[iPopindex][iDimindex];
-            }
-            
             iBetter[iPopindex] = 0;             							// Set to 0 unless new Pbest achieved
             
-			//translate to model space 
-			for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){
-				modelpos[iDimindex]=fBounds[iDimindex].min+fPos[iPopindex][iDimindex]*(fBounds[iDimindex].max-fBounds[iDimindex].min);
-			}
-			
-            fErrVal[iPopindex]=evaluator->evaluate(modelpos, iDIMENSIONS);    			// evaluates f function: fErrVal(iPopindex)
-            
             if(nIter==0){
                 fPbestVal[iPopindex] = fErrVal[iPopindex];
                 iGbest = 0;
@@ -240,62 +411,14 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
             }                                     							// End new Pbest condition
 		}								          							// end MAIN main loop for gold gbest only
 		
-		for(iPopindex = 0; iPopindex<iPOPSIZE; iPopindex++){         		// update velocity & position
-      
-            // Does neighborhood calculation of iLbest
-            if(iLOCAL > 0){
-				//TODO: check this
-                for(iHOODINDEX = 0; iHOODINDEX<=iHOODSIZE; iHOODINDEX++){
-                    iNeighbor[iHOODINDEX] = iPopindex - (iHOODSIZE / 2) + iHOODINDEX;
-                    // for iPopindex = 1,goes from 0 to 2 for iHOODSIZE of 2
-                    //                       from -1 to 3 for iHOODSIZE of 4
-                    
-					// Now wrap the ends of the array
-                    if(iNeighbor[iHOODINDEX] < 0){
-						iNeighbor[iHOODINDEX] += iPOPSIZE;
-					}
-                    if(iNeighbor[iHOODINDEX] >= iPOPSIZE){
-						iNeighbor[iHOODINDEX] -= iPOPSIZE;
-					}
-                    // Start with iNeighbor[0] as iLbest and try to beat it
-                    if(iHOODINDEX == 0){
-						iLbest = iNeighbor[0];
-					}
-                    if(fPbestVal[iNeighbor[iHOODINDEX]] < fPbestVal[iLbest]){
-						iLbest = iNeighbor[iHOODINDEX];
-					}
-                }
-            }
-            
-			if(iLOCAL == 0){
-				iLbest = iGbest;
-			}
-                        
-            // Update velocity vector for one particle Russ Reduced version
-            for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){        	//fInerWt below
-                fVel[iPopindex][iDimindex] = (0.5 + (Rnd() / 2.0)) * fVel[iPopindex][iDimindex] + 2.0 * Rnd() * 
-											 (fBestPos[iPopindex][iDimindex] - fPos[iPopindex][iDimindex]) + 
-											 2.0 * Rnd() * (fBestPos[iLbest][iDimindex] - fPos[iPopindex][iDimindex]);
-                 
-                if(fVel[iPopindex][iDimindex] > fMAXVEL){
-                    fVel[iPopindex][iDimindex] = fMAXVEL;
-				}
-                else if(fVel[iPopindex][iDimindex] < -fMAXVEL){
-                    fVel[iPopindex][iDimindex] = -fMAXVEL;
-                }
-            }
-            
-            //If it's going the right way, keep going
-            if(iBetter[iPopindex]== 1){
-                for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){
-                    fVel[iPopindex][iDimindex] = fDumVel[iDimindex];
-                }
-            }
-
-            for(iDimindex=0; iDimindex<iDIMENSIONS; iDimindex++){  		// Define new positions for all dimensions
-                fPos[iPopindex][iDimindex] = fPos[iPopindex][iDimindex] + fVel[iPopindex][iDimindex];
-            }
-		}                	//end velocity & position loop
+		// update velocity & position
+		swarm.iGbest=iGbest;
+		if(pool){
+			pool->run(numcontexts, swarmMoveTask, &swarm);
+		}
+		else{
+			swarmMoveTask(&swarm, 0);
+		}
 		
 		//write out iteration details
 		//translate to model space
@@ -340,15 +463,22 @@ std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBounds
 	}
 	
 	//delete storages
+	if(pool){
+		delete pool;
+	}
+	for(int c=0; c<numcontexts; c++){
+		delete streams[c];
+	}
+	delete [] streams;
+	delete2Darray<double>(swarm.modelpos, numcontexts, iDIMENSIONS);
+	delete2Darray<double>(swarm.fDumVel, numcontexts, iDIMENSIONS);
+	delete2Darray<int>(swarm.iNeighbor, numcontexts, iHOODSIZE+1);
 	delete2Darray<double>(fPos, iPOPSIZE, iDIMENSIONS);
-	delete2Darray<double>(fTempPos, iPOPSIZE, iDIMENSIONS);
 	delete2Darray<double>(fVel, iPOPSIZE, iDIMENSIONS);
 	delete2Darray<double>(fBestPos, iPOPSIZE, iDIMENSIONS);
-	delete [] fDumVel;
 	delete [] fErrVal;
 	delete [] fPbestVal;
 	delete [] iBetter;
-	delete [] iNeighbor;
 	
 	return result;
 }
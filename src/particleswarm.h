@@ -36,6 +36,8 @@ public:
 
 //----------------------------------------------------------------------------
 
-std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBoundsList bounds, int populationsize, int maxiterations=2000, int idlerunlength=50);
+//clones are independent evaluators of the same layout: with clones, each generation is evaluated in parallel
+//seed 0 seeds from the clock, otherwise the result is reproducible for the same seed and number of clones
+std::vector<double> iWQParticleSwarmOptimize(iWQEvaluator * evaluator, iWQBoundsList bounds, int populationsize, int maxiterations=2000, int idlerunlength=50, std::vector<iWQEvaluator *> clones=std::vector<iWQEvaluator *>(), unsigned int seed=0);
 
 #endif
@@ -30,6 +30,7 @@
 #include "seriesinterface.h"
 #include "filter.h"
 #include "script.h"
+#include "threadpool.h"
 
 //BEGIN NEW
 #include "Eigen/Dense"
@@ -78,24 +79,7 @@ void iWQModelLayout::printError(std::string errormessage, TiXmlElement * element
 
 iWQModelLayout::iWQModelLayout(std::string filename)
 {
-	mModels.clear();
-	mLinks.clear();
-	mExportLinks.clear();
-	mSolver=NULL;
-	mCommonParameters=NULL;
-	mEvaluator=NULL;
-	//mEvaluatorMethod=NULL;
-	mDataTable=NULL;
-	mComparisonLinks.clear();
-	mInitVals=NULL;
-	mFilename="";
-	mSeriesInterface=NULL;
-	mFilters.clear();
-	mPreScripts.clear();
-	mPostScripts.clear();
-	
-	//initialize model factory
-	mModelFactory=new iWQModelFactory("models");
+	emptyInit();
 	
 	//read conf from an xml file
 	TiXmlDocument * doc=new TiXmlDocument(filename.c_str());
@@ -104,6 +88,7 @@ iWQModelLayout::iWQModelLayout(std::string filename)
 		if(doc->Error()){
 			printf("%s:%d (%d) error code %d:\t%s\n",filename.c_str(),doc->ErrorRow(),doc->ErrorCol(),doc->ErrorId(),doc->ErrorDesc());
 		}
+		delete doc;
 		return;
 	}
 	else{
@@ -111,9 +96,56 @@ iWQModelLayout::iWQModelLayout(std::string filename)
 	}
 	if(doc->Error()){
 		printf("[Error]: %s:%d %s.\n",filename.c_str(),doc->ErrorRow(), doc->ErrorDesc());
+		delete doc;
+		return;
+	}
+	loadDocument(doc);
+}
+
+//---------------------------------------------------------------------------------------
+
+iWQModelLayout::iWQModelLayout(iWQModelLayout * layout)
+{
+	//the document as the other layout has loaded it, even if the file has changed since then
+	emptyInit();
+	if(!layout || !layout->mDocument){
 		return;
 	}
+	mFilename=layout->mFilename;
+	loadDocument(new TiXmlDocument(*layout->mDocument));
+}
+
+//---------------------------------------------------------------------------------------
+
+void iWQModelLayout::emptyInit()
+{
+	mModels.clear();
+	mLinks.clear();
+	mExportLinks.clear();
+	mSolver=NULL;
+	mCommonParameters=NULL;
+	mEvaluator=NULL;
+	//mEvaluatorMethod=NULL;
+	mDataTable=NULL;
+	mComparisonLinks.clear();
+	mInitVals=NULL;
+	mFilename="";
+	mSeriesInterface=NULL;
+	mFilters.clear();
+	mPreScripts.clear();
+	mPostScripts.clear();
+	mDocument=NULL;
 	
+	//initialize model factory
+	mModelFactory=new iWQModelFactory("models");
+}
+
+//---------------------------------------------------------------------------------------
+
+void iWQModelLayout::loadDocument(TiXmlDocument * doc)
+{
+	//the document is kept for the copies of the layout
+	mDocument=doc;
 	TiXmlHandle docHandle (doc);
 	
 	//check layout version
@@ -181,14 +213,13 @@ iWQModelLayout::iWQModelLayout(std::string filename)
 		//CONFIG OPTIMIZER
 		configureOptimizer(docHandle);
 	}
-	
-	delete doc;
 }
 
 //---------------------------------------------------------------------------------------
 
 iWQModelLayout::~iWQModelLayout()
 {
+	if(mDocument) delete mDocument;
 	if(mEvaluator) delete mEvaluator;
 	if(mSeriesInterface) delete mSeriesInterface;
 	if(mDataTable) delete mDataTable;
@@ -429,7 +460,27 @@ void iWQModelLayout::loadData(TiXmlHandle docHandle)
 		std::string datafilename="";
 		mDataColsToExport.clear();
 		if(xdata->QueryStringAttribute("src",&datafilename)==TIXML_SUCCESS){
-			mDataTable=new iWQDataTable (datafilename);
+			std::string streamstr;
+			bool stream=false;
+			if(xdata->QueryStringAttribute("stream",&streamstr)==TIXML_SUCCESS){
+				std::transform(streamstr.begin(), streamstr.end(), streamstr.begin(), ::tolower);
+				stream=(streamstr.compare("1")==0 || streamstr.compare("true")==0);
+			}
+			if(stream){
+				//only a window of the rows is in memory
+				int windowrows=IWQ_STREAM_WINDOW_ROWS;
+				if(xdata->QueryIntAttribute("streamrows",&windowrows)==TIXML_SUCCESS && windowrows<1){
+					printError("[streamrows] should be at least 1 for <data>.",xdata,0);
+					windowrows=IWQ_STREAM_WINDOW_ROWS;
+				}
+				mDataTable=new iWQDataTable;
+				if(mDataTable->openStream(datafilename, windowrows)){
+					printf("[data]: \"%s\" is streamed in windows of %d rows.\n",datafilename.c_str(),windowrows);
+				}
+			}
+			else{
+				mDataTable=new iWQDataTable (datafilename);
+			}
 			//check if loaded correctly
 			if(!mDataTable->numRows()){
 				//empty or corrupted file
@@ -1407,6 +1458,75 @@ void iWQModelLayout::configureSolver(TiXmlHandle docHandle)
 			mSolver->setMinStepLength(minstep);
 			stepset=true;
 		}
+		std::string warmstr;
+		if(xsolver->QueryStringAttribute("warmrestart",&warmstr)==TIXML_SUCCESS){
+			std::transform(warmstr.begin(), warmstr.end(), warmstr.begin(), ::tolower);
+			bool warm=(warmstr.compare("1")==0 || warmstr.compare("true")==0);
+			mSolver->setWarmRestart(warm);
+			if(warm){
+				printf("[solver]: Integrators are kept between timesteps (warm restart).\n");
+			}
+		}
+		int sampling;
+		if(xsolver->QueryIntAttribute("warmrestartsampling",&sampling)==TIXML_SUCCESS){
+			if(sampling<0){
+				printError("[warmrestartsampling] should not be negative for <solver>.",xsolver,0);
+				sampling=0;
+			}
+			mSolver->setWarmRestartSampling(sampling);
+			if(sampling){
+				printf("[solver]: Every %d. warm step is repeated with a cold start to measure the savings (diagnostics).\n",sampling);
+			}
+		}
+		std::string sparsestr;
+		if(xsolver->QueryStringAttribute("sparsejacobian",&sparsestr)==TIXML_SUCCESS){
+			std::transform(sparsestr.begin(), sparsestr.end(), sparsestr.begin(), ::tolower);
+			bool sparse=(sparsestr.compare("1")==0 || sparsestr.compare("true")==0);
+			mSolver->setSparseJacobian(sparse);
+			if(sparse){
+				printf("[solver]: Jacobians are built from their probed structure (sparse Jacobian).\n");
+			}
+		}
+		std::string parallelstr;
+		if(xsolver->QueryStringAttribute("parallel",&parallelstr)==TIXML_SUCCESS){
+			std::transform(parallelstr.begin(), parallelstr.end(), parallelstr.begin(), ::tolower);
+			if(parallelstr.compare("1")==0 || parallelstr.compare("true")==0){
+				int numthreads=iWQThreadPool::hardwareThreads();
+				if(xsolver->QueryIntAttribute("threads",&numthreads)==TIXML_SUCCESS && numthreads<1){
+					printError("[threads] should be at least 1 for <solver>.",xsolver,0);
+					numthreads=1;
+				}
+				mSolver->setNumThreads(numthreads);
+				if(mSolver->numThreads()>1){
+					printf("[solver]: Models of the same layer are solved in parallel (%d threads, %d layers).\n",mSolver->numThreads(),mSolver->numLayers());
+				}
+			}
+		}
+		std::string trajectorystr;
+		if(xsolver->QueryStringAttribute("trajectory",&trajectorystr)==TIXML_SUCCESS){
+			std::transform(trajectorystr.begin(), trajectorystr.end(), trajectorystr.begin(), ::tolower);
+			bool trajectory=(trajectorystr.compare("1")==0 || trajectorystr.compare("true")==0);
+			if(!mSolver->setTrajectoryMode(trajectory, mDataTable)){
+				printError("The model layout does not allow solving whole trajectories, models are solved row by row.",xsolver,0);
+			}
+			else if(trajectory){
+				printf("[solver]: Each model is solved over the whole time series before the next one (trajectory mode).\n");
+			}
+		}
+		std::string cachestr;
+		if(xsolver->QueryStringAttribute("cache",&cachestr)==TIXML_SUCCESS){
+			std::transform(cachestr.begin(), cachestr.end(), cachestr.begin(), ::tolower);
+			bool cache=(cachestr.compare("1")==0 || cachestr.compare("true")==0);
+			if(cache && !mSolver->trajectoryMode()){
+				printError("[cache] needs [trajectory] for <solver>, omitted.",xsolver,0);
+			}
+			else{
+				mSolver->setTrajectoryCache(cache);
+				if(cache){
+					printf("[solver]: Model trajectories are replayed when their parameters and inputs did not change.\n");
+				}
+			}
+		}
 		
 		//jump to next
 		next=xsolver->NextSibling("solver");
@@ -1460,8 +1580,101 @@ void iWQModelLayout::configureOptimizer(TiXmlHandle docHandle)
 			if(xpso->QueryIntAttribute("size",&swarmsize)==TIXML_SUCCESS){
 				mEvaluator->PSOSwarmSize=swarmsize;
 			}
+			std::string parallelstr;
+			if(xpso->QueryStringAttribute("parallel",&parallelstr)==TIXML_SUCCESS){
+				std::transform(parallelstr.begin(), parallelstr.end(), parallelstr.begin(), ::tolower);
+				if(parallelstr.compare("1")==0 || parallelstr.compare("true")==0){
+					int numthreads=iWQThreadPool::hardwareThreads();
+					if(xpso->QueryIntAttribute("threads",&numthreads)==TIXML_SUCCESS && numthreads<1){
+						printError("[threads] should be at least 1 for <particle-swarm>.",xpso,0);
+						numthreads=1;
+					}
+					mEvaluator->PSOThreads=numthreads;
+				}
+			}
+			int seed;
+			if(xpso->QueryIntAttribute("seed",&seed)==TIXML_SUCCESS){
+				mEvaluator->PSOSeed=seed;
+			}
+			if(active){
+				printf("[optimizer]: Particle Swarm optimization is active (size: %d, rounds: %d, idlelimit: %d)\n",mEvaluator->PSOSwarmSize,mEvaluator->PSOMaxNumRounds,mEvaluator->PSOMaxIdleRounds);
+				if(mEvaluator->PSOThreads>1){
+					printf("[optimizer]: Particles are evaluated in parallel on %d copies of the layout.\n",mEvaluator->PSOThreads);
+				}
+			}
+		}
+		
+		//check CMA-ES
+		TiXmlNode * cmaes=xopt->FirstChild("cma-es");
+		TiXmlElement * xcmaes=NULL;
+		if(cmaes){
+			xcmaes=cmaes->ToElement();
+		}
+		if(xcmaes){
+			bool active=false;
+			std::string activestr;
+			if(xcmaes->QueryStringAttribute("active",&activestr)==TIXML_SUCCESS){
+				std::transform(activestr.begin(), activestr.end(), activestr.begin(), ::tolower);
+				active=(activestr.compare("1")==0 || activestr.compare("true")==0);
+				mEvaluator->CMAESActive=active;
+			}
+			iWQCMAESOptimizer & cma=mEvaluator->CMAES;
+			if(xcmaes->QueryIntAttribute("size",&cma.populationSize)==TIXML_SUCCESS && cma.populationSize<2){
+				printError("[size] should be at least 2 for <cma-es>.",xcmaes,0);
+				cma.populationSize=0;
+			}
+			xcmaes->QueryIntAttribute("maxevaluations",&cma.maxEvaluations);
+			xcmaes->QueryIntAttribute("restarts",&cma.maxRestarts);
+			xcmaes->QueryDoubleAttribute("sigma",&cma.initialSigma);
+			xcmaes->QueryDoubleAttribute("tolerance",&cma.tolerance);
+			int seed;
+			if(xcmaes->QueryIntAttribute("seed",&seed)==TIXML_SUCCESS){
+				cma.seed=seed;
+			}
+			std::string parallelstr;
+			if(xcmaes->QueryStringAttribute("parallel",&parallelstr)==TIXML_SUCCESS){
+				std::transform(parallelstr.begin(), parallelstr.end(), parallelstr.begin(), ::tolower);
+				if(parallelstr.compare("1")==0 || parallelstr.compare("true")==0){
+					int numthreads=iWQThreadPool::hardwareThreads();
+					if(xcmaes->QueryIntAttribute("threads",&numthreads)==TIXML_SUCCESS && numthreads<1){
+						printError("[threads] should be at least 1 for <cma-es>.",xcmaes,0);
+						numthreads=1;
+					}
+					mEvaluator->CMAESThreads=numthreads;
+				}
+			}
+			if(active){
+				printf("[optimizer]: CMA-ES optimization is active (size: %d, evaluations: %d, restarts: %d, sigma: %g)\n",cma.populationSize,cma.maxEvaluations,cma.maxRestarts,cma.initialSigma);
+				if(mEvaluator->CMAESThreads>1){
+					printf("[optimizer]: Offspring are evaluated in parallel on %d copies of the layout.\n",mEvaluator->CMAESThreads);
+				}
+			}
+		}
+		
+		//check L-BFGS-B
+		TiXmlNode * lbfgsb=xopt->FirstChild("l-bfgs-b");
+		TiXmlElement * xlbfgsb=NULL;
+		if(lbfgsb){
+			xlbfgsb=lbfgsb->ToElement();
+		}
+		if(xlbfgsb){
+			bool active=false;
+			std::string activestr;
+			if(xlbfgsb->QueryStringAttribute("active",&activestr)==TIXML_SUCCESS){
+				std::transform(activestr.begin(), activestr.end(), activestr.begin(), ::tolower);
+				active=(activestr.compare("1")==0 || activestr.compare("true")==0);
+				mEvaluator->LBFGSBActive=active;
+			}
+			iWQLBFGSBOptimizer & lbfgs=mEvaluator->LBFGSB;
+			xlbfgsb->QueryIntAttribute("maxiterations",&lbfgs.maxIterations);
+			if(xlbfgsb->QueryIntAttribute("memory",&lbfgs.memory)==TIXML_SUCCESS && lbfgs.memory<1){
+				printError("[memory] should be at least 1 for <l-bfgs-b>.",xlbfgsb,0);
+				lbfgs.memory=5;
+			}
+			xlbfgsb->QueryDoubleAttribute("tolerance",&lbfgs.tolerance);
+			xlbfgsb->QueryDoubleAttribute("gradienttolerance",&lbfgs.gradientTolerance);
 			if(active){
-				printf("[optimizer]: Particle Swarm optimization is active (size: %d, rounds: %d, idlelimit: %d)\n",swarmsize,numrounds,numidlerounds);
+				printf("[optimizer]: L-BFGS-B optimization is active (iterations: %d, memory: %d), gradients from the forward sensitivities\n",lbfgs.maxIterations,lbfgs.memory);
 			}
 		}
 		
@@ -1478,9 +1691,7 @@ void iWQModelLayout::configureOptimizer(TiXmlHandle docHandle)
 			std::string activestr;
 			if(xnms->QueryStringAttribute("active",&activestr)==TIXML_SUCCESS){
 				std::transform(activestr.begin(), activestr.end(), activestr.begin(), ::tolower);
-				if(activestr.compare("1")==0 || activestr.compare("true")==0){
-					active=true;
-				}
+				active=(activestr.compare("1")==0 || activestr.compare("true")==0);
 				mEvaluator->NMSActive=active;
 			}
 			if(xnms->QueryIntAttribute("maxnumrounds",&numrounds)==TIXML_SUCCESS){
@@ -1493,6 +1704,30 @@ void iWQModelLayout::configureOptimizer(TiXmlHandle docHandle)
 				printf("[optimizer]: Nelder-Mead Simplex optimization is active (max. rounds: %d, tolerance: %g)\n",numrounds,tolerance);
 			}
 		}
+		
+		//early rejection of MCMC proposals
+		TiXmlNode * rejection=xopt->FirstChild("early-rejection");
+		TiXmlElement * xrejection=NULL;
+		if(rejection){
+			xrejection=rejection->ToElement();
+		}
+		if(xrejection){
+			bool active=false;
+			int chunk=100;
+			std::string activestr;
+			if(xrejection->QueryStringAttribute("active",&activestr)==TIXML_SUCCESS){
+				std::transform(activestr.begin(), activestr.end(), activestr.begin(), ::tolower);
+				active=(activestr.compare("1")==0 || activestr.compare("true")==0);
+			}
+			if(xrejection->QueryIntAttribute("chunk",&chunk)==TIXML_SUCCESS && chunk<1){
+				printError("[chunk] should be at least 1 for <early-rejection>.",xrejection,0);
+				chunk=100;
+			}
+			mEvaluator->RejectionChunk=active?chunk:0;
+			if(active){
+				printf("[optimizer]: MCMC proposals are rejected early (checked every %d rows)\n",chunk);
+			}
+		}
 			
 		//jump to next
 		next=xopt->NextSibling("optimizer");
@@ -1530,7 +1765,7 @@ iWQModelLayoutValidity iWQModelLayout::validity()
 	if(mDataTable && mSolver && mSolver->valid() && mCommonParameters && mInitVals && mDataTable->timePort() && mDataTable->numRows()){
 		//criteria for running
 		result=IWQ_VALID_FOR_RUN;
-		if(mEvaluator && mComparisonLinks.size()){
+		if(mEvaluator && mComparisonLinks.size() && !mDataTable->isStreamed()){
 			//criteria for evaluation
 			result=IWQ_VALID_FOR_CALIBRATE;
 		}
@@ -1564,6 +1799,10 @@ bool iWQModelLayout::verify()
 //private method without validity check: returns if the solution is stable
 bool iWQModelLayout::runmodel(int * firsterrorrow, double * firsterrort)
 {
+	if(mDataTable->isStreamed()){
+		printf("[Error]: The streamed data table holds a window of the rows only, it can only be used with RUN.\n");
+		return false;
+	}
 	mDataTable->rewind();
 	double * t=mDataTable->timePort();
 	double prev_t = *t;
@@ -1585,20 +1824,50 @@ bool iWQModelLayout::runmodel(int * firsterrorrow, double * firsterrort)
 	mSolver->saveInitVals(yfeed);
 	
 	//run models
-	while(mDataTable->stepRow()!=-1){
-		
-		if(!mSolver->solve1Step(prev_t, *t, yfeed)){
-			if(stable && firsterrorrow){
-				*firsterrorrow = mDataTable->pos();
+	if(mSolver->trajectoryMode()){
+		std::vector<int> failedrows;
+		if(!mSolver->solveTrajectory(mDataTable, mDataTable->numRows(), yfeed, &failedrows)){
+			if(firsterrorrow && failedrows.size()){
+				*firsterrorrow = failedrows[0];
 			}
-			if(stable && firsterrort){
-				*firsterrort = prev_t;
+			if(firsterrort && failedrows.size()){
+				*firsterrort = mDataTable->valueForColumn(mDataTable->timeColumn(), failedrows[0]-1);
 			}
-			stable=false;	
+			stable=false;
 		}
+	}
+	else{
+#ifdef IWQ_DEBUG
+		long steadyallocations=0;
+#endif
+		while(mDataTable->stepRow()!=-1){
+		
+#ifdef IWQ_DEBUG
+			long allocationsbefore=iWQHeapAllocationCount();
+#endif
+			bool solved=mSolver->solve1Step(prev_t, *t, yfeed);
+#ifdef IWQ_DEBUG
+			if(!yfeed){
+				//the solver should not allocate anything after the first row
+				steadyallocations+=iWQHeapAllocationCount()-allocationsbefore;
+			}
+#endif
+			if(!solved){
+				if(stable && firsterrorrow){
+					*firsterrorrow = mDataTable->pos();
+				}
+				if(stable && firsterrort){
+					*firsterrort = prev_t;
+				}
+				stable=false;	
+			}
 				
-		prev_t = *t;
-		yfeed=NULL;
+			prev_t = *t;
+			yfeed=NULL;
+		}
+#ifdef IWQ_DEBUG
+		printf("[Debug]: %ld heap allocations in the solver after the first row.\n",steadyallocations);
+#endif
 	}
 	
 	//run POST scripts
@@ -1635,7 +1904,25 @@ void iWQModelLayout::run()
 	}
 	int firsterrorrow = -1;
 	double firsterrort = -DBL_MAX;
-	if(!runmodel(&firsterrorrow, &firsterrort)){
+	mSolver->resetIntegratorStatistics();
+	bool stable=runmodel(&firsterrorrow, &firsterrort);
+	reportRun(stable, firsterrorrow, firsterrort);
+}
+
+//---------------------------------------------------------------------------------------
+
+void iWQModelLayout::reportRun(bool stable, int firsterrorrow, double firsterrort)
+{
+	if(mSolver->warmRestart()){
+		iWQIntegratorStatistics stats=mSolver->integratorStatistics();
+		printf("[solver]: %ld warm (%ld after input jumps) and %ld cold integrator steps, %ld RHS evaluations",
+			   stats.warmSteps, stats.restartSteps, stats.coldSteps, stats.warmEvaluations+stats.coldEvaluations);
+		if(mSolver->warmRestartSampling()){
+			printf(", approx. %ld evaluations saved by warm restart",stats.savedEvaluations());
+		}
+		printf(".\n");
+	}
+	if(!stable){
 		printf("[Warning]: Numerical stability could not be achieved with the minimal stepsize of %e.\n",mSolver->minStepLength());
 		std::vector<std::string> parnames=mCommonParameters->namesForPlainValues();
 		std::vector<double> parvalues=mCommonParameters->plainValues();
@@ -1668,6 +1955,117 @@ void iWQModelLayout::run()
 
 //---------------------------------------------------------------------------------------
 
+void iWQModelLayout::runStreaming(std::string filename)
+{
+	if(validity()<IWQ_VALID_FOR_RUN){
+		printf("[Error]: Model layout is not suitable to run.\n");
+		return;
+	}
+	if(!mDataTable->isStreamed()){
+		run();
+		saveResults(filename);
+		return;
+	}
+	if(!verify()){
+		printf("[Error]: Model layout contains defects.\n");
+		return;
+	}
+	if(mPreScripts.size()>0 || mPostScripts.size()>0){
+		printf("[Error]: Scripts need the whole data table, they cannot run on a streamed one.\n");
+		return;
+	}
+	for(int i=0; i<mFilters.size(); i++){
+		for(int j=0; j<=i && mFilters[i]; j++){
+			//the rows kept for the next window would be filtered again, with filtered values as input
+			if(mFilters[j] && mFilters[i]->destFieldName().compare(mFilters[j]->srcFieldName())==0){
+				printf("[Error]: Filter into \"%s\" overwrites the source of a filter, it cannot run on a streamed data table.\n",mFilters[i]->destFieldName().c_str());
+				return;
+			}
+		}
+	}
+	if(!mDataTable->rewindStream()){
+		printf("[Error]: The streamed data table has no rows.\n");
+		return;
+	}
+	FILE * f=fopen(filename.c_str(),"w");
+	if(!f){
+		printf("[Error]: Failed to write data table to \"%s\".\n",filename.c_str());
+		return;
+	}
+	
+	//the models are stepped row by row
+	bool trajectory=mSolver->trajectoryMode();
+	if(trajectory){
+		mSolver->setTrajectoryMode(false, mDataTable);
+	}
+	
+	//rows kept from the previous window for the filters: a filtered value is final when all its
+	//window was in the table, chained filters add up their reach
+	int lookback=0;
+	int lookahead=0;
+	for(int i=0; i<mFilters.size(); i++){
+		if(mFilters[i]){
+			lookback+=mFilters[i]->windowCenter();
+			lookahead+=mFilters[i]->windowLength()-mFilters[i]->windowCenter()-1;
+		}
+	}
+	int overlap=lookback+lookahead;
+	
+	int firsterrorrow = -1;
+	double firsterrort = -DBL_MAX;
+	mSolver->resetIntegratorStatistics();
+	mDataTable->rewind();
+	double * t=mDataTable->timePort();
+	double prev_t = *t;
+	iWQInitialValues * yfeed=mInitVals;
+	mSolver->saveInitVals(yfeed);
+	bool stable=true;
+	int firstrow=1;			//first row to solve in the window
+	int firstexport=0;		//first row not yet in the file
+	mDataTable->writeRowsToFile(f, 0, 0, true);
+	for(;;){
+		int numrows=mDataTable->numRows();
+		for(int r=firstrow; r<numrows; r++){
+			mDataTable->setRow(r);
+			if(!mSolver->solve1Step(prev_t, *t, yfeed)){
+				if(stable){
+					firsterrorrow = mDataTable->windowStart()+r;
+					firsterrort = prev_t;
+				}
+				stable=false;
+			}
+			prev_t = *t;
+			yfeed=NULL;
+		}
+		for(int i=0; i<mFilters.size(); i++){
+			if(mFilters[i]){
+				mFilters[i]->filter();
+			}
+		}
+		
+		//the last rows wait for the next window if the filters look ahead
+		int endexport=std::max(firstexport, numrows-lookahead);
+		mDataTable->writeRowsToFile(f, firstexport, endexport, false);
+		int keep=std::min(std::max(overlap, 1), numrows);
+		int newrows=mDataTable->loadNextWindow(keep);
+		firstrow=keep;
+		firstexport=endexport-(numrows-keep);
+		if(newrows==0){
+			//the end of the series: the waiting rows are final
+			mDataTable->writeRowsToFile(f, firstexport, mDataTable->numRows(), false);
+			break;
+		}
+	}
+	fclose(f);
+	
+	if(trajectory){
+		mSolver->setTrajectoryMode(true, mDataTable);
+	}
+	reportRun(stable, firsterrorrow, firsterrort);
+}
+
+//---------------------------------------------------------------------------------------
+
 double iWQModelLayout::evaluate()
 {
 	if(validity()<IWQ_VALID_FOR_CALIBRATE){
@@ -1694,12 +2092,86 @@ void iWQModelLayout::calibrate()
 		return;
 	}
 	mEvaluator->printWarnings=false;
+	mSolver->resetTrajectoryCacheStatistics();
+	
+	//independent copies of the layout for the parallel global optimizers
+	int numthreads=1;
+	if(mEvaluator->PSOActive){
+		numthreads=std::max(numthreads, mEvaluator->PSOThreads);
+	}
+	if(mEvaluator->CMAESActive){
+		numthreads=std::max(numthreads, mEvaluator->CMAESThreads);
+	}
+	std::vector<iWQModelLayout *> clones;
+	if(numthreads>1){
+		if(mPreScripts.size()>0 || mPostScripts.size()>0){
+			printf("[Warning]: Layouts with scripts are not copied, the optimizers evaluate sequentially.\n");
+		}
+		else{
+			for(int i=1; i<numthreads; i++){
+				iWQModelLayout * layout=clone();
+				if(!layout){
+					break;
+				}
+				clones.push_back(layout);
+				mEvaluator->OptimizerClones.push_back(layout->evaluator());
+			}
+		}
+	}
+	
 	mEvaluator->calibrate();
+	
+	mEvaluator->OptimizerClones.clear();
+	for(int i=0; i<clones.size(); i++){
+		delete clones[i];
+	}
+	reportTrajectoryCache();
 	mEvaluator->printWarnings=true;
 }
 
 //---------------------------------------------------------------------------------------
 
+iWQModelLayout * iWQModelLayout::clone()
+{
+	//same document, with the live state of this layout: data, initial values, parameter values and evaluation interval
+	iWQModelLayout * layout=new iWQModelLayout(this);
+	if(layout->validity()<IWQ_VALID_FOR_CALIBRATE){
+		printf("[Error]: Failed to copy the model layout.\n");
+		delete layout;
+		return NULL;
+	}
+	layout->dataTable()->copyValuesFrom(mDataTable);
+	layout->initialValues()->copyValuesFrom(mInitVals);
+	layout->parameters()->setPlainValues(mCommonParameters->plainValues());
+	layout->evaluator()->copyStateFrom(mEvaluator);
+	layout->evaluator()->printWarnings=false;
+	return layout;
+}
+
+//---------------------------------------------------------------------------------------
+
+void iWQModelLayout::reportTrajectoryCache()
+{
+	if(!mSolver || !mSolver->trajectoryCache()){
+		return;
+	}
+	long hits=mSolver->trajectoryCacheHits();
+	long total=hits+mSolver->trajectoryCacheMisses();
+	printf("[solver]: %ld of %ld model trajectories replayed from the cache (%.1f%% hit rate).\n", hits, total, (total>0)?100.0*hits/total:0.0);
+}
+
+//---------------------------------------------------------------------------------------
+
+void iWQModelLayout::reportEarlyRejections()
+{
+	if(!mEvaluator || mEvaluator->boundedRuns()==0){
+		return;
+	}
+	printf("[evaluator]: %ld of %ld proposals rejected early, %.1f%% of their rows were not simulated.\n", mEvaluator->earlyRejections(), mEvaluator->boundedRuns(), 100.0*mEvaluator->skippedRowRatio());
+}
+
+//---------------------------------------------------------------------------------------
+
 #pragma mark File I/O wrappers 
 
 void iWQModelLayout::saveParameters(std::string filename, bool tabdelimited)
@@ -1821,22 +2293,79 @@ void iWQModelLayout::saveLayoutGraph(std::string dotfilename)
 
 #pragma mark Sensitivity analysis
 
-void iWQModelLayout::localSensitivityAnalysis(double rel_deviance, std::string target, std::string filename)
+bool iWQModelLayout::forwardSensitivityRun(std::string target, std::vector<double *> ports)
 {
-	if(validity()<IWQ_VALID_FOR_RUN){
-		printf("[Error]: Local sensitivity analysis failed: setup is not valid to run.\n");
-		return;
+	double * targetport=mDataTable->portForColumn(target);
+	if(!targetport || ports.size()!=mCommonParameters->numberOfParams()){
+		return false;
+	}
+	if(mPreScripts.size()>0 || mPostScripts.size()>0 || mFilters.size()>0){
+		printf("[Warning]: Scripts and filters are left out of the forward sensitivities.\n");
 	}
 	
-	//new columns
-	std::vector<std::string> newcols;
+	//the sensitivities are integrated row by row
+	bool trajectory=mSolver->trajectoryMode();
+	if(trajectory){
+		mSolver->setTrajectoryMode(false, mDataTable);
+	}
+	std::vector<int> slots;
+	for(int i=0; i<ports.size(); i++){
+		slots.push_back(i);
+	}
+	mSolver->setSensitivityParameters(slots);
 	
-	//basename
-	std::string basename=target+std::string(" base");
-	//newcols.push_back(basename);
+	mDataTable->rewind();
+	double * t=mDataTable->timePort();
+	double prev_t = *t;
+	iWQInitialValues * yfeed=mInitVals;
+	mSolver->saveInitVals(yfeed);
+	for(int i=0; i<ports.size(); i++){
+		*ports[i]=0.0;
+	}
+	bool stable=true;
+	bool exported=true;
+	while(mDataTable->stepRow()!=-1){
+		stable=mSolver->solve1Step(prev_t, *t, yfeed) && stable;
+		const double * sens=mSolver->sensitivitiesForPort(targetport);
+		exported=(sens!=NULL);
+		for(int i=0; i<ports.size(); i++){
+			*ports[i]=(sens)?sens[i]:0.0;
+		}
+		prev_t = *t;
+		yfeed=NULL;
+	}
 	
-	//make base run / with full warnings
-	run();
+	mSolver->setSensitivityParameters(std::vector<int> ());
+	if(trajectory){
+		mSolver->setTrajectoryMode(true, mDataTable);
+	}
+	if(!exported){
+		printf("[Error]: %s is not written by the models.\n",target.c_str());
+	}
+	if(!stable){
+		printf("[Warning]: Numerical stability could not be achieved in the forward sensitivity run.\n");
+	}
+	return exported;
+}
+
+//---------------------------------------------------------------------------------------
+
+void iWQModelLayout::localSensitivityAnalysis(double rel_deviance, std::string target, std::string filename, bool forward)
+{
+	if(validity()<IWQ_VALID_FOR_RUN){
+		printf("[Error]: Local sensitivity analysis failed: setup is not valid to run.\n");
+		return;
+	}
+	
+	//new columns
+	std::vector<std::string> newcols;
+	
+	//basename
+	std::string basename=target+std::string(" base");
+	//newcols.push_back(basename);
+	
+	//make base run / with full warnings
+	run();
 	
 	//copy results
 	mDataTable->copyColumn(target, basename);
@@ -1855,18 +2384,37 @@ void iWQModelLayout::localSensitivityAnalysis(double rel_deviance, std::string t
 	//make the sensitivity analysis
 	std::vector<double> pars;
 	int numpars=par_backup.size();
-	for(int i=0; i<numpars; i++){
-		//perturb a single parameter
-		pars.assign(par_backup.begin(),par_backup.end());
-		pars[i] *= 1.0 + rel_deviance;
-		mCommonParameters->setPlainValues(pars);
-		runmodel();
-		std::stringstream s;
-		s<<"SENSLOC_"<<target<<"_"<<par_names[i]<<"_"<<rel_deviance;
-		std::string newname=s.str();
-		mDataTable->copyColumn(target, newname);
-		newcols.push_back(newname);
-		modvals.push_back(mDataTable->portForColumn(newname));
+	if(forward){
+		//all derivatives from one run
+		for(int i=0; i<numpars; i++){
+			std::stringstream s;
+			s<<"SENSLOC_"<<target<<"_"<<par_names[i]<<"_forward";
+			newcols.push_back(s.str());
+			mDataTable->addColumn(s.str(), false);
+		}
+		for(int i=0; i<numpars; i++){
+			modvals.push_back(mDataTable->portForColumn(newcols[i]));
+		}
+		if(!forwardSensitivityRun(target, modvals)){
+			printf("[Error]: Forward sensitivities of %s could not be calculated.\n",target.c_str());
+		}
+	}
+	else{
+		mSolver->resetTrajectoryCacheStatistics();
+		for(int i=0; i<numpars; i++){
+			//perturb a single parameter
+			pars.assign(par_backup.begin(),par_backup.end());
+			pars[i] *= 1.0 + rel_deviance;
+			mCommonParameters->setPlainValues(pars);
+			runmodel();
+			std::stringstream s;
+			s<<"SENSLOC_"<<target<<"_"<<par_names[i]<<"_"<<rel_deviance;
+			std::string newname=s.str();
+			mDataTable->copyColumn(target, newname);
+			newcols.push_back(newname);
+			modvals.push_back(mDataTable->portForColumn(newname));
+		}
+		reportTrajectoryCache();
 	}
 	
 	//rescale the results to get relative sensitivity
@@ -1875,7 +2423,10 @@ void iWQModelLayout::localSensitivityAnalysis(double rel_deviance, std::string t
 		while(mDataTable->stepRow()!=-1){
 			for(int i=0; i<numpars; i++){
 				double * ptr=modvals[i];
-				if(ptr){
+				if(ptr && forward){
+					*ptr = *ptr * par_backup[i] / *baseval;		//the limit of the perturbed runs
+				}
+				else if(ptr){
 					*ptr = (*ptr - *baseval) / *baseval / rel_deviance;
 				}
 			}
@@ -1926,7 +2477,12 @@ void iWQModelLayout::localSensitivityAnalysis(double rel_deviance, std::string t
 		printf("[Error]: Failed to create %s.\n",filename.c_str());
 	}
 	else{
-		fprintf(ofile,"LOCAL SENSITIVITY TEST for %s\nParamater perturbation=%d%%\n",target.c_str(),(int)(rel_deviance*100));
+		if(forward){
+			fprintf(ofile,"LOCAL SENSITIVITY TEST for %s\nForward sensitivity equations\n",target.c_str());
+		}
+		else{
+			fprintf(ofile,"LOCAL SENSITIVITY TEST for %s\nParamater perturbation=%d%%\n",target.c_str(),(int)(rel_deviance*100));
+		}
 		fprintf(ofile,"\nSensitivity ranks:\n");
 		for(int i=0; i<numpars; i++){
 			fprintf(ofile,"%s\t%lf\n",par_names[i].c_str(),sensranks[i]);
@@ -2244,6 +2800,8 @@ void iWQModelLayout::MCMC(int numrounds, int burnin, std::string filename, bool
 	}
 	
 	printf("Markov-chain Monte Carlo experiment.\n");
+	mSolver->resetTrajectoryCacheStatistics();
+	mEvaluator->resetRejectionStatistics();
 		
 	srand(time(0));
 	int thinning=5;
@@ -2379,7 +2937,14 @@ void iWQModelLayout::MCMC(int numrounds, int burnin, std::string filename, bool
 		
 		//evaluate it
 		mCommonParameters->setPlainValues(nparvals,n);
-		Pxi=mEvaluator->evaluate();
+		double p=-1.0;
+		double bound=DBL_MAX;
+		if(mEvaluator->RejectionChunk>0 && mEvaluatorMethods[0]->isLogScale()){
+			//the acceptance threshold is known before the run, so it can stop early
+			p=urand();
+			bound=Pxt-log(p);
+		}
+		Pxi=mEvaluator->evaluateWithBound(bound);
 		
 		if(Pxi!=DBL_MAX){ //if valid run
 			//first let's see its absolute performace
@@ -2402,7 +2967,9 @@ void iWQModelLayout::MCMC(int numrounds, int burnin, std::string filename, bool
 					printf("\nError in log draw: a=%lf Pxt=%lf Pxi=%lf n=%d\n",a,Pxt,Pxi,n);
 				}
 			}
-			double p=urand();
+			if(p<0.0){
+				p=urand();
+			}
 			if(p<a){				
 				//copy if needed
 				Pxt=Pxi;
@@ -2624,6 +3191,8 @@ void iWQModelLayout::MCMC(int numrounds, int burnin, std::string filename, bool
 	//END NEW: close series samples files
 	
 	printf("\nMCMC sampling finished.\n");
+	reportTrajectoryCache();
+	reportEarlyRejections();
 	
 	return;
 }
@@ -2660,6 +3229,8 @@ void iWQModelLayout::MCMC_Haario(int numrounds, int burnin, std::string filename
 	saveBestSolutionSoFar();
 	
 	printf("Initial optimization finished.\nDoing MCMC (Haario):\n");	
+	mSolver->resetTrajectoryCacheStatistics();
+	mEvaluator->resetRejectionStatistics();
 	
 	//start actual MCMC here
 	double spreadfactor=1.0/12.0;
@@ -2737,7 +3308,14 @@ void iWQModelLayout::MCMC_Haario(int numrounds, int burnin, std::string filename
 				
 		//evaluate it
 		mCommonParameters->setPlainValues(nparvals,n);
-		Pxi=mEvaluator->evaluate();
+		double p=-1.0;
+		double bound=DBL_MAX;
+		if(mEvaluator->RejectionChunk>0 && mEvaluatorMethods[0]->isLogScale()){
+			//the acceptance threshold is known before the run, so it can stop early
+			p=urand();
+			bound=Pxt-log(p);
+		}
+		Pxi=mEvaluator->evaluateWithBound(bound);
 		
 		if(Pxi!=DBL_MAX){ //if valid run
 			//first let's see its absolute performace
@@ -2760,7 +3338,9 @@ void iWQModelLayout::MCMC_Haario(int numrounds, int burnin, std::string filename
 					printf("\nError in log draw: a=%lf Pxt=%lf Pxi=%lf n=%d\n",a,Pxt,Pxi,n);
 				}
 			}
-			double p=urand();
+			if(p<0.0){
+				p=urand();
+			}
 			if(p<a){				
 				//copy if needed
 				Pxt=Pxi;
@@ -2914,12 +3494,794 @@ void iWQModelLayout::MCMC_Haario(int numrounds, int burnin, std::string filename
 	mEvaluator->printWarnings=true;
 		
 	printf("\nMCMC_HAARIO sampling finished.\n");
+	reportTrajectoryCache();
+	reportEarlyRejections();
 	
 	return;
 }
 
 //---------------------------------------------------------------------------------------
 
+//Proposals of one generation of parallel chains: chain c is evaluated on layout c % layouts.size()
+
+struct iWQChainProposals
+{
+	std::vector<iWQModelLayout *> layouts;
+	std::vector< std::vector<double> > proposals;
+	std::vector<double> bounds;		//early rejection bounds, empty: full runs
+	std::vector<double> results;
+};
+
+static void chainEvaluateTask(void * context, int index)
+{
+	iWQChainProposals * chains=(iWQChainProposals *)context;
+	iWQModelLayout * layout=chains->layouts[index];
+	for(int c=index; c<chains->proposals.size(); c+=chains->layouts.size()){
+		layout->parameters()->setPlainValues(chains->proposals[c]);
+		chains->results[c]=layout->evaluator()->evaluateWithBound((c<chains->bounds.size())?chains->bounds[c]:DBL_MAX);
+	}
+}
+
+//---------------------------------------------------------------------------------------
+
+//Gelman-Rubin potential scale reduction factor of each parameter, trace[c][j] is the j-th parameter vector of chain c
+
+static std::vector<double> gelmanRubin(std::vector< std::vector< std::vector<double> > > & trace)
+{
+	int m=trace.size();
+	int len=trace[0].size();
+	int n=(len>0)?trace[0][0].size():0;
+	std::vector<double> rhat (n, DBL_MAX);
+	if(m<2 || len<2){
+		return rhat;
+	}
+	for(int p=0; p<n; p++){
+		std::vector<double> means (m, 0.0);
+		double W=0.0;
+		for(int c=0; c<m; c++){
+			for(int j=0; j<len; j++){
+				means[c]+=trace[c][j][p];
+			}
+			means[c]/=len;
+			double s2=0.0;
+			for(int j=0; j<len; j++){
+				s2+=(trace[c][j][p]-means[c])*(trace[c][j][p]-means[c]);
+			}
+			W+=s2/(len-1);
+		}
+		W/=m;
+		double grandmean=0.0;
+		for(int c=0; c<m; c++){
+			grandmean+=means[c];
+		}
+		grandmean/=m;
+		double B=0.0;
+		for(int c=0; c<m; c++){
+			B+=(means[c]-grandmean)*(means[c]-grandmean);
+		}
+		B*=len/(m-1.0);
+		double V=(len-1.0)/len*W + B/len;
+		if(W>0.0){
+			rhat[p]=sqrt(V/W);
+		}
+		else{
+			rhat[p]=(B>0.0)?DBL_MAX:1.0;	//frozen chains
+		}
+	}
+	return rhat;
+}
+
+//---------------------------------------------------------------------------------------
+
+//DREAM(ZS) of Vrugt & ter Braak: parallel direction proposals from an archive of past states
+
+void iWQModelLayout::DREAM(int numgenerations, int burnin, std::string filename, int numchains, int numthreads, unsigned int seed)
+{
+	if(!verify()){
+		printf("[Error]: Model layout contains defects.\n");
+		return;
+	}
+	int n=mCommonParameters->numberOfParams();
+	if(n<1){
+		printf("[Error]: There are no parameters to sample.\n");
+		return;
+	}
+	if(numchains<3){
+		printf("[Warning]: DREAM needs at least 3 chains, using 3.\n");
+		numchains=3;
+	}
+	if(numthreads<1){
+		numthreads=iWQThreadPool::hardwareThreads();
+	}
+	if(numthreads>numchains){
+		numthreads=numchains;
+	}
+	if(seed==0){
+		seed=time(0);
+	}
+	
+	printf("Markov-chain Monte Carlo experiment (DREAM(ZS), %d chains).\n",numchains);
+	mSolver->resetTrajectoryCacheStatistics();
+	mEvaluator->resetRejectionStatistics();
+	
+	FILE * ofile=fopen(filename.c_str(),"w");
+	if(!ofile){
+		printf("[Error]: Failed to open output file.\n");
+		return;
+	}
+	
+	int thinning=5;
+	int nrounds=numgenerations*thinning;
+	int burn_in=burnin*thinning;
+	int archivegrowth=10;	//chain states are added to the archive after this many generations
+	int rhatcheck=50;		//thinned samples between the convergence checks
+	double rhatlimit=1.2;
+	double jitter=0.05;		//relative random change of the jump length
+	
+	std::vector<double> orig_pars=mCommonParameters->plainValues();
+	std::vector<std::string> parnames=mCommonParameters->namesForPlainValues();
+	
+	//the same bounds as for the global optimizers
+	std::vector<double> lo (n);
+	std::vector<double> hi (n);
+	for(int j=0; j<n; j++){
+		if(mCommonParameters->hasLimitsForParam(parnames[j])){
+			iWQLimits lim=mCommonParameters->limitsForParam(parnames[j]);
+			lo[j]=lim.min;
+			hi[j]=lim.max;
+		}
+		else{
+			lo[j]=0.0;
+			hi[j]=(orig_pars[j]!=0.0)?10*orig_pars[j]:0.0;
+		}
+		if(lo[j]>hi[j]){
+			std::swap(lo[j],hi[j]);
+		}
+	}
+	
+	//independent copies of the layout for evaluating the chains in parallel
+	iWQChainProposals chains;
+	chains.layouts.push_back(this);
+	if(numthreads>1){
+		if(mPreScripts.size()>0 || mPostScripts.size()>0){
+			printf("[Warning]: Layouts with scripts are not copied, the chains are evaluated sequentially.\n");
+		}
+		else{
+			for(int i=1; i<numthreads; i++){
+				iWQModelLayout * layout=clone();
+				if(!layout){
+					break;
+				}
+				chains.layouts.push_back(layout);
+			}
+		}
+	}
+	iWQThreadPool pool(chains.layouts.size());
+	printf("Chains are evaluated on %d thread(s), seed %u.\n",(int)chains.layouts.size(),seed);
+	
+	mEvaluator->printWarnings=false;
+	
+	//all random numbers are drawn on this thread: the sample depends only on the seed
+	iWQRandomUniformGenerator U;
+	U.setSeed(seed);
+	
+	//initial archive from the bounds
+	std::vector< std::vector<double> > Z;
+	for(int i=0; i<10*n; i++){
+		std::vector<double> z (n);
+		for(int j=0; j<n; j++){
+			z[j]=lo[j]+U.generate()*(hi[j]-lo[j]);
+		}
+		Z.push_back(z);
+	}
+	
+	//initial states: the actual values and draws from the archive
+	std::vector< std::vector<double> > X (numchains);
+	X[0]=orig_pars;
+	for(int c=1; c<numchains; c++){
+		X[c]=Z[(int)(U.generate()*Z.size())%Z.size()];
+	}
+	chains.proposals=X;
+	chains.results.assign(numchains,DBL_MAX);
+	pool.run(chains.layouts.size(), chainEvaluateTask, &chains);
+	std::vector<double> PX=chains.results;
+	chains.bounds.assign(numchains,DBL_MAX);
+	
+	double besteval=DBL_MAX;
+	std::vector<double> bestpars=orig_pars;
+	bool bestsaved=true;
+	for(int c=0; c<numchains; c++){
+		if(PX[c]<besteval){
+			besteval=PX[c];
+			bestpars=X[c];
+			bestsaved=false;
+		}
+	}
+	
+	fprintf(ofile,"step\tchain");
+	for(int j=0; j<n; j++){
+		std::string actparname=replaceParentheses(parnames[j]);	//remove [] from parnames because R does not like it
+		fprintf(ofile,"\t%s",actparname.c_str());
+	}
+	fprintf(ofile,"\tEvaluation\talpha\tp\tburn_in\tacception\n");
+	
+	printf("Thinning factor: %d\n",thinning);
+	
+	std::vector<double> alphas (numchains, 0.0);
+	std::vector<double> ps (numchains, 0.0);
+	std::vector<int> accepted (numchains, 0);
+	std::vector<double> acception (numchains, 0.0);
+	int proposed=0;
+	
+	//post burn-in sample of each chain for the convergence check
+	std::vector< std::vector< std::vector<double> > > trace (numchains);
+	bool converged=false;
+	
+	//cached result output to HD
+	std::string writecache="";
+	char buf [1024];
+	
+	bool logscale=mEvaluatorMethods[0]->isLogScale();
+	
+	for(int i=0; i<nrounds && !converged; i++){
+		//jump rate 1 in every 5th generation to move between modes
+		bool unitjump=(i%5==4);
+		
+		//generate the candidates from the differences of archive members
+		for(int c=0; c<numchains; c++){
+			int delta=1+(int)(U.generate()*3.0);
+			if(2*delta>Z.size()){
+				delta=Z.size()/2;
+			}
+			std::vector<int> picks;
+			while(picks.size()<2*delta){
+				int r=(int)(U.generate()*Z.size())%Z.size();
+				if(std::find(picks.begin(),picks.end(),r)==picks.end()){
+					picks.push_back(r);
+				}
+			}
+			//crossover: the subset of parameters to update
+			double CR=(1+(int)(U.generate()*3.0))/3.0;
+			std::vector<bool> update (n, false);
+			int numupdated=0;
+			for(int j=0; j<n; j++){
+				if(U.generate()<CR){
+					update[j]=true;
+					numupdated++;
+				}
+			}
+			if(numupdated==0){
+				update[(int)(U.generate()*n)%n]=true;
+				numupdated=1;
+			}
+			double gamma=unitjump?1.0:2.38/sqrt(2.0*delta*numupdated);
+			
+			std::vector<double> prop=X[c];
+			for(int j=0; j<n; j++){
+				double e=U.generate();
+				double eps=U.generate();
+				if(!update[j]){
+					continue;
+				}
+				double diff=0.0;
+				for(int k=0; k<delta; k++){
+					diff+=Z[picks[2*k]][j]-Z[picks[2*k+1]][j];
+				}
+				prop[j]+=(1.0+jitter*(2.0*e-1.0))*gamma*diff + 1E-6*(hi[j]-lo[j])*(2.0*eps-1.0);
+				//reflect into the bounds
+				if(prop[j]<lo[j]){
+					prop[j]=2.0*lo[j]-prop[j];
+				}
+				if(prop[j]>hi[j]){
+					prop[j]=2.0*hi[j]-prop[j];
+				}
+				prop[j]=std::max(lo[j],std::min(hi[j],prop[j]));
+			}
+			chains.proposals[c]=prop;
+		}
+		
+		//evaluate them
+		//the acceptance thresholds are known before the runs, so they can stop early
+		for(int c=0; c<numchains; c++){
+			ps[c]=U.generate();
+			chains.bounds[c]=(logscale && PX[c]<DBL_MAX)?PX[c]-log(ps[c]):DBL_MAX;
+		}
+		pool.run(chains.layouts.size(), chainEvaluateTask, &chains);
+		proposed++;
+		
+		//Metropolis acceptance for each chain
+		for(int c=0; c<numchains; c++){
+			double Pxi=chains.results[c];
+			double Pxt=PX[c];
+			double a;
+			double p=ps[c];
+			if(Pxi==DBL_MAX || std::isnan(Pxi) || std::isinf(Pxi)){
+				a=0.0;		//numerically unstable proposal
+			}
+			else if(Pxt==DBL_MAX){
+				a=1.0;		//the chain has not found a valid point yet
+			}
+			else if(!logscale){
+				a=(Pxi!=0.0)?(Pxt/Pxi):1.0;		//reversed, since we want to minimize
+			}
+			else{
+				a=(Pxi>Pxt)?exp((Pxt - Pxi)):1.0;	//reversed, since we want to minimize
+			}
+			if(p<a){
+				X[c]=chains.proposals[c];
+				PX[c]=Pxi;
+				accepted[c]++;
+				if(Pxi<besteval){
+					besteval=Pxi;
+					bestpars=X[c];
+					bestsaved=false;
+				}
+			}
+			alphas[c]=a;
+		}
+		
+		//let the archive follow the chains
+		if((i+1)%archivegrowth==0){
+			Z.insert(Z.end(),X.begin(),X.end());
+		}
+		
+		if((i+1)%thinning==0){
+			//save result
+			for(int c=0; c<numchains; c++){
+				memset(buf, '\0', sizeof(buf) );
+				sprintf(buf,"%d\t%d",i/thinning,c);
+				writecache+=buf;
+				for(int j=0; j<n; j++){
+					memset(buf, '\0', sizeof(buf) );
+					sprintf(buf,"\t%g",X[c][j]);
+					writecache+=buf;
+				}
+				memset(buf, '\0', sizeof(buf) );
+				sprintf(buf,"\t%lf\t%lf\t%lf\t%c\t%d%%\n",PX[c],alphas[c],ps[c],(i>=burn_in?'1':'0'),(int)(acception[c]*100));
+				writecache+=buf;
+				
+				if(i>=burn_in){
+					trace[c].push_back(X[c]);
+				}
+			}
+			if(i<burn_in){
+				printf("*");
+			}
+			printf("%d ",i/thinning);
+			fflush(stdout);
+			
+			//convergence check on the post burn-in sample
+			int len=trace[0].size();
+			if(len>0 && len%rhatcheck==0){
+				std::vector<double> rhat=gelmanRubin(trace);
+				double maxrhat=*std::max_element(rhat.begin(),rhat.end());
+				printf("\n*** Gelman-Rubin R-hat after %d samples per chain: max %lf",len,maxrhat);
+				for(int j=0; j<n; j++){
+					printf(" %s=%lf",parnames[j].c_str(),rhat[j]);
+				}
+				printf(" ***\n");
+				if(maxrhat<rhatlimit){
+					printf("*** Chains converged (R-hat < %lf), stopping. ***\n",rhatlimit);
+					converged=true;
+				}
+				
+				//keep the best solution on disk as the run goes
+				if(!bestsaved){
+					mCommonParameters->setPlainValues(bestpars);
+					mEvaluator->evaluate();
+					saveBestSolutionSoFar();
+					bestsaved=true;
+				}
+			}
+		}
+		
+		//rotate acception stats
+		int rotatefreq = 100;
+		if(proposed>=rotatefreq){				//update after 100 proposals
+			printf("\n*** Last %d rounds acception statistics:",rotatefreq);
+			for(int c=0; c<numchains; c++){
+				acception[c]=accepted[c]/(double)proposed;
+				printf(" %d%%",(int)(acception[c]*100));
+				accepted[c]=0;
+			}
+			printf(" ***\n");
+			printf("*** Current best likelihood point: [%lf] ***\n",besteval);
+			proposed=0;
+		}
+		
+		//rotate write cache
+		if(writecache.size()>=10240){	//write out in 10KB chunks
+			fprintf(ofile,"%s",writecache.c_str());
+			fflush(ofile);
+			writecache="";
+		}
+	}
+	
+	//flush remaining write cache (if any)
+	if(writecache.size()){
+		fprintf(ofile,"%s",writecache.c_str());
+	}
+	
+	fclose(ofile);
+	
+	if(!converged){
+		printf("\n[Warning]: The chains did not converge (R-hat < %lf) in %d generations.\n",rhatlimit,numgenerations);
+	}
+	
+	if(!bestsaved){
+		mCommonParameters->setPlainValues(bestpars);
+		mEvaluator->evaluate();
+		saveBestSolutionSoFar();
+	}
+	
+	for(int i=1; i<chains.layouts.size(); i++){
+		mEvaluator->mergeRejectionStatistics(chains.layouts[i]->evaluator());
+		delete chains.layouts[i];
+	}
+	
+	//restore original parameter values
+	mCommonParameters->setPlainValues(orig_pars);
+	mEvaluator->printWarnings=true;
+	
+	printf("\nDREAM sampling finished.\n");
+	reportTrajectoryCache();
+	reportEarlyRejections();
+}
+
+//---------------------------------------------------------------------------------------
+
+//Adaptive Metropolis state of one tempered chain
+
+struct iWQTemperedChain
+{
+	double beta;			//inverse temperature
+	std::vector<double> x;	//actual state
+	double Px;				//its evaluation
+	std::vector<double> stdevs;
+	std::vector< std::vector<double> > subsample;	//accepted states during burn-in, subsample[p][j]
+	bool initblankrun;
+	Eigen::MatrixXd L_SIGMA;
+	int accepted;
+	double acception;
+};
+
+//---------------------------------------------------------------------------------------
+
+//Replica exchange: chains at temperatures between 1 and maxtemperature, only the cold chain is sampled
+
+void iWQModelLayout::parallelTempering(int numrounds, int burnin, std::string filename, int numtemperatures, double maxtemperature, int numthreads, unsigned int seed)
+{
+	if(!verify()){
+		printf("[Error]: Model layout contains defects.\n");
+		return;
+	}
+	int n=mCommonParameters->numberOfParams();
+	if(n<1){
+		printf("[Error]: There are no parameters to sample.\n");
+		return;
+	}
+	if(numtemperatures<2){
+		printf("[Warning]: Parallel tempering needs at least 2 temperatures, using 2.\n");
+		numtemperatures=2;
+	}
+	if(maxtemperature<=1.0){
+		printf("[Warning]: The highest temperature should be above 1, using 10.\n");
+		maxtemperature=10.0;
+	}
+	if(numthreads<1 || numthreads>numtemperatures){
+		numthreads=numtemperatures;
+	}
+	if(seed==0){
+		seed=time(0);
+	}
+	
+	printf("Markov-chain Monte Carlo experiment (parallel tempering, %d temperatures).\n",numtemperatures);
+	mSolver->resetTrajectoryCacheStatistics();
+	mEvaluator->resetRejectionStatistics();
+	
+	FILE * ofile=fopen(filename.c_str(),"w");
+	if(!ofile){
+		printf("[Error]: Failed to open output file.\n");
+		return;
+	}
+	
+	int thinning=5;
+	int nrounds=numrounds*thinning;
+	int burn_in=burnin*thinning;
+	double spreadfactor=1.0/12.0;
+	double blankrunlimit=0.25;
+	
+	std::vector<double> orig_pars=mCommonParameters->plainValues();
+	std::vector<std::string> parnames=mCommonParameters->namesForPlainValues();
+	bool logscale=mEvaluatorMethods[0]->isLogScale();
+	
+	//independent copies of the layout for evaluating the chains in parallel
+	iWQChainProposals chains;
+	chains.layouts.push_back(this);
+	if(numthreads>1){
+		if(mPreScripts.size()>0 || mPostScripts.size()>0){
+			printf("[Warning]: Layouts with scripts are not copied, the chains are evaluated sequentially.\n");
+		}
+		else{
+			for(int i=1; i<numthreads; i++){
+				iWQModelLayout * layout=clone();
+				if(!layout){
+					break;
+				}
+				chains.layouts.push_back(layout);
+			}
+		}
+	}
+	iWQThreadPool pool(chains.layouts.size());
+	
+	mEvaluator->printWarnings=false;
+	
+	//all random numbers are drawn on this thread: the sample depends only on the seed
+	iWQRandomUniformGenerator U;
+	U.setSeed(seed);
+	iWQRandomNormalGenerator N;
+	N.setSeed(seed+1);
+	
+	//geometric temperature ladder, all chains start from the actual values
+	std::vector<iWQTemperedChain> T (numtemperatures);
+	printf("Temperatures:");
+	for(int k=0; k<numtemperatures; k++){
+		double temperature=pow(maxtemperature,k/(numtemperatures-1.0));
+		printf(" %lf",temperature);
+		T[k].beta=1.0/temperature;
+		T[k].x=orig_pars;
+		T[k].stdevs.resize(n);
+		for(int j=0; j<n; j++){
+			T[k].stdevs[j]=fabs(orig_pars[j])*spreadfactor;
+		}
+		T[k].subsample.resize(n);
+		T[k].initblankrun=true;
+		T[k].accepted=0;
+		T[k].acception=0.0;
+	}
+	printf("\nChains are evaluated on %d thread(s), seed %u.\n",(int)chains.layouts.size(),seed);
+	
+	double besteval=mEvaluator->evaluate();
+	saveBestSolutionSoFar();
+	std::vector<double> bestpars=orig_pars;
+	bool bestsaved=true;
+	for(int k=0; k<numtemperatures; k++){
+		T[k].Px=besteval;
+	}
+	
+	fprintf(ofile,"step");
+	for(int j=0; j<n; j++){
+		std::string actparname=replaceParentheses(parnames[j]);	//remove [] from parnames because R does not like it
+		fprintf(ofile,"\t%s",actparname.c_str());
+	}
+	fprintf(ofile,"\tEvaluation\talpha\tp\tburn_in\tacception\n");
+	
+	printf("Thinning factor: %d\n",thinning);
+	
+	std::vector<int> swapaccepted (numtemperatures-1, 0);
+	std::vector<int> swapproposed (numtemperatures-1, 0);
+	std::vector<int> totalswapaccepted (numtemperatures-1, 0);
+	std::vector<int> totalswapproposed (numtemperatures-1, 0);
+	int proposed=0;
+	double a0=0.0;
+	double p0=0.0;
+	
+	//cached result output to HD
+	std::string writecache="";
+	char buf [1024];
+	
+	chains.proposals.resize(numtemperatures);
+	chains.bounds.resize(numtemperatures);
+	chains.results.resize(numtemperatures);
+	std::vector<double> ps (numtemperatures);
+	std::vector<double> zs (n);
+	
+	for(int i=0; i<nrounds; i++){
+		//generate a candidate for each chain
+		for(int k=0; k<numtemperatures; k++){
+			for(int j=0; j<n; j++){
+				zs[j]=N.generate();
+			}
+			if(T[k].initblankrun){
+				//blank draw in 1st period
+				chains.proposals[k]=T[k].x;
+				for(int j=0; j<n; j++){
+					chains.proposals[k][j]+=T[k].stdevs[j]*zs[j];
+				}
+			}
+			else{
+				//proper multivariate draw
+				chains.proposals[k]=multivariateNormal(T[k].L_SIGMA, zs, T[k].x);
+			}
+		}
+		
+		//evaluate them, the tempered acceptance thresholds are known before the runs
+		for(int k=0; k<numtemperatures; k++){
+			ps[k]=U.generate();
+			chains.bounds[k]=(logscale && T[k].Px<DBL_MAX)?T[k].Px-log(ps[k])/T[k].beta:DBL_MAX;
+		}
+		pool.run(chains.layouts.size(), chainEvaluateTask, &chains);
+		proposed++;
+		
+		//Metropolis acceptance on the tempered evaluations
+		for(int k=0; k<numtemperatures; k++){
+			double Pxi=chains.results[k];
+			double Pxt=T[k].Px;
+			double a;
+			double p=ps[k];
+			if(Pxi==DBL_MAX || std::isnan(Pxi) || std::isinf(Pxi)){
+				a=0.0;		//numerically unstable proposal
+			}
+			else if(!logscale){
+				a=(Pxi!=0.0)?pow(Pxt/Pxi,T[k].beta):1.0;			//reversed, since we want to minimize
+			}
+			else{
+				a=(Pxi>Pxt)?exp(T[k].beta*(Pxt - Pxi)):1.0;		//reversed, since we want to minimize
+			}
+			if(p<a){
+				T[k].x=chains.proposals[k];
+				T[k].Px=Pxi;
+				T[k].accepted++;
+				if(i<burn_in){
+					for(int j=0; j<n; j++){
+						T[k].subsample[j].push_back(T[k].x[j]);
+					}
+				}
+				if(Pxi<besteval){
+					besteval=Pxi;
+					bestpars=T[k].x;
+					bestsaved=false;
+				}
+			}
+			if(k==0){
+				a0=a;
+				p0=p;
+			}
+		}
+		
+		//swap states between neighbouring temperatures, alternating the even and odd pairs
+		for(int k=i%2; k<numtemperatures-1; k+=2){
+			double Ek=logscale?T[k].Px:log(T[k].Px);
+			double El=logscale?T[k+1].Px:log(T[k+1].Px);
+			double a=exp((T[k].beta - T[k+1].beta)*(Ek - El));
+			swapproposed[k]++;
+			if(U.generate()<a){
+				std::swap(T[k].x,T[k+1].x);
+				std::swap(T[k].Px,T[k+1].Px);
+				swapaccepted[k]++;
+			}
+		}
+		
+		if((i+1)%thinning==0){
+			//save result of the cold chain
+			memset(buf, '\0', sizeof(buf) );
+			sprintf(buf,"%d",i/thinning);
+			writecache+=buf;
+			for(int j=0; j<n; j++){
+				memset(buf, '\0', sizeof(buf) );
+				sprintf(buf,"\t%g",T[0].x[j]);
+				writecache+=buf;
+			}
+			memset(buf, '\0', sizeof(buf) );
+			sprintf(buf,"\t%lf\t%lf\t%lf\t%c\t%d%%\n",T[0].Px,a0,p0,(i>=burn_in?'1':'0'),(int)(T[0].acception*100));
+			writecache+=buf;
+			
+			if(i<burn_in){
+				printf("*");
+			}
+			printf("%d ",i/thinning);
+			fflush(stdout);
+		}
+		
+		//rotate acception stats
+		int rotatefreq = 100;
+		if(proposed>=rotatefreq){				//update after 100 proposals
+			for(int k=0; k<numtemperatures; k++){
+				iWQTemperedChain & chain=T[k];
+				chain.acception=chain.accepted/(double)proposed;
+				chain.accepted=0;
+				if(i>=burn_in){
+					continue;
+				}
+				int ns=chain.subsample[0].size();
+				if(chain.initblankrun){
+					if(chain.acception>blankrunlimit && ns>n){
+						//the covariance of the accepted states replaces the independent draws
+						chain.initblankrun=false;
+					}
+					else{
+						// Limits are taken from Gelman, Roberts and Gilks (1996)
+						double std_mod=(chain.acception<0.2)?0.9:((chain.acception>0.4)?1.1:1.0);
+						for(int j=0; j<n; j++){
+							chain.stdevs[j]*=std_mod;
+						}
+						continue;
+					}
+				}
+				//covar matrix update with temporary scaling
+				double c=1.0;
+				if(chain.acception<0.15){
+					c=0.8;
+				}
+				else if(chain.acception>0.4){
+					c=1.2;
+				}
+				Eigen::MatrixXd SIGMA_ALT=c*((ns-1.0)/ns)*covarMatrix(chain.subsample, ns/2);
+				for(int j=0; j<n; j++){
+					SIGMA_ALT(j,j)+=1E-6*chain.stdevs[j]*chain.stdevs[j];	//keeps frozen parameters positive definite
+				}
+				chain.L_SIGMA=choleskyDecomposition(SIGMA_ALT);
+			}
+			
+			printf("\n*** Last %d rounds acception statistics:",rotatefreq);
+			for(int k=0; k<numtemperatures; k++){
+				printf(" %d%%",(int)(T[k].acception*100));
+			}
+			printf(" ***\n*** Swap acception statistics:");
+			for(int k=0; k<numtemperatures-1; k++){
+				printf(" %d<->%d %d%%",k,k+1,swapproposed[k]?(int)(100*swapaccepted[k]/swapproposed[k]):0);
+				totalswapaccepted[k]+=swapaccepted[k];
+				totalswapproposed[k]+=swapproposed[k];
+				swapaccepted[k]=0;
+				swapproposed[k]=0;
+			}
+			printf(" ***\n");
+			printf("*** Current best likelihood point: [%lf] ***\n",besteval);
+			proposed=0;
+			
+			//keep the best solution on disk as the run goes
+			if(!bestsaved){
+				mCommonParameters->setPlainValues(bestpars);
+				mEvaluator->evaluate();
+				saveBestSolutionSoFar();
+				bestsaved=true;
+			}
+		}
+		
+		//rotate write cache
+		if(writecache.size()>=10240){	//write out in 10KB chunks
+			fprintf(ofile,"%s",writecache.c_str());
+			fflush(ofile);
+			writecache="";
+		}
+	}
+	
+	//flush remaining write cache (if any)
+	if(writecache.size()){
+		fprintf(ofile,"%s",writecache.c_str());
+	}
+	
+	fclose(ofile);
+	
+	printf("\nSwap acception between neighbouring temperatures:\n");
+	for(int k=0; k<numtemperatures-1; k++){
+		totalswapaccepted[k]+=swapaccepted[k];
+		totalswapproposed[k]+=swapproposed[k];
+		printf("%lf <-> %lf: %d of %d (%d%%)\n",1.0/T[k].beta,1.0/T[k+1].beta,totalswapaccepted[k],totalswapproposed[k],totalswapproposed[k]?(int)(100.0*totalswapaccepted[k]/totalswapproposed[k]):0);
+	}
+	
+	if(!bestsaved){
+		mCommonParameters->setPlainValues(bestpars);
+		mEvaluator->evaluate();
+		saveBestSolutionSoFar();
+	}
+	
+	for(int i=1; i<chains.layouts.size(); i++){
+		mEvaluator->mergeRejectionStatistics(chains.layouts[i]->evaluator());
+		delete chains.layouts[i];
+	}
+	
+	//restore original parameter values
+	mCommonParameters->setPlainValues(orig_pars);
+	mEvaluator->printWarnings=true;
+	
+	printf("Parallel tempering sampling finished.\n");
+	reportTrajectoryCache();
+	reportEarlyRejections();
+}
+
+//---------------------------------------------------------------------------------------
+
 void iWQModelLayout::runOnSample(std::string samplefilename, std::string outputfilename)
 {
 	//open the sample file
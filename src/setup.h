@@ -22,6 +22,7 @@ class iWQEvaluator;
 class iWQEvaluatorMethod;
 class iWQDataTable;
 class iWQModelFactory;
+class TiXmlDocument;
 class TiXmlHandle;
 class TiXmlNode;
 class TiXmlElement;
@@ -55,6 +56,10 @@ private:
 	void configureOptimizer(TiXmlHandle docHandle);
 		
 	bool checkLayoutVersion(TiXmlHandle docHandle);
+	
+	void emptyInit();
+	void loadDocument(TiXmlDocument * doc);	//takes the ownership
+	TiXmlDocument * mDocument;				//as loaded, for the copies
 		
 	void storeNodeInMap(TiXmlNode * pParent, std::multimap<std::string, std::string> * container, std::string prefix, int level);
 	
@@ -82,8 +87,14 @@ private:
 	void printError(std::string errormessage, TiXmlElement * element, int errorlevel=1);
 	
 	bool runmodel(int * firsterrorrow=NULL, double * firsterrort=NULL);	//core running routine
+	void reportRun(bool stable, int firsterrorrow, double firsterrort);		//integrator statistics and stability problems
+	void reportTrajectoryCache();	//hit rate since the last reset, if the cache is on
+	void reportEarlyRejections();	//of the MCMC proposals, if early rejection is on
+	bool forwardSensitivityRun(std::string target, std::vector<double *> ports);	//d(target)/d(parameter) of each row into the ports
 	
 	void saveBestSolutionSoFar();	//helper for MCMC
+	iWQModelLayout(iWQModelLayout * layout);	//from the document of another layout
+	iWQModelLayout * clone();		//independent copy with the same state, e.g. for parallel evaluations
 	
 public:
 	//constructor/destructor
@@ -107,13 +118,14 @@ public:
 	
 	//unified run method
 	void run();
+	void runStreaming(std::string filename);	//run and save the results window by window (streamed data tables)
 	
 	//evaluator wrapper methods
 	void calibrate();
 	double evaluate();
 	
 	//unified sensitivity analysis routines
-	void localSensitivityAnalysis(double rel_deviance, std::string target, std::string filename);
+	void localSensitivityAnalysis(double rel_deviance, std::string target, std::string filename, bool forward=false);	//forward: from the sensitivity equations in one run
 	void regionalSensitivityAnalysis(double rel_deviance, std::string target, std::string filename, int numsimulations);
 	
 	//file I/O wrappers
@@ -126,6 +138,8 @@ public:
 	//Markov-chain Monte Carlo sampling (now on the evaluator function)
 	void MCMC(int numrounds, int burnin, std::string filename, bool loadpropmatrix=false);			//Plain own adaptive Metropolis
 	void MCMC_Haario(int numrounds, int burnin, std::string filename);	//Haario's continually adaptive algorithm from MHAdaptive
+	void DREAM(int numgenerations, int burnin, std::string filename, int numchains=3, int numthreads=1, unsigned int seed=0);	//multi-chain DREAM(ZS), stops on R-hat convergence
+	void parallelTempering(int numrounds, int burnin, std::string filename, int numtemperatures=4, double maxtemperature=10.0, int numthreads=0, unsigned int seed=0);	//replica exchange, 0 threads: one per temperature
 	void runOnSample(std::string samplefilename, std::string outputfilename);
 	void runStandardSeriesOnSample(std::string samplefilename, int desiredrowcount=1000, bool predictivemode=false, bool binary=true);
 	void createBestSeries(std::string parbestfilename);
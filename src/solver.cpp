@@ -9,9 +9,84 @@
  */ 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include <atomic>
  
 #include "solver.h"
 #include "datatable.h"
+#include "threadpool.h"
+
+//--------------------------------------------------------------------------------------------------
+
+#pragma mark Debug allocation counter
+
+#ifdef IWQ_DEBUG
+
+//Debug builds of the server count every heap allocation of the process (plugins included, 
+//because the definitions below take precedence over the shared libraries). The counter is 
+//shared by the threads of the pools, so it is atomic.
+static std::atomic<long> iWQHeapAllocationCounter (0);
+
+#ifdef __GLIBC__
+//malloc, calloc and realloc are counted, new and new[] end in malloc
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t count, size_t size);
+extern "C" void * __libc_realloc(void * p, size_t size);
+
+extern "C" void * malloc(size_t size)
+{
+	iWQHeapAllocationCounter.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t count, size_t size)
+{
+	iWQHeapAllocationCounter.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void * realloc(void * p, size_t size)
+{
+	iWQHeapAllocationCounter.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(p, size);
+}
+#else
+//only new and new[] are counted, direct calls of malloc, calloc and realloc are not
+void * operator new(size_t size)
+{
+	iWQHeapAllocationCounter.fetch_add(1, std::memory_order_relaxed);
+	void * p=malloc(size);
+	if(!p){
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void * operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void * p) throw()
+{
+	free(p);
+}
+
+void operator delete[](void * p) throw()
+{
+	free(p);
+}
+#endif
+
+long iWQHeapAllocationCount()
+{
+	return iWQHeapAllocationCounter.load(std::memory_order_relaxed);
+}
+
+#endif
 
 //--------------------------------------------------------------------------------------------------
 
@@ -113,6 +188,17 @@ void iWQLink::linkadd()
 
 //--------------------------------------------------------------------------------------------------
 
+double iWQLink::currentProportion() const
+{
+	//same formula as zerodest()
+	if(keyed_proportion){
+		return (*prop_denominator!=0.0)?(*prop_numerator)/(*prop_denominator):1.0;
+	}
+	return proportion;
+}
+
+//--------------------------------------------------------------------------------------------------
+
 iWQModel * iWQLink::dependsOn()
 { 
 	return srcmod; 
@@ -192,11 +278,194 @@ bool iWQLink::operator!=(const iWQLink & alink) const
 		
 //##################################################################################################
 
+#pragma mark Link program
+
+iWQLinkProgram::iWQLinkProgram()
+{
+	mOrdered=false;
+	mDestStarts.assign(1,0);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQLinkProgram::compile(const iWQLinkSet & links)
+{
+	mSources.clear();
+	mProportions.clear();
+	mValues.clear();
+	mTermLinks.clear();
+	mDestinations.clear();
+	mDestStarts.clear();
+	mKeyedTerms.clear();
+	mKeyNumerators.clear();
+	mKeyDenominators.clear();
+	mTermDestinations.clear();
+	mOrdered=false;
+	
+	int i;
+	
+	//distinct destinations (links without source only zero theirs)
+	std::map<const double *, int> destIndex;
+	for(i=0; i<links.size(); i++){
+		if(links[i].destptr && !destIndex.count(links[i].destptr)){
+			destIndex[links[i].destptr]=0;
+			mDestinations.push_back(links[i].destptr);
+		}
+	}
+	
+	//reading a destination makes the result depend on the evaluation order
+	for(i=0; i<links.size(); i++){
+		const iWQLink & link=links[i];
+		if(!link.destptr || !link.srcptr){
+			continue;
+		}
+		if(destIndex.count(link.srcptr) || (link.keyed_proportion && (destIndex.count(link.prop_numerator) || destIndex.count(link.prop_denominator)))){
+			mOrdered=true;
+			break;
+		}
+	}
+	
+	std::vector<int> order;
+	if(mOrdered){
+		//terms in link order
+		for(i=0; i<links.size(); i++){
+			if(links[i].destptr && links[i].srcptr){
+				order.push_back(i);
+			}
+		}
+		mDestStarts.assign(mDestinations.size()+1,0);
+	}
+	else{
+		//destinations by address, terms of a destination in link order
+		std::sort(mDestinations.begin(), mDestinations.end());
+		for(i=0; i<mDestinations.size(); i++){
+			destIndex[mDestinations[i]]=i;
+		}
+		mDestStarts.assign(mDestinations.size()+1,0);
+		for(i=0; i<links.size(); i++){
+			if(links[i].destptr && links[i].srcptr){
+				mDestStarts[destIndex[links[i].destptr]+1]++;
+			}
+		}
+		for(i=0; i<mDestinations.size(); i++){
+			mDestStarts[i+1]+=mDestStarts[i];
+		}
+		std::vector<int> fill(mDestStarts.begin(), mDestStarts.end()-1);
+		order.assign(mDestStarts.back(),-1);
+		for(i=0; i<links.size(); i++){
+			if(links[i].destptr && links[i].srcptr){
+				order[fill[destIndex[links[i].destptr]]++]=i;
+			}
+		}
+	}
+	
+	for(i=0; i<order.size(); i++){
+		const iWQLink & link=links[order[i]];
+		mSources.push_back(link.srcptr);
+		mProportions.push_back(link.proportion);
+		mTermLinks.push_back(order[i]);
+		mTermDestinations.push_back(link.destptr);
+		if(link.keyed_proportion && link.prop_numerator && link.prop_denominator){
+			mKeyedTerms.push_back(i);
+			mKeyNumerators.push_back(link.prop_numerator);
+			mKeyDenominators.push_back(link.prop_denominator);
+		}
+	}
+	mValues.assign(mSources.size(),0.0);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQLinkProgram::refreshProportions(int first, int last)
+{
+	//same formula as iWQLink::zerodest()
+	int k=std::lower_bound(mKeyedTerms.begin(), mKeyedTerms.end(), first)-mKeyedTerms.begin();
+	for(; k<mKeyedTerms.size() && mKeyedTerms[k]<last; k++){
+		if(*mKeyDenominators[k]!=0.0){
+			mProportions[mKeyedTerms[k]]=(*mKeyNumerators[k])/(*mKeyDenominators[k]);
+		}
+		else{
+			mProportions[mKeyedTerms[k]]=1.0;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQLinkProgram::run()
+{
+	int k, d;
+	int numterms=mSources.size();
+	int numdests=mDestinations.size();
+	
+	if(mOrdered){
+		for(d=0; d<numdests; d++){
+			*mDestinations[d]=0.0;
+		}
+		refreshProportions(0,numterms);
+		for(k=0; k<numterms; k++){
+			*mTermDestinations[k] += mProportions[k] * (*mSources[k]);
+		}
+		return;
+	}
+	
+	refreshProportions(0,numterms);
+	
+	//gather
+	double * values=(numterms)?&mValues[0]:NULL;
+	const double * proportions=(numterms)?&mProportions[0]:NULL;
+	for(k=0; k<numterms; k++){
+		values[k]=*mSources[k];
+	}
+	//contiguous, vectorised by the compiler
+	for(k=0; k<numterms; k++){
+		values[k]*=proportions[k];
+	}
+	//sum per destination, starting from zero like zerodest()
+	const int * starts=&mDestStarts[0];
+	for(d=0; d<numdests; d++){
+		double sum=0.0;
+		for(k=starts[d]; k<starts[d+1]; k++){
+			sum+=values[k];
+		}
+		*mDestinations[d]=sum;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQLinkProgram::runDestination(int d)
+{
+	int first=mDestStarts[d];
+	int last=mDestStarts[d+1];
+	refreshProportions(first,last);
+	double sum=0.0;
+	for(int k=first; k<last; k++){
+		sum+=mProportions[k] * (*mSources[k]);
+	}
+	*mDestinations[d]=sum;
+}
+		
+//##################################################################################################
+
 #pragma mark Solver
 
 iWQSolver::iWQSolver(iWQLinkSet links, iWQLinkSet outputlinks)
 {
 	mTreeError=false;
+	mWarmRestart=false;
+	mWarmRestartSampling=0;
+	mSparseJacobian=false;
+	mThreadPool=NULL;
+	mStepFrom=mStepTo=0.0;
+	mStepInitVals=NULL;
+	mStepLayerStart=0;
+	mIncrementalLinks=false;
+	mTrajectoryMode=false;
+	mExportTrajectory=NULL;
+	mTrajectoryTimes=NULL;
+	mTrajectoryFirst=mTrajectoryLast=0;
+	mTrajectoryCache=false;
 	
 	if(links.size()==0 && outputlinks.size()==0){
 		//nothing to do
@@ -283,6 +552,10 @@ iWQSolver::iWQSolver(iWQLinkSet links, iWQLinkSet outputlinks)
 		}	
 	} 
 	
+	mLinkProgram.compile(mLinks);
+	mInterLinkProgram.compile(mInterLinks);
+	mExportLinkProgram.compile(mExportLinks);
+	
 	//get tree root
 	//const iWQModel * tree_root=NULL;
 	//int tree_root_index=-1;
@@ -402,14 +675,20 @@ iWQSolver::iWQSolver(iWQLinkSet links, iWQLinkSet outputlinks)
 	}
 	
 	mModels.clear();
+	mLayerStarts.clear();
 	
 	for(int i=max_layer_index; i>=0; i--){
+		mLayerStarts.push_back(mModels.size());
 		for(int j=0; j<modelbuf.size(); j++){
 			if(layerIndex[j]==i){
 				mModels.push_back(modelbuf[j]);	//need to make them unconst for solving
 			}
 		}
 	}
+	mLayerStarts.push_back(mModels.size());
+	mSolvedFlags.assign(mModels.size(),1);
+	
+	buildPropagationLists();
 	
 	//DEBUG
 	//printf("\n*** SOLUTION ORDER ***\n");
@@ -422,6 +701,122 @@ iWQSolver::iWQSolver(iWQLinkSet links, iWQLinkSet outputlinks)
 
 //--------------------------------------------------------------------------------------------------
 
+iWQSolver::~iWQSolver()
+{
+	if(mThreadPool){
+		delete mThreadPool;
+	}
+	clearTrajectories();
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::buildPropagationLists()
+{
+	mModelPorts.assign(mModels.size(),std::vector<int>());
+	mIncrementalLinks=false;
+	
+	//a link reading another inter-link port would depend on the order of the full pass
+	if(mInterLinkProgram.ordered()){
+		return;
+	}
+	
+	//a port changes when one of its sources is solved, or its own model (keyed proportions, overwritten inputs)
+	std::map<const iWQModel *, int> modelIndex;
+	for(int i=0; i<mModels.size(); i++){
+		modelIndex[mModels[i]]=i;
+	}
+	for(int p=0; p<mInterLinkProgram.numDestinations(); p++){
+		for(int k=mInterLinkProgram.firstTerm(p); k<mInterLinkProgram.lastTerm(p); k++){
+			const iWQLink & link=mInterLinks[mInterLinkProgram.linkOfTerm(k)];
+			const iWQModel * related[2]={link.srcmod, link.destmod};
+			for(int r=0; r<2; r++){
+				std::map<const iWQModel *, int>::iterator it=modelIndex.find(related[r]);
+				if(it==modelIndex.end()){
+					return;
+				}
+				std::vector<int> & ports=mModelPorts[it->second];
+				if(ports.size()==0 || ports.back()!=p){
+					ports.push_back(p);
+				}
+			}
+		}
+	}
+	
+	mIncrementalLinks=true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::propagateFrom(int modelindex)
+{
+	const std::vector<int> & ports=mModelPorts[modelindex];
+	for(int p=0; p<ports.size(); p++){
+		mInterLinkProgram.runDestination(ports[p]);
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool iWQSolver::layersAreIndependent()
+{
+	//every inter-model link has to point to a lower layer, otherwise models of 
+	//the same layer would read each other's outputs within the timestep
+	std::map<const iWQModel *, int> layerOf;
+	for(int l=0; l+1<mLayerStarts.size(); l++){
+		for(int i=mLayerStarts[l]; i<mLayerStarts[l+1]; i++){
+			layerOf[mModels[i]]=l;
+		}
+	}
+	for(int i=0; i<mInterLinks.size(); i++){
+		std::map<const iWQModel *, int>::iterator src=layerOf.find(mInterLinks[i].srcmod);
+		std::map<const iWQModel *, int>::iterator dest=layerOf.find(mInterLinks[i].destmod);
+		if(src==layerOf.end() || dest==layerOf.end() || src->second>=dest->second){
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::setNumThreads(int numthreads)
+{
+	if(mThreadPool){
+		delete mThreadPool;
+		mThreadPool=NULL;
+	}
+	if(numthreads<=1){
+		return;
+	}
+	if(mTreeError){
+		return;
+	}
+	if(!layersAreIndependent()){
+		printf("[Warning]: Models of the same layer are linked to each other, solving them sequentially.\n");
+		return;
+	}
+	mThreadPool=new iWQThreadPool(numthreads);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int iWQSolver::numThreads()
+{
+	return (mThreadPool)?mThreadPool->numThreads():1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::solveModelTask(void * solver, int index)
+{
+	iWQSolver * s=(iWQSolver *)solver;
+	index+=s->mStepLayerStart;
+	s->mSolvedFlags[index]=s->mModels[index]->solve1Step(s->mStepFrom, s->mStepTo, s->mStepInitVals, s->mHmin, s->mEps);
+}
+
+//--------------------------------------------------------------------------------------------------
+
 bool iWQSolver::saveInitVals(iWQInitialValues * yfrom)
 {			
 	if(!yfrom){
@@ -434,12 +829,7 @@ bool iWQSolver::saveInitVals(iWQInitialValues * yfrom)
         	mModels[i]->setInitialValues(yfrom);
         }
     }
-    for(i=0; i<mExportLinks.size(); i++){
-		mExportLinks[i].zerodest();
-	}
-	for(i=0; i<mExportLinks.size(); i++){
-		mExportLinks[i].linkadd();
-	}
+    mExportLinkProgram.run();
 	return true;
 }
 
@@ -454,44 +844,646 @@ bool iWQSolver::solve1Step(double xfrom, double xto, iWQInitialValues * yfrom)
 		return true;
 	}
 	
-	int i, j;
+	int i;
 	bool cleansolution=true;
 	if(yfrom){	//forget wrong models only in the beginning
 		mFaultyModels.clear();
 	}
 	
-	for(i=0; i<mLinks.size(); i++){
-		mLinks[i].zerodest();
+	mLinkProgram.run();
+	
+	if(mThreadPool && mSensitivitySlots.size()==0){
+		//solve the layers in dependency order, the models of a layer concurrently
+		mStepFrom=xfrom;
+		mStepTo=xto;
+		mStepInitVals=yfrom;
+		for(int l=0; l+1<mLayerStarts.size(); l++){
+			int first=mLayerStarts[l];
+			int last=mLayerStarts[l+1];
+			mStepLayerStart=first;
+			mThreadPool->run(last-first, solveModelTask, this);
+			for(i=first; i<last; i++){
+				if(!mSolvedFlags[i]){
+					mFaultyModels.push_back(mModels[i]);
+					cleansolution=false;
+				}
+			}
+			//propagate after the barrier, by the calling thread only
+			if(mIncrementalLinks && l>0){
+				for(i=first; i<last; i++){
+					propagateFrom(i);
+				}
+			}
+			else{
+				mInterLinkProgram.run();
+			}
+		}
+	}
+	else{
+		for(i=0; i<mModels.size(); i++){
+			if(mSensitivitySlots.size()){
+				gatherInputSensitivities(i);
+			}
+			//solve models in dependency order
+			if(!mModels[i]->solve1Step(xfrom, xto, yfrom, mHmin, mEps)){
+				mFaultyModels.push_back(mModels[i]);
+				cleansolution=false;
+			}
+			//the first pass replaces the values written by mLinks, then only the outputs of the solved model
+			if(mIncrementalLinks && i>0){
+				propagateFrom(i);
+			}
+			else{
+				mInterLinkProgram.run();
+			}
+		}
+	}
+	
+	mExportLinkProgram.run();
+	if(mSensitivitySlots.size()){
+		exportSensitivities();
+	}
+	return cleansolution;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool iWQSolver::setSensitivityParameters(std::vector<int> slots)
+{
+	if(slots.size() && mTrajectoryMode){
+		printf("[Error]: Forward sensitivities are only available in the row by row solution.\n");
+		return false;
+	}
+	mSensitivitySlots=slots;
+	for(int i=0; i<mModels.size(); i++){
+		mModels[i]->setSensitivityParameters(slots);
+	}
+	
+	//links between the models, the data inputs do not depend on the parameters
+	mSensitivityLinks.assign(mModels.size(), std::vector<int> ());
+	for(int l=0; l<mInterLinks.size(); l++){
+		for(int i=0; i<mModels.size(); i++){
+			if(mInterLinks[l].destmod==mModels[i]){
+				mSensitivityLinks[i].push_back(l);
+			}
+		}
+	}
+	
+	mSensitivityPorts.clear();
+	for(int l=0; l<mExportLinks.size(); l++){
+		const double * port=mExportLinks[l].destptr;
+		if(port && std::find(mSensitivityPorts.begin(), mSensitivityPorts.end(), port)==mSensitivityPorts.end()){
+			mSensitivityPorts.push_back(port);
+		}
+	}
+	mExportSensitivities.assign(mSensitivityPorts.size()*slots.size(), 0.0);
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::gatherInputSensitivities(int modelindex)
+{
+	//d(input)/dp = sum of proportion * d(outlet)/dp, the proportions are taken as constants
+	iWQModel * model=mModels[modelindex];
+	std::vector<int> & links=mSensitivityLinks[modelindex];
+	int numsens=mSensitivitySlots.size();
+	for(int j=0; j<links.size(); j++){
+		double * dest=model->inputSensitivities(mInterLinks[links[j]].destptr);
+		if(dest){
+			std::fill(dest, dest+numsens, 0.0);
+		}
+	}
+	for(int j=0; j<links.size(); j++){
+		iWQLink & link=mInterLinks[links[j]];
+		double * dest=model->inputSensitivities(link.destptr);
+		if(dest && link.srcptr){
+			link.srcmod->addOutletSensitivities(link.srcptr, link.currentProportion(), dest);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::exportSensitivities()
+{
+	int numsens=mSensitivitySlots.size();
+	std::fill(mExportSensitivities.begin(), mExportSensitivities.end(), 0.0);
+	for(int l=0; l<mExportLinks.size(); l++){
+		iWQLink & link=mExportLinks[l];
+		if(!link.srcmod || !link.srcptr){
+			continue;
+		}
+		int d=std::find(mSensitivityPorts.begin(), mSensitivityPorts.end(), link.destptr)-mSensitivityPorts.begin();
+		if(d<mSensitivityPorts.size()){
+			link.srcmod->addOutletSensitivities(link.srcptr, link.currentProportion(), &mExportSensitivities[d*numsens]);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+const double * iWQSolver::sensitivitiesForPort(const double * port)
+{
+	int numsens=mSensitivitySlots.size();
+	int d=std::find(mSensitivityPorts.begin(), mSensitivityPorts.end(), port)-mSensitivityPorts.begin();
+	if(numsens==0 || d>=mSensitivityPorts.size()){
+		return NULL;
+	}
+	return &mExportSensitivities[d*numsens];
+}
+
+//--------------------------------------------------------------------------------------------------
+
+#pragma mark Trajectory
+
+//mixes the bits of a value into a 64 bit hash
+static inline void iWQHashValue(unsigned long long & hash, double value)
+{
+	unsigned long long bits;
+	memcpy(&bits, &value, sizeof(bits));
+	hash^=bits+0x9e3779b97f4a7c15ULL+(hash<<6)+(hash>>2);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int iWQModelTrajectory::recordSlot(const double * port)
+{
+	for(int i=0; i<recordedPorts.size(); i++){
+		if(recordedPorts[i]==port){
+			return i;
+		}
+	}
+	recordedPorts.push_back(port);
+	return recordedPorts.size()-1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQModelTrajectory::stage(int row)
+{
+	int n=staging.size();
+	for(int k=0; k<n; k++){
+		staging[k]=stagedBases[k][row*stagedStrides[k]];
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQModelTrajectory::record(int row)
+{
+	int n=recordedPorts.size();
+	if(n==0){
+		return;
+	}
+	double * out=&records[row*n];
+	for(int s=0; s<n; s++){
+		out[s]=*recordedPorts[s];
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::clearTrajectories()
+{
+	for(int i=0; i<mTrajectories.size(); i++){
+		delete mTrajectories[i];
+	}
+	mTrajectories.clear();
+	if(mExportTrajectory){
+		delete mExportTrajectory;
+		mExportTrajectory=NULL;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::stageLinks(iWQModelTrajectory * consumer, iWQLinkSet & links)
+{
+	//redirect the sources of links (and keyed denominators) to the staging area of the consumer
+	std::map<const double *, int> stagedIndex;
+	std::map<const iWQModel *, iWQModelTrajectory *> owners;
+	for(int i=0; i<mTrajectories.size(); i++){
+		owners[mTrajectories[i]->model]=mTrajectories[i];
+	}
+	
+	for(int pass=0; pass<2; pass++){
+		if(pass==1){
+			//the addresses are taken now, the staging area is never resized later
+			consumer->staging.assign(consumer->stagedPorts.size(),0.0);
+		}
+		for(int i=0; i<links.size(); i++){
+			iWQLink & link=links[i];
+			const double ** sources[2]={&link.srcptr, (link.keyed_proportion)?&link.prop_denominator:NULL};
+			for(int j=0; j<2; j++){
+				if(!sources[j] || !*sources[j]){
+					continue;
+				}
+				const double * src=*sources[j];
+				if(pass==1){
+					*sources[j]=&consumer->staging[stagedIndex[src]];
+					continue;
+				}
+				if(stagedIndex.count(src)){
+					continue;
+				}
+				stagedIndex[src]=consumer->stagedPorts.size();
+				if(link.srcmod){
+					iWQModelTrajectory * owner=owners[link.srcmod];
+					consumer->stagedPorts.push_back(NULL);
+					consumer->stagedOwners.push_back(owner);
+					consumer->stagedSlots.push_back(owner->recordSlot(src));
+				}
+				else{
+					consumer->stagedPorts.push_back((double *)src);
+					consumer->stagedOwners.push_back(NULL);
+					consumer->stagedSlots.push_back(0);
+				}
+			}
+		}
+	}
+	consumer->stagedBases.assign(consumer->staging.size(),NULL);
+	consumer->stagedStrides.assign(consumer->staging.size(),1);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool iWQSolver::prepareTrajectories(iWQDataTable * table)
+{
+	clearTrajectories();
+	if(mTreeError || !table || !table->timePort() || mModels.size()==0){
+		return false;
+	}
+	
+	//row by row, a model reads the values of the same row only from models solved before it
+	if(mLinkProgram.ordered() || mInterLinkProgram.ordered() || mExportLinkProgram.ordered()){
+		return false;
+	}
+	std::map<const iWQModel *, int> modelIndex;
+	int i;
+	for(i=0; i<mModels.size(); i++){
+		modelIndex[mModels[i]]=i;
+	}
+	for(i=0; i<mInterLinks.size(); i++){
+		const iWQLink & link=mInterLinks[i];
+		if(!modelIndex.count(link.srcmod) || !modelIndex.count(link.destmod) || modelIndex[link.srcmod]>=modelIndex[link.destmod]){
+			return false;
+		}
+	}
+	
+	//data sources have to be columns which are not overwritten by the exports
+	std::map<const double *, bool> exported;
+	for(i=0; i<mExportLinks.size(); i++){
+		const iWQLink & link=mExportLinks[i];
+		if(!link.srcmod || !modelIndex.count(link.srcmod) || (link.destptr && !table->isPortValid(link.destptr))){
+			return false;
+		}
+		exported[link.destptr]=true;
 	}
 	for(i=0; i<mLinks.size(); i++){
-		mLinks[i].linkadd();
+		const iWQLink & link=mLinks[i];
+		if(!link.destmod || !modelIndex.count(link.destmod)){
+			return false;
+		}
+		if(!link.srcmod && link.srcptr && (!table->isPortValid((double *)link.srcptr) || exported.count(link.srcptr))){
+			return false;
+		}
 	}
 	
+	//plans
 	for(i=0; i<mModels.size(); i++){
-        //solve models in dependency order
-		if(!mModels[i]->solve1Step(xfrom, xto, yfrom, mHmin, mEps)){
-			mFaultyModels.push_back(mModels[i]);
-			cleansolution=false;
+		iWQModelTrajectory * traj=new iWQModelTrajectory;
+		traj->model=mModels[i];
+		mTrajectories.push_back(traj);
+	}
+	std::map<const double *, bool> linkPorts;
+	for(i=0; i<mInterLinkProgram.numDestinations(); i++){
+		linkPorts[mInterLinkProgram.destination(i)]=true;
+	}
+	for(i=0; i<mModels.size(); i++){
+		//after the first model of a row, the inter-link ports hold the inter-link values only
+		iWQLinkSet datalinks;
+		iWQLinkSet interlinks;
+		for(int j=0; j<mLinks.size(); j++){
+			if(mLinks[j].destmod==mModels[i] && (i==0 || !linkPorts.count(mLinks[j].destptr))){
+				datalinks.push_back(mLinks[j]);
+			}
+		}
+		for(int j=0; j<mInterLinks.size(); j++){
+			if(mInterLinks[j].destmod==mModels[i]){
+				interlinks.push_back(mInterLinks[j]);
+			}
+		}
+		iWQLinkSet both=datalinks;
+		both.insert(both.end(), interlinks.begin(), interlinks.end());
+		stageLinks(mTrajectories[i], both);
+		mTrajectories[i]->dataInputs.compile(iWQLinkSet(both.begin(), both.begin()+datalinks.size()));
+		mTrajectories[i]->linkInputs.compile(iWQLinkSet(both.begin()+datalinks.size(), both.end()));
+	}
+	mExportTrajectory=new iWQModelTrajectory;
+	iWQLinkSet exportlinks=mExportLinks;
+	stageLinks(mExportTrajectory, exportlinks);
+	mExportTrajectory->linkInputs.compile(exportlinks);
+	
+	return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool iWQSolver::setTrajectoryMode(bool value, iWQDataTable * datatable)
+{
+	mTrajectoryMode=false;
+	clearTrajectories();
+	if(value){
+		mTrajectoryMode=prepareTrajectories(datatable);
+		if(!mTrajectoryMode){
+			clearTrajectories();
+		}
+	}
+	return mTrajectoryMode==value;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::collectParameterSlots(iWQModelTrajectory * traj)
+{
+	//not thread safe: the managers log into one vector at a time
+	iWQModel * model=traj->model;
+	iWQParameterManager * managers[2]={model->sharedManager(), (mStepInitVals)?mStepInitVals->parameterManager():NULL};
+	if(managers[1]==managers[0]){
+		managers[1]=NULL;
+	}
+	long revision=0;
+	traj->parameterSlots.clear();
+	for(int m=0; m<2; m++){
+		if(managers[m]){
+			managers[m]->startAccessLog(&traj->parameterSlots);
+			revision+=managers[m]->revision();
 		}
-		for(j=0; j<mInterLinks.size(); j++){
-			mInterLinks[j].zerodest();
+	}
+	
+	//the parameters through the model flags, and the initial values, which can be parameters too
+	model->stateValues(traj->scratch);
+	model->updateParameters();
+	if(mStepInitVals){
+		model->setInitialValues(mStepInitVals);
+	}
+	model->setStateValues(traj->scratch);
+	
+	for(int m=0; m<2; m++){
+		if(managers[m]){
+			managers[m]->stopAccessLog();
 		}
-		for(j=0; j<mInterLinks.size(); j++){
-			mInterLinks[j].linkadd();
+	}
+	std::sort(traj->parameterSlots.begin(), traj->parameterSlots.end());
+	traj->parameterSlots.erase(std::unique(traj->parameterSlots.begin(), traj->parameterSlots.end()), traj->parameterSlots.end());
+	traj->parameterRevision=revision;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+unsigned long long iWQSolver::trajectoryKey(iWQModelTrajectory * traj)
+{
+	unsigned long long hash=0;
+	int i;
+	iWQHashValue(hash, mTrajectoryFirst);
+	iWQHashValue(hash, mTrajectoryLast);
+	iWQHashValue(hash, mHmin);
+	iWQHashValue(hash, mEps);
+	for(i=0; i<traj->parameterSlots.size(); i++){
+		iWQHashValue(hash, *traj->parameterSlots[i]);
+	}
+	traj->model->parameterValues(traj->scratch);
+	for(i=0; i<traj->scratch.size(); i++){
+		iWQHashValue(hash, traj->scratch[i]);
+	}
+	//input trajectory: the times, the data columns and the records of the upstream models
+	for(int row=mTrajectoryFirst-1; row<=mTrajectoryLast; row++){
+		iWQHashValue(hash, mTrajectoryTimes[row]);
+		if(row>=mTrajectoryFirst){
+			traj->stage(row);
+			for(i=0; i<traj->staging.size(); i++){
+				iWQHashValue(hash, traj->staging[i]);
+			}
 		}
 	}
+	return hash;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::integrateTrajectory(int index)
+{
+	iWQModelTrajectory * traj=mTrajectories[index];
+	iWQModel * model=traj->model;
+	const double * times=mTrajectoryTimes;
 	
-	for(i=0; i<mExportLinks.size(); i++){
-		mExportLinks[i].zerodest();
+	//the records and failures of the last run are still valid if nothing changed
+	unsigned long long key=0;
+	bool cacheable=(mTrajectoryCache && mStepInitVals);	//partial runs start from a state set from outside
+	if(cacheable){
+		key=trajectoryKey(traj);
+		if(traj->cached && traj->cacheKey==key){
+			model->setStateValues(traj->cachedState);
+			traj->cacheHits++;
+			return;
+		}
+		traj->cacheMisses++;
 	}
-	for(i=0; i<mExportLinks.size(); i++){
-		mExportLinks[i].linkadd();
+	traj->cached=false;
+	
+	traj->failedRows.clear();
+	for(int row=mTrajectoryFirst; row<=mTrajectoryLast; row++){
+		if(times[row]<times[row-1]){
+			continue;	//skipped by solve1Step() too
+		}
+		traj->stage(row);
+		traj->dataInputs.run();
+		traj->linkInputs.run();
+		if(!model->solve1Step(times[row-1], times[row], (row==mTrajectoryFirst)?mStepInitVals:NULL, mHmin, mEps)){
+			traj->failedRows.push_back(row);
+		}
+		//keyed proportions see the new state, as with the propagation after each model
+		traj->linkInputs.run();
+		traj->record(row);
+	}
+	
+	if(cacheable){
+		traj->cacheKey=key;
+		model->stateValues(traj->cachedState);
+		traj->cached=true;
 	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::integrateTrajectoryTask(void * solver, int index)
+{
+	iWQSolver * s=(iWQSolver *)solver;
+	s->integrateTrajectory(index+s->mStepLayerStart);
+}
+
+//--------------------------------------------------------------------------------------------------
+
+bool iWQSolver::solveTrajectory(iWQDataTable * datatable, int endrow, iWQInitialValues * yfrom, std::vector<int> * failedrows)
+{
+	if(!mTrajectoryMode || !datatable){
+		return false;
+	}
+	
+	//the table stays on the start row during the run, the rows are accessed in the storage
+	int startrow=datatable->pos();
+	int numrows=datatable->numRows();
+	int lastrow=(endrow<numrows)?endrow:numrows-1;
+	int finalrow=(endrow<numrows)?endrow:-1;	//where stepping row by row would stop
+	datatable->commit();
+	
+	if(yfrom){
+		mFaultyModels.clear();
+	}
+	if(failedrows){
+		failedrows->clear();
+	}
+	if(startrow<0 || lastrow<=startrow){
+		datatable->setRow(finalrow);
+		return true;
+	}
+	
+	//resolve the row access
+	mTrajectoryTimes=datatable->columnDataForPort(datatable->timePort());
+	mTrajectoryFirst=startrow+1;
+	mTrajectoryLast=lastrow;
+	mStepInitVals=yfrom;
+	int i, k;
+	for(i=0; i<mTrajectories.size(); i++){
+		iWQModelTrajectory * traj=mTrajectories[i];
+		if(traj->records.size()!=numrows*traj->recordedPorts.size()){
+			traj->records.assign(numrows*traj->recordedPorts.size(),0.0);
+			traj->cached=false;
+		}
+		if(mTrajectoryCache && yfrom){
+			iWQParameterManager * manager=traj->model->sharedManager();
+			iWQParameterManager * initmanager=yfrom->parameterManager();
+			long revision=((manager)?manager->revision():0)+((initmanager && initmanager!=manager)?initmanager->revision():0);
+			if(revision!=traj->parameterRevision){
+				collectParameterSlots(traj);
+			}
+		}
+	}
+	for(i=0; i<=mTrajectories.size(); i++){
+		iWQModelTrajectory * traj=(i<mTrajectories.size())?mTrajectories[i]:mExportTrajectory;
+		for(k=0; k<traj->staging.size(); k++){
+			iWQModelTrajectory * owner=traj->stagedOwners[k];
+			if(owner){
+				traj->stagedBases[k]=(owner->records.size())?&owner->records[traj->stagedSlots[k]]:NULL;
+				traj->stagedStrides[k]=owner->recordedPorts.size();
+			}
+			else{
+				traj->stagedBases[k]=datatable->columnDataForPort(traj->stagedPorts[k]);
+				traj->stagedStrides[k]=1;
+			}
+		}
+	}
+	
+	//models in dependency order, those of a layer concurrently
+	if(mThreadPool){
+		for(int l=0; l+1<mLayerStarts.size(); l++){
+			mStepLayerStart=mLayerStarts[l];
+			mThreadPool->run(mLayerStarts[l+1]-mLayerStarts[l], integrateTrajectoryTask, this);
+		}
+	}
+	else{
+		for(i=0; i<mTrajectories.size(); i++){
+			integrateTrajectory(i);
+		}
+	}
+	
+	//exports straight into the columns
+	iWQLinkProgram & exports=mExportTrajectory->linkInputs;
+	std::vector<double *> exportColumns;
+	for(k=0; k<exports.numDestinations(); k++){
+		exportColumns.push_back(datatable->columnDataForPort(exports.destination(k)));
+	}
+	for(int row=mTrajectoryFirst; row<=mTrajectoryLast; row++){
+		if(mTrajectoryTimes[row]<mTrajectoryTimes[row-1]){
+			continue;
+		}
+		mExportTrajectory->stage(row);
+		exports.run();
+		for(k=0; k<exportColumns.size(); k++){
+			exportColumns[k][row]=*exports.destination(k);
+		}
+	}
+	for(k=0; k<exportColumns.size(); k++){
+		datatable->touchColumnForPort(exports.destination(k));
+		*exports.destination(k)=exportColumns[k][startrow];	//ports belong to the start row until it is left
+	}
+	
+	//collect the failures
+	bool cleansolution=true;
+	for(i=0; i<mTrajectories.size(); i++){
+		std::vector<int> & rows=mTrajectories[i]->failedRows;
+		for(k=0; k<rows.size(); k++){
+			mFaultyModels.push_back(mTrajectories[i]->model);
+			if(failedrows){
+				failedrows->push_back(rows[k]);
+			}
+			cleansolution=false;
+		}
+	}
+	if(failedrows){
+		std::sort(failedrows->begin(), failedrows->end());
+		failedrows->erase(std::unique(failedrows->begin(), failedrows->end()), failedrows->end());
+	}
+	
+	datatable->setRow(finalrow);
 	return cleansolution;
 }
 
 //--------------------------------------------------------------------------------------------------
 
+void iWQSolver::setTrajectoryCache(bool value)
+{
+	mTrajectoryCache=value;
+	for(int i=0; i<mTrajectories.size(); i++){
+		mTrajectories[i]->cached=false;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+long iWQSolver::trajectoryCacheHits()
+{
+	long result=0;
+	for(int i=0; i<mTrajectories.size(); i++){
+		result+=mTrajectories[i]->cacheHits;
+	}
+	return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+long iWQSolver::trajectoryCacheMisses()
+{
+	long result=0;
+	for(int i=0; i<mTrajectories.size(); i++){
+		result+=mTrajectories[i]->cacheMisses;
+	}
+	return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::resetTrajectoryCacheStatistics()
+{
+	for(int i=0; i<mTrajectories.size(); i++){
+		mTrajectories[i]->cacheHits=0;
+		mTrajectories[i]->cacheMisses=0;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
 bool iWQSolver::valid()
 {
 	return !mTreeError;
@@ -523,6 +1515,66 @@ void iWQSolver::setAccuracy(double value)
 
 //--------------------------------------------------------------------------------------------------
 
+void iWQSolver::setWarmRestart(bool value)
+{
+	mWarmRestart=value;
+	for(int i=0; i<mModels.size(); i++){
+		if(mModels[i] && !mModels[i]->isStatic()){
+			mModels[i]->setPersistentIntegrator(value);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::setWarmRestartSampling(int interval)
+{
+	mWarmRestartSampling=interval;
+	for(int i=0; i<mModels.size(); i++){
+		if(mModels[i] && !mModels[i]->isStatic()){
+			mModels[i]->setIntegratorSampling(interval);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::setSparseJacobian(bool value)
+{
+	mSparseJacobian=value;
+	for(int i=0; i<mModels.size(); i++){
+		if(mModels[i] && !mModels[i]->isStatic()){
+			mModels[i]->setSparseJacobian(value);
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+iWQIntegratorStatistics iWQSolver::integratorStatistics()
+{
+	iWQIntegratorStatistics result;
+	for(int i=0; i<mModels.size(); i++){
+		if(mModels[i]){
+			result.add(mModels[i]->integratorStatistics());
+		}
+	}
+	return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQSolver::resetIntegratorStatistics()
+{
+	for(int i=0; i<mModels.size(); i++){
+		if(mModels[i]){
+			mModels[i]->resetIntegratorStatistics();
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
 std::vector<std::string> iWQSolver::exportedDataHeaders(iWQDataTable * datatable)
 {
 	//returns data headers of the outputs
@@ -36,9 +36,11 @@ class iWQLink
 		const double * prop_denominator;
 		
 		friend class iWQSolver;
+		friend class iWQLinkProgram;
 		
 		void zerodest();
 		void linkadd();
+		double currentProportion() const;
 		
 		void init();	//To zero out all member fields before establishment
 		
@@ -69,7 +71,98 @@ typedef std::vector<iWQLink> iWQLinkSet;
 
 //-----------------------------------------------------------------------------------------------
 
+// Link set compiled into flat arrays. Terms are grouped by destination (original order kept
+// within a destination, so the sums are the same as with zerodest()/linkadd()) and evaluated
+// as gather, multiply and per-destination sum. Sets where a link reads the destination of 
+// another one are run term by term in the original order.
+class iWQLinkProgram
+	{
+	private:
+		//terms
+		std::vector<const double *> mSources;
+		std::vector<double> mProportions;
+		std::vector<double> mValues;			//gathered source values
+		std::vector<int> mTermLinks;			//index of the link in the compiled set
+		
+		//destinations, terms of destination d are mDestStarts[d]..mDestStarts[d+1]-1
+		std::vector<double *> mDestinations;
+		std::vector<int> mDestStarts;
+		
+		//keyed proportions to refresh before each run
+		std::vector<int> mKeyedTerms;
+		std::vector<const double *> mKeyNumerators;
+		std::vector<const double *> mKeyDenominators;
+		
+		//fallback for aliased sets
+		bool mOrdered;
+		std::vector<double *> mTermDestinations;
+		
+		void refreshProportions(int first, int last);
+		
+	public:
+		iWQLinkProgram();
+		void compile(const iWQLinkSet & links);
+		void run();
+		void runDestination(int d);		//only the terms of one destination (not for ordered programs)
+		
+		bool ordered(){ return mOrdered; }
+		int numDestinations(){ return mDestinations.size(); }
+		double * destination(int d){ return mDestinations[d]; }
+		int firstTerm(int d){ return mDestStarts[d]; }
+		int lastTerm(int d){ return mDestStarts[d+1]; }	//one past the last
+		int linkOfTerm(int term){ return mTermLinks[term]; }
+	};
+
+//-----------------------------------------------------------------------------------------------
+
+// Plan of one model in the whole-trajectory mode. The link programs read a staging area, 
+// which is refreshed for each row from the data columns and the records of upstream models.
+class iWQModelTrajectory
+	{
+	public:
+		iWQModel * model;							//NULL for the export stage
+		iWQLinkProgram dataInputs;					//links from data columns
+		iWQLinkProgram linkInputs;					//links from upstream models
+		
+		std::vector<double> staging;				//source values of the current row
+		std::vector<double *> stagedPorts;			//data table port of a data source, NULL for records
+		std::vector<iWQModelTrajectory *> stagedOwners;	//upstream model of a record source
+		std::vector<int> stagedSlots;				//record index in the owner
+		std::vector<const double *> stagedBases;	//resolved for each run: column or first record
+		std::vector<int> stagedStrides;
+		
+		std::vector<const double *> recordedPorts;	//outlets read downstream (inter-links, exports)
+		std::vector<double> records;				//row by row, recordedPorts.size() values each
+		
+		std::vector<int> failedRows;
+		
+		//single entry cache of the last solution (records, failures and final state), replayed when the key matches
+		std::vector<const double *> parameterSlots;	//parameter manager slots read by the model
+		long parameterRevision;						//of the manager(s) when the slots were collected
+		bool cached;
+		unsigned long long cacheKey;
+		std::vector<double> cachedState;
+		long cacheHits;
+		long cacheMisses;
+		std::vector<double> scratch;
+		
+		iWQModelTrajectory(){ model=NULL; parameterRevision=-1; cached=false; cacheKey=0; cacheHits=cacheMisses=0; }
+		int recordSlot(const double * port);
+		void stage(int row);
+		void record(int row);
+	};
+
+//-----------------------------------------------------------------------------------------------
+
+#ifdef IWQ_DEBUG
+// Number of heap allocations so far (debug builds only)
+long iWQHeapAllocationCount();
+#endif
+
+//-----------------------------------------------------------------------------------------------
+
 class iWQDataTable;
+class iWQThreadPool;
 
 // Solver for a set of linked models
 class iWQSolver
@@ -82,17 +175,91 @@ class iWQSolver
 		bool mTreeError;
 		double mHmin;
 		double mEps;
+		bool mWarmRestart;
+		int mWarmRestartSampling;
+		bool mSparseJacobian;
 		
 		std::vector<iWQModel *> mFaultyModels;	//storage for models that did not solve properly
+		
+		//compiled forms of the link sets above
+		iWQLinkProgram mLinkProgram;
+		iWQLinkProgram mInterLinkProgram;
+		iWQLinkProgram mExportLinkProgram;
+		
+		//incremental propagation: destinations of mInterLinkProgram listed per source model
+		std::vector<std::vector<int> > mModelPorts;		//for each model in mModels: ports to refresh after solving it
+		bool mIncrementalLinks;
+		void buildPropagationLists();
+		void propagateFrom(int modelindex);
+		
+		//layer-parallel execution: models of a layer are independent within a timestep
+		std::vector<int> mLayerStarts;			//first index in mModels for each layer (+ end marker)
+		iWQThreadPool * mThreadPool;
+		std::vector<int> mSolvedFlags;			//per model result of the parallel step (not vector<bool>: written concurrently)
+		double mStepFrom;
+		double mStepTo;
+		iWQInitialValues * mStepInitVals;
+		int mStepLayerStart;
+		bool layersAreIndependent();
+		static void solveModelTask(void * solver, int index);
+		
+		//whole-trajectory mode: each model over all rows before the next one
+		bool mTrajectoryMode;
+		std::vector<iWQModelTrajectory *> mTrajectories;	//same order as mModels
+		iWQModelTrajectory * mExportTrajectory;
+		const double * mTrajectoryTimes;
+		int mTrajectoryFirst;
+		int mTrajectoryLast;
+		bool prepareTrajectories(iWQDataTable * table);
+		void clearTrajectories();
+		void stageLinks(iWQModelTrajectory * consumer, iWQLinkSet & links);
+		void integrateTrajectory(int index);
+		static void integrateTrajectoryTask(void * solver, int index);
+		
+		//memoisation of whole trajectories
+		bool mTrajectoryCache;
+		void collectParameterSlots(iWQModelTrajectory * traj);
+		unsigned long long trajectoryKey(iWQModelTrajectory * traj);
+		
+		//forward sensitivities, propagated through the links with their proportions
+		std::vector<int> mSensitivitySlots;
+		std::vector<std::vector<int> > mSensitivityLinks;	//for each model in mModels: the links into its inputs in mInterLinks
+		std::vector<const double *> mSensitivityPorts;		//destinations of the export links
+		std::vector<double> mExportSensitivities;			//mSensitivitySlots.size() values per port
+		void gatherInputSensitivities(int modelindex);
+		void exportSensitivities();
 
 	public:
 		iWQSolver(iWQLinkSet inputlinks, iWQLinkSet outputlinks);
 		iWQSolver(iWQLinkSet alllinks);
+		~iWQSolver();
 		void setMinStepLength(double value);
 		void setAccuracy(double value);
 		double minStepLength(){ return mHmin; }
 		double accuracy(){ return mEps; } 
+		void setWarmRestart(bool value);	//persistent integrators for the dynamic models
+		bool warmRestart(){ return mWarmRestart; }
+		void setWarmRestartSampling(int interval);	//diagnostics: every n-th warm step is repeated cold, 0: off
+		int warmRestartSampling(){ return mWarmRestartSampling; }
+		void setSparseJacobian(bool value);	//coloured finite-difference Jacobians for the dynamic models
+		bool sparseJacobian(){ return mSparseJacobian; }
+		iWQIntegratorStatistics integratorStatistics();
+		void resetIntegratorStatistics();
+		void setNumThreads(int numthreads);	//1: sequential, more: models of the same layer in parallel
+		int numThreads();
+		int numLayers(){ return (mLayerStarts.size())?mLayerStarts.size()-1:0; }
         bool solve1Step(double xvon, double xbis, iWQInitialValues * yvon);
+		bool setTrajectoryMode(bool value, iWQDataTable * datatable);	//false if the layout does not allow it
+		bool trajectoryMode(){ return mTrajectoryMode; }
+		bool solveTrajectory(iWQDataTable * datatable, int endrow, iWQInitialValues * yfrom, std::vector<int> * failedrows=NULL);
+		void setTrajectoryCache(bool value);	//replay models whose parameters and inputs did not change
+		bool trajectoryCache(){ return mTrajectoryCache; }
+		long trajectoryCacheHits();
+		long trajectoryCacheMisses();
+		void resetTrajectoryCacheStatistics();
+		bool setSensitivityParameters(std::vector<int> slots);	//indices in plainValues() of the shared manager, empty: off
+		int numSensitivityParameters(){ return mSensitivitySlots.size(); }
+		const double * sensitivitiesForPort(const double * port);	//of the last step for an exported data port, NULL if unknown
 		bool valid();
 		bool saveInitVals(iWQInitialValues * yfrom);
 		std::vector<std::string> exportedDataHeaders(iWQDataTable * datatable);
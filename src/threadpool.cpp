@@ -0,0 +1,130 @@
+/*
+ *  threadpool.cpp
+ *  Fixed-size pool of worker threads for parallel loops
+ *
+ *  iWaQa model framework 2010-2017
+ *
+ *  SYSTEM/UTILITIES
+ *
+ */
+
+#include "threadpool.h"
+
+//--------------------------------------------------------------------------------------------------
+
+iWQThreadPool::iWQThreadPool(int numthreads)
+{
+	mTask=NULL;
+	mContext=NULL;
+	mNumTasks=0;
+	mNextTask=0;
+	mBusyWorkers=0;
+	mGeneration=0;
+	mStopping=false;
+
+	for(int i=1; i<numthreads; i++){
+		mWorkers.push_back(std::thread(&iWQThreadPool::workerLoop, this));
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+iWQThreadPool::~iWQThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mStopping=true;
+	}
+	mWakeUp.notify_all();
+	for(int i=0; i<mWorkers.size(); i++){
+		mWorkers[i].join();
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+int iWQThreadPool::hardwareThreads()
+{
+	int n=std::thread::hardware_concurrency();
+	return (n>0)?n:1;
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQThreadPool::processTasks()
+{
+	//take the next free index until there is none
+	int index;
+	while((index=mNextTask++)<mNumTasks){
+		mTask(mContext, index);
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQThreadPool::workerLoop()
+{
+	long seen=0;
+	while(true){
+		//poll for a while, the next loop usually comes soon
+		for(int spin=0; spin<IWQ_THREADPOOL_SPIN_COUNT && mGeneration==seen; spin++){
+			std::this_thread::yield();
+		}
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			while(!mStopping && mGeneration==seen){
+				mWakeUp.wait(lock);
+			}
+			if(mStopping){
+				return;
+			}
+			seen=mGeneration;
+		}
+
+		processTasks();
+
+		if(--mBusyWorkers==0){
+			std::unique_lock<std::mutex> lock(mMutex);
+			mDone.notify_one();
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------------------
+
+void iWQThreadPool::run(int numtasks, iWQThreadTask task, void * context)
+{
+	if(numtasks<=0 || !task){
+		return;
+	}
+
+	if(mWorkers.size()==0 || numtasks==1){
+		//nothing to share
+		for(int i=0; i<numtasks; i++){
+			task(context, i);
+		}
+		return;
+	}
+
+	mTask=task;
+	mContext=context;
+	mNumTasks=numtasks;
+	mNextTask=0;
+	mBusyWorkers=mWorkers.size();
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mGeneration++;
+	}
+	mWakeUp.notify_all();
+
+	processTasks();
+
+	//barrier: wait for the workers to finish their last tasks
+	for(int spin=0; spin<IWQ_THREADPOOL_SPIN_COUNT && mBusyWorkers>0; spin++){
+		std::this_thread::yield();
+	}
+	std::unique_lock<std::mutex> lock(mMutex);
+	while(mBusyWorkers>0){
+		mDone.wait(lock);
+	}
+}
@@ -0,0 +1,57 @@
+/*
+ *  threadpool.h
+ *  Fixed-size pool of worker threads for parallel loops
+ *
+ *  iWaQa model framework 2010-2017
+ *
+ *  SYSTEM/UTILITIES
+ *
+ */
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#ifndef threadpool_h
+#define threadpool_h
+
+// Number of polls before a waiting thread goes to sleep (short loops, e.g. one per timestep)
+#define IWQ_THREADPOOL_SPIN_COUNT 4000
+
+// Task executed for each index of a parallel loop
+typedef void (*iWQThreadTask)(void * context, int index);
+
+// Worker threads are started once and wait for parallel loops. run() returns only
+// when all indices are done, so it acts as a barrier. The calling thread works too.
+class iWQThreadPool
+{
+private:
+	std::vector<std::thread> mWorkers;
+	std::mutex mMutex;
+	std::condition_variable mWakeUp;
+	std::condition_variable mDone;
+
+	//current loop
+	iWQThreadTask mTask;
+	void * mContext;
+	int mNumTasks;
+	std::atomic<int> mNextTask;
+	std::atomic<int> mBusyWorkers;
+	std::atomic<long> mGeneration;
+	bool mStopping;
+
+	void workerLoop();
+	void processTasks();
+
+public:
+	iWQThreadPool(int numthreads);	//total number of threads including the caller
+	~iWQThreadPool();
+	int numThreads() const { return mWorkers.size()+1; }
+	void run(int numtasks, iWQThreadTask task, void * context);
+
+	static int hardwareThreads();
+};
+
+#endif